@@ -9,8 +9,8 @@ SerialLogHandler logHandler;
 
 // Save and restore the device keys in EEPROM at offset 100 in the EEPROM
 // The amount os space used at that offset depends on the device:
-// - For Wi-Fi devices (Photon, P1): 1608 bytes
-// - For cellular devices (Electron, E series): 328 bytes
+// - For Wi-Fi devices (Photon, P1): 1620 bytes
+// - For cellular devices (Electron, E series): 340 bytes
 DeviceKeyHelperEEPROM deviceKeyHelper(100);
 
 void setup() {
@@ -0,0 +1,250 @@
+#include "Particle.h"
+
+#include "DeviceKeyHelperRK.h"
+
+// Benchmark for DeviceKeyHelper::check()
+//
+// This does not touch the real device keys or any external storage. The DCT and the backup are
+// both replaced by RAM copies so every combination of check mode and backup state can be
+// exercised repeatedly, including the ones that would normally restore the keys and reset.
+//
+// The size of the keys depends on the platform you build for, so build for both a Wi-Fi device
+// (Photon, P1: 1600 bytes, TCP layout) and a cellular device (Electron, E series: 320 bytes, UDP
+// layout) to get numbers for both.
+//
+// Results are printed to the USB serial debug log.
+
+SYSTEM_MODE(MANUAL);
+
+SerialLogHandler logHandler;
+
+// Number of times check() is called for each combination of scenario and check mode
+const size_t ITERATIONS = 50;
+
+/**
+ * @brief DeviceKeyHelper that stores both the DCT and the backup in RAM and counts the I/O
+ *
+ * The backup is implemented using the random access storage methods, the same as the storage
+ * classes included in the library.
+ */
+class BenchmarkDeviceKeyHelper : public DeviceKeyHelper {
+public:
+	enum Scenario {
+		SCENARIO_UNCHANGED,			//< Backup is valid and matches the DCT
+		SCENARIO_CHANGED,			//< Backup is valid but the DCT keys are different
+		SCENARIO_INVALID_BACKUP,	//< Backup can be loaded but fails validation
+		SCENARIO_MISSING_BACKUP,	//< Backup cannot be loaded
+		SCENARIO_V1_BACKUP,			//< Backup is valid and matches the DCT, but is in the version 1 format
+		SCENARIO_CACHED,			//< Backup is valid and matches the DCT and was already verified
+		SCENARIO_COUNT
+	};
+
+	BenchmarkDeviceKeyHelper() {
+	}
+
+	/**
+	 * @brief Set up the DCT and backup RAM copies for a scenario and clear the counters
+	 */
+	void prepare(Scenario scenario) {
+		for(size_t ii = 0; ii < DEVICE_KEYS_HELPER_SIZE; ii++) {
+			dct[ii] = (uint8_t) rand();
+		}
+
+		memcpy(backup.keys, dct, DEVICE_KEYS_HELPER_SIZE);
+		initHeader((DeviceKeyHelperSavedDataHeader *)&backup, calculateCrc(backup.keys, DEVICE_KEYS_HELPER_SIZE));
+		backup.generation = 1;
+		memcpy(backup.regions, DEVICE_KEYS_HELPER_REGIONS, sizeof(backup.regions));
+		backupPresent = true;
+
+		switch(scenario) {
+		case SCENARIO_UNCHANGED:
+		default:
+			break;
+
+		case SCENARIO_CHANGED:
+			// Change the last byte so a compare has to go all of the way through the keys
+			dct[DEVICE_KEYS_HELPER_SIZE - 1] ^= 0x5a;
+			break;
+
+		case SCENARIO_INVALID_BACKUP:
+			backup.crc ^= 0xffffffff;
+			break;
+
+		case SCENARIO_MISSING_BACKUP:
+			backupPresent = false;
+			break;
+
+		case SCENARIO_V1_BACKUP: {
+			// Saved by version 0.0.4 and earlier of the library, converted on the first check
+			DeviceKeyHelperSavedDataV1Header *v1 = (DeviceKeyHelperSavedDataV1Header *)&backup;
+			memmove(&v1[1], backup.keys, DEVICE_KEYS_HELPER_SIZE);
+			v1->magic = DATA_HEADER_MAGIC;
+			v1->size = DEVICE_KEYS_HELPER_SIZE;
+			v1->sum = calculateChecksumV1(&v1[1], DEVICE_KEYS_HELPER_SIZE);
+			break;
+		}
+		}
+
+		invalidateCache();
+		if (scenario == SCENARIO_CACHED) {
+			// Not using check() so this doesn't show up in getStats()
+			setVerified(calculateDctCrc());
+		}
+
+		bytesLoaded = bytesSaved = dctBytesRead = dctBytesWritten = 0;
+		resetCount = 0;
+		heapInUse = 0;
+	}
+
+	/**
+	 * @brief Time the version 1 16-bit sum against the CRC-32 used by the current version
+	 */
+	void benchmarkChecksums() {
+		const size_t count = 100;
+		uint32_t result = 0;
+
+		uint32_t start = micros();
+		for(size_t ii = 0; ii < count; ii++) {
+			result += calculateChecksumV1(dct, DEVICE_KEYS_HELPER_SIZE);
+		}
+		uint32_t sumTime = micros() - start;
+
+		start = micros();
+		for(size_t ii = 0; ii < count; ii++) {
+			result += calculateCrc(dct, DEVICE_KEYS_HELPER_SIZE);
+		}
+		uint32_t crcTime = micros() - start;
+
+		Log.info("%u bytes: 16-bit sum %lu nsec, CRC-32 %lu nsec (result %lu)", DEVICE_KEYS_HELPER_SIZE,
+			sumTime * (1000 / count), crcTime * (1000 / count), result);
+	}
+
+	size_t bytesLoaded = 0;
+	size_t bytesSaved = 0;
+	size_t dctBytesRead = 0;
+	size_t dctBytesWritten = 0;
+	size_t resetCount = 0;
+	uint32_t heapBefore = 0;
+	uint32_t heapInUse = 0;
+
+protected:
+	virtual bool storageOpen(bool write) {
+		// check() has allocated any buffers it needs by now, so this is the peak heap usage
+		uint32_t used = heapBefore - System.freeMemory();
+		if (used > heapInUse) {
+			heapInUse = used;
+		}
+
+		return write || backupPresent;
+	}
+
+	virtual bool storageRead(size_t offset, void *data, size_t size) {
+		if (offset + size > sizeof(DeviceKeyHelperSavedData)) {
+			return false;
+		}
+		memcpy(data, &((const uint8_t *)&backup)[offset], size);
+		bytesLoaded += size;
+		return true;
+	}
+
+	virtual bool storageWrite(size_t offset, const void *data, size_t size) {
+		if (offset + size > sizeof(DeviceKeyHelperSavedData)) {
+			return false;
+		}
+		memcpy(&((uint8_t *)&backup)[offset], data, size);
+		backupPresent = true;
+		bytesSaved += size;
+		return true;
+	}
+
+	virtual int dctRead(size_t offset, void *data, size_t size) {
+		memcpy(data, &dct[offset - DEVICE_KEYS_HELPER_OFFSET], size);
+		dctBytesRead += size;
+		return 0;
+	}
+
+	virtual int dctWrite(size_t offset, const void *data, size_t size) {
+		memcpy(&dct[offset - DEVICE_KEYS_HELPER_OFFSET], data, size);
+		dctBytesWritten += size;
+		return 0;
+	}
+
+	virtual void systemReset() {
+		resetCount++;
+	}
+
+	uint8_t dct[DEVICE_KEYS_HELPER_SIZE];
+	DeviceKeyHelperSavedData backup;
+	bool backupPresent = false;
+};
+
+BenchmarkDeviceKeyHelper deviceKeyHelper;
+
+static const char *scenarioNames[] = { "unchanged", "changed", "invalid backup", "missing backup", "version 1 backup", "cached" };
+static const char *checkModeNames[] = { "AUTOMATIC", "AUTOMATIC_NO_RESTART", "CHECK_ONLY", "SAVE_CURRENT" };
+
+bool benchmarkRun = false;
+
+void runBenchmark() {
+	Log.info("DeviceKeyHelper benchmark DEVICE_KEYS_HELPER_SIZE=%u sizeof(DeviceKeyHelperSavedData)=%u iterations=%u",
+		DEVICE_KEYS_HELPER_SIZE, sizeof(DeviceKeyHelperSavedData), ITERATIONS);
+
+	deviceKeyHelper.benchmarkChecksums();
+
+	for(int scenario = 0; scenario < BenchmarkDeviceKeyHelper::SCENARIO_COUNT; scenario++) {
+		for(int checkMode = 0; checkMode < 4; checkMode++) {
+			uint32_t minTime = 0xffffffff, maxTime = 0, totalTime = 0;
+			deviceKeyHelper.resetStats();
+
+			for(size_t ii = 0; ii < ITERATIONS; ii++) {
+				deviceKeyHelper.prepare((BenchmarkDeviceKeyHelper::Scenario) scenario);
+				deviceKeyHelper.heapBefore = System.freeMemory();
+
+				uint32_t start = micros();
+				deviceKeyHelper.check((DeviceKeyHelper::CheckMode) checkMode);
+				uint32_t elapsed = micros() - start;
+
+				totalTime += elapsed;
+				if (elapsed < minTime) {
+					minTime = elapsed;
+				}
+				if (elapsed > maxTime) {
+					maxTime = elapsed;
+				}
+			}
+
+			// The counters are from the last iteration, which is the same as all of the others
+			Log.info("%s %s: min=%lu mean=%lu max=%lu usec heap=%lu loaded=%u saved=%u dctRead=%u dctWritten=%u resets=%u",
+				scenarioNames[scenario], checkModeNames[checkMode],
+				minTime, totalTime / ITERATIONS, maxTime,
+				deviceKeyHelper.heapInUse,
+				deviceKeyHelper.bytesLoaded, deviceKeyHelper.bytesSaved,
+				deviceKeyHelper.dctBytesRead, deviceKeyHelper.dctBytesWritten,
+				deviceKeyHelper.resetCount);
+
+			// Mean time of each phase, for the iterations that included it
+			const DeviceKeyHelperStats &stats = deviceKeyHelper.getStats();
+			String phases;
+			for(size_t phase = 0; phase < DeviceKeyHelper::PHASE_COUNT; phase++) {
+				const DeviceKeyHelperPhaseStats &phaseStats = stats.phases[phase];
+				if (phaseStats.count > 0) {
+					phases += String::format(" %s=%lu", DeviceKeyHelper::getPhaseName((DeviceKeyHelper::Phase) phase), phaseStats.totalMicros / phaseStats.count);
+				}
+			}
+			Log.info("  phase mean usec:%s", phases.c_str());
+		}
+	}
+}
+
+void setup() {
+	// Give a few seconds to connect to the USB serial port to see the output
+	waitFor(Serial.isConnected, 10000);
+	delay(1000);
+}
+
+void loop() {
+	if (!benchmarkRun) {
+		benchmarkRun = true;
+		runBenchmark();
+	}
+}
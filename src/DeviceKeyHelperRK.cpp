@@ -11,138 +11,1746 @@ static Logger log("app.devicekeys");
 
 DeviceKeyHelper *DeviceKeyHelper::instance;
 
+const DeviceKeyHelperRegion DEVICE_KEYS_HELPER_REGIONS[1] = {
+	{ DEVICE_KEYS_HELPER_OFFSET, DEVICE_KEYS_HELPER_SIZE }
+};
+
+const DeviceKeyHelperRegion DEVICE_KEYS_HELPER_VAULT_REGIONS[DEVICE_KEYS_HELPER_VAULT_REGION_COUNT] = {
+	{ DCT_DEVICE_PRIVATE_KEY_OFFSET, DCT_DEVICE_PRIVATE_KEY_SIZE + DCT_DEVICE_PUBLIC_KEY_SIZE },
+	{ DCT_SERVER_PUBLIC_KEY_OFFSET, DCT_SERVER_PUBLIC_KEY_SIZE },
+	{ DCT_ALT_DEVICE_PRIVATE_KEY_OFFSET, DCT_ALT_DEVICE_PRIVATE_KEY_SIZE + DCT_ALT_DEVICE_PUBLIC_KEY_SIZE },
+	{ DCT_ALT_SERVER_PUBLIC_KEY_OFFSET, DCT_ALT_SERVER_PUBLIC_KEY_SIZE }
+};
+
 
 DeviceKeyHelper::DeviceKeyHelper(std::function<bool(DeviceKeyHelperSavedData *savedData)> load, std::function<bool(const DeviceKeyHelperSavedData *savedData)> save) :
 	load(load), save(save) {
 	instance = this;
 }
 
-DeviceKeyHelper::~DeviceKeyHelper() {
+DeviceKeyHelper::DeviceKeyHelper() {
+	instance = this;
+}
+
+DeviceKeyHelper::~DeviceKeyHelper() {
+	delete scrubState;
+}
+
+void DeviceKeyHelper::startMonitor() {
+	if (executionMode != EXECUTION_MODE_SYSTEM_EVENT && !checkQueue) {
+		os_queue_create(&checkQueue, sizeof(CheckMode), CHECK_QUEUE_SIZE, 0);
+	}
+	if (executionMode == EXECUTION_MODE_THREAD && !thread) {
+		thread = new Thread("DeviceKeyHelper", threadFunctionStatic, this, threadPriority, threadStackSize);
+	}
+
+	// Events go to the helper that is monitoring, not the last one constructed, which may only be
+	// used for its storage, such as a replica of DeviceKeyHelperReplicated
+	instance = this;
+	System.on(cloud_status, eventHandlerStatic);
+}
+
+DeviceKeyHelper &DeviceKeyHelper::withLoopExecution() {
+	executionMode = EXECUTION_MODE_LOOP;
+	return *this;
+}
+
+DeviceKeyHelper &DeviceKeyHelper::withThreadExecution(os_thread_prio_t priority, size_t stackSize) {
+	executionMode = EXECUTION_MODE_THREAD;
+	threadPriority = priority;
+	threadStackSize = stackSize;
+	return *this;
+}
+
+DeviceKeyHelper &DeviceKeyHelper::withCheckCompleteCallback(std::function<void(CheckMode checkMode, bool result)> checkCompleteCallback) {
+	this->checkCompleteCallback = checkCompleteCallback;
+	return *this;
+}
+
+DeviceKeyHelper &DeviceKeyHelper::withStatsCallback(std::function<void(const DeviceKeyHelperStats &stats)> statsCallback) {
+	this->statsCallback = statsCallback;
+	return *this;
+}
+
+void DeviceKeyHelper::loop() {
+	CheckMode checkMode;
+
+	if (checkQueue && executionMode == EXECUTION_MODE_LOOP) {
+		while(os_queue_take(checkQueue, &checkMode, 0, 0) == 0) {
+			runCheck(checkMode);
+		}
+	}
+}
+
+DeviceKeyHelper &DeviceKeyHelper::withScrubCallback(std::function<void(const DeviceKeyHelperScrubStats &scrubStats)> scrubCallback) {
+	this->scrubCallback = scrubCallback;
+	return *this;
+}
+
+bool DeviceKeyHelper::scrub() {
+	if (load) {
+		// The whole saved data is loaded at once, which can't be split over several calls
+		return false;
+	}
+	if (!scrubState) {
+		scrubState = new ScrubState;
+		if (!scrubState) {
+			log.error("unable to allocate %u bytes, not scrubbing", sizeof(ScrubState));
+			stats.allocationFailures++;
+			return false;
+		}
+		scrubState->active = false;
+	}
+	if (!checkMutex.trylock()) {
+		// A check is running, try again on the next call
+		return false;
+	}
+
+	uint32_t start = micros();
+	uint32_t passes = scrubStats.passes;
+	ScrubState &ss = *scrubState;
+
+	if (ss.active && ss.checks != stats.checks) {
+		// The check may have saved the keys, so the slot and layout may have changed
+		log.trace("check ran, restarting scrub");
+		scrubStats.restarts++;
+		ss.active = false;
+	}
+	if (!ss.active) {
+		ss.startMillis = millis();
+	}
+
+	if (storageOpen(false)) {
+		// Opening the storage, reading the headers, and reading the layout count towards the budget
+		// like reading a chunk, and each call does at least one of them so the scrub always progresses
+		ss.dctError = false;
+		while(true) {
+			bool ok;
+			if (!ss.active) {
+				ok = scrubStart();
+				if (ok && !ss.active) {
+					// Nothing to scrub
+					break;
+				}
+			}
+			else
+			if (!ss.haveLayout) {
+				ok = scrubReadLayout();
+			}
+			else {
+				ok = scrubChunk();
+			}
+
+			if (!ok) {
+				if (storageError() != 0) {
+					// Continue from the same step on the next call
+					log.error("storage error %d, not scrubbed", storageError());
+					scrubStats.storageErrors++;
+				}
+				else {
+					scrubFinish(true, false);
+				}
+				break;
+			}
+			if (!ss.active || ss.dctError || micros() - start >= scrubBudgetMicros) {
+				break;
+			}
+		}
+		storageClose();
+	}
+	else
+	if (storageError() != 0) {
+		log.error("storage error %d, not scrubbed", storageError());
+		scrubStats.storageErrors++;
+	}
+	else {
+		scrubFinish(true, false);
+	}
+
+	uint32_t elapsed = micros() - start;
+	if (elapsed > scrubStats.maxCallMicros) {
+		scrubStats.maxCallMicros = elapsed;
+	}
+	checkMutex.unlock();
+
+	bool completed = (scrubStats.passes != passes);
+	if (completed && scrubCallback) {
+		scrubCallback(scrubStats);
+	}
+	return completed;
+}
+
+uint8_t DeviceKeyHelper::getScrubProgress() const {
+	if (!scrubState || !scrubState->active) {
+		return 0;
+	}
+	return (uint8_t)(scrubState->keysOffset * 100 / keysSize);
+}
+
+bool DeviceKeyHelper::scrubStart() {
+	ScrubState &ss = *scrubState;
+
+	// Reading the headers selects the slots, which the next save depends on, so leave them as they were
+	size_t savedLoadSlot = loadSlot;
+	size_t savedSaveSlot = saveSlot;
+	uint32_t savedGeneration = generation;
+
+	DeviceKeyHelperSavedDataHeader headers[2];
+	size_t order[2];
+	size_t numSlots = readSlotHeaders(headers, order);
+
+	loadSlot = savedLoadSlot;
+	saveSlot = savedSaveSlot;
+	generation = savedGeneration;
+
+	if (numSlots == 0) {
+		return false;
+	}
+
+	// The newest slot is the one that would be restored
+	const DeviceKeyHelperSavedDataHeader &header = headers[order[0]];
+	if (header.magic != DATA_HEADER_MAGIC_V2) {
+		// Version 1 saved data has no CRC to validate, and is rewritten in the current format by the
+		// next check, so no pass is counted until then
+		log.trace("version 1 saved data, not scrubbed");
+		return true;
+	}
+
+	ss.offset = slotOffset(order[0]);
+	ss.header = header;
+	ss.haveLayout = false;
+	ss.keysOffset = 0;
+	ss.checks = stats.checks;
+	ss.active = true;
+	return true;
+}
+
+bool DeviceKeyHelper::scrubReadLayout() {
+	ScrubState &ss = *scrubState;
+
+	DeviceKeyHelperLayoutBuffer *layoutBuffer = allocLayoutBuffer();
+	if (!layoutBuffer) {
+		// Not damage, start the pass again on the next call
+		ss.active = false;
+		return true;
+	}
+
+	// In compact mode this rebuilds the public key, which takes longer than reading a chunk
+	bool result = readLayout(ss.offset, ss.header, ss.layout, layoutBuffer->privateKey);
+	freeLayoutBuffer(layoutBuffer);
+	if (!result) {
+		return false;
+	}
+
+	// In compact mode, bytes after the public key in the public key slot are not compared
+	ss.expected = ss.header.crc;
+	ss.compareSize = ss.layout.rebuild ? ss.layout.privateKeySize + ss.layout.derLen : keysSize;
+	ss.crc = 0;
+	ss.same = true;
+	ss.haveLayout = true;
+	return true;
+}
+
+bool DeviceKeyHelper::scrubChunk() {
+	ScrubState &ss = *scrubState;
+	uint8_t onDevice[DEVICE_KEYS_HELPER_CHUNK_SIZE];
+	uint8_t saved[DEVICE_KEYS_HELPER_CHUNK_SIZE];
+
+	size_t count = keysSize - ss.keysOffset;
+	if (count > DEVICE_KEYS_HELPER_CHUNK_SIZE) {
+		count = DEVICE_KEYS_HELPER_CHUNK_SIZE;
+	}
+
+	if (!readLayoutKeys(ss.offset, ss.layout, ss.keysOffset, saved, count)) {
+		return false;
+	}
+
+	if (ss.same && ss.keysOffset < ss.compareSize) {
+		size_t compareCount = ss.compareSize - ss.keysOffset;
+		if (compareCount > count) {
+			compareCount = count;
+		}
+		if (keysRead(ss.keysOffset, onDevice, compareCount) != 0) {
+			// The chunk was not compared, so it's read again on the next call
+			log.error("unable to read the DCT, not scrubbed");
+			scrubStats.dctErrors++;
+			ss.dctError = true;
+			return true;
+		}
+		if (memcmp(onDevice, saved, compareCount) != 0) {
+			log.trace("keys differ in chunk at offset %u", ss.keysOffset);
+			ss.same = false;
+		}
+	}
+
+	ss.crc = calculateCrc(saved, count, ss.crc);
+	ss.keysOffset += count;
+	if (ss.keysOffset >= keysSize) {
+		bool damaged = (ss.crc != ss.expected);
+		scrubFinish(damaged, !damaged && !ss.same);
+	}
+	return true;
+}
+
+void DeviceKeyHelper::scrubFinish(bool damaged, bool mismatch) {
+	scrubState->active = false;
+
+	scrubStats.passes++;
+	scrubStats.lastPassMillis = millis();
+	scrubStats.lastPassDurationMillis = scrubStats.lastPassMillis - scrubState->startMillis;
+	scrubStats.lastDamaged = damaged;
+	scrubStats.lastMismatch = mismatch;
+
+	if (damaged) {
+		log.error("scrub found the saved keys missing or not valid");
+		scrubStats.damaged++;
+		scrubFoundDamage();
+	}
+	if (mismatch) {
+		log.warn("scrub found the keys in the DCT differ from the saved keys");
+		scrubStats.mismatches++;
+	}
+}
+
+void DeviceKeyHelper::scrubFoundDamage() {
+	scrubDamaged = true;
+	invalidateCache();
+}
+
+DeviceKeyHelper::Phase DeviceKeyHelper::enterPhase(Phase phase) {
+	uint32_t now = micros();
+	phaseMicros[currentPhase] += now - phaseStart;
+	phaseStart = now;
+	phasesUsed |= (1 << phase);
+
+	Phase previous = currentPhase;
+	currentPhase = phase;
+	return previous;
+}
+
+void DeviceKeyHelper::recordPhase(Phase phase, uint32_t elapsed) {
+	DeviceKeyHelperPhaseStats &phaseStats = stats.phases[phase];
+
+	if (phaseStats.count == 0 || elapsed < phaseStats.minMicros) {
+		phaseStats.minMicros = elapsed;
+	}
+	if (elapsed > phaseStats.maxMicros) {
+		phaseStats.maxMicros = elapsed;
+	}
+	phaseStats.totalMicros += elapsed;
+	phaseStats.count++;
+}
+
+void DeviceKeyHelper::resetStats() {
+	memset(&stats, 0, sizeof(stats));
+}
+
+size_t DeviceKeyHelper::getStatsJson(char *buf, size_t bufSize) const {
+	// Leave room for the null terminator, which JSONBufferWriter does not add
+	JSONBufferWriter writer(buf, bufSize - 1);
+
+	writer.beginObject();
+	writer.name("checks").value((unsigned) stats.checks);
+	writer.name("cacheHits").value((unsigned) stats.cacheHits);
+	writer.name("saves").value((unsigned) stats.saves);
+	writer.name("saveFailures").value((unsigned) stats.saveFailures);
+	writer.name("v1SavesRefused").value((unsigned) stats.v1SavesRefused);
+	writer.name("storageErrors").value((unsigned) stats.storageErrors);
+	writer.name("restores").value((unsigned) stats.restores);
+	writer.name("checksumFailures").value((unsigned) stats.checksumFailures);
+	writer.name("allocationFailures").value((unsigned) stats.allocationFailures);
+	writer.name("storageRead").value((unsigned) stats.storageBytesRead);
+	writer.name("storageWritten").value((unsigned) stats.storageBytesWritten);
+	writer.name("dctRead").value((unsigned) stats.dctBytesRead);
+	writer.name("dctWritten").value((unsigned) stats.dctBytesWritten);
+	writer.name("reconnectRecoveries").value((unsigned) stats.reconnectRecoveries);
+	writer.name("reconnectMs").value((unsigned) stats.lastReconnectMillis);
+	writer.name("reconnectReset").value(stats.lastReconnectReset);
+
+	writer.name("phases").beginObject();
+	for(size_t ii = 0; ii < PHASE_COUNT; ii++) {
+		const DeviceKeyHelperPhaseStats &phaseStats = stats.phases[ii];
+		if (phaseStats.count == 0) {
+			continue;
+		}
+		writer.name(getPhaseName((Phase) ii)).beginObject();
+		writer.name("n").value((unsigned) phaseStats.count);
+		writer.name("min").value((unsigned) phaseStats.minMicros);
+		writer.name("max").value((unsigned) phaseStats.maxMicros);
+		writer.name("mean").value((unsigned) (phaseStats.totalMicros / phaseStats.count));
+		writer.endObject();
+	}
+	writer.endObject();
+
+	writer.endObject();
+
+	size_t len = writer.dataSize();
+	buf[(len < bufSize) ? len : (bufSize - 1)] = 0;
+	return len;
+}
+
+// [static]
+const char *DeviceKeyHelper::getPhaseName(Phase phase) {
+	static const char *names[PHASE_COUNT] = { "check", "dctRead", "load", "validate", "compare", "dctWrite", "save" };
+
+	return (phase < PHASE_COUNT) ? names[phase] : "";
+}
+
+void DeviceKeyHelper::queueCheck(CheckMode checkMode) {
+	if (checkQueue) {
+		if (os_queue_put(checkQueue, &checkMode, 0, 0) != 0) {
+			// A check is already queued and will see the current keys when it runs
+			log.trace("check queue full");
+		}
+	}
+	else {
+		runCheck(checkMode);
+	}
+}
+
+bool DeviceKeyHelper::runCheck(CheckMode checkMode) {
+	checkMutex.lock();
+	bool result = check(checkMode);
+	checkMutex.unlock();
+
+	if (checkCompleteCallback) {
+		checkCompleteCallback(checkMode, result);
+	}
+	return result;
+}
+
+void DeviceKeyHelper::recoverKeys() {
+	Particle.disconnect();
+
+	if (!reconnectRecovery) {
+		runCheck(CheckMode::CHECKMODE_AUTOMATIC);
+
+		// Normally this line won't be reached because check does a restart if keys
+		// are restored, but this is here in case the restore fails, so the device
+		// won't be left in disconnected state.
+		systemReset();
+		return;
+	}
+
+	recoveryStart = millis();
+	if (runCheck(CheckMode::CHECKMODE_AUTOMATIC_NO_RESTART)) {
+		// Keys were not restored, so connecting again would fail the same way
+		log.info("keys not restored, resetting");
+		systemReset();
+		return;
+	}
+
+	// The keys are read from the DCT when connecting, so the restored keys are used without a reset
+	log.info("keys restored, reconnecting");
+	recoveryState = RECOVERY_CONNECT_REQUESTED;
+	failureCount = 0;
+	Particle.connect();
+}
+
+void DeviceKeyHelper::recordReconnect() {
+	if (recoveryState != RECOVERY_NONE) {
+		stats.reconnectRecoveries++;
+		stats.lastReconnectMillis = millis() - recoveryStart;
+		stats.lastReconnectReset = false;
+		recoveryState = RECOVERY_NONE;
+		log.info("reconnected after restoring keys in %lu ms", stats.lastReconnectMillis);
+	}
+	else
+	if (firstConnect && System.resetReason() == RESET_REASON_USER && System.resetReasonData() == RESET_REASON_DATA) {
+		// Does not include the time before the reset, which is short compared to reconnecting
+		stats.lastReconnectMillis = millis();
+		stats.lastReconnectReset = true;
+		log.info("reconnected after restoring keys and resetting in %lu ms from boot", stats.lastReconnectMillis);
+	}
+	firstConnect = false;
+}
+
+void DeviceKeyHelper::threadFunction() {
+	CheckMode checkMode;
+
+	while(true) {
+		if (os_queue_take(checkQueue, &checkMode, CONCURRENT_WAIT_FOREVER, 0) == 0) {
+			runCheck(checkMode);
+		}
+	}
+}
+
+// [static]
+void DeviceKeyHelper::threadFunctionStatic(void *param) {
+	((DeviceKeyHelper *)param)->threadFunction();
+}
+
+
+DeviceKeyHelper &DeviceKeyHelper::withStaticBuffer() {
+	// This is only linked in (and only uses RAM) if withStaticBuffer() is called
+	static DeviceKeyHelperBuffer staticBuffer;
+
+	buffer = &staticBuffer;
+	return *this;
+}
+
+
+DeviceKeyHelper &DeviceKeyHelper::withRegions(const DeviceKeyHelperRegion *regions, size_t regionCount) {
+	if (regionCount > DEVICE_KEYS_HELPER_MAX_REGIONS) {
+		log.error("too many regions %u, limit is %u", regionCount, DEVICE_KEYS_HELPER_MAX_REGIONS);
+		return *this;
+	}
+
+	this->regions = regions;
+	this->regionCount = regionCount;
+
+	keysSize = 0;
+	for(size_t ii = 0; ii < regionCount; ii++) {
+		keysSize += regions[ii].size;
+	}
+
+	invalidateCache();
+	return *this;
+}
+
+DeviceKeyHelper &DeviceKeyHelper::withVault() {
+	return withRegions(DEVICE_KEYS_HELPER_VAULT_REGIONS, DEVICE_KEYS_HELPER_VAULT_REGION_COUNT);
+}
+
+DeviceKeyHelper &DeviceKeyHelper::withRetainedCache(DeviceKeyHelperVerifiedCache *retainedCache) {
+	this->retainedCache = retainedCache;
+	return *this;
+}
+
+void DeviceKeyHelper::invalidateCache() {
+	memset(&sessionCache, 0, sizeof(DeviceKeyHelperVerifiedCache));
+	if (retainedCache) {
+		memset(retainedCache, 0, sizeof(DeviceKeyHelperVerifiedCache));
+	}
+}
+
+bool DeviceKeyHelper::isVerified(uint32_t crc) const {
+	const DeviceKeyHelperVerifiedCache *caches[2] = { &sessionCache, retainedCache };
+
+	for(size_t ii = 0; ii < 2; ii++) {
+		const DeviceKeyHelperVerifiedCache *cache = caches[ii];
+		if (cache && cache->magic == VERIFIED_CACHE_MAGIC && cache->crc == crc && cache->crcInverted == ~crc) {
+			return true;
+		}
+	}
+	return false;
+}
+
+void DeviceKeyHelper::setVerified(uint32_t crc) {
+	sessionCache.magic = VERIFIED_CACHE_MAGIC;
+	sessionCache.crc = crc;
+	sessionCache.crcInverted = ~crc;
+	if (retainedCache) {
+		*retainedCache = sessionCache;
+	}
+}
+
+bool DeviceKeyHelper::check(CheckMode checkMode) {
+	// The time spent in each phase is added up during the check and recorded as one sample at the end
+	memset(phaseMicros, 0, sizeof(phaseMicros));
+	phasesUsed = 0;
+	currentPhase = PHASE_CHECK;
+	phaseStart = micros();
+
+	uint32_t start = phaseStart;
+	stats.checks++;
+
+	bool result = checkKeys(checkMode);
+
+	enterPhase(PHASE_CHECK);
+	for(size_t ii = PHASE_CHECK + 1; ii < PHASE_COUNT; ii++) {
+		if (phasesUsed & (1 << ii)) {
+			recordPhase((Phase) ii, phaseMicros[ii]);
+		}
+	}
+	recordPhase(PHASE_CHECK, micros() - start);
+
+	if (statsCallback) {
+		statsCallback(stats);
+	}
+	return result;
+}
+
+bool DeviceKeyHelper::checkKeys(CheckMode checkMode) {
+	bool result = true;
+
+	if (load && regions != DEVICE_KEYS_HELPER_REGIONS) {
+		log.error("withRegions() requires random access storage, keys not checked");
+		return true;
+	}
+
+	// Reading the DCT is fast, so if these keys were already verified against the saved keys
+	// there's no need to access the storage medium again
+	uint32_t dctCrc = calculateDctCrc();
+	if (isVerified(dctCrc)) {
+		log.info("device keys unchanged (cached)");
+		stats.cacheHits++;
+		return true;
+	}
+
+	if (!load) {
+		// Random access storage, checks are done a chunk at a time
+		return checkStorage(checkMode, dctCrc);
+	}
+
+	// The header decides whether the rest of the saved data needs to be loaded
+	bool loadKeys = true;
+	if (loadHeader) {
+		switch(checkLoadedHeader(dctCrc)) {
+		case CHUNKED_UNCHANGED:
+			log.info("device keys unchanged");
+			setVerified(dctCrc);
+			return true;
+
+		case CHUNKED_INVALID:
+			loadKeys = false;
+			break;
+
+		case CHUNKED_CHANGED:
+		default:
+			break;
+		}
+	}
+
+	if (buffer) {
+		result = checkWithBuffer(checkMode, buffer, loadKeys);
+	}
+	else {
+		// On TCP devices, this is over 3K so it's too large to allocate on the stack safely.
+		// We deallocate it before exiting this function.
+		DeviceKeyHelperBuffer *checkBuffer = new DeviceKeyHelperBuffer;
+		if (checkBuffer) {
+			result = checkWithBuffer(checkMode, checkBuffer, loadKeys);
+			delete checkBuffer;
+		}
+		else {
+			log.error("unable to allocate %u bytes, keys not checked", sizeof(DeviceKeyHelperBuffer));
+			stats.allocationFailures++;
+		}
+	}
+	return result;
+}
+
+bool DeviceKeyHelper::checkStorage(CheckMode checkMode, uint32_t dctCrc) {
+	ChunkedResult result = checkChunked(checkMode, dctCrc);
+	if (result == CHUNKED_UNCHANGED && scrubDamaged) {
+		// Only the header was read, which still matches, but scrub() found the saved keys damaged
+		log.info("saved keys damaged");
+		result = CHUNKED_INVALID;
+	}
+
+	switch(result) {
+	case CHUNKED_UNCHANGED:
+		log.info("device keys unchanged");
+		setVerified(dctCrc);
+		return true;
+
+	case CHUNKED_CHANGED:
+		if (checkMode == CHECKMODE_SAVE_CURRENT) {
+			log.info("saving keys");
+			saveChunked(dctCrc);
+			return true;
+		}
+		if (checkMode == CHECKMODE_CHECK_ONLY) {
+			log.info("device keys changed");
+			return false;
+		}
+		return restoreChunked(checkMode, dctCrc);
+
+	case CHUNKED_INVALID:
+	default:
+		if (storageError() != 0) {
+			// The saved keys may be fine, so don't overwrite them with keys that haven't been checked
+			log.error("storage error %d, keys not checked", storageError());
+			stats.storageErrors++;
+			return true;
+		}
+		log.info("was unable to load existing key data or data was not valid");
+		log.info("saving keys");
+		saveChunked(dctCrc);
+		return true;
+	}
+}
+
+bool DeviceKeyHelper::checkWithBuffer(CheckMode checkMode, DeviceKeyHelperBuffer *checkBuffer, bool loadKeys) {
+	bool result = true;
+
+	uint8_t *onDevice = checkBuffer->onDevice;
+	DeviceKeyHelperSavedData *saved = &checkBuffer->saved;
+
+	// The buffer may be reused across checks, so make sure data from a previous check is not
+	// mistaken for saved data if load fails.
+	memset(saved, 0, sizeof(DeviceKeyHelperSavedData));
+
+	keysRead(0, onDevice, DEVICE_KEYS_HELPER_SIZE);
+
+	bool saveKeys = false;
+	bool upgraded = false;
+	v1Found = false;
+
+	if (!loadKeys) {
+		// checkLoadedHeader() found there are no saved keys
+		log.info("no saved keys");
+		saveKeys = true;
+	}
+	else
+	if (loadSavedData(saved)) {
+		v1Found = (saved->magic == DATA_HEADER_MAGIC);
+
+		// We were able to load some data, but make sure it's valid
+		if (validateData(saved)) {
+			// Looks valid
+			upgraded = upgradeData(saved);
+
+			bool same = false;
+			if (checkMode != CHECKMODE_SAVE_CURRENT) {
+				PhaseTimer timer(this, PHASE_COMPARE);
+				same = (memcmp(onDevice, saved->keys, DEVICE_KEYS_HELPER_SIZE) == 0);
+			}
+
+			if (checkMode == CHECKMODE_SAVE_CURRENT) {
+				log.trace("force save device keys");
+				saveKeys = true;
+			}
+			else
+			if (!same) {
+				// Changed
+				if (checkMode != CHECKMODE_CHECK_ONLY) {
+					invalidateCache();
+
+					int res = keysWrite(0, saved->keys, DEVICE_KEYS_HELPER_SIZE);
+					stats.restores++;
+
+					log.info("device keys changed! reverting offset=%u size=%u result=%d", DEVICE_KEYS_HELPER_OFFSET, DEVICE_KEYS_HELPER_SIZE, res);
+
+					if (checkMode != CHECKMODE_AUTOMATIC_NO_RESTART) {
+						systemReset();
+					}
+				}
+				else {
+					log.info("device keys changed");
+				}
+				result = false;
+			}
+			else {
+				// Same
+				log.info("device keys unchanged");
+				setVerified(saved->crc);
+
+				// Save in the current format if the saved data was in an old format and it won't
+				// overwrite anything after it
+				saveKeys = upgraded && v1Upgrade;
+			}
+		}
+		else {
+			// Not valid, just save the current keys
+			log.info("was able to load device keys, but data was not valid");
+			saveKeys = true;
+		}
+
+	}
+	else {
+		// Did not successfully load, so save the current key instead
+		log.info("was unable to load existing key data");
+		saveKeys = true;
+	}
+
+	if (saveKeys && (!upgraded || !v1Upgrade)) {
+		// Version 1 saved data that was upgraded was already validated, and it's only saved again if
+		// it may be replaced by the larger format
+		if ((upgraded || (isHeaderValid((const DeviceKeyHelperSavedDataHeader *)saved, saved->regions) &&
+			saved->crc == calculateCrc(saved->keys, DEVICE_KEYS_HELPER_SIZE))) &&
+			memcmp(saved->keys, onDevice, DEVICE_KEYS_HELPER_SIZE) == 0) {
+			//
+			log.trace("keys unchanged, no need to save");
+			setVerified(saved->crc);
+			saveKeys = false;
+		}
+	}
+
+	if (saveKeys && v1Found && !v1Upgrade) {
+		// The keys differ from the version 1 saved keys, but the save function writes the whole
+		// DeviceKeyHelperSavedData, which is larger
+		log.warn("version 1 saved keys found, not saving %u bytes over them, see withV1Upgrade()", sizeof(DeviceKeyHelperSavedData));
+		stats.v1SavesRefused++;
+		saveKeys = false;
+	}
+
+	if (saveKeys) {
+		// Save a header (with magic bytes, version, length, CRC, and table of contents)
+		log.info("saving keys");
+		memcpy(saved->keys, onDevice, DEVICE_KEYS_HELPER_SIZE);
+
+		initHeader((DeviceKeyHelperSavedDataHeader *)saved, calculateCrc(saved->keys, DEVICE_KEYS_HELPER_SIZE));
+		saved->generation = generation + 1;
+		memcpy(saved->regions, DEVICE_KEYS_HELPER_REGIONS, sizeof(saved->regions));
+
+		if (saveSavedData(saved)) {
+			log.info("saved keys, %u bytes written", lastSaveBytesWritten);
+			setVerified(saved->crc);
+		}
+		else {
+			invalidateCache();
+		}
+	}
+
+	return result;
+}
+
+DeviceKeyHelper::ChunkedResult DeviceKeyHelper::checkChunked(CheckMode checkMode, uint32_t dctCrc) {
+	PhaseTimer timer(this, PHASE_LOAD);
+
+	if (!storageOpen(false)) {
+		loadSlot = saveSlot = 0;
+		return CHUNKED_INVALID;
+	}
+
+	ChunkedResult result = CHUNKED_INVALID;
+	bool upgrade = false;
+
+	DeviceKeyHelperSavedDataHeader headers[2];
+	size_t order[2];
+	size_t numSlots = readSlotHeaders(headers, order);
+
+	for(size_t ii = 0; ii < numSlots && result == CHUNKED_INVALID; ii++) {
+		const DeviceKeyHelperSavedDataHeader &header = headers[order[ii]];
+		size_t offset = slotOffset(order[ii]);
+
+		if (header.magic == DATA_HEADER_MAGIC_V2) {
+			if (header.crc == dctCrc) {
+				// The keys in the DCT are the ones that were saved, no need to read the saved keys
+				log.trace("crc unchanged");
+				result = CHUNKED_UNCHANGED;
+			}
+			else
+			if (header.flags & FLAG_COMPACT) {
+				// The CRC includes the rebuilt public key slot, which may differ from the DCT after the
+				// public key, so the keys are always compared
+				result = compareLayout(checkMode, offset, header);
+			}
+			else
+			if (checkMode == CHECKMODE_CHECK_ONLY || dualSlot) {
+				// Need to know whether the saved keys are valid to know whether to return false. In
+				// dual slot mode, also to make sure a save never overwrites the only valid slot.
+				if (header.flags & FLAG_TRIMMED) {
+					result = compareLayout(CHECKMODE_CHECK_ONLY, offset, header);
+				}
+				else {
+					result = compareChunked(CHECKMODE_CHECK_ONLY, offset + keysOffset(), false, header.crc);
+				}
+			}
+			else {
+				// Either the saved data will be overwritten (CHECKMODE_SAVE_CURRENT) or it will be
+				// validated by restoreChunked()
+				result = CHUNKED_CHANGED;
+			}
+		}
+		else {
+			// Version 1 saved data has no CRC, so compare the keys
+			const DeviceKeyHelperSavedDataV1Header *v1 = (const DeviceKeyHelperSavedDataV1Header *)&header;
+			result = compareChunked(checkMode, offset + sizeof(DeviceKeyHelperSavedDataV1Header), true, v1->sum);
+
+			// Save in the current format if the keys are the same, otherwise it will be overwritten
+			// or restored anyway. Unless there's room for it, version 1 saved data is kept.
+			upgrade = (result == CHUNKED_UNCHANGED) && !useV1Format();
+		}
+
+		if (result != CHUNKED_INVALID) {
+			selectSlot(order[ii]);
+		}
+	}
+
+	storageClose();
+
+	if (upgrade) {
+		log.info("saving keys in version %u format", DATA_VERSION);
+		saveChunked(dctCrc);
+	}
+
+	return result;
+}
+
+DeviceKeyHelper::ChunkedResult DeviceKeyHelper::checkLoadedHeader(uint32_t dctCrc) {
+	PhaseTimer timer(this, PHASE_LOAD);
+
+	DeviceKeyHelperSavedDataHeader header;
+	if (!loadHeader(&header)) {
+		// Load the whole saved data instead
+		log.trace("unable to load header");
+		return CHUNKED_CHANGED;
+	}
+	stats.storageBytesRead += sizeof(header);
+
+	const DeviceKeyHelperSavedDataV1Header *v1 = (const DeviceKeyHelperSavedDataV1Header *)&header;
+	if (header.magic == DATA_HEADER_MAGIC_V2 && header.version == DATA_VERSION && header.flags == 0 && header.size == DEVICE_KEYS_HELPER_SIZE) {
+		generation = header.generation;
+		if (header.crc == dctCrc) {
+			log.trace("crc unchanged");
+			return CHUNKED_UNCHANGED;
+		}
+		return CHUNKED_CHANGED;
+	}
+	else
+	if (header.magic == DATA_HEADER_MAGIC && v1->size == DEVICE_KEYS_HELPER_SIZE) {
+		// Version 1 saved data has no CRC, so the keys are compared
+		return CHUNKED_CHANGED;
+	}
+
+	log.info("bad magic bytes, version, or size magic=%08lx version=%u size=%u", header.magic, header.version, header.size);
+	generation = 0;
+	return CHUNKED_INVALID;
+}
+
+size_t DeviceKeyHelper::readSlotHeaders(DeviceKeyHelperSavedDataHeader *headers, size_t *order) {
+	size_t numSlots = 0;
+	uint32_t generations[2];
+	DeviceKeyHelperRegion toc[DEVICE_KEYS_HELPER_MAX_REGIONS];
+
+	// Until a valid slot is found, save to the first slot
+	loadSlot = saveSlot = 0;
+	generation = 0;
+	v1Found = false;
+
+	if (dualSlot && useCompact() && !compactProbed) {
+		// The offset of the second slot depends on whether the keys can be saved in compact mode, so
+		// find out before the first save
+		DeviceKeyHelperSavedDataHeader header;
+		initHeader(&header, 0);
+		compactProbed = initCompactHeader(&header);
+	}
+
+	for(size_t slot = 0; slot < (dualSlot ? 2 : 1); slot++) {
+		DeviceKeyHelperSavedDataHeader &header = headers[slot];
+		if (!readStorage(slotOffset(slot), &header, sizeof(header))) {
+			// Normal for the second slot in a file that has only been saved to once
+			log.trace("unable to read header slot=%u", slot);
+			continue;
+		}
+
+		const DeviceKeyHelperSavedDataV1Header *v1 = (const DeviceKeyHelperSavedDataV1Header *)&header;
+		if (header.magic == DATA_HEADER_MAGIC_V2 &&
+			readStorage(slotOffset(slot) + sizeof(header), toc, regionCount * sizeof(DeviceKeyHelperRegion)) &&
+			isHeaderValid(&header, toc)) {
+			generations[slot] = header.generation;
+		}
+		else
+		if (header.magic == DATA_HEADER_MAGIC && v1->size == DEVICE_KEYS_HELPER_SIZE && slot == 0 && regions == DEVICE_KEYS_HELPER_REGIONS) {
+			// Version 1 saved data has no generation, only ever has one slot, and only contains the device keys
+			generations[slot] = 0;
+			v1Found = true;
+		}
+		else {
+			log.info("bad magic bytes, version, size, or regions slot=%u magic=%08lx version=%u size=%u", slot, header.magic, header.version, header.size);
+			continue;
+		}
+
+		if (generations[slot] > generation) {
+			generation = generations[slot];
+		}
+
+		if (numSlots > 0 && generations[slot] > generations[order[0]]) {
+			// Newest first
+			order[1] = order[0];
+			order[0] = slot;
+		}
+		else {
+			order[numSlots] = slot;
+		}
+		numSlots++;
+	}
+
+	return numSlots;
+}
+
+void DeviceKeyHelper::selectSlot(size_t slot) {
+	loadSlot = slot;
+	saveSlot = dualSlot ? (1 - slot) : 0;
+}
+
+DeviceKeyHelper::ChunkedResult DeviceKeyHelper::compareChunked(CheckMode checkMode, size_t keysOffset, bool v1, uint32_t expected) {
+	PhaseTimer timer(this, PHASE_COMPARE);
+	uint8_t onDevice[DEVICE_KEYS_HELPER_CHUNK_SIZE];
+	uint8_t saved[DEVICE_KEYS_HELPER_CHUNK_SIZE];
+	uint32_t check = 0;
+	bool same = true;
+
+	for(size_t offset = 0; offset < keysSize; offset += DEVICE_KEYS_HELPER_CHUNK_SIZE) {
+		size_t count = keysSize - offset;
+		if (count > DEVICE_KEYS_HELPER_CHUNK_SIZE) {
+			count = DEVICE_KEYS_HELPER_CHUNK_SIZE;
+		}
+
+		if (!readStorage(keysOffset + offset, saved, count)) {
+			log.info("error reading saved keys");
+			return CHUNKED_INVALID;
+		}
+		{
+			PhaseTimer timer(this, PHASE_VALIDATE);
+			if (v1) {
+				check = (uint16_t)(check + calculateChecksumV1(saved, count));
+			}
+			else {
+				check = calculateCrc(saved, count, check);
+			}
+		}
+
+		if (same) {
+			keysRead(offset, onDevice, count);
+			if (memcmp(onDevice, saved, count) != 0) {
+				log.trace("keys differ in chunk at offset %u", offset);
+				same = false;
+				if (checkMode == CHECKMODE_SAVE_CURRENT) {
+					// Will be overwritten, so no need to read the rest to validate it
+					return CHUNKED_CHANGED;
+				}
+			}
+		}
+	}
+
+	if (check != expected) {
+		log.info("bad checksum");
+		stats.checksumFailures++;
+		return CHUNKED_INVALID;
+	}
+
+	return same ? CHUNKED_UNCHANGED : CHUNKED_CHANGED;
+}
+
+DeviceKeyHelper::ChunkedResult DeviceKeyHelper::compareLayout(CheckMode checkMode, size_t offset, const DeviceKeyHelperSavedDataHeader &header) {
+	PhaseTimer timer(this, PHASE_COMPARE);
+	DeviceKeyHelperLayoutBuffer *layoutBuffer = allocLayoutBuffer();
+	if (!layoutBuffer) {
+		return CHUNKED_INVALID;
+	}
+	ChunkedResult result = compareLayout(checkMode, offset, header, layoutBuffer);
+	freeLayoutBuffer(layoutBuffer);
+	return result;
+}
+
+DeviceKeyHelper::ChunkedResult DeviceKeyHelper::compareLayout(CheckMode checkMode, size_t offset, const DeviceKeyHelperSavedDataHeader &header, DeviceKeyHelperLayoutBuffer *layoutBuffer) {
+	DeviceKeyHelperRecordLayout &layout = layoutBuffer->layout;
+	if (!readLayout(offset, header, layout, layoutBuffer->privateKey)) {
+		return CHUNKED_INVALID;
+	}
+
+	// In compact mode, bytes after the public key in the public key slot are not compared
+	size_t compareSize = layout.rebuild ? layout.privateKeySize + layout.derLen : keysSize;
+
+	// The private key was only needed to rebuild the public key, so its memory is reused for chunks
+	static_assert(sizeof(DeviceKeyHelperLayoutBuffer::privateKey) >= 2 * DEVICE_KEYS_HELPER_CHUNK_SIZE, "private key buffer is smaller than two chunks");
+	uint8_t *onDevice = layoutBuffer->privateKey;
+	uint8_t *saved = &layoutBuffer->privateKey[DEVICE_KEYS_HELPER_CHUNK_SIZE];
+	uint32_t crc = 0;
+	bool same = true;
+
+	for(size_t keysOffset = 0; keysOffset < keysSize; keysOffset += DEVICE_KEYS_HELPER_CHUNK_SIZE) {
+		size_t count = keysSize - keysOffset;
+		if (count > DEVICE_KEYS_HELPER_CHUNK_SIZE) {
+			count = DEVICE_KEYS_HELPER_CHUNK_SIZE;
+		}
+
+		if (!readLayoutKeys(offset, layout, keysOffset, saved, count)) {
+			log.info("error reading saved keys");
+			return CHUNKED_INVALID;
+		}
+		{
+			PhaseTimer timer(this, PHASE_VALIDATE);
+			crc = calculateCrc(saved, count, crc);
+		}
+
+		if (same && keysOffset < compareSize) {
+			size_t compareCount = compareSize - keysOffset;
+			if (compareCount > count) {
+				compareCount = count;
+			}
+			keysRead(keysOffset, onDevice, compareCount);
+			if (memcmp(onDevice, saved, compareCount) != 0) {
+				log.trace("keys differ in chunk at offset %u", keysOffset);
+				same = false;
+				if (checkMode == CHECKMODE_SAVE_CURRENT) {
+					// Will be overwritten, so no need to read the rest to validate it
+					return CHUNKED_CHANGED;
+				}
+			}
+		}
+	}
+
+	if (crc != header.crc) {
+		log.info("bad checksum");
+		stats.checksumFailures++;
+		return CHUNKED_INVALID;
+	}
+
+	return same ? CHUNKED_UNCHANGED : CHUNKED_CHANGED;
+}
+
+bool DeviceKeyHelper::readLayout(size_t offset, const DeviceKeyHelperSavedDataHeader &header, DeviceKeyHelperRecordLayout &layout, uint8_t *privateKey) {
+	DeviceKeyHelperTrim trim[2];
+	if ((header.flags & FLAG_TRIMMED) && !readStorage(offset + keysOffset(), trim, sizeof(trim))) {
+		log.info("error reading saved keys");
+		return false;
+	}
+
+	if (!DeviceKeyHelperRecord::initLayout(header, regionCount * sizeof(DeviceKeyHelperRegion), trim, layout)) {
+		log.info("bad trimmed lengths private=%u public=%u", trim[0].length, trim[1].length);
+		return false;
+	}
+
+	if (layout.rebuild) {
+		// Only reads from the private key slot, so the public key isn't needed yet
+		size_t privateSize = sizeof(DeviceKeyHelperLayoutBuffer::privateKey);
+		if (!readLayoutKeys(offset, layout, 0, privateKey, privateSize) ||
+			!DeviceKeyHelperRecord::rebuildPublicKey(layout, privateKey, privateSize)) {
+			log.info("unable to rebuild the public key from the saved private key");
+			return false;
+		}
+	}
+	return true;
+}
+
+DeviceKeyHelperLayoutBuffer *DeviceKeyHelper::allocLayoutBuffer() {
+	if (buffer) {
+		return (DeviceKeyHelperLayoutBuffer *)buffer;
+	}
+
+	DeviceKeyHelperLayoutBuffer *layoutBuffer = new DeviceKeyHelperLayoutBuffer;
+	if (!layoutBuffer) {
+		log.error("unable to allocate %u bytes", sizeof(DeviceKeyHelperLayoutBuffer));
+		stats.allocationFailures++;
+	}
+	return layoutBuffer;
+}
+
+void DeviceKeyHelper::freeLayoutBuffer(DeviceKeyHelperLayoutBuffer *layoutBuffer) {
+	if (layoutBuffer != (DeviceKeyHelperLayoutBuffer *)buffer) {
+		delete layoutBuffer;
+	}
+}
+
+bool DeviceKeyHelper::readLayoutKeys(size_t offset, const DeviceKeyHelperRecordLayout &layout, size_t keysOffset, uint8_t *data, size_t size) {
+	return DeviceKeyHelperRecord::readLayoutKeys(layout, keysOffset, data, size, [this, offset](size_t savedOffset, void *savedData, size_t savedSize) {
+		return readStorage(offset + savedOffset, savedData, savedSize);
+	});
+}
+
+bool DeviceKeyHelper::initCompactHeader(DeviceKeyHelperSavedDataHeader *header) {
+	DeviceKeyHelperLayoutBuffer *layoutBuffer = allocLayoutBuffer();
+	if (!layoutBuffer) {
+		return false;
+	}
+	if (!initCompactHeader(header, layoutBuffer)) {
+		// Such as a key larger than KEY_PARSE_SIZE, which the system firmware doesn't create. Saving the
+		// whole keys takes more space, but not saving them would leave no backup at all.
+		log.warn("unable to rebuild the public key from the private key, not using compact mode");
+		compactUnavailable = true;
+	}
+	freeLayoutBuffer(layoutBuffer);
+	return true;
+}
+
+bool DeviceKeyHelper::initCompactHeader(DeviceKeyHelperSavedDataHeader *header, DeviceKeyHelperLayoutBuffer *layoutBuffer) {
+	keysRead(0, layoutBuffer->privateKey, sizeof(layoutBuffer->privateKey));
+
+	uint8_t *der = layoutBuffer->layout.der;
+	size_t derLen = buildPublicKeyDer(layoutBuffer->privateKey, sizeof(layoutBuffer->privateKey), der, sizeof(layoutBuffer->layout.der));
+	if (derLen == 0 || DEVICE_KEYS_HELPER_PRIVATE_KEY_SIZE + derLen > keysSize) {
+		return false;
+	}
+
+	// Use the same fill byte after the public key as the DCT, so the keys are usually identical
+	uint8_t fill = 0xff;
+	if (DEVICE_KEYS_HELPER_PRIVATE_KEY_SIZE + derLen < keysSize) {
+		keysRead(DEVICE_KEYS_HELPER_PRIVATE_KEY_SIZE + derLen, &fill, 1);
+	}
+	header->flags = FLAG_COMPACT;
+	if (fill == 0x00) {
+		header->flags |= FLAG_FILL_ZERO;
+	}
+	else {
+		fill = 0xff;
+	}
+
+	// CRC of the keys as they will be restored: the private key from the DCT and the rebuilt public key
+	// slot. The private key was only needed to build the public key, so its memory is reused for chunks.
+	uint8_t *chunk = layoutBuffer->privateKey;
+	uint32_t crc = 0;
+	for(size_t offset = 0; offset < DEVICE_KEYS_HELPER_PRIVATE_KEY_SIZE; offset += DEVICE_KEYS_HELPER_CHUNK_SIZE) {
+		size_t count = DEVICE_KEYS_HELPER_PRIVATE_KEY_SIZE - offset;
+		if (count > DEVICE_KEYS_HELPER_CHUNK_SIZE) {
+			count = DEVICE_KEYS_HELPER_CHUNK_SIZE;
+		}
+		keysRead(offset, chunk, count);
+		crc = calculateCrc(chunk, count, crc);
+	}
+	crc = calculateCrc(der, derLen, crc);
+
+	memset(chunk, fill, DEVICE_KEYS_HELPER_CHUNK_SIZE);
+	for(size_t offset = DEVICE_KEYS_HELPER_PRIVATE_KEY_SIZE + derLen; offset < keysSize; offset += DEVICE_KEYS_HELPER_CHUNK_SIZE) {
+		size_t count = keysSize - offset;
+		if (count > DEVICE_KEYS_HELPER_CHUNK_SIZE) {
+			count = DEVICE_KEYS_HELPER_CHUNK_SIZE;
+		}
+		crc = calculateCrc(chunk, count, crc);
+	}
+
+	header->crc = crc;
+	return true;
+}
+
+bool DeviceKeyHelper::initTrim(const DeviceKeyHelperSavedDataHeader &header, DeviceKeyHelperTrim *trim) {
+	trimSlot(0, DEVICE_KEYS_HELPER_PRIVATE_KEY_SIZE, trim[0]);
+
+	if (header.flags & FLAG_COMPACT) {
+		// The public key is rebuilt instead, this is the padding after it
+		trim[1].length = 0;
+		trim[1].fill = (header.flags & FLAG_FILL_ZERO) ? 0x00 : 0xff;
+		trim[1].reserved = 0;
+	}
+	else {
+		trimSlot(DEVICE_KEYS_HELPER_PRIVATE_KEY_SIZE, keysSize - DEVICE_KEYS_HELPER_PRIVATE_KEY_SIZE, trim[1]);
+	}
+
+	return 2 * sizeof(DeviceKeyHelperTrim) + trim[0].length + trim[1].length <= storedKeysSize();
+}
+
+void DeviceKeyHelper::trimSlot(size_t start, size_t size, DeviceKeyHelperTrim &trim) {
+	uint8_t chunk[DEVICE_KEYS_HELPER_CHUNK_SIZE];
+	size_t count = (size < sizeof(chunk)) ? size : sizeof(chunk);
+	keysRead(start, chunk, count);
+
+	// Use the same padding as the DCT after the DER encoded key
+	trim.fill = 0xff;
+	trim.reserved = 0;
+	size_t derLen = DeviceKeyHelperRecord::derSequenceSize(chunk, count);
+	if (derLen > 0 && derLen < size) {
+		uint8_t fill;
+		keysRead(start + derLen, &fill, 1);
+		if (fill == 0x00) {
+			trim.fill = 0x00;
+		}
+	}
+
+	// Save up to the last byte that is not padding
+	size_t used = 0;
+	for(size_t offset = 0; offset < size; offset += sizeof(chunk)) {
+		count = size - offset;
+		if (count > sizeof(chunk)) {
+			count = sizeof(chunk);
+		}
+		if (offset > 0) {
+			keysRead(start + offset, chunk, count);
+		}
+		for(size_t ii = 0; ii < count; ii++) {
+			if (chunk[ii] != trim.fill) {
+				used = offset + ii + 1;
+			}
+		}
+	}
+	trim.length = (uint16_t) used;
+}
+
+bool DeviceKeyHelper::restoreChunked(CheckMode checkMode, uint32_t dctCrc) {
+	// All of the saved keys must be validated before any are written to the DCT, and the DCT
+	// should be written as few times as possible, so the keys are read into RAM
+	uint8_t *keys;
+	bool allocated = false;
+	if (buffer && keysSize <= sizeof(DeviceKeyHelperBuffer)) {
+		keys = (uint8_t *)buffer;
+	}
+	else {
+		keys = new uint8_t[keysSize];
+		if (!keys) {
+			log.error("unable to allocate %u bytes, keys not restored", keysSize);
+			stats.allocationFailures++;
+			return true;
+		}
+		allocated = true;
+	}
+
+	bool valid = false;
+	{
+		PhaseTimer timer(this, PHASE_LOAD);
+		if (storageOpen(false)) {
+			size_t offset = slotOffset(loadSlot);
+
+			DeviceKeyHelperSavedDataHeader header;
+			if (readStorage(offset, &header, sizeof(header))) {
+				if (header.magic == DATA_HEADER_MAGIC) {
+					const DeviceKeyHelperSavedDataV1Header *v1 = (const DeviceKeyHelperSavedDataV1Header *)&header;
+					valid = readStorage(offset + sizeof(DeviceKeyHelperSavedDataV1Header), keys, keysSize) &&
+						validateKeys(keys, keysSize, true, v1->sum);
+				}
+				else
+				if (header.flags & (FLAG_COMPACT | FLAG_TRIMMED)) {
+					// The private key used to rebuild the public key is read into keys, which are read
+					// again afterwards. When keys is the buffer from withBuffer(), the layout fits after them.
+					DeviceKeyHelperLayoutBuffer *layoutBuffer = NULL;
+					DeviceKeyHelperRecordLayout *layout = NULL;
+					if (keys != (uint8_t *)buffer) {
+						layoutBuffer = allocLayoutBuffer();
+						if (layoutBuffer) {
+							layout = &layoutBuffer->layout;
+						}
+					}
+					else
+					if (keysSize <= sizeof(buffer->onDevice)) {
+						// Only the default regions can be saved compact or trimmed, so this is always the case for valid data
+						layout = (DeviceKeyHelperRecordLayout *)&buffer->saved;
+					}
+					valid = layout &&
+						readLayout(offset, header, *layout, keys) &&
+						readLayoutKeys(offset, *layout, 0, keys, keysSize) &&
+						validateKeys(keys, keysSize, false, header.crc);
+					freeLayoutBuffer(layoutBuffer);
+				}
+				else {
+					valid = readStorage(offset + keysOffset(), keys, keysSize) &&
+						validateKeys(keys, keysSize, false, header.crc);
+				}
+			}
+			storageClose();
+		}
+	}
+
+	bool result;
+	if (valid) {
+		invalidateCache();
+
+		int res = keysWrite(0, keys, keysSize);
+		stats.restores++;
+
+		log.info("device keys changed! reverting regions=%u size=%u result=%d", regionCount, keysSize, res);
+
+		if (checkMode != CHECKMODE_AUTOMATIC_NO_RESTART) {
+			systemReset();
+		}
+		result = false;
+	}
+	else
+	if (storageError() != 0) {
+		log.error("storage error %d, keys not restored", storageError());
+		stats.storageErrors++;
+		result = true;
+	}
+	else {
+		// Not valid, just save the current keys
+		log.info("was able to load device keys, but data was not valid");
+		log.info("saving keys");
+		saveChunked(dctCrc);
+		result = true;
+	}
+
+	if (allocated) {
+		delete[] keys;
+	}
+	return result;
+}
+
+bool DeviceKeyHelper::saveChunked(uint32_t dctCrc) {
+	// The CRC is in the header, which is why it's calculated before saving. This way the
+	// file-based storage methods can write sequentially and never need to seek past the end
+	// of the file.
+	PhaseTimer timer(this, PHASE_SAVE);
+	DeviceKeyHelperSavedDataHeader header;
+	initHeader(&header, dctCrc);
+
+	if (useV1Format()) {
+		// Compact and trimmed mode are not available in version 1 format
+		header.flags = 0;
+	}
+	else
+	if (useCompact() && !initCompactHeader(&header)) {
+		stats.saveFailures++;
+		return false;
+	}
+
+	DeviceKeyHelperTrim trim[2];
+	if (useTrimmed()) {
+		if (initTrim(header, trim)) {
+			header.flags |= FLAG_TRIMMED;
+		}
+		else {
+			log.info("keys fill the slots, saving without trimming");
+		}
+	}
+
+	invalidateCache();
+
+	if (!storageOpen(true)) {
+		log.info("unable to open storage to save keys");
+		stats.saveFailures++;
+		return false;
+	}
+
+	bool result = (useV1Format() ? saveSlotDataV1() : saveSlotData(header, trim)) && storageCommit();
+
+	storageClose();
+
+	if (result) {
+		log.info("saved keys, %u bytes written", lastSaveBytesWritten);
+		stats.saves++;
+		scrubDamaged = false;
+		setVerified(dctCrc);
+	}
+	else {
+		log.info("error saving keys");
+		stats.saveFailures++;
+	}
+	return result;
+}
+
+bool DeviceKeyHelper::saveSlotData(DeviceKeyHelperSavedDataHeader header, const DeviceKeyHelperTrim *trim) {
+	uint8_t onDevice[DEVICE_KEYS_HELPER_CHUNK_SIZE];
+	size_t offset = slotOffset(saveSlot);
 
-}
+	// The magic bytes are written last, so if the save is interrupted this slot is not valid
+	// (and in dual slot mode, the other slot is used). The rest of the header and the table of
+	// contents are still written first so file-based storage is written sequentially.
+	uint32_t magic = header.magic;
+	header.magic = 0;
+	header.size = keysSize;
+	header.generation = generation + 1;
 
-void DeviceKeyHelper::startMonitor() {
-	System.on(cloud_status, eventHandlerStatic);
+	// The keys are saved as up to two segments: the whole keys, only the private key slot in compact
+	// mode, or the used bytes of each key slot in trimmed mode
+	size_t segmentStart[2] = { 0, DEVICE_KEYS_HELPER_PRIVATE_KEY_SIZE };
+	size_t segmentSize[2] = { (header.flags & FLAG_COMPACT) ? DEVICE_KEYS_HELPER_PRIVATE_KEY_SIZE : keysSize, 0 };
+	size_t dataOffset = keysOffset();
+
+	lastSaveBytesWritten = 0;
+
+	bool result = storageWriteChanged(offset, &header, sizeof(header)) &&
+		storageWriteChanged(offset + sizeof(header), regions, regionCount * sizeof(DeviceKeyHelperRegion));
+
+	if (result && (header.flags & FLAG_TRIMMED)) {
+		result = storageWriteChanged(offset + dataOffset, trim, 2 * sizeof(DeviceKeyHelperTrim));
+		dataOffset += 2 * sizeof(DeviceKeyHelperTrim);
+		segmentSize[0] = trim[0].length;
+		segmentSize[1] = trim[1].length;
+	}
+
+	for(size_t segment = 0; result && segment < 2; segment++) {
+		for(size_t keysOffset = 0; result && keysOffset < segmentSize[segment]; keysOffset += DEVICE_KEYS_HELPER_CHUNK_SIZE) {
+			size_t count = segmentSize[segment] - keysOffset;
+			if (count > DEVICE_KEYS_HELPER_CHUNK_SIZE) {
+				count = DEVICE_KEYS_HELPER_CHUNK_SIZE;
+			}
+
+			keysRead(segmentStart[segment] + keysOffset, onDevice, count);
+			result = storageWriteChanged(offset + dataOffset + keysOffset, onDevice, count);
+		}
+		dataOffset += segmentSize[segment];
+	}
+
+	if (result) {
+		result = storageWriteChanged(offset, &magic, sizeof(magic));
+	}
+
+	if (result) {
+		log.trace("saved slot=%u generation=%lu", saveSlot, header.generation);
+		generation = header.generation;
+		selectSlot(saveSlot);
+	}
+	return result;
 }
 
+bool DeviceKeyHelper::saveSlotDataV1() {
+	uint8_t onDevice[DEVICE_KEYS_HELPER_CHUNK_SIZE];
 
-bool DeviceKeyHelper::check(CheckMode checkMode) {
-	// On TCP devices, this is 1600 bytes so it's kind of large to allocate on the stack safely, plus we need two of them.
-	// We deallocate it before exiting this function.
-	bool result = true;
+	// The checksum is in the header, which is written first
+	DeviceKeyHelperSavedDataV1Header header;
+	header.magic = 0;
+	header.size = DEVICE_KEYS_HELPER_SIZE;
+	header.sum = 0;
+	for(size_t offset = 0; offset < DEVICE_KEYS_HELPER_SIZE; offset += sizeof(onDevice)) {
+		size_t count = DEVICE_KEYS_HELPER_SIZE - offset;
+		if (count > sizeof(onDevice)) {
+			count = sizeof(onDevice);
+		}
+		keysRead(offset, onDevice, count);
+		header.sum = (uint16_t)(header.sum + calculateChecksumV1(onDevice, count));
+	}
 
-	uint8_t *onDevice = new uint8_t[DEVICE_KEYS_HELPER_SIZE];
-	if (onDevice) {
-		DeviceKeyHelperSavedData *saved = new DeviceKeyHelperSavedData();
-		if (saved) {
-			//
-			dct_read_app_data_copy(DEVICE_KEYS_HELPER_OFFSET, onDevice, DEVICE_KEYS_HELPER_SIZE);
+	lastSaveBytesWritten = 0;
 
-			bool saveKeys = false;
+	bool result = storageWriteChanged(0, &header, sizeof(header));
 
-			if (load(saved)) {
-				// We were able to load some data, but make sure it's valid
-				if (validateData(saved)) {
-					// Looks valid
-					if (checkMode == CHECKMODE_SAVE_CURRENT) {
-						log.trace("force save device keys");
-						saveKeys = true;
-					}
-					else
-					if (memcmp(onDevice, saved->keys, DEVICE_KEYS_HELPER_SIZE) != 0) {
-						// Changed
-						if (checkMode != CHECKMODE_CHECK_ONLY) {
-							int res = dct_write_app_data(saved->keys, DEVICE_KEYS_HELPER_OFFSET, DEVICE_KEYS_HELPER_SIZE);
+	for(size_t offset = 0; result && offset < DEVICE_KEYS_HELPER_SIZE; offset += sizeof(onDevice)) {
+		size_t count = DEVICE_KEYS_HELPER_SIZE - offset;
+		if (count > sizeof(onDevice)) {
+			count = sizeof(onDevice);
+		}
+		keysRead(offset, onDevice, count);
+		result = storageWriteChanged(sizeof(header) + offset, onDevice, count);
+	}
 
-							log.info("device keys changed! reverting offset=%u size=%u result=%d", DEVICE_KEYS_HELPER_OFFSET, DEVICE_KEYS_HELPER_SIZE, res);
+	if (result) {
+		// Magic bytes last, as with the current version
+		header.magic = DATA_HEADER_MAGIC;
+		result = storageWriteChanged(0, &header.magic, sizeof(header.magic));
+	}
 
-							if (checkMode != CHECKMODE_AUTOMATIC_NO_RESTART) {
-								System.reset();
-							}
-						}
-						else {
-							log.info("device keys changed");
-						}
-						result = false;
-					}
-					else {
-						// Same
-						log.info("device keys unchanged");
-					}
-				}
-				else {
-					// Not valid, just save the current keys
-					log.info("was able to load device keys, but data was not valid");
-					saveKeys = true;
-				}
+	if (result) {
+		log.trace("saved slot=0 in version 1 format");
+		generation = 0;
+		selectSlot(0);
+	}
+	return result;
+}
+
+bool DeviceKeyHelper::readStorage(size_t offset, void *data, size_t size) {
+	PhaseTimer timer(this, PHASE_LOAD);
+
+	bool result = storageRead(offset, data, size);
+	if (result) {
+		stats.storageBytesRead += size;
+	}
+	return result;
+}
+
+bool DeviceKeyHelper::validateKeys(const void *keys, size_t size, bool v1, uint32_t expected) {
+	PhaseTimer timer(this, PHASE_VALIDATE);
+
+	uint32_t check = v1 ? calculateChecksumV1(keys, size) : calculateCrc(keys, size);
+	if (check != expected) {
+		log.info("bad checksum");
+		stats.checksumFailures++;
+		return false;
+	}
+	return true;
+}
+
+bool DeviceKeyHelper::storageWriteChanged(size_t offset, const void *data, size_t size) {
+	const uint8_t *newData = (const uint8_t *)data;
+	uint8_t stored[DEVICE_KEYS_HELPER_CHUNK_SIZE];
 
+	while(size > 0) {
+		size_t count = size;
+		if (count > DEVICE_KEYS_HELPER_CHUNK_SIZE) {
+			count = DEVICE_KEYS_HELPER_CHUNK_SIZE;
+		}
+
+		// Range of bytes in this chunk to write, the whole chunk unless it can be read
+		size_t start = 0;
+		size_t end = count;
+		if (storageRead(offset, stored, count)) {
+			stats.storageBytesRead += count;
+			while(start < end && stored[start] == newData[start]) {
+				start++;
 			}
-			else {
-				// Did not successfully load, so save the current key instead
-				log.info("was unable to load existing key data");
-				saveKeys = true;
+			while(end > start && stored[end - 1] == newData[end - 1]) {
+				end--;
 			}
+		}
 
-			if (saveKeys) {
-				if (saved->magic == DATA_HEADER_MAGIC &&
-					saved->size == DEVICE_KEYS_HELPER_SIZE &&
-					saved->sum == calculateChecksum(saved) &&
-					memcmp(saved->keys, onDevice, DEVICE_KEYS_HELPER_SIZE) == 0) {
-					//
-					log.trace("keys unchanged, no need to save");
-					saveKeys = false;
-				}
+		if (start < end) {
+			if (!storageWrite(offset + start, &newData[start], end - start)) {
+				return false;
 			}
+			lastSaveBytesWritten += end - start;
+			stats.storageBytesWritten += end - start;
+		}
 
-			if (saveKeys) {
-				// Save a header (with magic bytes, length, and checksum)
-				log.info("saving keys");
-				memcpy(saved->keys, onDevice, DEVICE_KEYS_HELPER_SIZE);
-
-				saved->magic = DATA_HEADER_MAGIC;
-				saved->size = DEVICE_KEYS_HELPER_SIZE;
-				saved->sum = calculateChecksum(saved);
+		offset += count;
+		newData += count;
+		size -= count;
+	}
+	return true;
+}
 
-				save(saved);
-			}
+uint32_t DeviceKeyHelper::calculateDctCrc() {
+	PhaseTimer timer(this, PHASE_DCT_READ);
+	uint8_t onDevice[DEVICE_KEYS_HELPER_CHUNK_SIZE];
+	uint32_t crc = 0;
 
-			delete saved;
+	for(size_t offset = 0; offset < keysSize; offset += DEVICE_KEYS_HELPER_CHUNK_SIZE) {
+		size_t count = keysSize - offset;
+		if (count > DEVICE_KEYS_HELPER_CHUNK_SIZE) {
+			count = DEVICE_KEYS_HELPER_CHUNK_SIZE;
 		}
+		keysRead(offset, onDevice, count);
+		crc = calculateCrc(onDevice, count, crc);
+	}
+	return crc;
+}
 
-		delete[] onDevice;
+bool DeviceKeyHelper::loadSavedData(DeviceKeyHelperSavedData *savedData) {
+	PhaseTimer timer(this, PHASE_LOAD);
+
+	bool result = load(savedData);
+	if (result) {
+		stats.storageBytesRead += sizeof(DeviceKeyHelperSavedData);
+		generation = (savedData->magic == DATA_HEADER_MAGIC_V2) ? savedData->generation : 0;
 	}
 	return result;
 }
 
+bool DeviceKeyHelper::saveSavedData(const DeviceKeyHelperSavedData *savedData) {
+	PhaseTimer timer(this, PHASE_SAVE);
 
-uint16_t DeviceKeyHelper::calculateChecksum(const DeviceKeyHelperSavedData *savedData) const {
-	uint16_t sum = 0;
+	// The save function always writes the whole structure
+	lastSaveBytesWritten = 0;
 
-	for(size_t ii = 0; ii < DEVICE_KEYS_HELPER_SIZE; ii++) {
-		sum += savedData->keys[ii];
+	bool result = save(savedData);
+	if (result) {
+		lastSaveBytesWritten = sizeof(DeviceKeyHelperSavedData);
+		stats.storageBytesWritten += sizeof(DeviceKeyHelperSavedData);
+		stats.saves++;
+		generation = savedData->generation;
+	}
+	else {
+		stats.saveFailures++;
 	}
-	return sum;
+	return result;
+}
+
+bool DeviceKeyHelper::storageOpen(bool write) {
+	return false;
+}
+
+bool DeviceKeyHelper::storageRead(size_t offset, void *data, size_t size) {
+	return false;
+}
+
+bool DeviceKeyHelper::storageWrite(size_t offset, const void *data, size_t size) {
+	return false;
+}
+
+bool DeviceKeyHelper::storageCommit() {
+	return true;
+}
+
+int DeviceKeyHelper::storageError() {
+	return 0;
 }
 
-bool DeviceKeyHelper::validateData(const DeviceKeyHelperSavedData *savedData) const {
+void DeviceKeyHelper::storageClose() {
+}
+
+bool DeviceKeyHelper::isHeaderValid(const DeviceKeyHelperSavedDataHeader *header, const DeviceKeyHelperRegion *toc) const {
+	return header->magic == DATA_HEADER_MAGIC_V2 &&
+		header->version == DATA_VERSION &&
+		header->size == keysSize &&
+		memcmp(toc, regions, regionCount * sizeof(DeviceKeyHelperRegion)) == 0;
+}
+
+bool DeviceKeyHelper::validateData(const DeviceKeyHelperSavedData *savedData) {
+	PhaseTimer timer(this, PHASE_VALIDATE);
 
-	if (savedData->magic != DATA_HEADER_MAGIC || savedData->size != DEVICE_KEYS_HELPER_SIZE) {
-		log.info("bad magic bytes or size magic=%08lx size=%u", savedData->magic, savedData->size);
+	// Version 1 saved data (library 0.0.4 and earlier) is also accepted
+	DeviceKeyHelperRecordInfo info;
+	DeviceKeyHelperRecord::Result result = DeviceKeyHelperRecord::validate(savedData, sizeof(DeviceKeyHelperSavedData), info);
+	if (result == DeviceKeyHelperRecord::RESULT_BAD_CHECKSUM) {
+		log.info("bad checksum");
+		stats.checksumFailures++;
 		return false;
 	}
 
-	if (savedData->sum != calculateChecksum(savedData)) {
-		log.info("bad checksum");
+	// Load and save functions always use the full DeviceKeyHelperSavedData layout, so no flags
+	if (result != DeviceKeyHelperRecord::RESULT_VALID || info.flags != 0 || info.layout.keysSize != DEVICE_KEYS_HELPER_SIZE ||
+		(info.version != 1 && !isHeaderValid((const DeviceKeyHelperSavedDataHeader *)savedData, savedData->regions))) {
+		log.info("bad magic bytes, version, size, or regions magic=%08lx version=%u size=%u result=%s", savedData->magic, savedData->version, savedData->size,
+			DeviceKeyHelperRecord::getResultName(result));
+		return false;
+	}
+	return true;
+}
+
+bool DeviceKeyHelper::upgradeData(DeviceKeyHelperSavedData *savedData) const {
+	if (savedData->magic != DATA_HEADER_MAGIC) {
 		return false;
 	}
+
+	// Version 1 has a smaller header, so the keys need to be moved
+	memmove(savedData->keys, &((uint8_t *)savedData)[sizeof(DeviceKeyHelperSavedDataV1Header)], DEVICE_KEYS_HELPER_SIZE);
+
+	initHeader((DeviceKeyHelperSavedDataHeader *)savedData, calculateCrc(savedData->keys, DEVICE_KEYS_HELPER_SIZE));
+	memcpy(savedData->regions, DEVICE_KEYS_HELPER_REGIONS, sizeof(savedData->regions));
+
+	log.info("converted saved keys from version 1");
 	return true;
 }
 
+int DeviceKeyHelper::keysRead(size_t offset, void *data, size_t size) {
+	PhaseTimer timer(this, PHASE_DCT_READ);
+	stats.dctBytesRead += size;
+
+	uint8_t *p = (uint8_t *)data;
+	size_t regionStart = 0;
+	int result = 0;
+
+	for(size_t ii = 0; ii < regionCount && size > 0; ii++) {
+		if (offset < regionStart + regions[ii].size) {
+			size_t regionOffset = offset - regionStart;
+			size_t count = regions[ii].size - regionOffset;
+			if (count > size) {
+				count = size;
+			}
+
+			int res = dctRead(regions[ii].offset + regionOffset, p, count);
+			if (res != 0 && result == 0) {
+				result = res;
+			}
+			offset += count;
+			p += count;
+			size -= count;
+		}
+		regionStart += regions[ii].size;
+	}
+	return result;
+}
+
+int DeviceKeyHelper::keysWrite(size_t offset, const void *data, size_t size) {
+	PhaseTimer timer(this, PHASE_DCT_WRITE);
+	stats.dctBytesWritten += size;
+
+	const uint8_t *p = (const uint8_t *)data;
+	size_t regionStart = 0;
+	int result = 0;
+
+	// One DCT write per region
+	for(size_t ii = 0; ii < regionCount && size > 0; ii++) {
+		if (offset < regionStart + regions[ii].size) {
+			size_t regionOffset = offset - regionStart;
+			size_t count = regions[ii].size - regionOffset;
+			if (count > size) {
+				count = size;
+			}
+
+			int res = dctWrite(regions[ii].offset + regionOffset, p, count);
+			if (res != 0 && result == 0) {
+				result = res;
+			}
+			offset += count;
+			p += count;
+			size -= count;
+		}
+		regionStart += regions[ii].size;
+	}
+	return result;
+}
+
+int DeviceKeyHelper::dctRead(size_t offset, void *data, size_t size) {
+	return dct_read_app_data_copy(offset, data, size);
+}
+
+int DeviceKeyHelper::dctWrite(size_t offset, const void *data, size_t size) {
+	return dct_write_app_data(data, offset, size);
+}
+
+void DeviceKeyHelper::systemReset() {
+	System.reset(RESET_REASON_DATA);
+}
+
 void DeviceKeyHelper::eventHandler(system_event_t event, int param) {
 	if (event == cloud_status) {
 		if (param == cloud_status_connecting) {
 			log.trace("cloud_status_connecting");
 			connected = false;
+
+			if (recoveryState == RECOVERY_CONNECT_REQUESTED) {
+				recoveryState = RECOVERY_CONNECTING;
+			}
 		}
 		else
 		if (param == cloud_status_connected) {
@@ -150,28 +1758,35 @@ void DeviceKeyHelper::eventHandler(system_event_t event, int param) {
 
 			connected = true;
 			failureCount = 0;
-			check(CheckMode::CHECKMODE_SAVE_CURRENT);
+			recordReconnect();
+			queueCheck(CheckMode::CHECKMODE_SAVE_CURRENT);
 		}
 		else
 		if (param == cloud_status_disconnected) {
 			log.trace("cloud_status_disconnected");
 
+			if (!connected && recoveryState == RECOVERY_CONNECTING) {
+				// Connecting with the restored keys failed, so fall back to a reset
+				log.warn("unable to reconnect after restoring keys, resetting");
+				recoveryState = RECOVERY_NONE;
+				systemReset();
+			}
+			else
 			if (!connected) {
 #if SYSTEM_VERSION >= 0x00080000
+				// The error code is fetched by itself, so recovery never depends on the other IDs being available
 				int32_t value;
 				if (getSystemDiagValue(DIAG_ID_CLOUD_CONNECTION_ERROR_CODE, value)) {
-					log.trace("DIAG_ID_CLOUD_CONNECTION_ERROR_CODE=%ld", value);
+					// The attempts and disconnects are only logged, to help correlate keys errors with other connection problems
+					static const uint16_t ids[2] = { DIAG_ID_CLOUD_CONNECTION_ATTEMPTS, DIAG_ID_CLOUD_DISCONNECTS };
+					DeviceKeyHelperDiagValue values[2];
+					getSystemDiagValues(ids, 2, values);
+					log.trace("DIAG_ID_CLOUD_CONNECTION_ERROR_CODE=%ld attempts=%ld disconnects=%ld", value, values[0].value, values[1].value);
 
 					if (value == 26 || value == 10) {
 						// Keys error. It's 26 on TCP devices and 10 on UDP devices.
 						log.warn("keys error, resetting keys if possible");
-						Particle.disconnect();
-						check(CheckMode::CHECKMODE_AUTOMATIC);
-
-						// Normally this line won't be reached because check does a restart if keys
-						// are restored, but this is here in case the restore fails, so the device
-						// won't be left in disconnected state.
-						System.reset();
+						recoverKeys();
 					}
 				}
 #else
@@ -181,13 +1796,7 @@ void DeviceKeyHelper::eventHandler(system_event_t event, int param) {
 				if (failureCount >= 3) {
 					// If this happens more than 3 times, assume we have a keys error
 					log.warn("possible keys error, resetting keys if possible");
-					Particle.disconnect();
-					check(CheckMode::CHECKMODE_AUTOMATIC);
-
-					// Normally this line won't be reached because check does a restart if keys
-					// are restored, but this is here in case the restore fails, so the device
-					// won't be left in disconnected state.
-					System.reset();
+					recoverKeys();
 				}
 #endif
 
@@ -206,42 +1815,378 @@ void DeviceKeyHelper::eventHandlerStatic(system_event_t event, int param) {
 
 // [static]
 bool DeviceKeyHelper::getSystemDiagValue(uint16_t id, int32_t &value) {
+	DeviceKeyHelperDiagValue result;
+
+	getSystemDiagValues(&id, 1, &result);
+
+	value = result.value;
+	return result.present;
+}
+
+#if SYSTEM_VERSION >= 0x00080000
+/**
+ * @brief Parses the binary output of system_format_diag_data as it's passed to the appender
+ *
+ * The output starts with the size of the ID field and the size of the value field (both uint16_t),
+ * followed by an ID and value for each ID that is available. The data can be split across appender
+ * calls anywhere, so bytes are collected in field until a complete field has been received.
+ */
+class DeviceKeyHelperDiagParser {
+public:
+	DeviceKeyHelperDiagParser(const uint16_t *ids, size_t count, DeviceKeyHelperDiagValue *values) :
+		ids(ids), count(count), values(values) {
+	}
+
+	static bool appender(void *appender, const uint8_t *data, size_t size) {
+		DeviceKeyHelperDiagParser *parser = (DeviceKeyHelperDiagParser *)appender;
+		for(size_t ii = 0; ii < size; ii++) {
+			parser->addByte(data[ii]);
+		}
+		return true;
+	}
+
+	size_t found = 0;
+
+protected:
+	void addByte(uint8_t b) {
+		// Fields larger than field (not used by current system firmware) are truncated
+		if (fieldLen < sizeof(field)) {
+			field[fieldLen] = b;
+		}
+		fieldLen++;
+
+		if (headerLen < 4) {
+			// idSize and valueSize
+			if (++headerLen == 4) {
+				idSize = field[0] | (field[1] << 8);
+				valueSize = field[2] | (field[3] << 8);
+				fieldLen = 0;
+			}
+			return;
+		}
+
+		if (!haveId) {
+			if (fieldLen == idSize) {
+				id = getField(idSize);
+				haveId = true;
+				fieldLen = 0;
+			}
+			return;
+		}
+
+		if (fieldLen == valueSize) {
+			addValue(id, (int32_t) getField(valueSize));
+			haveId = false;
+			fieldLen = 0;
+		}
+	}
+
+	uint32_t getField(size_t size) const {
+		// Little endian, sign extended if less than 4 bytes
+		uint32_t value = 0;
+		for(size_t ii = 0; ii < size && ii < 4; ii++) {
+			value |= ((uint32_t) field[ii]) << (ii * 8);
+		}
+		if (size > 0 && size < 4 && (field[size - 1] & 0x80) != 0) {
+			value |= 0xffffffff << (size * 8);
+		}
+		return value;
+	}
+
+	void addValue(uint16_t id, int32_t value) {
+		for(size_t ii = 0; ii < count; ii++) {
+			if (ids[ii] == id && !values[ii].present) {
+				values[ii].present = true;
+				values[ii].value = value;
+				found++;
+				break;
+			}
+		}
+	}
+
+	const uint16_t *ids;
+	size_t count;
+	DeviceKeyHelperDiagValue *values;
+	size_t headerLen = 0;
+	uint16_t idSize = 0;
+	uint16_t valueSize = 0;
+	uint8_t field[8];
+	size_t fieldLen = 0;
+	uint16_t id = 0;
+	bool haveId = false;
+};
+#endif
+
+// [static]
+size_t DeviceKeyHelper::getSystemDiagValues(const uint16_t *ids, size_t count, DeviceKeyHelperDiagValue *values) {
+	for(size_t ii = 0; ii < count; ii++) {
+		values[ii].present = false;
+		values[ii].value = 0;
+	}
+
 #if SYSTEM_VERSION >= 0x00080000
-    // Only available in system firmware 0.8.0 and later!
-    union Data {
-        struct __attribute__((packed)) {
-            uint16_t idSize;
-            uint16_t valueSize;
-            uint16_t id;
-            int32_t     value;
-            size_t offset;
-        } d;
-        uint8_t b[10];
-    };
-    Data data;
-    data.d.offset = data.d.value = 0;
-
-    struct {
-        static bool appender(void* appender, const uint8_t* data, size_t size) {
-            Data *d = (Data *)appender;
-            if ((d->d.offset + size) <= sizeof(Data::b)) {
-                memcpy(&d->b[d->d.offset], data, size);
-                d->d.offset += size;
-            }
-            return true;
-        }
-    } Callback;
-
-    system_format_diag_data(&id, 1, 1, Callback.appender, &data, nullptr);
-
-    // Log.info("idSize=%u valueSize=%u id=%u value=%ld", data.d.idSize, data.d.valueSize, data.d.id, data.d.value);
-
-    value = data.d.value;
-
-    return (data.d.offset == sizeof(Data::b));
+	// Only available in system firmware 0.8.0 and later!
+	DeviceKeyHelperDiagParser parser(ids, count, values);
+
+	if (system_format_diag_data(ids, count, 1, DeviceKeyHelperDiagParser::appender, &parser, nullptr) != 0) {
+		// Values parsed before the error may be incomplete, so none are returned
+		for(size_t ii = 0; ii < count; ii++) {
+			values[ii].present = false;
+			values[ii].value = 0;
+		}
+		return 0;
+	}
+
+	return parser.found;
 #else
-    value = 0;
-    return false;
+	return 0;
 #endif
 }
 
+
+DeviceKeyHelperReplicated::DeviceKeyHelperReplicated() {
+	memset(replicaStats, 0, sizeof(replicaStats));
+}
+
+DeviceKeyHelperReplicated &DeviceKeyHelperReplicated::withReplica(DeviceKeyHelper &replica) {
+	if (replicaCount >= DEVICE_KEYS_HELPER_MAX_REPLICAS) {
+		log.error("too many replicas, limit is %u", DEVICE_KEYS_HELPER_MAX_REPLICAS);
+		return *this;
+	}
+	if (replica.load) {
+		log.error("replicas require random access storage");
+		return *this;
+	}
+
+	replicas[replicaCount++] = &replica;
+	invalidateCache();
+	return *this;
+}
+
+void DeviceKeyHelperReplicated::loop() {
+	DeviceKeyHelper::loop();
+
+	// A check running from the worker thread repairs the replicas itself when it's done
+	if (repairPending && checkMutex.trylock()) {
+		for(size_t ii = 0; ii < replicaCount; ii++) {
+			if (repairPending & (1 << ii)) {
+				repairPending &= ~(1 << ii);
+				repairReplica(ii);
+				break;
+			}
+		}
+		checkMutex.unlock();
+	}
+}
+
+void DeviceKeyHelperReplicated::repairReplicas() {
+	checkMutex.lock();
+	for(size_t ii = 0; ii < replicaCount; ii++) {
+		if (repairPending & (1 << ii)) {
+			repairPending &= ~(1 << ii);
+			repairReplica(ii);
+		}
+	}
+	checkMutex.unlock();
+}
+
+bool DeviceKeyHelperReplicated::checkStorage(CheckMode checkMode, uint32_t dctCrc) {
+	if (replicaCount == 0) {
+		log.error("no replicas, keys not checked");
+		return true;
+	}
+
+	// Restoring from a replica with damaged keys would lose the good copy on another one, so unless
+	// the saved keys are going to be overwritten anyway they're validated while checking
+	CheckMode replicaCheckMode = (checkMode == CHECKMODE_SAVE_CURRENT) ? CHECKMODE_SAVE_CURRENT : CHECKMODE_CHECK_ONLY;
+
+	size_t order[DEVICE_KEYS_HELPER_MAX_REPLICAS];
+	getReadOrder(order);
+
+	ChunkedResult chunkedResult = CHUNKED_INVALID;
+	size_t writable = replicaCount;
+	for(size_t ii = 0; ii < replicaCount; ii++) {
+		chunkedResult = checkReplica(order[ii], replicaCheckMode, dctCrc);
+		if (chunkedResult != CHUNKED_INVALID) {
+			break;
+		}
+		if (storageError() != 0) {
+			log.error("replica %u storage error %d", order[ii], storageError());
+		}
+		else
+		if (writable == replicaCount) {
+			writable = order[ii];
+		}
+		log.info("replica %u has no valid saved keys", order[ii]);
+	}
+
+	bool result = true;
+	switch(chunkedResult) {
+	case CHUNKED_UNCHANGED:
+		log.info("device keys unchanged");
+		setVerified(dctCrc);
+		break;
+
+	case CHUNKED_CHANGED:
+		if (checkMode == CHECKMODE_SAVE_CURRENT) {
+			log.info("saving keys");
+			saveReplica(dctCrc);
+		}
+		else
+		if (checkMode == CHECKMODE_CHECK_ONLY) {
+			log.info("device keys changed");
+			return false;
+		}
+		else {
+			// The other replicas are repaired after the next check, once the restored keys are verified
+			result = restoreChunked(checkMode, dctCrc);
+		}
+		break;
+
+	case CHUNKED_INVALID:
+	default:
+		if (writable == replicaCount) {
+			// The saved keys may be fine, so don't overwrite them with keys that haven't been checked
+			log.error("storage errors on all replicas, keys not checked");
+			stats.storageErrors++;
+			return true;
+		}
+		log.info("no replica has valid saved keys, saving keys");
+		current = writable;
+		{
+			// The slot to save to and the generation are still from the last replica that was checked
+			DeviceKeyHelperSavedDataHeader headers[2];
+			size_t slotOrder[2];
+			if (storageOpen(false)) {
+				readSlotHeaders(headers, slotOrder);
+				storageClose();
+			}
+			else {
+				loadSlot = saveSlot = 0;
+				generation = 0;
+			}
+		}
+		result = saveReplica(dctCrc);
+		break;
+	}
+
+	// The other replicas are made the same as the one that was used, as is this one if it was
+	// found damaged earlier, as only its header may have been read this time
+	repairPending = (((1 << replicaCount) - 1) & ~(1 << current)) | damaged;
+	if (!backgroundRepair) {
+		for(size_t ii = 0; ii < replicaCount; ii++) {
+			if (repairPending & (1 << ii)) {
+				repairPending &= ~(1 << ii);
+				repairReplica(ii);
+			}
+		}
+	}
+	return result;
+}
+
+DeviceKeyHelper::ChunkedResult DeviceKeyHelperReplicated::checkReplica(size_t index, CheckMode checkMode, uint32_t dctCrc) {
+	current = index;
+
+	uint32_t start = micros();
+	ChunkedResult result = checkChunked(checkMode, dctCrc);
+	uint32_t elapsed = micros() - start;
+
+	DeviceKeyHelperReplicaStats &rs = replicaStats[index];
+	rs.reads++;
+	rs.lastMicros = elapsed;
+	rs.averageMicros = (rs.reads == 1) ? elapsed : (rs.averageMicros * 7 + elapsed) / 8;
+	if (result == CHUNKED_INVALID) {
+		damaged |= (1 << index);
+		rs.invalid++;
+		if (storageError() != 0) {
+			rs.storageErrors++;
+		}
+	}
+	return result;
+}
+
+void DeviceKeyHelperReplicated::repairReplica(size_t index) {
+	// Only keys that were verified against a replica are copied to the others. If the keys in the
+	// DCT changed since, the next check repairs the replicas instead.
+	uint32_t dctCrc = calculateDctCrc();
+	if (!isVerified(dctCrc)) {
+		return;
+	}
+
+	// The header of a replica with damaged keys can still match, so those are always rewritten. The
+	// check is still needed to select the slot to save to.
+	ChunkedResult result = checkReplica(index, CHECKMODE_SAVE_CURRENT, dctCrc);
+	if (result == CHUNKED_UNCHANGED && !(damaged & (1 << index))) {
+		return;
+	}
+	if (result == CHUNKED_INVALID && storageError() != 0) {
+		log.error("replica %u storage error %d, not repaired", index, storageError());
+		replicaStats[index].repairFailures++;
+		return;
+	}
+
+	log.info("repairing replica %u", index);
+	if (saveReplica(dctCrc)) {
+		replicaStats[index].repairs++;
+	}
+	else {
+		replicaStats[index].repairFailures++;
+	}
+}
+
+void DeviceKeyHelperReplicated::scrubFoundDamage() {
+	// scrub() reads the replica the storage methods were last used with. With background repair,
+	// loop() rewrites it, otherwise the next check does.
+	damaged |= (1 << current);
+	repairPending |= (1 << current);
+	if (!backgroundRepair) {
+		invalidateCache();
+	}
+}
+
+bool DeviceKeyHelperReplicated::saveReplica(uint32_t dctCrc) {
+	if (!saveChunked(dctCrc)) {
+		return false;
+	}
+	damaged &= ~(1 << current);
+	return true;
+}
+
+void DeviceKeyHelperReplicated::getReadOrder(size_t *order) const {
+	for(size_t ii = 0; ii < replicaCount; ii++) {
+		order[ii] = ii;
+	}
+
+	// Insertion sort keeps replicas with the same average in the order they were added
+	for(size_t ii = 1; ii < replicaCount; ii++) {
+		for(size_t jj = ii; jj > 0 && replicaStats[order[jj - 1]].averageMicros > replicaStats[order[jj]].averageMicros; jj--) {
+			size_t temp = order[jj];
+			order[jj] = order[jj - 1];
+			order[jj - 1] = temp;
+		}
+	}
+}
+
+bool DeviceKeyHelperReplicated::storageOpen(bool write) {
+	return replicas[current]->storageOpen(write);
+}
+
+bool DeviceKeyHelperReplicated::storageRead(size_t offset, void *data, size_t size) {
+	return replicas[current]->storageRead(offset, data, size);
+}
+
+bool DeviceKeyHelperReplicated::storageWrite(size_t offset, const void *data, size_t size) {
+	return replicas[current]->storageWrite(offset, data, size);
+}
+
+bool DeviceKeyHelperReplicated::storageCommit() {
+	return replicas[current]->storageCommit();
+}
+
+int DeviceKeyHelperReplicated::storageError() {
+	return replicas[current]->storageError();
+}
+
+void DeviceKeyHelperReplicated::storageClose() {
+	replicas[current]->storageClose();
+}
@@ -12,28 +12,195 @@
 #include "Particle.h"
 #include "dct.h"
 
+#include "DeviceKeyHelperRecord.h"
+
 // The size of the public and private keys depends on whether the device uses UDP (cellular devices, typically)
 // which use the ALT key slot, or TCP (Wi-Fi devices) which use the main key slot
 #if HAL_PLATFORM_CLOUD_UDP
 const size_t DEVICE_KEYS_HELPER_SIZE = DCT_ALT_DEVICE_PRIVATE_KEY_SIZE + DCT_ALT_DEVICE_PUBLIC_KEY_SIZE;
 const size_t DEVICE_KEYS_HELPER_OFFSET = DCT_ALT_DEVICE_PRIVATE_KEY_OFFSET;
+const size_t DEVICE_KEYS_HELPER_PRIVATE_KEY_SIZE = DCT_ALT_DEVICE_PRIVATE_KEY_SIZE;
 #else
 const size_t DEVICE_KEYS_HELPER_SIZE = DCT_DEVICE_PRIVATE_KEY_SIZE + DCT_DEVICE_PUBLIC_KEY_SIZE;
 const size_t DEVICE_KEYS_HELPER_OFFSET = DCT_DEVICE_PRIVATE_KEY_OFFSET;
+const size_t DEVICE_KEYS_HELPER_PRIVATE_KEY_SIZE = DCT_DEVICE_PRIVATE_KEY_SIZE;
 #endif
 
+static_assert(DeviceKeyHelperRecord::privateKeySize(DEVICE_KEYS_HELPER_SIZE) == DEVICE_KEYS_HELPER_PRIVATE_KEY_SIZE &&
+	DeviceKeyHelperRecord::TCP_KEYS_OFFSET == DCT_DEVICE_PRIVATE_KEY_OFFSET && DeviceKeyHelperRecord::UDP_KEYS_OFFSET == DCT_ALT_DEVICE_PRIVATE_KEY_OFFSET,
+	"DeviceKeyHelperRecord key sizes and offsets do not match the DCT");
+
+/**
+ * @brief The default region to save, the device private and public keys for the protocol the device uses
+ */
+extern const DeviceKeyHelperRegion DEVICE_KEYS_HELPER_REGIONS[1];
+
+/**
+ * @brief Number of regions in DEVICE_KEYS_HELPER_VAULT_REGIONS
+ */
+const size_t DEVICE_KEYS_HELPER_VAULT_REGION_COUNT = 4;
+
+/**
+ * @brief The regions saved by DeviceKeyHelper::withVault()
+ *
+ * The device keys and server public key for both TCP and UDP.
+ */
+extern const DeviceKeyHelperRegion DEVICE_KEYS_HELPER_VAULT_REGIONS[DEVICE_KEYS_HELPER_VAULT_REGION_COUNT];
+
+/**
+ * @brief Size of the chunks used when comparing or saving keys using random access storage
+ *
+ * Comparing uses two buffers of this size on the stack, one for the keys in the DCT and one for the saved
+ * keys. Saving also uses two, one for the keys being saved and one in storageWriteChanged() for the bytes
+ * already stored. DeviceKeyHelperSpiffsParticle with a temporary file name uses a third while copying
+ * the old file during a save. Load and save functions use DeviceKeyHelperBuffer instead.
+ */
+const size_t DEVICE_KEYS_HELPER_CHUNK_SIZE = 64;
+
 /**
- * @brief Structure for holding saved keys, including magic bytes, size, checksum, and the actual keys.
+ * @brief Maximum number of storage media used by DeviceKeyHelperReplicated
+ */
+const size_t DEVICE_KEYS_HELPER_MAX_REPLICAS = 4;
+
+/**
+ * @brief Structure for holding saved keys, including magic bytes, version, size, generation, CRC, the table
+ * of contents, and the actual keys.
  *
- * This is what is saved in EEPROM, SPI Flash, FRAM, etc.
+ * This is what is saved in EEPROM, SPI Flash, FRAM, etc. This structure is for the default region,
+ * DEVICE_KEYS_HELPER_REGIONS. When using DeviceKeyHelper::withRegions() the table of contents has an
+ * entry for each region and the keys field contains all of the regions, one after the other. Compact
+ * and trimmed saved data have a different layout after the table of contents. The format is defined in
+ * DeviceKeyHelperRecord.h, which can also be used by programs that don't run on a device.
  */
 typedef struct {
-	uint32_t	magic;  // DATA_HEADER_MAGIC = 0x75a65c63
-	uint16_t	size;	// size of the keys field only, DEVICE_KEYS_HELPER_SIZE not the size of the structure!
-	uint16_t	sum; 	// Checksum of the keys field only. Straight sum of uint8_t bytes, 16 bits wide.
+	uint32_t	magic;		// DeviceKeyHelperRecord::MAGIC_V2 = 0x75a65c64
+	uint8_t		version;	// DeviceKeyHelperRecord::VERSION = 2
+	uint8_t		flags;		// 0 unless compact or trimmed, which have a different layout, see DeviceKeyHelperRecord
+	uint16_t	size;		// size of the keys field only, DEVICE_KEYS_HELPER_SIZE not the size of the structure!
+	uint32_t	generation;	// Incremented on every save. In dual slot mode, the valid slot with the highest generation is used.
+	uint32_t	crc; 		// CRC-32 of the keys field only. Also used to check for changed keys without reading the saved keys.
+	DeviceKeyHelperRegion regions[1]; // Table of contents, the DCT regions in keys
 	uint8_t 	keys[DEVICE_KEYS_HELPER_SIZE];
 } DeviceKeyHelperSavedData;
 
+static_assert(sizeof(DeviceKeyHelperSavedDataHeader) == offsetof(DeviceKeyHelperSavedData, regions) &&
+	sizeof(DeviceKeyHelperSavedDataHeader) + sizeof(DeviceKeyHelperRegion) == offsetof(DeviceKeyHelperSavedData, keys), "DeviceKeyHelperSavedDataHeader does not match DeviceKeyHelperSavedData");
+
+/**
+ * @brief Working memory used by check()
+ *
+ * By default this is allocated from the heap for the duration of each check that uses load and save
+ * functions, or for restoring keys from random access storage. Compact or trimmed saved keys also
+ * allocate a smaller DeviceKeyHelperLayoutBuffer when they're checked or saved. You can supply one using
+ * DeviceKeyHelper::withBuffer() or DeviceKeyHelper::withStaticBuffer() instead so checks never allocate
+ * memory. The size is the worst-case memory used by a check:
+ * For Wi-Fi devices (Photon, P1): 3220 bytes
+ * For cellular devices (Electron, E series): 660 bytes
+ *
+ * When restoring, the whole buffer is used to hold the keys, so it's also large enough for withVault()
+ * on Wi-Fi devices.
+ */
+typedef struct {
+	uint8_t onDevice[DEVICE_KEYS_HELPER_SIZE];	// Keys read from the DCT
+	DeviceKeyHelperSavedData saved;				// Keys read from the storage medium
+} DeviceKeyHelperBuffer;
+
+static_assert(sizeof(DeviceKeyHelperBuffer) == (DEVICE_KEYS_HELPER_SIZE == 1600 ? 3220 : 660), "DeviceKeyHelperBuffer size does not match the documented size");
+
+/**
+ * @brief Working memory used to rebuild the public key with compact or trimmed saved keys
+ *
+ * This is too large for the stack of the system thread, where checks run from the connection monitor,
+ * so it's the start of the buffer from DeviceKeyHelper::withBuffer() or allocated from the heap.
+ */
+typedef struct {
+	DeviceKeyHelperRecordLayout layout;	// Where the keys come from, including the rebuilt public key
+	uint8_t privateKey[DeviceKeyHelperRecord::KEY_PARSE_SIZE < DEVICE_KEYS_HELPER_PRIVATE_KEY_SIZE ? DeviceKeyHelperRecord::KEY_PARSE_SIZE : DEVICE_KEYS_HELPER_PRIVATE_KEY_SIZE];	// Part of the private key used to rebuild it
+} DeviceKeyHelperLayoutBuffer;
+
+static_assert(sizeof(DeviceKeyHelperLayoutBuffer) <= sizeof(DeviceKeyHelperBuffer) &&
+	sizeof(DeviceKeyHelperRecordLayout) <= sizeof(DeviceKeyHelperSavedData), "DeviceKeyHelperLayoutBuffer does not fit in DeviceKeyHelperBuffer");
+
+/**
+ * @brief Records the keys that were last verified to match the saved keys
+ *
+ * Each DeviceKeyHelper keeps one of these in RAM so repeated checks during the same boot only
+ * need to calculate the CRC of the keys in the DCT, not access the storage medium. You can also
+ * supply one in retained memory using DeviceKeyHelper::withRetainedCache() so this also works
+ * after System.reset().
+ */
+typedef struct {
+	uint32_t	magic;			// VERIFIED_CACHE_MAGIC if valid
+	uint32_t	crc;			// CRC-32 of the keys in the DCT that were verified to match the saved keys
+	uint32_t	crcInverted;	// ~crc, so random data in retained memory after power-up is not mistaken for a valid entry
+} DeviceKeyHelperVerifiedCache;
+
+/**
+ * @brief Number of phases of check() that are timed, see DeviceKeyHelper::Phase
+ */
+const size_t DEVICE_KEYS_HELPER_PHASE_COUNT = 7;
+
+/**
+ * @brief Timing statistics for one phase of check()
+ *
+ * One sample is recorded for each check that does any work in the phase. Times are in microseconds
+ * and don't include the other phases it calls, such as the DCT reads done while comparing keys.
+ */
+typedef struct {
+	uint32_t	count;			// Number of checks that included this phase
+	uint32_t	minMicros;		// Shortest time
+	uint32_t	maxMicros;		// Longest time
+	uint32_t	totalMicros;	// Sum of the times, the mean is totalMicros / count
+} DeviceKeyHelperPhaseStats;
+
+/**
+ * @brief Counters and timers for all checks since the object was created or DeviceKeyHelper::resetStats()
+ */
+typedef struct {
+	uint32_t	checks;					// Number of calls to check()
+	uint32_t	cacheHits;				// Checks that didn't access storage because the keys were already verified
+	uint32_t	saves;					// Successful saves
+	uint32_t	saveFailures;			// Saves that could not open or write storage
+	uint32_t	v1SavesRefused;			// Changed keys not saved because of version 1 saved data, see DeviceKeyHelper::withV1Upgrade()
+	uint32_t	storageErrors;			// Checks that stopped because the storage medium reported an error, such as an I2C error
+	uint32_t	restores;				// Times saved keys were written to the DCT
+	uint32_t	checksumFailures;		// Saved keys with an incorrect checksum or CRC
+	uint32_t	allocationFailures;		// Checks or restores that could not allocate memory
+	uint32_t	storageBytesRead;		// Bytes read from the storage medium
+	uint32_t	storageBytesWritten;	// Bytes written to the storage medium
+	uint32_t	dctBytesRead;			// Bytes read from the DCT
+	uint32_t	dctBytesWritten;		// Bytes written to the DCT
+	uint32_t	reconnectRecoveries;	// Keys errors recovered from by reconnecting, see DeviceKeyHelper::withReconnectRecovery()
+	uint32_t	lastReconnectMillis;	// Time to reconnect after the last keys error, 0 if none
+	bool		lastReconnectReset;		// true if the device was reset for the last keys error, in which case lastReconnectMillis is from boot
+	DeviceKeyHelperPhaseStats phases[DEVICE_KEYS_HELPER_PHASE_COUNT];	// Indexed by DeviceKeyHelper::Phase
+} DeviceKeyHelperStats;
+
+/**
+ * @brief Results of DeviceKeyHelper::scrub() since the object was created or DeviceKeyHelper::resetScrubStats()
+ */
+typedef struct {
+	uint32_t	passes;					// Full passes over the saved keys that completed
+	uint32_t	restarts;				// Passes started over because a check ran, which may have saved the keys
+	uint32_t	mismatches;				// Passes that found the keys in the DCT differ from valid saved keys
+	uint32_t	damaged;				// Passes that found the saved keys missing or not valid
+	uint32_t	storageErrors;			// Calls that stopped because the storage medium reported an error
+	uint32_t	dctErrors;				// Calls that stopped because the DCT couldn't be read, the chunk is compared again by the next call
+	uint32_t	lastPassMillis;			// millis() value when the last pass completed, 0 if none
+	uint32_t	lastPassDurationMillis;	// Time from the start to the end of the last pass, including time between calls
+	uint32_t	maxCallMicros;			// Longest time spent in one call to scrub()
+	bool		lastMismatch;			// The last pass found the keys in the DCT differ from the saved keys
+	bool		lastDamaged;			// The last pass found the saved keys missing or not valid
+} DeviceKeyHelperScrubStats;
+
+/**
+ * @brief The result for one ID from DeviceKeyHelper::getSystemDiagValues()
+ */
+typedef struct {
+	bool		present;	// true if the system returned a value for this ID
+	int32_t		value;		// The value, or 0 if not present
+} DeviceKeyHelperDiagValue;
+
 /**
  * @brief Base class for saving and restoring data
  *
@@ -62,85 +229,1373 @@ public:
 	 * bool save(const DeviceKeyHelperSavedData *savedData)
 	 *
 	 * Both return true on success or false on error.
+	 *
+	 * If your storage medium supports reading and writing at an offset, it's more efficient to
+	 * subclass DeviceKeyHelper and override storageOpen(), storageRead(), storageWrite(), and
+	 * storageClose() instead.
 	 */
 	DeviceKeyHelper(std::function<bool(DeviceKeyHelperSavedData *savedData)> load, std::function<bool(const DeviceKeyHelperSavedData *savedData)> save);
 	virtual ~DeviceKeyHelper();
 
 	/**
-	 * @brief Start the connection monitor. Done from setup() typically.
+	 * @brief The options for check
+	 */
+	enum CheckMode {
+		CHECKMODE_AUTOMATIC, 			//< Check keys, if changed, restore and System.reset.
+		CHECKMODE_AUTOMATIC_NO_RESTART, //< Check keys, if changed, restore and return false, do not System.reset
+		CHECKMODE_CHECK_ONLY, 			//< Check keys, if changed return false but do not restore and do not reset.
+		CHECKMODE_SAVE_CURRENT 			//< Save current keys if changed
+	};
+
+	/**
+	 * @brief Start the connection monitor. Done from setup() typically.
+	 *
+	 * If you are using withThreadExecution(), the worker thread is started here. Only one helper can
+	 * monitor the connection; it becomes the instance returned by getInstance().
+	 */
+	void startMonitor();
+
+	/**
+	 * @brief Where the checks requested by the connection monitor are run
+	 */
+	enum ExecutionMode {
+		EXECUTION_MODE_SYSTEM_EVENT,	//< Run checks from the cloud_status system event handler (default)
+		EXECUTION_MODE_LOOP,			//< Queue checks and run them when loop() is called
+		EXECUTION_MODE_THREAD			//< Queue checks and run them from a worker thread
+	};
+
+	/**
+	 * @brief Queue the checks done after connecting to the cloud and run them from loop() instead
+	 *
+	 * You must call deviceKeyHelper.loop() from your loop() function. This avoids accessing the
+	 * storage medium from the system event handler, which delays the cloud handshake and the
+	 * registration of functions and variables.
+	 *
+	 * The check done after a keys error is still run immediately from the system event handler, as
+	 * the device is reset afterwards anyway.
+	 */
+	DeviceKeyHelper &withLoopExecution();
+
+	/**
+	 * @brief Queue the checks done after connecting to the cloud and run them from a worker thread
+	 *
+	 * @param priority The thread priority (default: OS_THREAD_PRIORITY_DEFAULT)
+	 *
+	 * @param stackSize The thread stack size in bytes (default: OS_THREAD_STACK_SIZE_DEFAULT)
+	 *
+	 * This is the same as withLoopExecution() except the thread is started from startMonitor() and
+	 * you don't need to call loop(). The check after a keys error is still run immediately.
+	 */
+	DeviceKeyHelper &withThreadExecution(os_thread_prio_t priority = OS_THREAD_PRIORITY_DEFAULT, size_t stackSize = OS_THREAD_STACK_SIZE_DEFAULT);
+
+	/**
+	 * @brief Set a function to call after each check run by the connection monitor
+	 *
+	 * @param checkCompleteCallback The callback function or lambda
+	 *
+	 * The prototype of the callback is:
+	 *
+	 * void callback(DeviceKeyHelper::CheckMode checkMode, bool result)
+	 *
+	 * The result is the value returned by check(). The callback is called from whatever context the
+	 * check is run from: the system event handler, loop(), or the worker thread.
+	 */
+	DeviceKeyHelper &withCheckCompleteCallback(std::function<void(CheckMode checkMode, bool result)> checkCompleteCallback);
+
+	/**
+	 * @brief After a keys error, reconnect to the cloud once the keys are restored instead of resetting
+	 *
+	 * @param reconnectRecovery true to reconnect (the default if you omit the parameter), false to reset
+	 *
+	 * A reset reinitializes the cellular modem or Wi-Fi module, which adds many seconds before the
+	 * device is back online. With this option the saved keys are written to the DCT and the device
+	 * connects again right away. It's only reset if that connection attempt also fails, or if the keys
+	 * could not be restored.
+	 *
+	 * The time to reconnect is in DeviceKeyHelperStats for both paths. After a reset it's measured from
+	 * boot, which requires STARTUP(System.enableFeature(FEATURE_RESET_INFO)) on the Photon, P1, and
+	 * Electron.
+	 */
+	inline DeviceKeyHelper &withReconnectRecovery(bool reconnectRecovery = true) { this->reconnectRecovery = reconnectRecovery; return *this; };
+
+	/**
+	 * @brief Run any queued checks. Call from loop() when using withLoopExecution().
+	 */
+	void loop();
+
+	/**
+	 * @brief Use a caller-supplied buffer for checks instead of allocating one from the heap
+	 *
+	 * @param buffer The buffer to use, typically a global variable. It must remain valid for
+	 * the life of this object. Pass NULL to go back to allocating from the heap.
+	 *
+	 * Since check() is run from the cloud_status system event handler, the heap may be fragmented
+	 * at that point and the allocation could fail. Supplying a buffer guarantees the check can be
+	 * done. A buffer must not be shared by objects that may run check() at the same time.
+	 */
+	inline DeviceKeyHelper &withBuffer(DeviceKeyHelperBuffer *buffer) { this->buffer = buffer; return *this; };
+
+	/**
+	 * @brief Load only the header of the saved data before loading all of it, when using load and save functions
+	 *
+	 * @param loadHeader Function to load the first sizeof(DeviceKeyHelperSavedDataHeader) bytes (16) of
+	 * the saved data.
+	 *
+	 * The prototype of the function is:
+	 *
+	 * bool loadHeader(DeviceKeyHelperSavedDataHeader *header)
+	 *
+	 * It returns true on success or false on error. When it returns false, the whole saved data is loaded
+	 * as if there were no loadHeader function.
+	 *
+	 * The header contains the magic bytes, size, and CRC of the saved keys. When the CRC matches the
+	 * keys in the DCT, which is the case for nearly every check, the check is done without loading the
+	 * rest of the saved data or allocating a buffer. When the magic bytes or size show there are no saved
+	 * keys, such as on a new device or if something else is stored there, the keys are saved without
+	 * loading the rest. The whole saved data is only loaded when the keys differ.
+	 */
+	inline DeviceKeyHelper &withLoadHeader(std::function<bool(DeviceKeyHelperSavedDataHeader *header)> loadHeader) { this->loadHeader = loadHeader; return *this; };
+
+	/**
+	 * @brief Save and restore these regions of the DCT instead of only the device keys
+	 *
+	 * @param regions Array of regions. It must remain valid for the life of this object, typically a
+	 * global or static const array.
+	 *
+	 * @param regionCount Number of regions, up to DEVICE_KEYS_HELPER_MAX_REGIONS
+	 *
+	 * All of the regions are saved in one record with a table of contents, so checking them takes a
+	 * single open of the storage medium and sequential reads, and restoring them takes one DCT write
+	 * per region. Only supported by storage classes that use random access storage, which includes
+	 * all of the classes in this library, not load and save functions.
+	 *
+	 * Changing the regions makes existing saved data invalid, so the keys will be saved again on the
+	 * next check.
+	 */
+	DeviceKeyHelper &withRegions(const DeviceKeyHelperRegion *regions, size_t regionCount);
+
+	/**
+	 * @brief Save and restore the device keys and server public key for both TCP and UDP
+	 *
+	 * This is withRegions() with DEVICE_KEYS_HELPER_VAULT_REGIONS. The saved data is 2912 bytes, so it's
+	 * too large for the emulated EEPROM on the Photon, P1, and Electron.
+	 */
+	DeviceKeyHelper &withVault();
+
+	/**
+	 * @brief Save only the device private key and rebuild the public key from it when restoring
+	 *
+	 * @param compactKeys true to enable compact mode (the default if you omit the parameter)
+	 *
+	 * The public key is contained in the private key (the modulus and exponent for RSA on Wi-Fi devices,
+	 * the public point for ECC on cellular devices), so it does not need to be saved. The saved data is
+	 * 1236 bytes instead of 1620 on Wi-Fi devices and 148 instead of 340 on cellular devices, and that
+	 * much less is read when restoring.
+	 *
+	 * The rebuilt public key is followed by the byte that followed the public key in the DCT when it was
+	 * saved (0x00 or 0xff). Only the public key itself is compared, not the rest of the public key slot.
+	 *
+	 * If the public key can't be rebuilt, for example an RSA key larger than the 1024-bit keys the system
+	 * firmware creates, a warning is logged and the whole keys are saved as if compact mode were off, so
+	 * the storage must have room for the full saved data. In dual slot mode this is checked when the
+	 * headers are first read, since the slot offsets depend on it.
+	 *
+	 * Only used with the default regions and random access storage, which includes all of the storage
+	 * classes in this library. Saved data from the other mode is still read, but the dual slot offsets
+	 * depend on the mode, so after changing modes only the first slot is used until the keys are saved.
+	 */
+	inline DeviceKeyHelper &withCompactKeys(bool compactKeys = true) { this->compactKeys = compactKeys; compactUnavailable = compactProbed = false; return *this; };
+
+	/**
+	 * @brief Save only the used part of each DCT key slot instead of the whole slot
+	 *
+	 * @param trimmedKeys true to enable trimmed mode (the default if you omit the parameter)
+	 *
+	 * The keys are DER encoded and only use part of their fixed-size DCT slots, the rest is padding.
+	 * In trimmed mode, each slot is saved as the length of the key (extended to the last byte that is not
+	 * padding, so restoring is exact) and the padding byte, followed by only those bytes. With RSA keys on
+	 * Wi-Fi devices, checks that compare the keys and restores read about 800 bytes of saved data instead
+	 * of 1620, and saves write that much less.
+	 *
+	 * Can be combined with withCompactKeys(), in which case only the used part of the private key slot
+	 * is saved. Trimmed mode does not change the space reserved for each slot, so dual slot offsets are
+	 * the same as without it. If the keys fill the slots, they are saved without trimming.
+	 *
+	 * Only used with the default regions and random access storage, which includes all of the storage
+	 * classes in this library.
+	 */
+	inline DeviceKeyHelper &withTrimmedKeys(bool trimmedKeys = true) { this->trimmedKeys = trimmedKeys; return *this; };
+
+	/**
+	 * @brief Keep two copies of the saved data and alternate between them when saving
+	 *
+	 * @param dualSlot true to enable dual slot mode (the default if you omit the parameter)
+	 *
+	 * The second slot immediately follows the first, so twice the storage is required. For
+	 * DeviceKeyHelperEEPROM and DeviceKeyHelperFRAM that's 3240 bytes on Wi-Fi devices (too large for
+	 * the emulated EEPROM) and 680 bytes on cellular devices. File-based storage uses a file twice
+	 * as large.
+	 *
+	 * Each save goes to the slot that does not contain the newest valid saved data and has a higher
+	 * generation number, so if power is lost during a save, the previous copy is still intact and is
+	 * used instead. Only the two headers are read to find the newest slot.
+	 *
+	 * Only supported by storage classes that use random access storage, which includes all of the
+	 * classes in this library. It has no effect when using load and save functions.
+	 */
+	inline DeviceKeyHelper &withDualSlot(bool dualSlot = true) { this->dualSlot = dualSlot; return *this; };
+
+	/**
+	 * @brief Allow saved keys in the version 1 format to be replaced by larger version 2 saved data
+	 *
+	 * @param v1Upgrade true to allow it (the default if you omit the parameter)
+	 *
+	 * Version 1 saved data, from version 0.0.4 and earlier of this library, is 1608 bytes on Wi-Fi
+	 * devices and 328 bytes on cellular devices. Version 2 saved data of the whole keys is 12 bytes
+	 * larger, which would overwrite whatever the application stores right after the old saved data.
+	 *
+	 * By default, when version 1 saved data is found it's not upgraded, and saves keep using the version 1
+	 * format so they take the same space. Compact and trimmed mode, and the CRC and generation of version 2,
+	 * are not used until it's upgraded. With load and save functions, which always save the whole
+	 * DeviceKeyHelperSavedData, keys that match the version 1 saved keys are verified as usual, but changed
+	 * keys are not saved: each refused save logs a warning and increments DeviceKeyHelperStats::v1SavesRefused,
+	 * and a later keys error restores the old saved keys. Use this once the storage has room for the larger
+	 * saved data. Dual slot mode already requires the larger size, so it always upgrades.
+	 */
+	inline DeviceKeyHelper &withV1Upgrade(bool v1Upgrade = true) { this->v1Upgrade = v1Upgrade; return *this; };
+
+	/**
+	 * @brief Also store the record of the last verified keys in retained memory
+	 *
+	 * @param retainedCache A retained variable. It must remain valid for the life of this object.
+	 *
+	 * For example:
+	 *
+	 * retained DeviceKeyHelperVerifiedCache keysCache;
+	 *
+	 * Retained memory must be enabled using STARTUP(System.enableFeature(FEATURE_RETAINED_MEMORY)).
+	 *
+	 * When the keys in the DCT match the keys that were last verified, check() does not access the
+	 * storage medium. This means that if the storage medium is replaced, the keys won't be saved to
+	 * it until they change, the device is powered down, or invalidateCache() is called.
+	 */
+	DeviceKeyHelper &withRetainedCache(DeviceKeyHelperVerifiedCache *retainedCache);
+
+	/**
+	 * @brief Clear the record of the last verified keys in RAM and retained memory
+	 *
+	 * This is done automatically when keys are restored to the DCT or saved. Call this if you've
+	 * modified the storage medium outside of this library, so the next check will access it.
+	 */
+	void invalidateCache();
+
+	/**
+	 * @brief Use a statically allocated buffer for checks instead of allocating one from the heap
+	 *
+	 * This is the same as withBuffer() except the library allocates the buffer. It's shared by all
+	 * DeviceKeyHelper objects that call withStaticBuffer().
+	 */
+	DeviceKeyHelper &withStaticBuffer();
+
+	/**
+	 * @brief Call to check the keys
+	 *
+	 * NOTE: If the keys are swapped back to the saved key, this function will pause, then restart.
+	 *
+	 * @param checkMode (optional, default: CHECKMODE_AUTOMATIC) See the CheckMode enum for details.
+	 */
+	bool check(CheckMode checkMode = CHECKMODE_AUTOMATIC);
+
+	/**
+	 * @brief Get the number of bytes written to the storage medium by the last save
+	 *
+	 * With random access storage, only the bytes that differ from what is already stored are written,
+	 * so this is often much smaller than sizeof(DeviceKeyHelperSavedData). When using a save function,
+	 * the whole structure is always written.
+	 */
+	inline size_t getLastSaveBytesWritten() const { return lastSaveBytesWritten; };
+
+	/**
+	 * @brief Get the total number of bytes written to the storage medium since this object was created
+	 *
+	 * This can be used to keep track of wear on the storage medium. It's also cleared by resetStats().
+	 */
+	inline uint32_t getTotalBytesWritten() const { return stats.storageBytesWritten; };
+
+	/**
+	 * @brief Phases of check() that are timed in DeviceKeyHelperStats
+	 */
+	enum Phase {
+		PHASE_CHECK,		//< The whole check, including all of the other phases
+		PHASE_DCT_READ,		//< Reading the keys from the DCT and calculating their CRC
+		PHASE_LOAD,			//< Opening storage and reading the saved data
+		PHASE_VALIDATE,		//< Calculating the checksum or CRC of the saved keys
+		PHASE_COMPARE,		//< Comparing the keys in the DCT with the saved keys
+		PHASE_DCT_WRITE,	//< Writing the saved keys to the DCT
+		PHASE_SAVE,			//< Opening storage and writing the saved data
+		PHASE_COUNT
+	};
+
+	/**
+	 * @brief Get the counters and timers for all checks since this object was created or resetStats() was called
+	 */
+	inline const DeviceKeyHelperStats &getStats() const { return stats; };
+
+	/**
+	 * @brief Clear the counters and timers, including getTotalBytesWritten()
+	 */
+	void resetStats();
+
+	/**
+	 * @brief Format the counters and timers as JSON
+	 *
+	 * @param buf Buffer to write to. It's always null terminated.
+	 *
+	 * @param bufSize Size of buf in bytes. It's typically around 600 bytes when all of the phases have
+	 * been timed, 1024 bytes is enough for any values. Phases that have not been timed are omitted.
+	 *
+	 * @return The length of the JSON data, not including the null terminator. If this is greater than
+	 * or equal to bufSize the data was truncated, like snprintf.
+	 *
+	 * The phase times are in microseconds. For example:
+	 *
+	 * {"checks":2,"cacheHits":1,"saves":1,...,"phases":{"check":{"n":2,"min":180,"max":14200,"mean":7190},...}}
+	 */
+	size_t getStatsJson(char *buf, size_t bufSize) const;
+
+	/**
+	 * @brief Get the name of a phase as used in getStatsJson(), such as "dctRead"
+	 */
+	static const char *getPhaseName(Phase phase);
+
+	/**
+	 * @brief Set a function to call at the end of each check, with the updated statistics
+	 *
+	 * @param statsCallback The callback function or lambda
+	 *
+	 * The prototype of the callback is:
+	 *
+	 * void callback(const DeviceKeyHelperStats &stats)
+	 *
+	 * The callback is called from whatever context the check is run from, which is the system event
+	 * handler for the connection monitor unless you use withLoopExecution() or withThreadExecution().
+	 * It's not called when keys are restored and the device is reset.
+	 */
+	DeviceKeyHelper &withStatsCallback(std::function<void(const DeviceKeyHelperStats &stats)> statsCallback);
+
+	/**
+	 * @brief Set the time scrub() may spend in each call
+	 *
+	 * @param scrubBudgetMicros The budget in microseconds (default: 1000)
+	 *
+	 * The time includes opening the storage medium. It's checked after each step: reading the headers at
+	 * the start of a pass, reading the layout of the saved keys (which rebuilds the public key with
+	 * withCompactKeys()), and reading each chunk of DEVICE_KEYS_HELPER_CHUNK_SIZE bytes. A call can go
+	 * over by the time for one step. At least one step is done per call so the scrub always progresses.
+	 */
+	inline DeviceKeyHelper &withScrubBudget(uint32_t scrubBudgetMicros) { this->scrubBudgetMicros = scrubBudgetMicros; return *this; };
+
+	/**
+	 * @brief Set a function to call when a pass of scrub() completes
+	 *
+	 * @param scrubCallback The callback function or lambda
+	 *
+	 * The prototype of the callback is:
+	 *
+	 * void callback(const DeviceKeyHelperScrubStats &scrubStats)
+	 *
+	 * It's called from scrub(). lastMismatch and lastDamaged are the results of this pass.
+	 */
+	DeviceKeyHelper &withScrubCallback(std::function<void(const DeviceKeyHelperScrubStats &scrubStats)> scrubCallback);
+
+	/**
+	 * @brief Check part of the saved keys in the background. Call from loop() or a software timer.
+	 *
+	 * @return true if a pass over all of the saved keys completed during this call
+	 *
+	 * Each call reads the saved keys for up to the time set by withScrubBudget(), validating their CRC
+	 * and comparing them with the keys in the DCT, and continues where it left off on the next call.
+	 * This finds saved keys that were damaged on the storage medium, which check() doesn't notice while
+	 * the CRC in the header matches, and keys in the DCT that changed without a connection failure.
+	 *
+	 * Damaged saved keys are rewritten by the next check, as the keys in the DCT were verified when they
+	 * were saved. When the keys differ, nothing is changed; call check() to restore or save them.
+	 *
+	 * Only random access storage can be scrubbed. If a check is running, the call returns without
+	 * doing anything, and a pass is started over if a check ran since it started. Version 1 saved data
+	 * has no CRC, so it isn't scrubbed and no pass is counted until a check saves it in the current
+	 * format.
+	 */
+	bool scrub();
+
+	/**
+	 * @brief Get the progress of the current scrub() pass as a percentage, 0 to 100
+	 */
+	uint8_t getScrubProgress() const;
+
+	/**
+	 * @brief Get the results of scrub() since this object was created or resetScrubStats() was called
+	 */
+	inline const DeviceKeyHelperScrubStats &getScrubStats() const { return scrubStats; };
+
+	/**
+	 * @brief Clear the results of scrub()
+	 */
+	inline void resetScrubStats() { memset(&scrubStats, 0, sizeof(scrubStats)); };
+
+	/**
+	 * @brief Get a system diagnostic value
+	 *
+	 * @param id The ID to get such as DIAG_ID_CLOUD_CONNECTION_ERROR_CODE
+	 *
+	 * @param value Filled with that diagnostic value
+	 *
+	 * @return true on success or false if not available
+	 *
+	 * This only works on system firmware 0.8.0 and later. It returns false and 0 for the value if called on
+	 * older system firmware versions.
+	 */
+	static bool getSystemDiagValue(uint16_t id, int32_t &value);
+
+	/**
+	 * @brief Get several system diagnostic values at once
+	 *
+	 * @param ids The IDs to get, such as DIAG_ID_CLOUD_CONNECTION_ERROR_CODE
+	 *
+	 * @param count The number of entries in ids
+	 *
+	 * @param values Filled in with the result for each ID, in the same order as ids. Must have room
+	 * for count entries.
+	 *
+	 * @return The number of IDs that have a value
+	 *
+	 * This makes one call to system_format_diag_data for all of the IDs, instead of one per ID. IDs that
+	 * are not available are not returned by the system, so each entry in values has a present flag. If
+	 * system_format_diag_data fails, no values are present. Like getSystemDiagValue() this only works on
+	 * system firmware 0.8.0 and later and returns 0 on older versions.
+	 */
+	static size_t getSystemDiagValues(const uint16_t *ids, size_t count, DeviceKeyHelperDiagValue *values);
+
+	/**
+	 * @brief Gets the global singleton instance of this class
+	 *
+	 * This is the helper that called startMonitor(), or the last one constructed before that.
+	 */
+	static inline DeviceKeyHelper *getInstance() { return instance; };
+
+protected:
+	friend class DeviceKeyHelperReplicated;
+
+	/**
+	 * @brief Constructor for subclasses that implement random access storage
+	 *
+	 * Subclasses that use this constructor override storageOpen(), storageRead(), storageWrite(), and
+	 * storageClose() instead of passing load and save functions. This allows check() to compare and
+	 * save the keys in chunks of DEVICE_KEYS_HELPER_CHUNK_SIZE bytes instead of loading the whole
+	 * DeviceKeyHelperSavedData structure into RAM, and stop reading as soon as a difference is found.
+	 */
+	DeviceKeyHelper();
+
+	/**
+	 * @brief Open the storage medium. Only used by subclasses that use the default constructor.
+	 *
+	 * @param write true if the storage is being opened to save data, false to read. When opening
+	 * for write, the storage should be created if it does not exist, but not truncated.
+	 *
+	 * @return true on success or false on error, such as no saved data existing yet.
+	 *
+	 * Every successful call to storageOpen() is followed by a call to storageClose().
+	 */
+	virtual bool storageOpen(bool write);
+
+	/**
+	 * @brief Read data from the storage medium
+	 *
+	 * @param offset Offset relative to the beginning of the DeviceKeyHelperSavedData structure, or of the
+	 * first slot in dual slot mode
+	 *
+	 * @param data Buffer to read into
+	 *
+	 * @param size Number of bytes to read
+	 *
+	 * @return true on success or false on error, including not being able to read all of the bytes.
+	 */
+	virtual bool storageRead(size_t offset, void *data, size_t size);
+
+	/**
+	 * @brief Write data to the storage medium
+	 *
+	 * @param offset Offset relative to the beginning of the DeviceKeyHelperSavedData structure, or of the
+	 * first slot in dual slot mode
+	 *
+	 * @param data Data to write
+	 *
+	 * @param size Number of bytes to write
+	 *
+	 * @return true on success or false on error
+	 */
+	virtual bool storageWrite(size_t offset, const void *data, size_t size);
+
+	/**
+	 * @brief Make the saved data permanent after all of it has been written
+	 *
+	 * @return true on success or false if the save failed
+	 *
+	 * Called after the last storageWrite() of a successful save, before storageClose(). The default
+	 * implementation does nothing. Storage that writes to a copy of the saved data, such as
+	 * DeviceKeyHelperSpiffsParticleBackend with a temporary file, replaces the saved data here.
+	 */
+	virtual bool storageCommit();
+
+	/**
+	 * @brief Get the error from the storage medium for the last storageOpen() or storageRead() that failed
+	 *
+	 * @return 0 if there was no error, or the storage could not tell an error from missing data
+	 *
+	 * When saved data can't be read, it's normally treated as missing and the current keys are saved.
+	 * When this returns an error instead, the check stops so saved keys that could be read later are not
+	 * overwritten. The default implementation returns 0.
+	 */
+	virtual int storageError();
+
+	/**
+	 * @brief Close the storage medium after a successful storageOpen()
+	 */
+	virtual void storageClose();
+
+	/**
+	 * @brief Does the actual work of check(). check() records the statistics.
+	 */
+	bool checkKeys(CheckMode checkMode);
+
+	/**
+	 * @brief Check, save, or restore the keys using random access storage, called from checkKeys()
+	 *
+	 * @param checkMode The check mode passed to check()
+	 *
+	 * @param dctCrc The CRC of the keys in the DCT, from calculateDctCrc()
+	 *
+	 * @return The result of check()
+	 *
+	 * DeviceKeyHelperReplicated overrides this to use several storage media.
+	 */
+	virtual bool checkStorage(CheckMode checkMode, uint32_t dctCrc);
+
+	/**
+	 * @brief Called when scrub() finds that the saved keys are missing or not valid
+	 *
+	 * Makes the next check save the keys even if the CRC in the header matches. DeviceKeyHelperReplicated
+	 * overrides this to repair the replica instead.
+	 */
+	virtual void scrubFoundDamage();
+
+	/**
+	 * @brief Start a pass of scrub(): read the header of the newest saved data
+	 *
+	 * Must only be called between storageOpen() and storageClose(), like the other scrub steps.
+	 *
+	 * @return false if there's no valid header. Returns true without starting a pass for version 1
+	 * saved data.
+	 */
+	bool scrubStart();
+
+	/**
+	 * @brief Read the layout of the saved keys being scrubbed, the second step of a pass of scrub()
+	 */
+	bool scrubReadLayout();
+
+	/**
+	 * @brief Read and check the next chunk of the saved keys being scrubbed, finishing the pass after
+	 * the last one
+	 */
+	bool scrubChunk();
+
+	/**
+	 * @brief Finish a pass of scrub() and update scrubStats
+	 */
+	void scrubFinish(bool damaged, bool mismatch);
+
+	/**
+	 * @brief Results from checkChunked()
+	 */
+	enum ChunkedResult {
+		CHUNKED_UNCHANGED,			//< Saved data is valid and the same as the keys in the DCT
+		CHUNKED_CHANGED,			//< Saved data differs from the keys in the DCT
+		CHUNKED_INVALID				//< Saved data could not be read or was not valid
+	};
+
+	/**
+	 * @brief Check the keys in the DCT against the saved data using random access storage
+	 *
+	 * Only the header is read if the CRC of the keys in the DCT matches the saved CRC. Otherwise,
+	 * the saved keys are only read if needed, using compareChunked().
+	 */
+	ChunkedResult checkChunked(CheckMode checkMode, uint32_t dctCrc);
+
+	/**
+	 * @brief Check the header loaded by loadHeader, when using load and save functions
+	 *
+	 * Returns CHUNKED_UNCHANGED if the CRC matches the keys in the DCT, CHUNKED_INVALID if it's not
+	 * saved data, and CHUNKED_CHANGED if the whole saved data needs to be loaded to find out.
+	 */
+	ChunkedResult checkLoadedHeader(uint32_t dctCrc);
+
+	/**
+	 * @brief Compare the keys in the DCT against the saved keys one chunk at a time
+	 *
+	 * @param checkMode The check mode passed to check()
+	 *
+	 * @param keysOffset The offset of the keys in storage, which depends on the version and slot
+	 *
+	 * @param v1 true if the saved data is version 1, which uses calculateChecksumV1() instead of
+	 * calculateCrc().
+	 *
+	 * @param expected The expected checksum or CRC from the header
+	 *
+	 * Stops reading the DCT at the first chunk that differs. In CHECKMODE_SAVE_CURRENT, the saved
+	 * data will be overwritten anyway so reading the saved data stops there as well, otherwise the
+	 * rest is read to validate the checksum.
+	 *
+	 * Must only be called between storageOpen() and storageClose().
+	 */
+	ChunkedResult compareChunked(CheckMode checkMode, size_t keysOffset, bool v1, uint32_t expected);
+
+	/**
+	 * @brief Save the keys in the DCT to storage one chunk at a time
+	 *
+	 * @param dctCrc The CRC of the keys in the DCT, from calculateDctCrc()
+	 *
+	 * Only used with random access storage.
+	 */
+	bool saveChunked(uint32_t dctCrc);
+
+	/**
+	 * @brief Restore the keys from random access storage to the DCT
+	 *
+	 * @param checkMode CHECKMODE_AUTOMATIC or CHECKMODE_AUTOMATIC_NO_RESTART
+	 *
+	 * @param dctCrc The CRC of the keys in the DCT, from calculateDctCrc()
+	 *
+	 * Reads the saved keys from loadSlot into RAM (the buffer from withBuffer() if large enough,
+	 * otherwise the heap) and validates them before writing them to the DCT. If they're not valid,
+	 * the current keys are saved instead.
+	 *
+	 * @return false if the keys were restored, true if not, like check().
+	 */
+	bool restoreChunked(CheckMode checkMode, uint32_t dctCrc);
+
+	/**
+	 * @brief Read data from the storage medium using storageRead(), timed as PHASE_LOAD
+	 */
+	bool readStorage(size_t offset, void *data, size_t size);
+
+	/**
+	 * @brief Returns true if the checksum (version 1) or CRC of saved keys is correct, timed as PHASE_VALIDATE
+	 */
+	bool validateKeys(const void *keys, size_t size, bool v1, uint32_t expected);
+
+	/**
+	 * @brief Write data to storage, skipping bytes that are already stored
+	 *
+	 * @param offset Offset relative to the beginning of the DeviceKeyHelperSavedData structure, or of the
+	 * first slot in dual slot mode
+	 *
+	 * @param data Data to write
+	 *
+	 * @param size Number of bytes to write
+	 *
+	 * The stored data is read one chunk at a time and only the range from the first to the last byte
+	 * that differs in each chunk is written. If a chunk cannot be read, such as when it's past the end
+	 * of a file, the whole chunk is written. Chunks are processed in order so files are still extended
+	 * sequentially.
+	 *
+	 * Must only be called between storageOpen(true) and storageClose().
+	 */
+	bool storageWriteChanged(size_t offset, const void *data, size_t size);
+
+	/**
+	 * @brief Write the saved data for the keys in the DCT to saveSlot so that it only becomes valid at the end
+	 *
+	 * @param header The header to write. The magic bytes are written last, after the table of contents
+	 * and the keys, which are read from the DCT one chunk at a time.
+	 *
+	 * @param trim The saved length and padding of the private and public key slots, only used if
+	 * header has FLAG_TRIMMED set
+	 *
+	 * On success, the saved slot becomes loadSlot and generation is updated. Only used with random
+	 * access storage.
+	 */
+	bool saveSlotData(DeviceKeyHelperSavedDataHeader header, const DeviceKeyHelperTrim *trim = NULL);
+
+	/**
+	 * @brief Saves the keys in version 1 format to slot 0, see withV1Upgrade()
+	 *
+	 * Only used with random access storage.
+	 */
+	bool saveSlotDataV1();
+
+	/**
+	 * @brief Reads the slot headers to find the order to try the slots in
+	 *
+	 * @param headers Filled in with the header of each slot. Must have room for 2 headers.
+	 *
+	 * @param order Filled in with the slot numbers with a usable header, newest first. Must have room for 2.
+	 *
+	 * @return The number of slots in order
+	 *
+	 * Also sets generation to the highest generation found and saveSlot to the slot that would be
+	 * saved to if none of the slots turn out to be valid. Call selectSlot() for the slot that is valid.
+	 *
+	 * Must only be called between storageOpen() and storageClose().
+	 */
+	size_t readSlotHeaders(DeviceKeyHelperSavedDataHeader *headers, size_t *order);
+
+	/**
+	 * @brief Records that the saved data in slot is valid, so it's used for loading and the other slot for saving
+	 */
+	void selectSlot(size_t slot);
+
+	/**
+	 * @brief Returns the offset of a slot relative to the start of the storage
+	 */
+	inline size_t slotOffset(size_t slot) const { return slot * (keysOffset() + storedKeysSize()); };
+
+	/**
+	 * @brief Returns true if saves use compact mode. See withCompactKeys().
+	 */
+	inline bool useCompact() const { return compactKeys && !compactUnavailable && !load && regions == DEVICE_KEYS_HELPER_REGIONS; };
+
+	/**
+	 * @brief Returns the number of bytes of keys that are saved, which is only the private key in compact mode
+	 */
+	inline size_t storedKeysSize() const { return useCompact() ? DEVICE_KEYS_HELPER_PRIVATE_KEY_SIZE : keysSize; };
+
+	/**
+	 * @brief Returns true if saves use trimmed mode. See withTrimmedKeys().
+	 */
+	inline bool useTrimmed() const { return trimmedKeys && !load && regions == DEVICE_KEYS_HELPER_REGIONS; };
+
+	/**
+	 * @brief Returns true if saves keep the version 1 format that was found. See withV1Upgrade().
+	 */
+	inline bool useV1Format() const { return v1Found && !v1Upgrade && !dualSlot; };
+
+	/**
+	 * @brief Compare the keys in the DCT against compact or trimmed saved keys one chunk at a time
+	 *
+	 * @param checkMode The check mode passed to check()
+	 *
+	 * @param offset The offset of the slot in storage
+	 *
+	 * @param header The header of the slot, which must have FLAG_COMPACT or FLAG_TRIMMED set
+	 *
+	 * This is the same as compareChunked() except the keys are rebuilt using readLayout() and
+	 * readLayoutKeys(). In compact mode, only the public key itself is compared, not the rest of the
+	 * public key slot.
+	 *
+	 * Must only be called between storageOpen() and storageClose().
+	 */
+	ChunkedResult compareLayout(CheckMode checkMode, size_t offset, const DeviceKeyHelperSavedDataHeader &header);
+
+	/**
+	 * @brief compareLayout() using memory from allocLayoutBuffer()
+	 */
+	ChunkedResult compareLayout(CheckMode checkMode, size_t offset, const DeviceKeyHelperSavedDataHeader &header, DeviceKeyHelperLayoutBuffer *layoutBuffer);
+
+	/**
+	 * @brief Set the flags and CRC of a header for saving the keys in the DCT in compact mode, using
+	 * memory from allocLayoutBuffer()
+	 *
+	 * @return false if the memory could not be allocated. If the public key could not be rebuilt from the
+	 * private key in the DCT, compact mode is turned off (compactUnavailable), the header is left as it was,
+	 * and true is returned so the whole keys are saved instead.
+	 */
+	bool initCompactHeader(DeviceKeyHelperSavedDataHeader *header);
+
+	/**
+	 * @brief Set the flags and CRC of a header for saving the keys in the DCT in compact mode
+	 *
+	 * @return false if the public key could not be rebuilt from the private key in the DCT
+	 */
+	bool initCompactHeader(DeviceKeyHelperSavedDataHeader *header, DeviceKeyHelperLayoutBuffer *layoutBuffer);
+
+	/**
+	 * @brief Set the saved length and padding of the private and public key slots for trimmed mode
+	 *
+	 * @param header The header being saved. In compact mode, the public key slot is not saved.
+	 *
+	 * @param trim Filled in with the private key slot and public key slot. Must have room for 2.
+	 *
+	 * @return false if the trimmed keys would not fit in the space for the untrimmed keys
+	 */
+	bool initTrim(const DeviceKeyHelperSavedDataHeader &header, DeviceKeyHelperTrim *trim);
+
+	/**
+	 * @brief Set the saved length of the DCT key slot at start so only the used bytes are saved
+	 *
+	 * The padding byte is the one after the DER encoded key if it's 0x00, otherwise 0xff (erased flash).
+	 * The length includes everything up to the last byte that is not padding, so the slot is restored
+	 * exactly even if the key could not be parsed.
+	 */
+	void trimSlot(size_t start, size_t size, DeviceKeyHelperTrim &trim);
+
+	/**
+	 * @brief Build a DER encoded public key from a DER encoded private key, see DeviceKeyHelperRecord::buildPublicKeyDer()
+	 */
+	static inline size_t buildPublicKeyDer(const uint8_t *privateKey, size_t privateSize, uint8_t *der, size_t derSize) { return DeviceKeyHelperRecord::buildPublicKeyDer(privateKey, privateSize, der, derSize); };
+
+	/**
+	 * @brief Returns the offset of the keys relative to the start of a slot, after the header and table of contents
+	 */
+	inline size_t keysOffset() const { return sizeof(DeviceKeyHelperSavedDataHeader) + regionCount * sizeof(DeviceKeyHelperRegion); };
+
+	/**
+	 * @brief Returns true if the keys with this CRC were already verified to match the saved keys
+	 */
+	bool isVerified(uint32_t crc) const;
+
+	/**
+	 * @brief Records that the keys with this CRC match the saved keys, in RAM and retained memory
+	 */
+	void setVerified(uint32_t crc);
+
+	/**
+	 * @brief Load the entire saved data structure using load
+	 */
+	bool loadSavedData(DeviceKeyHelperSavedData *savedData);
+
+	/**
+	 * @brief Save the entire saved data structure using save
+	 */
+	bool saveSavedData(const DeviceKeyHelperSavedData *savedData);
+
+	/**
+	 * @brief Does the actual work of check() using the specified buffer, when using load and save functions
+	 *
+	 * @param loadKeys false if checkLoadedHeader() found the saved data is not valid, so only the current
+	 * keys are saved.
+	 */
+	bool checkWithBuffer(CheckMode checkMode, DeviceKeyHelperBuffer *checkBuffer, bool loadKeys = true);
+
+	/**
+	 * @brief Calculate the 16-bit checksum used by version 1 saved data, see DeviceKeyHelperRecord::calculateChecksumV1()
+	 */
+	static inline uint16_t calculateChecksumV1(const void *data, size_t size) { return DeviceKeyHelperRecord::calculateChecksumV1(data, size); };
+
+	/**
+	 * @brief Calculate the CRC of the keys currently in the DCT, all of the regions
+	 */
+	uint32_t calculateDctCrc();
+
+	/**
+	 * @brief Calculate the CRC-32 of a block of data, see DeviceKeyHelperRecord::calculateCrc()
+	 */
+	static inline uint32_t calculateCrc(const void *data, size_t size, uint32_t crc = 0) { return DeviceKeyHelperRecord::calculateCrc(data, size, crc); };
+
+	/**
+	 * @brief Initialize a header for the current version with the CRC of the keys
+	 *
+	 * The size is DEVICE_KEYS_HELPER_SIZE and generation is 0. When saving using random access storage,
+	 * these are set by saveSlotData().
+	 */
+	static inline void initHeader(DeviceKeyHelperSavedDataHeader *header, uint32_t crc) { DeviceKeyHelperRecord::initHeader(header, crc, DEVICE_KEYS_HELPER_SIZE); };
+
+	/**
+	 * @brief Returns true if a current version header and its table of contents match the regions being saved
+	 */
+	bool isHeaderValid(const DeviceKeyHelperSavedDataHeader *header, const DeviceKeyHelperRegion *toc) const;
+
+	/**
+	 * @brief Validate savedData, making sure magic, version, size, table of contents, and the CRC are correct
+	 *
+	 * Version 1 saved data is also accepted if its checksum is valid. Use upgradeData() to convert it.
+	 *
+	 * @returns true if valid, false if not
+	 */
+	bool validateData(const DeviceKeyHelperSavedData *savedData);
+
+	/**
+	 * @brief Convert valid version 1 saved data to the current version in place
+	 *
+	 * @returns true if the data was converted, false if it was already the current version.
+	 */
+	bool upgradeData(DeviceKeyHelperSavedData *savedData) const;
+
+	/**
+	 * @brief Read keys from the DCT
+	 *
+	 * @param offset The offset into the keys, which are the regions being saved one after the other
+	 *
+	 * @param data Buffer to read into
+	 *
+	 * @param size Number of bytes to read. This may span multiple regions.
+	 *
+	 * @return 0 on success or the first non-zero error code from dctRead()
+	 */
+	int keysRead(size_t offset, void *data, size_t size);
+
+	/**
+	 * @brief Write keys to the DCT, the opposite of keysRead(). Does one dctWrite() per region.
+	 */
+	int keysWrite(size_t offset, const void *data, size_t size);
+
+	/**
+	 * @brief Read bytes from the DCT (device configuration table)
+	 *
+	 * The default implementation calls dct_read_app_data_copy. You can override this in a subclass to
+	 * substitute a different source of keys, such as a RAM copy when benchmarking or simulating.
+	 *
+	 * @return 0 on success or a non-zero error code
+	 */
+	virtual int dctRead(size_t offset, void *data, size_t size);
+
+	/**
+	 * @brief Write bytes to the DCT (device configuration table)
+	 *
+	 * The default implementation calls dct_write_app_data.
+	 *
+	 * @return 0 on success or a non-zero error code
+	 */
+	virtual int dctWrite(size_t offset, const void *data, size_t size);
+
+	/**
+	 * @brief Reset the device after restoring keys
+	 *
+	 * The default implementation calls System.reset() with RESET_REASON_DATA, so the time to reconnect
+	 * after the reset can be measured.
+	 */
+	virtual void systemReset();
+
+	/**
+	 * @brief Start timing a phase
+	 *
+	 * @return The phase that was being timed. Pass it to enterPhase() when the phase is done.
+	 *
+	 * Time is counted against one phase at a time, so a phase that calls another one does not include
+	 * its time. Use PhaseTimer instead of calling this directly.
+	 */
+	Phase enterPhase(Phase phase);
+
+	/**
+	 * @brief Add a sample to the statistics for a phase
+	 */
+	void recordPhase(Phase phase, uint32_t elapsed);
+
+	/**
+	 * @brief Times its scope as a phase of check()
+	 */
+	class PhaseTimer {
+	public:
+		inline PhaseTimer(DeviceKeyHelper *helper, Phase phase) : helper(helper), previous(helper->enterPhase(phase)) {};
+		inline ~PhaseTimer() { helper->enterPhase(previous); };
+
+	protected:
+		DeviceKeyHelper *helper;
+		Phase previous;
+	};
+
+	/**
+	 * @brief Run a check requested by the connection monitor now, or queue it, depending on the execution mode
+	 */
+	void queueCheck(CheckMode checkMode);
+
+	/**
+	 * @brief Run a check requested by the connection monitor and call the check complete callback
+	 *
+	 * @return The result of check()
+	 */
+	bool runCheck(CheckMode checkMode);
+
+	/**
+	 * @brief Restore the keys after a keys error, then reconnect or reset depending on withReconnectRecovery()
+	 */
+	void recoverKeys();
+
+	/**
+	 * @brief Called when connected to the cloud to record the time to reconnect after a keys error
+	 */
+	void recordReconnect();
+
+	/**
+	 * @brief Worker thread function used with withThreadExecution()
+	 */
+	void threadFunction();
+
+	static void threadFunctionStatic(void *param);
+
+	void eventHandler(system_event_t event, int param);
+
+	static void eventHandlerStatic(system_event_t event, int param);
+
+	static const uint32_t DATA_HEADER_MAGIC = DeviceKeyHelperRecord::MAGIC_V1; 		//< Magic bytes for version 1 saved data
+	static const uint32_t DATA_HEADER_MAGIC_V2 = DeviceKeyHelperRecord::MAGIC_V2;	//< Magic bytes for version 2 and later saved data
+	static const uint8_t DATA_VERSION = DeviceKeyHelperRecord::VERSION;				//< Current saved data version
+
+	static const uint8_t FLAG_COMPACT = DeviceKeyHelperRecord::FLAG_COMPACT;		//< Saved data only contains the private key, see withCompactKeys()
+	static const uint8_t FLAG_FILL_ZERO = DeviceKeyHelperRecord::FLAG_FILL_ZERO;	//< In compact mode, the rebuilt public key is followed by 0x00 instead of 0xff
+	static const uint8_t FLAG_TRIMMED = DeviceKeyHelperRecord::FLAG_TRIMMED;		//< Only the used bytes of each key slot are saved, see withTrimmedKeys()
+
+	static const size_t KEY_PARSE_SIZE = DeviceKeyHelperRecord::KEY_PARSE_SIZE;		//< Bytes of the private key used to rebuild the public key
+
+	/**
+	 * @brief Read the trimmed lengths and rebuild the public key for compact or trimmed saved data
+	 *
+	 * @param offset The offset of the slot in storage
+	 *
+	 * @param header The header of the slot
+	 *
+	 * @param layout Filled in with where the keys come from, for readLayoutKeys()
+	 *
+	 * @param privateKey Memory to read the private key into to rebuild the public key, the size of
+	 * DeviceKeyHelperLayoutBuffer::privateKey
+	 *
+	 * @return false if the saved data could not be read, the trimmed lengths are not valid, or the
+	 * public key could not be rebuilt
+	 *
+	 * Must only be called between storageOpen() and storageClose().
+	 */
+	bool readLayout(size_t offset, const DeviceKeyHelperSavedDataHeader &header, DeviceKeyHelperRecordLayout &layout, uint8_t *privateKey);
+
+	/**
+	 * @brief Get memory for readLayout() and initCompactHeader()
+	 *
+	 * @return The start of the buffer from withBuffer() if there is one, otherwise memory allocated
+	 * from the heap, or NULL if it could not be allocated. Release it with freeLayoutBuffer().
+	 */
+	DeviceKeyHelperLayoutBuffer *allocLayoutBuffer();
+
+	/**
+	 * @brief Release the memory from allocLayoutBuffer()
+	 */
+	void freeLayoutBuffer(DeviceKeyHelperLayoutBuffer *layoutBuffer);
+
+	/**
+	 * @brief Read part of the keys as they will be restored from compact or trimmed saved data
+	 *
+	 * @param offset The offset of the slot in storage
+	 *
+	 * @param layout From readLayout()
+	 *
+	 * @param keysOffset The offset in the keys to start at
+	 *
+	 * @param data Filled in with the keys
+	 *
+	 * @param size The number of bytes to read
+	 *
+	 * The saved bytes of each slot are read from storage, see DeviceKeyHelperRecord::readLayoutKeys().
+	 *
+	 * Must only be called between storageOpen() and storageClose().
+	 */
+	bool readLayoutKeys(size_t offset, const DeviceKeyHelperRecordLayout &layout, size_t keysOffset, uint8_t *data, size_t size);
+
+	std::function<bool(DeviceKeyHelperSavedData *savedData)> load;
+	std::function<bool(const DeviceKeyHelperSavedData *savedData)> save;
+	std::function<bool(DeviceKeyHelperSavedDataHeader *header)> loadHeader;
+
+	static const uint32_t VERIFIED_CACHE_MAGIC = 0x4a1c93e7;	//< Magic bytes for DeviceKeyHelperVerifiedCache
+
+	DeviceKeyHelperBuffer *buffer = NULL;
+	DeviceKeyHelperVerifiedCache sessionCache = {0, 0, 0};
+	DeviceKeyHelperVerifiedCache *retainedCache = NULL;
+
+	const DeviceKeyHelperRegion *regions = DEVICE_KEYS_HELPER_REGIONS;	//< Regions being saved
+	size_t regionCount = 1;												//< Number of entries in regions
+	size_t keysSize = DEVICE_KEYS_HELPER_SIZE;							//< Total size of all regions
+
+	bool dualSlot = false;
+	bool compactKeys = false;
+	bool compactUnavailable = false;	//< The public key can't be rebuilt from the private key in the DCT, see withCompactKeys()
+	bool compactProbed = false;			//< compactUnavailable was set by the first read of the dual slot headers
+	bool trimmedKeys = false;
+	bool v1Upgrade = false;
+	bool v1Found = false;		//< The last headers read had version 1 saved data, see withV1Upgrade()
+	size_t loadSlot = 0;		//< Slot containing the newest valid saved data
+	size_t saveSlot = 0;		//< Slot the next save will be written to
+	uint32_t generation = 0;	//< Highest generation of saved data found or saved
+
+	size_t lastSaveBytesWritten = 0;
+
+	/**
+	 * @brief Where scrub() is in the current pass. Allocated by the first call to scrub().
+	 */
+	struct ScrubState {
+		bool active;						//< A pass is in progress
+		size_t offset;						//< Offset of the slot being scrubbed
+		DeviceKeyHelperSavedDataHeader header;	//< Header of that slot
+		bool haveLayout;					//< layout has been read
+		DeviceKeyHelperRecordLayout layout;	//< Layout of the saved keys in that slot
+		uint32_t expected;					//< CRC from the header
+		size_t compareSize;					//< Number of bytes of the keys to compare with the DCT
+		size_t keysOffset;					//< Offset in the keys of the next chunk
+		uint32_t crc;						//< CRC of the saved keys up to keysOffset
+		bool same;							//< No difference from the DCT found so far
+		bool dctError;						//< The DCT couldn't be read in this call, so it stopped before the chunk at keysOffset
+		uint32_t checks;					//< stats.checks when the pass started
+		uint32_t startMillis;				//< millis() when the pass started
+	};
+
+	ScrubState *scrubState = NULL;
+	DeviceKeyHelperScrubStats scrubStats = {};
+	uint32_t scrubBudgetMicros = 1000;
+	std::function<void(const DeviceKeyHelperScrubStats &scrubStats)> scrubCallback;
+	bool scrubDamaged = false;			//< scrub() found the saved keys damaged and the next check needs to save them
+
+	DeviceKeyHelperStats stats = {};
+	uint32_t phaseMicros[PHASE_COUNT];		//< Time spent in each phase during the current check
+	uint32_t phasesUsed = 0;				//< Bit mask of the phases entered during the current check
+	Phase currentPhase = PHASE_CHECK;		//< Phase the time since phaseStart is counted against
+	uint32_t phaseStart = 0;				//< micros() value when currentPhase was entered
+	std::function<void(const DeviceKeyHelperStats &stats)> statsCallback;
+
+	ExecutionMode executionMode = EXECUTION_MODE_SYSTEM_EVENT;
+	os_thread_prio_t threadPriority = OS_THREAD_PRIORITY_DEFAULT;
+	size_t threadStackSize = OS_THREAD_STACK_SIZE_DEFAULT;
+	os_queue_t checkQueue = NULL;
+	Thread *thread = NULL;
+	Mutex checkMutex;	//< Prevents a queued check and a keys error check from running at the same time
+	std::function<void(CheckMode checkMode, bool result)> checkCompleteCallback;
+
+	static const size_t CHECK_QUEUE_SIZE = 4;	//< Number of checks that can be queued
+
+	size_t failureCount = 0;
+	bool connected = false;
+
+	/**
+	 * @brief State of the reconnect after restoring keys with withReconnectRecovery()
+	 */
+	enum RecoveryState {
+		RECOVERY_NONE,					//< Not recovering from a keys error
+		RECOVERY_CONNECT_REQUESTED,		//< Keys restored and Particle.connect() called
+		RECOVERY_CONNECTING				//< Connection attempt with the restored keys started
+	};
+
+	bool reconnectRecovery = false;
+	RecoveryState recoveryState = RECOVERY_NONE;
+	uint32_t recoveryStart = 0;			//< millis() value when the keys error was detected
+	bool firstConnect = true;			//< Used to measure the time to reconnect after a reset
+
+	static const uint32_t RESET_REASON_DATA = 0x6b657973;		//< System.resetReasonData() after systemReset()
+
+	static DeviceKeyHelper *instance;
+};
+
+static_assert(DeviceKeyHelper::PHASE_COUNT == DEVICE_KEYS_HELPER_PHASE_COUNT, "DEVICE_KEYS_HELPER_PHASE_COUNT does not match DeviceKeyHelper::Phase");
+
+/**
+ * @brief DeviceKeyHelper that uses a storage backend class known at compile time
+ *
+ * @param Backend A class with these methods, which are called in place of the storage methods
+ * of DeviceKeyHelper and are normally inline:
+ *
+ * bool open(bool write)
+ * bool read(size_t pos, void *data, size_t size)
+ * bool write(size_t pos, const void *data, size_t size)
+ * void close()
+ *
+ * A backend can also have a bool commit() method, which is called in place of storageCommit(), and
+ * an int getLastError() method, which is called in place of storageError(). They're optional;
+ * backends without commit() always succeed and backends without getLastError() never report errors.
+ *
+ * The constructor parameters are passed through to the Backend constructor. The storage classes
+ * in this library, such as DeviceKeyHelperEEPROM, are subclasses of this template that inherit its
+ * constructor, so they can still be forward declared as classes. You can define your own the same
+ * way instead of using load and save functions.
+ *
+ * The storage methods are still virtual; the template only saves writing the overrides. Each one
+ * is called once per chunk of DEVICE_KEYS_HELPER_CHUNK_SIZE bytes, not per byte.
+ */
+template<class Backend>
+class DeviceKeyHelperT : public DeviceKeyHelper {
+public:
+	template<typename... Args>
+	inline DeviceKeyHelperT(Args&&... args) : backend(std::forward<Args>(args)...) {
+	};
+
+	/**
+	 * @brief Get the backend object
+	 */
+	inline Backend &getBackend() { return backend; };
+
+protected:
+	virtual bool storageOpen(bool write) {
+		return backend.open(write);
+	}
+
+	virtual bool storageRead(size_t pos, void *data, size_t size) {
+		return backend.read(pos, data, size);
+	}
+
+	virtual bool storageWrite(size_t pos, const void *data, size_t size) {
+		return backend.write(pos, data, size);
+	}
+
+	virtual bool storageCommit() {
+		return commitBackend(backend, 0);
+	}
+
+	virtual int storageError() {
+		return errorBackend(backend, 0);
+	}
+
+	virtual void storageClose() {
+		backend.close();
+	}
+
+	// Calls backend.commit() if the backend has one
+	template<class B>
+	static inline auto commitBackend(B &b, int) -> decltype(b.commit()) {
+		return b.commit();
+	}
+
+	template<class B>
+	static inline bool commitBackend(B &b, long) {
+		return true;
+	}
+
+	// Calls backend.getLastError() if the backend has one
+	template<class B>
+	static inline auto errorBackend(B &b, int) -> decltype(b.getLastError()) {
+		return b.getLastError();
+	}
+
+	template<class B>
+	static inline int errorBackend(B &b, long) {
+		return 0;
+	}
+
+	Backend backend;
+};
+
+/**
+ * @brief Statistics for one replica of DeviceKeyHelperReplicated
+ */
+typedef struct {
+	uint32_t	reads;					// Times the saved data on this replica was checked
+	uint32_t	invalid;				// Checks that found no valid saved data, including storage errors
+	uint32_t	storageErrors;			// Checks that stopped because the storage medium reported an error
+	uint32_t	repairs;				// Times the saved data was rewritten to match the other replicas
+	uint32_t	repairFailures;			// Repairs that could not be written
+	uint32_t	lastMicros;				// Time to check this replica the last time, in microseconds
+	uint32_t	averageMicros;			// Moving average of the time to check this replica, in microseconds
+} DeviceKeyHelperReplicaStats;
+
+/**
+ * @brief DeviceKeyHelper that keeps the saved keys on several storage media at once
+ *
+ * Each replica is a helper using random access storage, such as DeviceKeyHelperEEPROM or
+ * DeviceKeyHelperFRAM. Only its storage is used: call startMonitor() and the with methods, such as
+ * withDualSlot() or withRegions(), on this object, not the replicas.
+ *
+ * A check reads the replica that has been fastest so far first, and only reads the next one if the
+ * saved data on it is missing or not valid. Before restoring, the saved keys are validated, so a
+ * damaged replica is never restored from. The other replicas are then checked and rewritten if they
+ * differ, either at the end of the check or later from loop() with withBackgroundRepair().
+ * scrub() reads the replica that was used last, normally the fastest one. If no replica has valid
+ * saved keys and saving them to one fails, check() returns false.
+ */
+class DeviceKeyHelperReplicated : public DeviceKeyHelper {
+public:
+	/**
+	 * @brief Constructor. Add the storage media using withReplica().
 	 */
-	void startMonitor();
+	DeviceKeyHelperReplicated();
 
 	/**
-	 * @brief The options for check
+	 * @brief Add a storage medium
+	 *
+	 * @param replica A helper that uses random access storage. It must not be destructed while this
+	 * object is in use.
+	 *
+	 * Up to DEVICE_KEYS_HELPER_MAX_REPLICAS can be added. When the replicas are equally fast, they're
+	 * read in the order they were added.
 	 */
-	enum CheckMode {
-		CHECKMODE_AUTOMATIC, 			//< Check keys, if changed, restore and System.reset.
-		CHECKMODE_AUTOMATIC_NO_RESTART, //< Check keys, if changed, restore and return false, do not System.reset
-		CHECKMODE_CHECK_ONLY, 			//< Check keys, if changed return false but do not restore and do not reset.
-		CHECKMODE_SAVE_CURRENT 			//< Save current keys if changed
-	};
+	DeviceKeyHelperReplicated &withReplica(DeviceKeyHelper &replica);
 
 	/**
-	 * @brief Call to check the keys
+	 * @brief Repair the other replicas from loop() instead of at the end of each check
 	 *
-	 * NOTE: If the keys are swapped back to the saved key, this function will pause, then restart.
-	 *
-	 * @param checkMode (optional, default: CHECKMODE_AUTOMATIC) See the CheckMode enum for details.
+	 * This keeps the time to check the keys after connecting to the time to check one replica. Call
+	 * loop() from the application loop(); one replica is repaired per call.
 	 */
-	bool check(CheckMode checkMode = CHECKMODE_AUTOMATIC);
+	inline DeviceKeyHelperReplicated &withBackgroundRepair(bool backgroundRepair = true) { this->backgroundRepair = backgroundRepair; return *this; };
 
 	/**
-	 * @brief Get a system diagnostic value
-	 *
-	 * @param id The ID to get such as DIAG_ID_CLOUD_CONNECTION_ERROR_CODE
-	 *
-	 * @param value Filled with that diagnostic value
-	 *
-	 * @return true on success or false if not available
+	 * @brief Run any queued checks and repair one replica if any need it. Call from loop() when using
+	 * withLoopExecution() or withBackgroundRepair().
+	 */
+	void loop();
+
+	/**
+	 * @brief Repair all of the replicas that need it now
 	 *
-	 * This only works on system firmware 0.8.0 and later. It returns false and 0 for the value if called on
-	 * older system firmware versions.
+	 * A replica is repaired by saving the keys in the DCT to it if its saved data differs, which is
+	 * only done if the keys in the DCT were verified by the last check.
 	 */
-	static bool getSystemDiagValue(uint16_t id, int32_t &value);
+	void repairReplicas();
 
 	/**
-	 * @brief Gets the global singleton instance of this class
+	 * @brief Returns true if some replicas still need to be checked and repaired
 	 */
-	static inline DeviceKeyHelper *getInstance() { return instance; };
+	inline bool isRepairPending() const { return repairPending != 0; };
 
-protected:
 	/**
-	 * @brief Calculate the 16-bit checksum of the keys array in savedData
+	 * @brief Get the number of replicas added using withReplica()
 	 */
-	uint16_t calculateChecksum(const DeviceKeyHelperSavedData *savedData) const;
+	inline size_t getReplicaCount() const { return replicaCount; };
 
 	/**
-	 * @brief Validate savedData, making sure magic, size, and the checksum are correct
+	 * @brief Get the statistics for a replica
 	 *
-	 * @returns true if valid, false if not
+	 * @param index The replica, 0 for the first one added
 	 */
-	bool validateData(const DeviceKeyHelperSavedData *savedData) const;
+	inline const DeviceKeyHelperReplicaStats &getReplicaStats(size_t index) const { return replicaStats[index]; };
 
-	void eventHandler(system_event_t event, int param);
+protected:
+	virtual bool checkStorage(CheckMode checkMode, uint32_t dctCrc);
+	virtual void scrubFoundDamage();
 
-	static void eventHandlerStatic(system_event_t event, int param);
+	virtual bool storageOpen(bool write);
+	virtual bool storageRead(size_t offset, void *data, size_t size);
+	virtual bool storageWrite(size_t offset, const void *data, size_t size);
+	virtual bool storageCommit();
+	virtual int storageError();
+	virtual void storageClose();
 
-	static const uint32_t DATA_HEADER_MAGIC = 0x75a65c63;
+	/**
+	 * @brief Check one replica using checkChunked(), timing it
+	 *
+	 * The replica becomes the one the storage methods use.
+	 */
+	ChunkedResult checkReplica(size_t index, CheckMode checkMode, uint32_t dctCrc);
 
-	std::function<bool(DeviceKeyHelperSavedData *savedData)> load;
-	std::function<bool(const DeviceKeyHelperSavedData *savedData)> save;
+	/**
+	 * @brief Check one replica and save the keys in the DCT to it if it differs
+	 */
+	void repairReplica(size_t index);
 
-	size_t failureCount = 0;
-	bool connected = false;
+	/**
+	 * @brief Save the keys in the DCT to the current replica using saveChunked()
+	 */
+	bool saveReplica(uint32_t dctCrc);
 
-	static DeviceKeyHelper *instance;
+	/**
+	 * @brief Get the order to read the replicas in, fastest first
+	 */
+	void getReadOrder(size_t *order) const;
+
+	DeviceKeyHelper *replicas[DEVICE_KEYS_HELPER_MAX_REPLICAS];
+	DeviceKeyHelperReplicaStats replicaStats[DEVICE_KEYS_HELPER_MAX_REPLICAS];
+	size_t replicaCount = 0;
+	size_t current = 0;					//< Replica used by the storage methods
+	uint32_t repairPending = 0;			//< Bit mask of the replicas to repair
+	uint32_t damaged = 0;				//< Bit mask of the replicas without valid saved data
+	bool backgroundRepair = false;
 };
 
 /**
- * @brief Class to save the keys in the emulated EEPROM
+ * @brief Backend to save the keys in the emulated EEPROM
  */
-class DeviceKeyHelperEEPROM : public DeviceKeyHelper {
+class DeviceKeyHelperEEPROMBackend {
 public:
 	/**
 	 * @brief Store data in the onboard emulated EEPROM
@@ -148,36 +1603,55 @@ public:
 	 * @param offset The offset to write to.
 	 *
 	 * The amount of space you need depends on your platform:
-	 * For Wi-Fi devices (Photon, P1): 1608 bytes
-	 * For cellular devices (Electron, E series): 328 bytes
+	 * For Wi-Fi devices (Photon, P1): 1620 bytes
+	 * For cellular devices (Electron, E series): 340 bytes
 	 *
 	 * The emulated EEPROM on the Photon, P1, and Electron is 2047 bytes so storing Wi-Fi device
 	 * keys will use most of it.
 	 */
-	inline DeviceKeyHelperEEPROM(size_t offset) :
-		DeviceKeyHelper([offset](DeviceKeyHelperSavedData *savedData) {
-			// Log.info("getting %u bytes at %u", sizeof(*savedData), offset);
-			EEPROM.get(offset, *savedData);
-			return true;
-		},
-		[offset](const DeviceKeyHelperSavedData *savedData) {
-			// Log.info("saving %u bytes at %u", sizeof(*savedData), offset);
-			EEPROM.put(offset, *savedData);
-			return true;
-		}) {
+	inline DeviceKeyHelperEEPROMBackend(size_t offset) : offset(offset) {
 	};
+
+	inline bool open(bool /* write */) {
+		return true;
+	}
+
+	inline bool read(size_t pos, void *data, size_t size) {
+		HAL_EEPROM_Get(offset + pos, data, size);
+		return true;
+	}
+
+	inline bool write(size_t pos, const void *data, size_t size) {
+		HAL_EEPROM_Put(offset + pos, data, size);
+		return true;
+	}
+
+	inline void close() {
+	}
+
+	size_t offset;
+};
+
+/**
+ * @brief Class to save the keys in the emulated EEPROM
+ *
+ * The constructor takes the offset in the EEPROM; see DeviceKeyHelperEEPROMBackend.
+ */
+class DeviceKeyHelperEEPROM : public DeviceKeyHelperT<DeviceKeyHelperEEPROMBackend> {
+public:
+	using DeviceKeyHelperT<DeviceKeyHelperEEPROMBackend>::DeviceKeyHelperT;
 };
 
 #ifdef __SPIFFSPARTICLERK_H
 /**
- * @brief Version that uses SpiffsParticleRK to save to SPI flash
+ * @brief Backend that uses SpiffsParticleRK to save to SPI flash
  *
  * This includes many standalone SPI flash chips, the unpopulated set of pads on the E series module
  * and the external flash on the P1.
  *
  * https://github.com/rickkas7/SpiffsParticleRK
  */
-class DeviceKeyHelperSpiffsParticle : public DeviceKeyHelper {
+class DeviceKeyHelperSpiffsParticleBackend {
 public:
 	/**
 	 * @brief Store data a SPIFFS file system
@@ -186,38 +1660,212 @@ public:
 	 *
 	 * @param filename The filename to store the keys in. Filenames are limited to 32 character and there
 	 * are no subdirectories in SPIFFS
+	 *
+	 * @param tempFilename If not NULL, saves are written to a new file with this name, which then replaces
+	 * filename. See below.
+	 *
+	 * By default the saved data is updated in place, and only the bytes that changed are written. The
+	 * magic bytes are written last, so an interrupted save is never mistaken for valid data, but the
+	 * previous keys are lost unless you use withDualSlot().
+	 *
+	 * With tempFilename, the whole saved data is written sequentially to the temporary file, which is
+	 * then renamed to filename, so filename always contains either the old or the new saved data. SPIFFS
+	 * can't rename over an existing file, so filename is removed first. If power is lost between the two,
+	 * the rename is finished the next time the keys are checked. The whole file is written on every
+	 * save, so a save writes more flash pages than updating in place (about twice as many when half
+	 * of the keys change, and much more when only a few bytes do). Using withDualSlot() and updating
+	 * in place is also safe from power loss and writes the fewest pages. In either mode nothing is
+	 * written when the keys are the same as the saved data.
+	 */
+	inline DeviceKeyHelperSpiffsParticleBackend(SpiffsParticle &fs, const char *filename, const char *tempFilename = NULL) : fs(fs), filename(filename), tempFilename(tempFilename) {
+	};
+
+	/**
+	 * @brief Keep the file open between checks
+	 *
+	 * @param keepOpen true to keep the file open (the default if you omit the parameter)
+	 *
+	 * Opening a SPIFFS file by name searches the object lookup pages of the file system, which is most
+	 * of the time a check takes when the keys have not changed. With this option, the file is only
+	 * opened once and the handle is used for all later checks. This permanently uses one of the file
+	 * descriptors of the file system. Don't modify or remove the file outside of this library while
+	 * it's open; call closeFile() first.
 	 */
-	inline DeviceKeyHelperSpiffsParticle(SpiffsParticle &fs, const char *filename) :
-		DeviceKeyHelper([&fs, filename](DeviceKeyHelperSavedData *savedData) {
-			bool result = false;
+	inline DeviceKeyHelperSpiffsParticleBackend &withKeepOpen(bool keepOpen = true) { this->keepOpen = keepOpen; return *this; };
+
+	/**
+	 * @brief Close the file if it's being kept open by withKeepOpen(). It's opened again on the next check.
+	 */
+	inline void closeFile() {
+		if (fh >= 0) {
+			fs.close(fh);
+			fh = -1;
+		}
+	}
+
+	inline bool open(bool write) {
+		if (write && tempFilename) {
+			// The saved data is replaced with a new file. The old one is only opened to copy any parts
+			// of it that are not being saved, such as the other slot in dual slot mode.
+			if (fh < 0) {
+				fh = fs.open(filename, SPIFFS_O_RDONLY);
+			}
+			tempFh = fs.open(tempFilename, SPIFFS_O_CREAT | SPIFFS_O_TRUNC | SPIFFS_O_RDWR);
+			tempLength = 0;
+			tempOk = (tempFh >= 0);
+			if (!tempOk && !keepOpen) {
+				closeFile();
+			}
+			return tempOk;
+		}
+		if (fh >= 0) {
+			return true;
+		}
+		// When keeping the file open it's opened for writing so the same handle can be used for saving
+		spiffs_flags flags = write ? (SPIFFS_O_CREAT | SPIFFS_O_RDWR) : (keepOpen ? SPIFFS_O_RDWR : SPIFFS_O_RDONLY);
+		fh = fs.open(filename, flags);
+		if (fh < 0 && tempFilename && finishReplace()) {
+			fh = fs.open(filename, flags);
+		}
+		return (fh >= 0);
+	}
 
-			SpiffsParticleFile f = fs.openFile(filename, SPIFFS_O_RDONLY);
-			if (f.isValid()) {
-				if (f.length() == sizeof(DeviceKeyHelperSavedData)) {
-					size_t len = f.readBytes((char *)savedData, sizeof(DeviceKeyHelperSavedData));
-					result = (len == sizeof(DeviceKeyHelperSavedData));
+	inline bool read(size_t pos, void *data, size_t size) {
+		if (tempFh >= 0) {
+			// While saving, the part already written is read from the new file and the rest from the old one
+			if (pos < tempLength) {
+				size_t count = (size < tempLength - pos) ? size : (tempLength - pos);
+				if (!readFile(tempFh, pos, data, count)) {
+					return false;
 				}
-				f.close();
+				pos += count;
+				data = (uint8_t *)data + count;
+				size -= count;
 			}
-			return result;
-		},
-		[&fs, filename](const DeviceKeyHelperSavedData *savedData) {
-			bool result = false;
-
-			SpiffsParticleFile f = fs.openFile(filename, SPIFFS_O_CREAT|SPIFFS_O_RDWR|SPIFFS_O_TRUNC);
-			if (f.isValid()) {
-				size_t len = f.write((const uint8_t *)savedData, sizeof(DeviceKeyHelperSavedData));
-				result = (len == sizeof(DeviceKeyHelperSavedData));
-				f.close();
+			return (size == 0) || (fh >= 0 && readFile(fh, pos, data, size));
+		}
+		return readFile(fh, pos, data, size);
+	}
+
+	inline bool write(size_t pos, const void *data, size_t size) {
+		if (tempFh >= 0) {
+			// Bytes that were the same as the old file were skipped, so they're copied first
+			tempOk = tempOk && copyOld(pos) && writeFile(tempFh, pos, data, size);
+			if (tempOk && pos + size > tempLength) {
+				tempLength = pos + size;
 			}
-			return result;
-		}) {
-	};
+			return tempOk;
+		}
+		return writeFile(fh, pos, data, size);
+	}
+
+	inline bool commit() {
+		if (tempFh < 0 || tempLength == 0) {
+			return true;
+		}
+
+		// Keep the rest of the old file
+		spiffs_stat st;
+		if (tempOk && fh >= 0 && fs.fstat(fh, &st) == SPIFFS_OK && st.size > tempLength) {
+			tempOk = copyOld(st.size);
+		}
+		if (!tempOk || fs.fflush(tempFh) < 0) {
+			return false;
+		}
+		closeFile();
+		fs.remove(filename);
+		if (fs.rename(tempFilename, filename) != SPIFFS_OK) {
+			return false;
+		}
+
+		// SPIFFS handles refer to the file, not the name, so the handle of the new file can be kept
+		fh = tempFh;
+		tempFh = -1;
+		return true;
+	}
+
+	inline void close() {
+		if (tempFh >= 0) {
+			// Not committed, so the old file is left as it was
+			fs.close(tempFh);
+			tempFh = -1;
+			fs.remove(tempFilename);
+		}
+		if (keepOpen) {
+			if (fh >= 0) {
+				fs.fflush(fh);
+			}
+		}
+		else {
+			closeFile();
+		}
+	}
+
+	SpiffsParticle &fs;
+	const char *filename;
+	const char *tempFilename;
+	bool keepOpen = false;
+	spiffs_file fh = -1;
+
+protected:
+	inline bool readFile(spiffs_file file, size_t pos, void *data, size_t size) {
+		if (fs.lseek(file, pos, SPIFFS_SEEK_SET) < 0) {
+			return false;
+		}
+		return (fs.read(file, data, size) == (s32_t) size);
+	}
+
+	inline bool writeFile(spiffs_file file, size_t pos, const void *data, size_t size) {
+		if (fs.lseek(file, pos, SPIFFS_SEEK_SET) < 0) {
+			return false;
+		}
+		return (fs.write(file, (void *)data, size) == (s32_t) size);
+	}
+
+	// Copy the old file to the new one from tempLength up to end
+	inline bool copyOld(size_t end) {
+		uint8_t buf[DEVICE_KEYS_HELPER_CHUNK_SIZE];
+		while(tempLength < end) {
+			size_t count = end - tempLength;
+			if (count > sizeof(buf)) {
+				count = sizeof(buf);
+			}
+			if (fh < 0 || !readFile(fh, tempLength, buf, count) || !writeFile(tempFh, tempLength, buf, count)) {
+				return false;
+			}
+			tempLength += count;
+		}
+		return true;
+	}
+
+	// Rename the temporary file if power was lost after removing the old file
+	inline bool finishReplace() {
+		spiffs_stat st;
+		return fs.stat(tempFilename, &st) == SPIFFS_OK && fs.rename(tempFilename, filename) == SPIFFS_OK;
+	}
+
+	spiffs_file tempFh = -1;
+	size_t tempLength = 0;
+	bool tempOk = false;
+};
+
+/**
+ * @brief Version that uses SpiffsParticleRK to save to SPI flash
+ *
+ * The constructor takes the file system, filename, and optional temporary filename; see
+ * DeviceKeyHelperSpiffsParticleBackend.
+ */
+class DeviceKeyHelperSpiffsParticle : public DeviceKeyHelperT<DeviceKeyHelperSpiffsParticleBackend> {
+public:
+	using DeviceKeyHelperT<DeviceKeyHelperSpiffsParticleBackend>::DeviceKeyHelperT;
 };
 #endif /* __SPIFFSPARTICLERK_H */
 
 #ifdef SdFat_h
-class DeviceKeyHelperSdFat : public DeviceKeyHelper {
+/**
+ * @brief Backend that saves to a file on an SD card using the SdFat library
+ */
+class DeviceKeyHelperSdFatBackend {
 public:
 	/**
 	 * @brief Store data a SdFat SD card file system using the SdFat library
@@ -228,39 +1876,265 @@ public:
 	 *
 	 * https://github.com/greiman/SdFat-Particle
 	 */
-	inline DeviceKeyHelperSdFat(const char *filename) :
-		DeviceKeyHelper([filename](DeviceKeyHelperSavedData *savedData) {
-			bool result = false;
+	inline DeviceKeyHelperSdFatBackend(const char *filename) : filename(filename) {
+	};
+
+	/**
+	 * @brief Read and write the saved data as raw sectors of a contiguous file
+	 *
+	 * @param sd The SdFat object for the card. begin() must be called on it before the first check.
+	 *
+	 * @param fileSize The size of the file. The default of 8192 bytes is enough for dual slot mode with
+	 * the vault enabled.
+	 *
+	 * Opening a file by name reads the directory and FAT on every check. In this mode the file is
+	 * allocated as a contiguous range of sectors the first time it's used, and after that the saved data
+	 * is read and written directly to those sectors through a one sector buffer in this object. Checking
+	 * unchanged keys reads one sector (two in dual slot mode), and changes to a sector are written to the
+	 * card once per save.
+	 *
+	 * If the file exists but is not contiguous or is too small, for example because it was saved without
+	 * this option, it's renamed with ".old" appended, copied into a new contiguous file, then removed.
+	 * If power is lost during the copy, it's started over from the ".old" file on the next check.
+	 *
+	 * Each check makes sure the location is still valid before using it: the card ID must be the same,
+	 * and the first sector must start with the magic bytes of saved data. Otherwise the file is looked up
+	 * by name again, so a card that was replaced, reformatted, or had the file removed is never written
+	 * at the old sectors. Still, don't modify, move, or remove the file any other way while the device is
+	 * running; call closeRawSectors() first.
+	 */
+	inline DeviceKeyHelperSdFatBackend &withRawSectors(SdFat &sd, size_t fileSize = 8192) {
+		this->sd = &sd;
+		rawFileSize = ((fileSize + SECTOR_SIZE - 1) / SECTOR_SIZE) * SECTOR_SIZE;
+		return *this;
+	};
+
+	/**
+	 * @brief Forget the location of the file when using withRawSectors(). It's looked up again on the next check.
+	 */
+	inline void closeRawSectors() {
+		flushSector();
+		rawSectorCount = 0;
+		cachedSector = NO_SECTOR;
+	}
+
+	inline bool open(bool write) {
+		if (sd) {
+			// The card could have been removed or replaced since the last check
+			cachedSector = NO_SECTOR;
+			if (rawSectorCount && !isRawLocationValid()) {
+				rawSectorCount = 0;
+				cachedSector = NO_SECTOR;
+			}
+			return rawSectorCount || openRawSectors();
+		}
+		return file.open(filename, write ? (O_CREAT | O_RDWR) : O_READ);
+	}
+
+	inline bool read(size_t pos, void *data, size_t size) {
+		if (sd) {
+			uint8_t *p = (uint8_t *)data;
+			while(size > 0) {
+				size_t offset = pos % SECTOR_SIZE;
+				size_t count = SECTOR_SIZE - offset;
+				if (count > size) {
+					count = size;
+				}
+				if (!loadSector(pos / SECTOR_SIZE)) {
+					return false;
+				}
+				memcpy(p, &sector[offset], count);
+				p += count;
+				pos += count;
+				size -= count;
+			}
+			return true;
+		}
+		if (!file.seekSet(pos)) {
+			return false;
+		}
+		return ((size_t) file.read(data, size) == size);
+	}
 
-			File f;
-			if (f.open(filename, O_READ)) {
-				if (f.size() == sizeof(DeviceKeyHelperSavedData)) {
-					size_t len = f.read((char *)savedData, sizeof(DeviceKeyHelperSavedData));
-					result = (len == sizeof(DeviceKeyHelperSavedData));
+	inline bool write(size_t pos, const void *data, size_t size) {
+		if (sd) {
+			const uint8_t *p = (const uint8_t *)data;
+			while(size > 0) {
+				size_t offset = pos % SECTOR_SIZE;
+				size_t count = SECTOR_SIZE - offset;
+				if (count > size) {
+					count = size;
+				}
+				// Writes are usually of bytes that were just compared, so the sector is already loaded.
+				// It's written when a different sector is needed or on commit, so the order of the
+				// writes to the card is the same as the order of the calls.
+				if (!loadSector(pos / SECTOR_SIZE)) {
+					return false;
 				}
+				memcpy(&sector[offset], p, count);
+				sectorDirty = true;
+				p += count;
+				pos += count;
+				size -= count;
+			}
+			return true;
+		}
+		if (!file.seekSet(pos)) {
+			return false;
+		}
+		return ((size_t) file.write(data, size) == size);
+	}
+
+	inline bool commit() {
+		return flushSector();
+	}
+
+	inline void close() {
+		if (sd) {
+			flushSector();
+		}
+		else {
+			file.close();
+		}
+	}
+
+	static const size_t SECTOR_SIZE = 512;
+	static const uint32_t NO_SECTOR = 0xffffffff;
+
+	const char *filename;
+	File file;
 
-				f.close();
+protected:
+	inline bool loadSector(uint32_t index) {
+		if (index >= rawSectorCount) {
+			return false;
+		}
+		if (index != cachedSector) {
+			if (!flushSector()) {
+				return false;
 			}
-			return result;
-		},
-		[filename](const DeviceKeyHelperSavedData *savedData) {
-			bool result = false;
-
-			File f;
-			if (f.open(filename, O_CREAT | O_RDWR | O_TRUNC)) {
-				size_t len = f.write((const uint8_t *)savedData, sizeof(DeviceKeyHelperSavedData));
-				result = (len == sizeof(DeviceKeyHelperSavedData));
-				f.close();
+			if (!sd->card()->readBlock(rawFirstSector + index, sector)) {
+				cachedSector = NO_SECTOR;
+				return false;
 			}
-			return result;
-		}) {
-	};
+			cachedSector = index;
+		}
+		return true;
+	}
+
+	inline bool flushSector() {
+		if (sectorDirty) {
+			sectorDirty = false;
+			if (!sd->card()->writeBlock(rawFirstSector + cachedSector, sector)) {
+				cachedSector = NO_SECTOR;
+				return false;
+			}
+		}
+		return true;
+	}
+
+	/**
+	 * @brief Returns true if the file is still at rawFirstSector on the same card
+	 *
+	 * Only the card ID is read from the card. The first sector is read into the sector buffer, which
+	 * the check reads next anyway. A file that was just created has no saved data yet, so it's looked up
+	 * again on the next check until the keys are saved, which only opens the file.
+	 */
+	inline bool isRawLocationValid() {
+		cid_t cid;
+		if (!sd->card()->readCID(&cid) || memcmp(&cid, &rawCid, sizeof(cid_t)) != 0) {
+			return false;
+		}
+		if (!loadSector(0)) {
+			return false;
+		}
+		uint32_t magic;
+		memcpy(&magic, sector, sizeof(magic));
+		return magic == DeviceKeyHelperRecord::MAGIC_V2 || magic == DeviceKeyHelperRecord::MAGIC_V1;
+	}
+
+	inline bool openRawSectors() {
+		String oldFilename = String(filename) + ".old";
+
+		// Remembered so a different card is detected by the next check
+		if (!sd->card()->readCID(&rawCid)) {
+			return false;
+		}
+
+		if (!sd->exists(oldFilename.c_str())) {
+			if (file.open(filename, O_READ)) {
+				uint32_t firstSector, lastSector;
+				bool usable = file.contiguousRange(&firstSector, &lastSector) && file.fileSize() >= rawFileSize;
+				file.close();
+				if (usable) {
+					rawFirstSector = firstSector;
+					rawSectorCount = rawFileSize / SECTOR_SIZE;
+					return true;
+				}
+				if (!sd->rename(filename, oldFilename.c_str())) {
+					return false;
+				}
+			}
+		}
+		else {
+			// A previous copy did not finish, start over from the old file
+			sd->remove(filename);
+		}
+
+		uint32_t firstSector, lastSector;
+		bool result = file.createContiguous(filename, rawFileSize) && file.contiguousRange(&firstSector, &lastSector);
+		file.close();
+		if (!result) {
+			return false;
+		}
+
+		// Copy the old file, or zero the new one so whatever the sectors contained before isn't used
+		File oldFile;
+		bool hasOld = oldFile.open(oldFilename.c_str(), O_READ);
+		for(uint32_t ii = 0; result && ii < rawFileSize / SECTOR_SIZE; ii++) {
+			memset(sector, 0, SECTOR_SIZE);
+			if (hasOld) {
+				oldFile.read(sector, SECTOR_SIZE);
+			}
+			result = sd->card()->writeBlock(firstSector + ii, sector);
+		}
+		if (hasOld) {
+			oldFile.close();
+		}
+		if (!result || (hasOld && !sd->remove(oldFilename.c_str()))) {
+			return false;
+		}
+
+		rawFirstSector = firstSector;
+		rawSectorCount = rawFileSize / SECTOR_SIZE;
+		return true;
+	}
+
+	SdFat *sd = 0;
+	size_t rawFileSize = 0;
+	uint32_t rawFirstSector = 0;
+	uint32_t rawSectorCount = 0;
+	uint32_t cachedSector = NO_SECTOR;
+	bool sectorDirty = false;
+	cid_t rawCid;
+	uint8_t sector[SECTOR_SIZE] __attribute__((aligned(4)));
+};
+
+/**
+ * @brief Version that saves to a file on an SD card using the SdFat library
+ *
+ * The constructor takes the filename; see DeviceKeyHelperSdFatBackend. To use raw sector I/O, call
+ * getBackend().withRawSectors(sd).
+ */
+class DeviceKeyHelperSdFat : public DeviceKeyHelperT<DeviceKeyHelperSdFatBackend> {
+public:
+	using DeviceKeyHelperT<DeviceKeyHelperSdFatBackend>::DeviceKeyHelperT;
 };
 #endif /* SdFat_h */
 
 #ifdef __MB85RC256V_FRAM_RK
 /**
- * @brief Interface to store device keys in a 32K I2C FRAM (MB85RC256V)
+ * @brief Backend to store device keys in a 32K I2C FRAM (MB85RC256V)
  *
  * Hardware:
  * https://www.adafruit.com/products/1895
@@ -268,7 +2142,7 @@ public:
  * Library:
  * https://github.com/rickkas7/MB85RC256V-FRAM-RK
  */
-class DeviceKeyHelperFRAM : public DeviceKeyHelper {
+class DeviceKeyHelperFRAMBackend {
 public:
 	/**
 	 * @brief Store data in a MB85RC256V FRAM (non-volatile ferro-electric RAM)
@@ -279,29 +2153,223 @@ public:
 	 * @param offset The offset to write to.
 	 *
 	 * The amount of space you need depends on your platform:
-	 * For Wi-Fi devices (Photon, P1): 1608 bytes
-	 * For cellular devices (Electron, E series): 328 bytes
+	 * For Wi-Fi devices (Photon, P1): 1620 bytes
+	 * For cellular devices (Electron, E series): 340 bytes
 	 */
-	inline DeviceKeyHelperFRAM(MB85RC256V &fram, size_t offset) :
-		DeviceKeyHelper([&fram, offset](DeviceKeyHelperSavedData *savedData) {
-			fram.get(offset, *savedData);
-			return true;
-		},
-		[&fram, offset](const DeviceKeyHelperSavedData *savedData) {
-			fram.put(offset, *savedData);
-			return true;
-		}) {
+	inline DeviceKeyHelperFRAMBackend(MB85RC256V &fram, size_t offset) : fram(fram), offset(offset) {
 	};
+
+	inline bool open(bool /* write */) {
+		return true;
+	}
+
+	inline bool read(size_t pos, void *data, size_t size) {
+		lastError = fram.readData(offset + pos, (uint8_t *)data, size) ? 0 : -1;
+		return lastError == 0;
+	}
+
+	inline bool write(size_t pos, const void *data, size_t size) {
+		lastError = fram.writeData(offset + pos, (const uint8_t *)data, size) ? 0 : -1;
+		return lastError == 0;
+	}
+
+	inline void close() {
+	}
+
+	/**
+	 * @brief Returns -1 if the last read or write failed, otherwise 0
+	 *
+	 * The MB85RC256V library only returns whether an I2C transfer succeeded. Use
+	 * DeviceKeyHelperFRAMWireBackend to get the I2C status.
+	 */
+	inline int getLastError() const { return lastError; };
+
+	MB85RC256V &fram;
+	size_t offset;
+	int lastError = 0;
+};
+
+/**
+ * @brief Interface to store device keys in a 32K I2C FRAM (MB85RC256V)
+ *
+ * The constructor takes the MB85RC256V object and offset; see DeviceKeyHelperFRAMBackend.
+ */
+class DeviceKeyHelperFRAM : public DeviceKeyHelperT<DeviceKeyHelperFRAMBackend> {
+public:
+	using DeviceKeyHelperT<DeviceKeyHelperFRAMBackend>::DeviceKeyHelperT;
 };
 #endif /* __MB85RC256V_FRAM_RK */
 
+/**
+ * @brief Backend to store device keys in an I2C FRAM using Wire directly
+ *
+ * This works with FRAM that uses two address bytes, such as the MB85RC64, MB85RC128, MB85RC256V, and
+ * MB85RC512T. It doesn't require the MB85RC256V-FRAM-RK library, and it can be used on the same chip
+ * as that library.
+ *
+ * Transfers are as large as the Wire buffer allows. A read sets the FRAM address once and then reads
+ * buffer size bytes at a time, because the FRAM keeps incrementing the address between reads. A write
+ * sends the address and buffer size - 2 bytes at a time.
+ *
+ * Checks compare the saved keys a chunk at a time as they're read, so the whole record is never copied
+ * to RAM. If the FRAM doesn't respond, the I2C status is returned by getLastError() and the check
+ * stops without overwriting the saved keys; see DeviceKeyHelper::storageError().
+ */
+class DeviceKeyHelperFRAMWireBackend {
+public:
+	/**
+	 * @brief Store data in an I2C FRAM
+	 *
+	 * @param wire The I2C interface, typically Wire
+	 *
+	 * @param offset The offset in the FRAM to store at. The amount of space you need depends on your
+	 * platform: 1620 bytes on Wi-Fi devices (Photon, P1) and 340 bytes on cellular devices (Electron,
+	 * E series), twice that with DeviceKeyHelper::withDualSlot().
+	 *
+	 * @param addr The address set with the A0-A2 pins, 0-7. This is added to the base address 0x50.
+	 */
+	inline DeviceKeyHelperFRAMWireBackend(TwoWire &wire, size_t offset, uint8_t addr = 0) : wire(wire), offset(offset), addr(addr) {
+	};
+
+	/**
+	 * @brief Set the I2C clock speed
+	 *
+	 * @param clockSpeed The speed in Hz, such as CLOCK_SPEED_400KHZ. The MB85RC256V supports up to
+	 * 1 MHz, but the I2C peripheral of the Photon and Electron only supports up to 400 kHz.
+	 *
+	 * The speed is set the first time the FRAM is used. If the bus was already started by other code it's
+	 * restarted with the new speed, which also changes the speed for all other devices on the bus.
+	 */
+	inline DeviceKeyHelperFRAMWireBackend &withClockSpeed(uint32_t clockSpeed) { this->clockSpeed = clockSpeed; this->clockSpeedSet = false; return *this; };
+
+	/**
+	 * @brief Set the maximum number of bytes in one I2C transfer
+	 *
+	 * @param bufferSize The size of the Wire buffer. The default is 32, the size in Device OS. If you've
+	 * made the buffer larger with acquireWireBuffer(), pass its size here. It must be from 3 to 255,
+	 * since each write also sends the 2-byte address and a read is at most 255 bytes. Other values are
+	 * ignored and 32 is used.
+	 */
+	inline DeviceKeyHelperFRAMWireBackend &withBufferSize(size_t bufferSize) { this->bufferSize = (bufferSize >= 3 && bufferSize <= 255) ? bufferSize : 32; return *this; };
+
+	inline bool open(bool /* write */) {
+		if (!clockSpeedSet && clockSpeed) {
+			if (wire.isEnabled()) {
+				wire.end();
+			}
+			wire.setSpeed(clockSpeed);
+			clockSpeedSet = true;
+		}
+		if (!wire.isEnabled()) {
+			wire.begin();
+		}
+
+		// Make sure the FRAM responds, so a missing chip is reported as an error instead of invalid data
+		wire.beginTransmission(deviceAddr());
+		lastError = wire.endTransmission(true);
+		return lastError == 0;
+	}
+
+	inline bool read(size_t pos, void *data, size_t size) {
+		uint8_t *p = (uint8_t *)data;
+
+		wire.beginTransmission(deviceAddr());
+		wire.write((uint8_t)((offset + pos) >> 8));
+		wire.write((uint8_t)(offset + pos));
+		lastError = wire.endTransmission(false);
+
+		while(lastError == 0 && size > 0) {
+			size_t count = (size < bufferSize) ? size : bufferSize;
+			if ((size_t) wire.requestFrom(deviceAddr(), (uint8_t) count, (uint8_t) (count == size)) != count) {
+				lastError = ERROR_SHORT_READ;
+
+				// Reads before the last one don't send a STOP, so end the transaction here or the bus
+				// stays busy for the other devices on it
+				while(wire.available()) {
+					wire.read();
+				}
+				wire.beginTransmission(deviceAddr());
+				wire.endTransmission(true);
+				break;
+			}
+			for(size_t ii = 0; ii < count; ii++) {
+				*p++ = (uint8_t) wire.read();
+			}
+			size -= count;
+		}
+		return lastError == 0;
+	}
+
+	inline bool write(size_t pos, const void *data, size_t size) {
+		const uint8_t *p = (const uint8_t *)data;
+
+		lastError = 0;
+		while(lastError == 0 && size > 0) {
+			// The first two bytes of each transfer are the address
+			size_t count = (size < bufferSize - 2) ? size : bufferSize - 2;
+
+			wire.beginTransmission(deviceAddr());
+			wire.write((uint8_t)((offset + pos) >> 8));
+			wire.write((uint8_t)(offset + pos));
+			size_t written = 0;
+			for(size_t ii = 0; ii < count; ii++) {
+				written += wire.write(*p++);
+			}
+			lastError = wire.endTransmission(true);
+			if (lastError == 0 && written != count) {
+				// The Wire buffer is smaller than bufferSize
+				lastError = ERROR_BUFFER_FULL;
+			}
+
+			pos += count;
+			size -= count;
+		}
+		return lastError == 0;
+	}
+
+	inline void close() {
+	}
+
+	/**
+	 * @brief Returns the error from the last open, read, or write, 0 if it succeeded
+	 *
+	 * The error is the value returned by Wire.endTransmission(), ERROR_SHORT_READ (-2) if the FRAM
+	 * returned fewer bytes than requested, or ERROR_BUFFER_FULL (-3) if the Wire buffer is smaller than
+	 * the size set with withBufferSize().
+	 */
+	inline int getLastError() const { return lastError; };
+
+	inline uint8_t deviceAddr() const { return (uint8_t)(0x50 | (addr & 0x7)); };
+
+	static const int ERROR_SHORT_READ = -2;
+	static const int ERROR_BUFFER_FULL = -3;
+
+	TwoWire &wire;
+	size_t offset;
+	uint8_t addr;
+	uint32_t clockSpeed = 0;
+	bool clockSpeedSet = false;
+	size_t bufferSize = 32;
+	int lastError = 0;
+};
+
+/**
+ * @brief Interface to store device keys in an I2C FRAM using Wire directly
+ *
+ * The constructor takes the Wire object, offset, and address; see DeviceKeyHelperFRAMWireBackend.
+ */
+class DeviceKeyHelperFRAMWire : public DeviceKeyHelperT<DeviceKeyHelperFRAMWireBackend> {
+public:
+	using DeviceKeyHelperT<DeviceKeyHelperFRAMWireBackend>::DeviceKeyHelperT;
+};
+
 #ifdef _FLASHEE_EEPROM_H_
 /**
- * @brief Store data in a file using flashee-eeprom
+ * @brief Backend to store data in a file using flashee-eeprom
  *
  * Include "flashee-eeprom.h" before DeviceHelperRK.h to enable this feature.
  */
-class DeviceKeyHelperFlasheeFile : public DeviceKeyHelper {
+class DeviceKeyHelperFlasheeFileBackend {
 public:
 	/**
 	 * @brief Store data in a file in P1 external flash using flashee-eeprom
@@ -310,40 +2378,56 @@ public:
 	 *
 	 * https://github.com/m-mcgowan/spark-flashee-eeprom/
 	 */
-	inline DeviceKeyHelperFlasheeFile(const char *filename) :
-		DeviceKeyHelper([filename](DeviceKeyHelperSavedData *savedData) {
-			FRESULT fResult;
-			FIL fil;
-			UINT dw;
+	inline DeviceKeyHelperFlasheeFileBackend(const char *filename) : filename(filename) {
+	};
 
-			fResult = f_open(&fil, filename, FA_READ | FA_OPEN_EXISTING);
-			if (fResult == FR_OK) {
-				fResult = f_read(&fil, savedData, sizeof(DeviceKeyHelperSavedData), &dw);
+	inline bool open(bool write) {
+		FRESULT fResult = f_open(&fil, filename, write ? (FA_READ | FA_WRITE | FA_OPEN_ALWAYS) : (FA_READ | FA_OPEN_EXISTING));
+		return (fResult == FR_OK);
+	}
 
-				// Log.info("f_read fResult=%d dw=%d", fResult, dw);
+	inline bool read(size_t pos, void *data, size_t size) {
+		UINT dw;
 
-				f_close(&fil);
-			}
+		if (f_lseek(&fil, pos) != FR_OK) {
+			return false;
+		}
+		FRESULT fResult = f_read(&fil, data, size, &dw);
 
-			return (fResult == FR_OK);
-		},
-		[filename](const DeviceKeyHelperSavedData *savedData) {
-			FRESULT fResult;
-			FIL fil;
-			UINT dw;
+		// Log.info("f_read fResult=%d dw=%d", fResult, dw);
 
-			fResult = f_open(&fil, filename, FA_WRITE | FA_CREATE_ALWAYS);
-			if (fResult == FR_OK) {
-				fResult = f_write(&fil, savedData, sizeof(DeviceKeyHelperSavedData), &dw);
+		return (fResult == FR_OK && dw == size);
+	}
 
-				// Log.info("f_write fResult=%d dw=%d", fResult, dw);
+	inline bool write(size_t pos, const void *data, size_t size) {
+		UINT dw;
 
-				f_close(&fil);
-			}
+		if (f_lseek(&fil, pos) != FR_OK) {
+			return false;
+		}
+		FRESULT fResult = f_write(&fil, data, size, &dw);
 
-			return (fResult == FR_OK);
-		}) {
-	};
+		// Log.info("f_write fResult=%d dw=%d", fResult, dw);
+
+		return (fResult == FR_OK && dw == size);
+	}
+
+	inline void close() {
+		f_close(&fil);
+	}
+
+	const char *filename;
+	FIL fil;
+};
+
+/**
+ * @brief Store data in a file using flashee-eeprom
+ *
+ * The constructor takes the filename; see DeviceKeyHelperFlasheeFileBackend.
+ */
+class DeviceKeyHelperFlasheeFile : public DeviceKeyHelperT<DeviceKeyHelperFlasheeFileBackend> {
+public:
+	using DeviceKeyHelperT<DeviceKeyHelperFlasheeFileBackend>::DeviceKeyHelperT;
 };
 #endif /* _FLASHEE_EEPROM_H_ */
 
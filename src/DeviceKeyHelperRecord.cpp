@@ -0,0 +1,456 @@
+/**
+ * Saved data format for DeviceKeyHelperRK
+ *
+ * Location: https://github.com/rickkas7/DeviceKeyHelperRK
+ * License: MIT
+ */
+
+#include "DeviceKeyHelperRecord.h"
+
+#include <string.h>
+
+static_assert(sizeof(DeviceKeyHelperSavedDataHeader) == 16 && sizeof(DeviceKeyHelperSavedDataV1Header) == 8 &&
+	sizeof(DeviceKeyHelperRegion) == 4 && sizeof(DeviceKeyHelperTrim) == 4, "saved data structures must not have padding");
+
+// [static]
+DeviceKeyHelperRecord::Result DeviceKeyHelperRecord::parse(const void *data, size_t size, DeviceKeyHelperRecordInfo &info) {
+	const uint8_t *p = (const uint8_t *)data;
+
+	// Records in files and images are not necessarily aligned, so everything is copied out
+	uint32_t magic;
+	if (size < sizeof(magic)) {
+		return RESULT_TRUNCATED;
+	}
+	memcpy(&magic, p, sizeof(magic));
+
+	DeviceKeyHelperRecordLayout &layout = info.layout;
+	info.regionCount = 0;
+
+	if (magic == MAGIC_V1) {
+		DeviceKeyHelperSavedDataV1Header v1;
+		if (size < sizeof(v1)) {
+			return RESULT_TRUNCATED;
+		}
+		memcpy(&v1, p, sizeof(v1));
+		if (v1.size == 0) {
+			return RESULT_BAD_HEADER;
+		}
+
+		info.version = 1;
+		info.flags = 0;
+		info.generation = 0;
+		info.check = v1.sum;
+
+		// Same as a version 2 record without flags, but with no table of contents
+		DeviceKeyHelperSavedDataHeader header;
+		initHeader(&header, 0, v1.size);
+		initLayout(header, 0, NULL, layout);
+		layout.dataOffset = sizeof(v1);
+	}
+	else
+	if (magic == MAGIC_V2) {
+		DeviceKeyHelperSavedDataHeader header;
+		if (size < sizeof(header)) {
+			return RESULT_TRUNCATED;
+		}
+		memcpy(&header, p, sizeof(header));
+		if (header.version != VERSION || header.size == 0 || (header.flags & ~FLAGS_ALL) != 0) {
+			return RESULT_BAD_HEADER;
+		}
+
+		info.version = header.version;
+		info.flags = header.flags;
+		info.generation = header.generation;
+		info.check = header.crc;
+
+		// The table of contents ends when the regions add up to the size of the keys
+		size_t total = 0;
+		while(total < header.size) {
+			if (info.regionCount >= DEVICE_KEYS_HELPER_MAX_REGIONS) {
+				return RESULT_BAD_HEADER;
+			}
+			DeviceKeyHelperRegion &region = info.regions[info.regionCount];
+			size_t offset = sizeof(header) + info.regionCount * sizeof(region);
+			if (size < offset + sizeof(region)) {
+				return RESULT_TRUNCATED;
+			}
+			memcpy(&region, &p[offset], sizeof(region));
+			if (region.size == 0) {
+				return RESULT_BAD_HEADER;
+			}
+			info.regionCount++;
+			total += region.size;
+		}
+		if (total != header.size) {
+			return RESULT_BAD_HEADER;
+		}
+		size_t tocSize = info.regionCount * sizeof(DeviceKeyHelperRegion);
+
+		DeviceKeyHelperTrim trim[2];
+		if (header.flags & FLAG_TRIMMED) {
+			if (size < sizeof(header) + tocSize + sizeof(trim)) {
+				return RESULT_TRUNCATED;
+			}
+			memcpy(trim, &p[sizeof(header) + tocSize], sizeof(trim));
+		}
+		if (!initLayout(header, tocSize, trim, layout)) {
+			return RESULT_BAD_LAYOUT;
+		}
+	}
+	else {
+		return RESULT_BAD_MAGIC;
+	}
+
+	info.recordSize = layout.dataOffset + layout.trim[0].length + layout.trim[1].length;
+	if (size < info.recordSize) {
+		return RESULT_TRUNCATED;
+	}
+
+	if (layout.rebuild) {
+		uint8_t privateKey[KEY_PARSE_SIZE];
+		size_t count = (layout.privateKeySize < sizeof(privateKey)) ? layout.privateKeySize : sizeof(privateKey);
+		if (!readKeys(data, info, 0, privateKey, count) || !rebuildPublicKey(layout, privateKey, count)) {
+			return RESULT_BAD_LAYOUT;
+		}
+	}
+	return RESULT_VALID;
+}
+
+// [static]
+DeviceKeyHelperRecord::Result DeviceKeyHelperRecord::validate(const void *data, size_t size, DeviceKeyHelperRecordInfo &info) {
+	Result result = parse(data, size, info);
+	if (result != RESULT_VALID) {
+		return result;
+	}
+
+	uint8_t chunk[64];
+	uint32_t check = 0;
+	for(size_t offset = 0; offset < info.layout.keysSize; offset += sizeof(chunk)) {
+		size_t count = info.layout.keysSize - offset;
+		if (count > sizeof(chunk)) {
+			count = sizeof(chunk);
+		}
+		readKeys(data, info, offset, chunk, count);
+		if (info.version == 1) {
+			check = (uint16_t)(check + calculateChecksumV1(chunk, count));
+		}
+		else {
+			check = calculateCrc(chunk, count, check);
+		}
+	}
+
+	return (check == info.check) ? RESULT_VALID : RESULT_BAD_CHECKSUM;
+}
+
+// [static]
+bool DeviceKeyHelperRecord::readKeys(const void *data, const DeviceKeyHelperRecordInfo &info, size_t keysOffset, void *keys, size_t size) {
+	return readLayoutKeys(info.layout, keysOffset, (uint8_t *)keys, size, [data](size_t offset, void *savedData, size_t savedSize) {
+		memcpy(savedData, &((const uint8_t *)data)[offset], savedSize);
+		return true;
+	});
+}
+
+// [static]
+bool DeviceKeyHelperRecord::initLayout(const DeviceKeyHelperSavedDataHeader &header, size_t tocSize, const DeviceKeyHelperTrim *trim, DeviceKeyHelperRecordLayout &layout) {
+	layout.keysSize = header.size;
+	layout.dataOffset = sizeof(DeviceKeyHelperSavedDataHeader) + tocSize;
+	layout.rebuild = (header.flags & FLAG_COMPACT) != 0;
+	layout.derLen = 0;
+
+	if ((header.flags & (FLAG_COMPACT | FLAG_TRIMMED)) == 0) {
+		// All of the keys are saved, as one slot
+		layout.privateKeySize = layout.keysSize;
+		layout.trim[0] = { (uint16_t) layout.keysSize, 0xff, 0 };
+		layout.trim[1] = { 0, 0xff, 0 };
+		return true;
+	}
+
+	layout.privateKeySize = privateKeySize(layout.keysSize);
+	if (layout.privateKeySize == 0) {
+		return false;
+	}
+	size_t publicSize = layout.keysSize - layout.privateKeySize;
+
+	if (header.flags & FLAG_TRIMMED) {
+		layout.trim[0] = trim[0];
+		layout.trim[1] = trim[1];
+		layout.dataOffset += 2 * sizeof(DeviceKeyHelperTrim);
+
+		if (layout.trim[0].length > layout.privateKeySize || layout.trim[1].length > publicSize ||
+			(layout.rebuild && layout.trim[1].length != 0)) {
+			return false;
+		}
+	}
+	else {
+		// Compact mode without trimming saves the whole private key slot
+		layout.trim[0] = { (uint16_t) layout.privateKeySize, 0xff, 0 };
+		layout.trim[1] = { 0, (uint8_t)((header.flags & FLAG_FILL_ZERO) ? 0x00 : 0xff), 0 };
+	}
+	return true;
+}
+
+// [static]
+bool DeviceKeyHelperRecord::rebuildPublicKey(DeviceKeyHelperRecordLayout &layout, const uint8_t *privateKey, size_t size) {
+	layout.derLen = buildPublicKeyDer(privateKey, size, layout.der, sizeof(layout.der));
+	return layout.derLen != 0 && layout.derLen <= layout.keysSize - layout.privateKeySize;
+}
+
+// [static]
+bool DeviceKeyHelperRecord::readLayoutKeys(const DeviceKeyHelperRecordLayout &layout, size_t keysOffset, uint8_t *data, size_t size, std::function<bool(size_t offset, void *data, size_t size)> readSaved) {
+	// The saved bytes of the private key slot are followed by the saved bytes of the public key slot
+	const size_t slotStart[2] = { 0, layout.privateKeySize };
+	const size_t slotEnd[2] = { layout.privateKeySize, layout.keysSize };
+	const size_t savedStart[2] = { layout.dataOffset, layout.dataOffset + layout.trim[0].length };
+
+	for(size_t slot = 0; slot < 2; slot++) {
+		size_t start = (keysOffset > slotStart[slot]) ? keysOffset : slotStart[slot];
+		size_t end = (keysOffset + size < slotEnd[slot]) ? keysOffset + size : slotEnd[slot];
+		if (start >= end) {
+			continue;
+		}
+
+		uint8_t *p = &data[start - keysOffset];
+		size_t pos = start - slotStart[slot];
+		size_t count = end - start;
+
+		bool rebuilt = (slot == 1 && layout.rebuild);
+		size_t used = rebuilt ? layout.derLen : layout.trim[slot].length;
+		if (pos < used) {
+			size_t usedCount = used - pos;
+			if (usedCount > count) {
+				usedCount = count;
+			}
+			if (rebuilt) {
+				memcpy(p, &layout.der[pos], usedCount);
+			}
+			else
+			if (!readSaved(savedStart[slot] + pos, p, usedCount)) {
+				return false;
+			}
+			p += usedCount;
+			count -= usedCount;
+		}
+		memset(p, layout.trim[slot].fill, count);
+	}
+	return true;
+}
+
+// [static]
+void DeviceKeyHelperRecord::initHeader(DeviceKeyHelperSavedDataHeader *header, uint32_t crc, size_t keysSize) {
+	header->magic = MAGIC_V2;
+	header->version = VERSION;
+	header->flags = 0;
+	header->size = (uint16_t) keysSize;
+	header->generation = 0;
+	header->crc = crc;
+}
+
+// [static]
+uint16_t DeviceKeyHelperRecord::calculateChecksumV1(const void *data, size_t size) {
+	const uint8_t *p = (const uint8_t *)data;
+	uint16_t sum = 0;
+
+	for(size_t ii = 0; ii < size; ii++) {
+		sum += p[ii];
+	}
+	return sum;
+}
+
+// CRC-32 (IEEE 802.3, same as zlib) lookup table, generated at compile time so it's stored in flash
+static constexpr uint32_t crcTableEntry(uint32_t c, int bits = 8) {
+	return (bits == 0) ? c : crcTableEntry((c >> 1) ^ ((c & 1) ? 0xedb88320 : 0), bits - 1);
+}
+
+#define CRC_TABLE_2(n) crcTableEntry(n), crcTableEntry(n + 1)
+#define CRC_TABLE_8(n) CRC_TABLE_2(n), CRC_TABLE_2(n + 2), CRC_TABLE_2(n + 4), CRC_TABLE_2(n + 6)
+#define CRC_TABLE_32(n) CRC_TABLE_8(n), CRC_TABLE_8(n + 8), CRC_TABLE_8(n + 16), CRC_TABLE_8(n + 24)
+#define CRC_TABLE_128(n) CRC_TABLE_32(n), CRC_TABLE_32(n + 32), CRC_TABLE_32(n + 64), CRC_TABLE_32(n + 96)
+
+static constexpr uint32_t crcTable[256] = { CRC_TABLE_128(0), CRC_TABLE_128(128) };
+
+#undef CRC_TABLE_2
+#undef CRC_TABLE_8
+#undef CRC_TABLE_32
+#undef CRC_TABLE_128
+
+static_assert(crcTable[1] == 0x77073096 && crcTable[255] == 0x2d02ef8d, "CRC table is incorrect");
+
+// [static]
+uint32_t DeviceKeyHelperRecord::calculateCrc(const void *data, size_t size, uint32_t crc) {
+	const uint8_t *p = (const uint8_t *)data;
+
+	crc = ~crc;
+	for(size_t ii = 0; ii < size; ii++) {
+		crc = crcTable[(crc ^ p[ii]) & 0xff] ^ (crc >> 8);
+	}
+	return ~crc;
+}
+
+// Reads a DER tag and length at pos. On success, pos is moved to the contents, which may extend past size.
+static bool derReadHeader(const uint8_t *der, size_t size, size_t &pos, uint8_t tag, size_t &len) {
+	if (pos + 2 > size || der[pos] != tag) {
+		return false;
+	}
+	size_t p = pos + 1;
+	len = der[p++];
+	if (len & 0x80) {
+		size_t lenBytes = len & 0x7f;
+		if (lenBytes == 0 || lenBytes > 2 || p + lenBytes > size) {
+			return false;
+		}
+		len = 0;
+		for(size_t ii = 0; ii < lenBytes; ii++) {
+			len = (len << 8) | der[p++];
+		}
+	}
+	pos = p;
+	return true;
+}
+
+// Size of a DER tag, length, and len bytes of contents
+static size_t derTlvSize(size_t len) {
+	return 1 + ((len < 0x80) ? 1 : (len < 0x100) ? 2 : 3) + len;
+}
+
+// Writes a DER tag and length, returns a pointer to where the contents go
+static uint8_t *derWriteHeader(uint8_t *p, uint8_t tag, size_t len) {
+	*p++ = tag;
+	if (len >= 0x100) {
+		*p++ = 0x82;
+		*p++ = (uint8_t)(len >> 8);
+	}
+	else
+	if (len >= 0x80) {
+		*p++ = 0x81;
+	}
+	*p++ = (uint8_t) len;
+	return p;
+}
+
+// AlgorithmIdentifier for RSA: SEQUENCE { OID rsaEncryption, NULL }
+static const uint8_t derRsaAlgorithm[] = { 0x30, 0x0d, 0x06, 0x09, 0x2a, 0x86, 0x48, 0x86, 0xf7, 0x0d, 0x01, 0x01, 0x01, 0x05, 0x00 };
+
+// OID id-ecPublicKey
+static const uint8_t derEcPublicKeyOid[] = { 0x06, 0x07, 0x2a, 0x86, 0x48, 0xce, 0x3d, 0x02, 0x01 };
+
+// OID prime256v1 (secp256r1), used if the private key does not include the curve
+static const uint8_t derPrime256v1Oid[] = { 0x06, 0x08, 0x2a, 0x86, 0x48, 0xce, 0x3d, 0x03, 0x01, 0x07 };
+
+// [static]
+size_t DeviceKeyHelperRecord::buildPublicKeyDer(const uint8_t *privateKey, size_t privateSize, uint8_t *der, size_t derSize) {
+	size_t pos = 0;
+	size_t len;
+
+	// Both key types start with SEQUENCE { INTEGER version, ... }
+	if (!derReadHeader(privateKey, privateSize, pos, 0x30, len) ||
+		!derReadHeader(privateKey, privateSize, pos, 0x02, len) || len != 1 || pos + 1 > privateSize) {
+		return 0;
+	}
+	uint8_t version = privateKey[pos++];
+
+	uint8_t *p = der;
+	if (version == 0) {
+		// RSAPrivateKey: version, modulus, publicExponent, ... The public key contains the modulus
+		// and publicExponent INTEGERs as they are.
+		size_t start = pos;
+		for(size_t ii = 0; ii < 2; ii++) {
+			if (!derReadHeader(privateKey, privateSize, pos, 0x02, len) || pos + len > privateSize) {
+				return 0;
+			}
+			pos += len;
+		}
+		size_t integersLen = pos - start;
+
+		// SubjectPublicKeyInfo: SEQUENCE { AlgorithmIdentifier, BIT STRING { SEQUENCE { modulus, publicExponent } } }
+		size_t bitStringLen = 1 + derTlvSize(integersLen);
+		size_t publicKeyLen = sizeof(derRsaAlgorithm) + derTlvSize(bitStringLen);
+		if (derTlvSize(publicKeyLen) > derSize) {
+			return 0;
+		}
+		p = derWriteHeader(p, 0x30, publicKeyLen);
+		memcpy(p, derRsaAlgorithm, sizeof(derRsaAlgorithm));
+		p += sizeof(derRsaAlgorithm);
+		p = derWriteHeader(p, 0x03, bitStringLen);
+		*p++ = 0;	// No unused bits
+		p = derWriteHeader(p, 0x30, integersLen);
+		memcpy(p, &privateKey[start], integersLen);
+		p += integersLen;
+	}
+	else
+	if (version == 1) {
+		// ECPrivateKey: version, OCTET STRING privateKey, [0] parameters (optional), [1] BIT STRING publicKey (optional)
+		if (!derReadHeader(privateKey, privateSize, pos, 0x04, len)) {
+			return 0;
+		}
+		pos += len;
+
+		const uint8_t *curve = derPrime256v1Oid;
+		size_t curveLen = sizeof(derPrime256v1Oid);
+		size_t savedPos = pos;
+		if (derReadHeader(privateKey, privateSize, pos, 0xa0, len) && pos + len <= privateSize) {
+			curve = &privateKey[pos];
+			curveLen = len;
+			pos += len;
+		}
+		else {
+			pos = savedPos;
+		}
+
+		// Computing the public key is not supported, it must be included in the private key
+		if (!derReadHeader(privateKey, privateSize, pos, 0xa1, len) || pos + len > privateSize) {
+			return 0;
+		}
+		const uint8_t *bitString = &privateKey[pos];
+		size_t bitStringLen = len;
+
+		// SubjectPublicKeyInfo: SEQUENCE { SEQUENCE { id-ecPublicKey, curve }, BIT STRING publicKey }
+		size_t algorithmLen = sizeof(derEcPublicKeyOid) + curveLen;
+		size_t publicKeyLen = derTlvSize(algorithmLen) + bitStringLen;
+		if (derTlvSize(publicKeyLen) > derSize) {
+			return 0;
+		}
+		p = derWriteHeader(p, 0x30, publicKeyLen);
+		p = derWriteHeader(p, 0x30, algorithmLen);
+		memcpy(p, derEcPublicKeyOid, sizeof(derEcPublicKeyOid));
+		p += sizeof(derEcPublicKeyOid);
+		memcpy(p, curve, curveLen);
+		p += curveLen;
+		memcpy(p, bitString, bitStringLen);
+		p += bitStringLen;
+	}
+	else {
+		return 0;
+	}
+
+	return p - der;
+}
+
+
+// [static]
+size_t DeviceKeyHelperRecord::derSequenceSize(const uint8_t *data, size_t size) {
+	size_t pos = 0;
+	size_t len;
+	if (!derReadHeader(data, size, pos, 0x30, len)) {
+		return 0;
+	}
+	return pos + len;
+}
+
+// [static]
+const char *DeviceKeyHelperRecord::getResultName(Result result) {
+	switch(result) {
+	case RESULT_VALID:
+		return "valid";
+	case RESULT_TRUNCATED:
+		return "truncated";
+	case RESULT_BAD_MAGIC:
+		return "bad_magic";
+	case RESULT_BAD_HEADER:
+		return "bad_header";
+	case RESULT_BAD_LAYOUT:
+		return "bad_layout";
+	case RESULT_BAD_CHECKSUM:
+		return "bad_checksum";
+	}
+	return "unknown";
+}
@@ -0,0 +1,300 @@
+/**
+ * Saved data format for DeviceKeyHelperRK
+ *
+ * This file does not depend on Device OS, so the same definitions and validation are used by the
+ * library on the device and by host tools that read saved data from storage media and images.
+ *
+ * Location: https://github.com/rickkas7/DeviceKeyHelperRK
+ * License: MIT
+ */
+
+#ifndef __DEVICEKEYHELPERRECORD_H
+#define __DEVICEKEYHELPERRECORD_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <functional>
+
+/**
+ * @brief A region of the DCT that is saved and restored
+ */
+typedef struct {
+	uint16_t	offset;		// Offset in the DCT
+	uint16_t	size;		// Number of bytes
+} DeviceKeyHelperRegion;
+
+/**
+ * @brief Maximum number of regions that can be passed to DeviceKeyHelper::withRegions()
+ *
+ * This is also the most table of contents entries a record can have.
+ */
+const size_t DEVICE_KEYS_HELPER_MAX_REGIONS = 8;
+
+/**
+ * @brief The header of saved data, everything before the table of contents
+ *
+ * The header is followed by the table of contents, one DeviceKeyHelperRegion for each DCT region that
+ * is saved, then the keys. The table of contents entries add up to size, which is how its length is
+ * determined without knowing the regions in advance.
+ */
+typedef struct {
+	uint32_t	magic;		// DeviceKeyHelperRecord::MAGIC_V2 = 0x75a65c64
+	uint8_t		version;	// DeviceKeyHelperRecord::VERSION = 2
+	uint8_t		flags;		// FLAG_COMPACT, FLAG_FILL_ZERO, and FLAG_TRIMMED, see DeviceKeyHelper::withCompactKeys() and withTrimmedKeys()
+	uint16_t	size;		// size of the keys only, all regions, not the size of the record!
+	uint32_t	generation;	// Incremented on every save. In dual slot mode, the valid slot with the highest generation is used.
+	uint32_t	crc;		// CRC-32 of the keys as they are restored. Also used to check for changed keys without reading the saved keys.
+} DeviceKeyHelperSavedDataHeader;
+
+/**
+ * @brief The header of version 1 saved data, used by version 0.0.4 and earlier of this library
+ *
+ * The keys immediately follow this 8-byte header. Version 1 saved data is still accepted, and is
+ * converted to the current version only if DeviceKeyHelper::withV1Upgrade() is used, as the current
+ * version is larger.
+ */
+typedef struct {
+	uint32_t	magic;  // DeviceKeyHelperRecord::MAGIC_V1 = 0x75a65c63
+	uint16_t	size;	// size of the keys field only
+	uint16_t	sum; 	// Checksum of the keys field only. Straight sum of uint8_t bytes, 16 bits wide.
+} DeviceKeyHelperSavedDataV1Header;
+
+/**
+ * @brief Saved length and padding of one DCT key slot, see DeviceKeyHelper::withTrimmedKeys()
+ *
+ * In trimmed saved data, there is one of these for the private key slot and one for the public key
+ * slot after the table of contents, followed by the saved bytes of each slot.
+ */
+typedef struct {
+	uint16_t	length;		// Number of bytes saved from the beginning of the slot
+	uint8_t		fill;		// Value of the rest of the bytes in the slot
+	uint8_t		reserved;	// Currently always 0
+} DeviceKeyHelperTrim;
+
+/**
+ * @brief Where each byte of the keys comes from in saved data
+ *
+ * The keys are split into two slots, the private key slot and the public key slot. The saved bytes of
+ * each slot are stored one after the other starting at dataOffset, and the rest of each slot is its
+ * padding byte. In compact mode the public key slot has no saved bytes and starts with the public key
+ * rebuilt from the private key instead.
+ *
+ * Records that are not compact or trimmed (including version 1 and records with more than one region)
+ * have all of the keys in the private key slot, saved in full.
+ */
+typedef struct {
+	size_t keysSize;				//< Total size of the keys, all regions
+	size_t privateKeySize;			//< Size of the private key slot, the public key slot is the rest of the keys
+	size_t dataOffset;				//< Offset of the saved key bytes relative to the start of the record
+	DeviceKeyHelperTrim trim[2];	//< Saved length and padding of the private and public key slots
+	bool rebuild;					//< The public key is rebuilt from the private key (compact mode)
+	size_t derLen;					//< Length of the rebuilt public key
+	uint8_t der[192];				//< The rebuilt public key, DeviceKeyHelperRecord::PUBLIC_KEY_DER_MAX bytes
+} DeviceKeyHelperRecordLayout;
+
+/**
+ * @brief Everything known about a record from DeviceKeyHelperRecord::parse()
+ */
+typedef struct {
+	uint8_t		version;		//< 1 or 2
+	uint8_t		flags;			//< Flags from the header, always 0 for version 1
+	uint32_t	generation;		//< Generation from the header, always 0 for version 1
+	uint32_t	check;			//< CRC-32 from the header, or the 16-bit sum for version 1
+	size_t		regionCount;	//< Number of table of contents entries, 0 for version 1
+	DeviceKeyHelperRegion regions[DEVICE_KEYS_HELPER_MAX_REGIONS];	//< Table of contents
+	size_t		recordSize;		//< Number of bytes the record occupies, header through the last saved key byte
+	DeviceKeyHelperRecordLayout layout;	//< Where the keys come from
+} DeviceKeyHelperRecordInfo;
+
+/**
+ * @brief Parsing, validation, and checksums for saved data
+ *
+ * All of the methods are static. They work on records in memory, except readLayoutKeys() which can read
+ * the saved bytes from anywhere, which is how DeviceKeyHelper reads records one chunk at a time from
+ * random access storage.
+ */
+class DeviceKeyHelperRecord {
+public:
+	/**
+	 * @brief Result of parse() and validate()
+	 */
+	enum Result {
+		RESULT_VALID = 0,			//< Record is valid
+		RESULT_TRUNCATED,			//< The data ends before the end of the record
+		RESULT_BAD_MAGIC,			//< Not a record
+		RESULT_BAD_HEADER,			//< Unsupported version or flags, or the table of contents does not match the size
+		RESULT_BAD_LAYOUT,			//< Trimmed lengths are not valid, or the public key cannot be rebuilt in compact mode
+		RESULT_BAD_CHECKSUM			//< The keys do not match the CRC or sum in the header
+	};
+
+	static const uint32_t MAGIC_V1 = 0x75a65c63;		//< Magic bytes for version 1 saved data
+	static const uint32_t MAGIC_V2 = 0x75a65c64;		//< Magic bytes for version 2 and later saved data
+	static const uint8_t VERSION = 2;					//< Current saved data version
+
+	static const uint8_t FLAG_COMPACT = 0x01;			//< Saved data only contains the private key, see DeviceKeyHelper::withCompactKeys()
+	static const uint8_t FLAG_FILL_ZERO = 0x02;			//< In compact mode, the rebuilt public key is followed by 0x00 instead of 0xff
+	static const uint8_t FLAG_TRIMMED = 0x04;			//< Only the used bytes of each key slot are saved, see DeviceKeyHelper::withTrimmedKeys()
+	static const uint8_t FLAGS_ALL = FLAG_COMPACT | FLAG_FILL_ZERO | FLAG_TRIMMED;
+
+	static const size_t KEY_PARSE_SIZE = 256;			//< Bytes of the private key used to rebuild the public key
+	static const size_t PUBLIC_KEY_DER_MAX = sizeof(DeviceKeyHelperRecordLayout::der);	//< Largest public key that can be rebuilt
+
+	static const size_t TCP_KEYS_OFFSET = 34;			//< DCT_DEVICE_PRIVATE_KEY_OFFSET
+	static const size_t TCP_KEYS_SIZE = 1600;			//< Device keys on Wi-Fi devices (Photon, P1), DCT_DEVICE_PRIVATE_KEY_SIZE + DCT_DEVICE_PUBLIC_KEY_SIZE
+	static const size_t TCP_PRIVATE_KEY_SIZE = 1216;	//< DCT_DEVICE_PRIVATE_KEY_SIZE
+	static const size_t UDP_KEYS_OFFSET = 3106;			//< DCT_ALT_DEVICE_PRIVATE_KEY_OFFSET
+	static const size_t UDP_KEYS_SIZE = 320;			//< Device keys on cellular devices (Electron, E series), DCT_ALT_DEVICE_PRIVATE_KEY_SIZE + DCT_ALT_DEVICE_PUBLIC_KEY_SIZE
+	static const size_t UDP_PRIVATE_KEY_SIZE = 128;		//< DCT_ALT_DEVICE_PRIVATE_KEY_SIZE
+
+	/**
+	 * @brief Returns the size of the private key slot for device keys of keysSize bytes, or 0 if unknown
+	 */
+	static constexpr size_t privateKeySize(size_t keysSize) {
+		return (keysSize == TCP_KEYS_SIZE) ? TCP_PRIVATE_KEY_SIZE : (keysSize == UDP_KEYS_SIZE) ? UDP_PRIVATE_KEY_SIZE : 0;
+	}
+
+	/**
+	 * @brief Parse the header, table of contents, and layout of a record
+	 *
+	 * @param data The record. It does not need to be aligned.
+	 *
+	 * @param size The number of bytes available at data. This can be more than the record.
+	 *
+	 * @param info Filled in with information about the record
+	 *
+	 * @return RESULT_VALID if the record can be read, but the checksum is not checked. Use validate() for that.
+	 *
+	 * In compact mode, this also rebuilds the public key.
+	 */
+	static Result parse(const void *data, size_t size, DeviceKeyHelperRecordInfo &info);
+
+	/**
+	 * @brief Parse a record and check the CRC (or sum for version 1) of the keys
+	 *
+	 * This is the same validation DeviceKeyHelper does, except the table of contents is not compared
+	 * to the regions being saved.
+	 */
+	static Result validate(const void *data, size_t size, DeviceKeyHelperRecordInfo &info);
+
+	/**
+	 * @brief Read part of the keys from a record in memory, as they would be restored
+	 *
+	 * @param data The record, which must have been parsed by parse() or validate() into info
+	 *
+	 * @param info From parse() or validate()
+	 *
+	 * @param keysOffset The offset in the keys to start at
+	 *
+	 * @param keys Filled in with the keys
+	 *
+	 * @param size The number of bytes to read. Use info.layout.keysSize for all of the keys.
+	 */
+	static bool readKeys(const void *data, const DeviceKeyHelperRecordInfo &info, size_t keysOffset, void *keys, size_t size);
+
+	/**
+	 * @brief Initialize a layout from a version 2 header
+	 *
+	 * @param header The header of the record
+	 *
+	 * @param tocSize The size of the table of contents in bytes
+	 *
+	 * @param trim For trimmed records, the two DeviceKeyHelperTrim after the table of contents. Ignored
+	 * if header does not have FLAG_TRIMMED set.
+	 *
+	 * @param layout Filled in with the layout. In compact mode, call rebuildPublicKey() next.
+	 *
+	 * @return false if the trimmed lengths are not valid or the size is not device keys in compact or
+	 * trimmed mode
+	 */
+	static bool initLayout(const DeviceKeyHelperSavedDataHeader &header, size_t tocSize, const DeviceKeyHelperTrim *trim, DeviceKeyHelperRecordLayout &layout);
+
+	/**
+	 * @brief Rebuild the public key for a compact layout from the beginning of the private key
+	 *
+	 * @param layout The layout from initLayout(), rebuild must be true
+	 *
+	 * @param privateKey The beginning of the private key slot, from readLayoutKeys()
+	 *
+	 * @param size The number of bytes at privateKey. KEY_PARSE_SIZE is enough.
+	 *
+	 * @return false if the private key was not recognized
+	 */
+	static bool rebuildPublicKey(DeviceKeyHelperRecordLayout &layout, const uint8_t *privateKey, size_t size);
+
+	/**
+	 * @brief Read part of the keys as they will be restored, using a function to read the saved bytes
+	 *
+	 * @param layout From initLayout() or parse()
+	 *
+	 * @param keysOffset The offset in the keys to start at
+	 *
+	 * @param data Filled in with the keys
+	 *
+	 * @param size The number of bytes to read
+	 *
+	 * @param readSaved Reads size bytes of the record at offset, relative to the start of the record
+	 *
+	 * The saved bytes of each slot are read using readSaved, the rest of the slot is the padding byte, and
+	 * in compact mode the public key is the rebuilt one.
+	 */
+	static bool readLayoutKeys(const DeviceKeyHelperRecordLayout &layout, size_t keysOffset, uint8_t *data, size_t size, std::function<bool(size_t offset, void *data, size_t size)> readSaved);
+
+	/**
+	 * @brief Initialize a header for the current version with the CRC of the keys
+	 *
+	 * The flags and generation are 0.
+	 */
+	static void initHeader(DeviceKeyHelperSavedDataHeader *header, uint32_t crc, size_t keysSize);
+
+	/**
+	 * @brief Calculate the 16-bit checksum used by version 1 saved data
+	 */
+	static uint16_t calculateChecksumV1(const void *data, size_t size);
+
+	/**
+	 * @brief Calculate the CRC-32 of a block of data
+	 *
+	 * @param data The data to calculate the CRC of
+	 *
+	 * @param size The number of bytes of data
+	 *
+	 * @param crc To calculate the CRC of data in multiple blocks, pass the result from the previous
+	 * block. Leave at the default of 0 for the first block.
+	 *
+	 * This is the same CRC-32 used by zlib and Ethernet. It uses a 1 Kbyte lookup table in flash.
+	 */
+	static uint32_t calculateCrc(const void *data, size_t size, uint32_t crc = 0);
+
+	/**
+	 * @brief Build a DER encoded SubjectPublicKeyInfo from a DER encoded private key
+	 *
+	 * @param privateKey A PKCS#1 RSAPrivateKey or an RFC 5915 ECPrivateKey that includes the public key.
+	 * Only the beginning of the private key is needed.
+	 *
+	 * @param privateSize The number of bytes available in privateKey
+	 *
+	 * @param der Buffer for the public key
+	 *
+	 * @param derSize Size of the der buffer
+	 *
+	 * @return The length of the public key or 0 if the private key was not recognized or der is too small
+	 *
+	 * This produces the same public key as the system firmware stores in the DCT.
+	 */
+	static size_t buildPublicKeyDer(const uint8_t *privateKey, size_t privateSize, uint8_t *der, size_t derSize);
+
+	/**
+	 * @brief Returns the length of the DER encoded SEQUENCE at the beginning of data, or 0 if there isn't one
+	 *
+	 * Both the private and public keys are a SEQUENCE, so this is the used part of a key slot.
+	 */
+	static size_t derSequenceSize(const uint8_t *data, size_t size);
+
+	/**
+	 * @brief Returns a short name for a result, such as "valid" or "bad_checksum"
+	 */
+	static const char *getResultName(Result result);
+};
+
+#endif /* __DEVICEKEYHELPERRECORD_H */
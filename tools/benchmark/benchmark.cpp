@@ -0,0 +1,447 @@
+/**
+ * Host tool that benchmarks DeviceKeyHelper::check()
+ *
+ * Runs check() from the library on a computer, in every CheckMode and for each state the saved keys
+ * can be in (unchanged, changed in the DCT, damaged, or missing), and reports the time, the heap
+ * allocations, and the bytes read and written per check. It's meant for catching regressions before
+ * they reach devices. The times are of the host CPU, so compare them with each other, not with a device;
+ * the allocations and bytes moved are the same as on a device.
+ *
+ * The storage is RAM, through either DeviceKeyHelperEEPROM (random access storage, like all of the
+ * storage classes in the library) or load and save functions. The Device OS functions the library calls
+ * are declared by the stand-ins in ../recoverysim/host and implemented at the end of this file.
+ *
+ * See README.md in this directory for building and usage.
+ *
+ * Location: https://github.com/rickkas7/DeviceKeyHelperRK
+ * License: MIT
+ */
+
+#include "DeviceKeyHelperRK.h"
+
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <chrono>
+#include <new>
+#include <random>
+#include <string>
+#include <vector>
+
+static const size_t DCT_SIZE = 4096;			// Covers all of the key offsets in dct.h
+static const size_t STORAGE_SIZE = 8192;		// Enough for dual slot Wi-Fi keys
+static const size_t EEPROM_OFFSET = 100;		// Where DeviceKeyHelperEEPROM saves, like the examples
+
+static uint8_t dct[DCT_SIZE];
+static uint8_t eeprom[STORAGE_SIZE];
+static uint32_t resets = 0;
+
+// Heap use while counting is true, by the operator new and delete replacements below
+static bool counting = false;
+static uint32_t allocations = 0;
+static uint32_t allocatedBytes = 0;
+
+static const std::chrono::steady_clock::time_point startTime = std::chrono::steady_clock::now();
+
+enum State {
+	STATE_VERIFIED,			// Unchanged, and already verified by the previous check
+	STATE_UNCHANGED,		// Unchanged, the cache was invalidated
+	STATE_CHANGED,			// One byte of the keys in the DCT is different from the saved keys
+	STATE_INVALID_BACKUP,	// The saved keys don't match their CRC
+	STATE_MISSING_BACKUP,	// Nothing saved
+	STATE_COUNT
+};
+
+static const char * const stateNames[STATE_COUNT] = {
+	"verified", "unchanged", "changed", "invalid-backup", "missing-backup"
+};
+
+static const DeviceKeyHelper::CheckMode checkModes[] = {
+	DeviceKeyHelper::CHECKMODE_AUTOMATIC,
+	DeviceKeyHelper::CHECKMODE_AUTOMATIC_NO_RESTART,
+	DeviceKeyHelper::CHECKMODE_CHECK_ONLY,
+	DeviceKeyHelper::CHECKMODE_SAVE_CURRENT
+};
+
+static const char * const checkModeNames[] = {
+	"automatic", "automatic-no-restart", "check-only", "save-current"
+};
+
+struct BenchOptions {
+	uint32_t iterations = 1000;
+	bool dualSlot = false;
+	bool trimmed = false;
+	bool staticBuffer = false;
+};
+
+/**
+ * @brief The results of running one case many times
+ */
+struct CaseResult {
+	bool result = false;				// Return value of check(), the same every time
+	std::vector<uint64_t> nanos;		// Time of each check
+	uint32_t allocations = 0;			// Totals over all of the iterations
+	uint32_t allocatedBytes = 0;
+	uint32_t storageBytesRead = 0;
+	uint32_t storageBytesWritten = 0;
+	uint32_t dctBytesRead = 0;
+	uint32_t dctBytesWritten = 0;
+	uint32_t resets = 0;
+};
+
+// Random bytes with 0xff padding at the end of each key slot, like keys in the DCT
+static void randomKeys(uint8_t *keys) {
+	std::mt19937 rng(1);
+	size_t slots[2] = { DEVICE_KEYS_HELPER_PRIVATE_KEY_SIZE, DEVICE_KEYS_HELPER_SIZE - DEVICE_KEYS_HELPER_PRIVATE_KEY_SIZE };
+	for(size_t slot = 0, start = 0; slot < 2; start += slots[slot++]) {
+		size_t used = slots[slot] / 2 + 8;
+		for(size_t ii = 0; ii < slots[slot]; ii++) {
+			keys[start + ii] = (ii < used) ? (uint8_t) rng() : 0xff;
+		}
+	}
+}
+
+static uint64_t percentile(const std::vector<uint64_t> &sorted, unsigned pct) {
+	if (sorted.empty()) {
+		return 0;
+	}
+	return sorted[std::min(sorted.size() - 1, sorted.size() * pct / 100)];
+}
+
+/**
+ * @brief Sets up the DCT and storage for state before each check
+ *
+ * good is the DCT keys, and saved is the storage after they were saved.
+ */
+static void setState(State state, const uint8_t *good, const uint8_t *saved, uint8_t *storage, size_t recordOffset) {
+	memcpy(&dct[DEVICE_KEYS_HELPER_OFFSET], good, DEVICE_KEYS_HELPER_SIZE);
+
+	if (state == STATE_MISSING_BACKUP) {
+		memset(storage, 0xff, STORAGE_SIZE);
+		return;
+	}
+	memcpy(storage, saved, STORAGE_SIZE);
+
+	if (state == STATE_CHANGED) {
+		dct[DEVICE_KEYS_HELPER_OFFSET + DEVICE_KEYS_HELPER_SIZE / 2] ^= 0x01;
+	}
+	else
+	if (state == STATE_INVALID_BACKUP) {
+		// Damaging the keys instead would not be noticed, as the CRC still matches the DCT, so the header
+		// is all that's read. The saved data is still recognized, so the keys are compared.
+		storage[recordOffset + offsetof(DeviceKeyHelperSavedDataHeader, crc)] ^= 0x01;
+	}
+}
+
+static CaseResult runCase(DeviceKeyHelper &helper, uint8_t *storage, size_t recordOffset, State state, DeviceKeyHelper::CheckMode checkMode, const BenchOptions &options) {
+	uint8_t good[DEVICE_KEYS_HELPER_SIZE];
+	randomKeys(good);
+
+	// The saved data for the keys, in the format the options select
+	static uint8_t saved[STORAGE_SIZE];
+	memset(storage, 0xff, STORAGE_SIZE);
+	memcpy(&dct[DEVICE_KEYS_HELPER_OFFSET], good, DEVICE_KEYS_HELPER_SIZE);
+	helper.invalidateCache();
+	helper.check(DeviceKeyHelper::CHECKMODE_SAVE_CURRENT);
+	memcpy(saved, storage, STORAGE_SIZE);
+
+	CaseResult result;
+	result.nanos.reserve(options.iterations);
+
+	// One check that isn't counted, so anything allocated once, such as the static buffer, is excluded
+	for(uint32_t ii = 0; ii <= options.iterations; ii++) {
+		setState(state, good, saved, storage, recordOffset);
+		if (state != STATE_VERIFIED) {
+			helper.invalidateCache();
+		}
+		helper.resetStats();
+		uint32_t resetsBefore = resets;
+
+		allocations = allocatedBytes = 0;
+		counting = true;
+		std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+		bool checkResult = helper.check(checkMode);
+
+		std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
+		counting = false;
+
+		if (ii == 0) {
+			continue;
+		}
+		result.result = checkResult;
+		result.nanos.push_back((uint64_t) std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count());
+		result.allocations += allocations;
+		result.allocatedBytes += allocatedBytes;
+
+		const DeviceKeyHelperStats &stats = helper.getStats();
+		result.storageBytesRead += stats.storageBytesRead;
+		result.storageBytesWritten += stats.storageBytesWritten;
+		result.dctBytesRead += stats.dctBytesRead;
+		result.dctBytesWritten += stats.dctBytesWritten;
+		result.resets += resets - resetsBefore;
+	}
+
+	std::sort(result.nanos.begin(), result.nanos.end());
+	return result;
+}
+
+static void printCase(const char *storageName, State state, size_t modeIndex, const CaseResult &result, const BenchOptions &options) {
+	double n = options.iterations;
+	printf("{\"storage\":\"%s\",\"state\":\"%s\",\"mode\":\"%s\",\"result\":%s,"
+		"\"nanos\":{\"p50\":%llu,\"p90\":%llu,\"max\":%llu},"
+		"\"allocations\":%.2f,\"allocatedBytes\":%.0f,\"storageRead\":%.0f,\"storageWritten\":%.0f,\"dctRead\":%.0f,\"dctWritten\":%.0f,\"resets\":%.2f}\n",
+		storageName, stateNames[state], checkModeNames[modeIndex], result.result ? "true" : "false",
+		(unsigned long long) percentile(result.nanos, 50), (unsigned long long) percentile(result.nanos, 90), (unsigned long long) result.nanos.back(),
+		result.allocations / n, result.allocatedBytes / n, result.storageBytesRead / n, result.storageBytesWritten / n,
+		result.dctBytesRead / n, result.dctBytesWritten / n, result.resets / n);
+}
+
+static void runStorage(const char *storageName, DeviceKeyHelper &helper, uint8_t *storage, size_t recordOffset, const BenchOptions &options) {
+	if (options.dualSlot) {
+		helper.withDualSlot();
+	}
+	if (options.trimmed) {
+		helper.withTrimmedKeys();
+	}
+	if (options.staticBuffer) {
+		helper.withStaticBuffer();
+	}
+
+	for(size_t state = 0; state < STATE_COUNT; state++) {
+		for(size_t modeIndex = 0; modeIndex < sizeof(checkModes) / sizeof(checkModes[0]); modeIndex++) {
+			CaseResult result = runCase(helper, storage, recordOffset, (State) state, checkModes[modeIndex], options);
+			printCase(storageName, (State) state, modeIndex, result, options);
+		}
+	}
+}
+
+// Times the CRC-32 of the current saved data and the 16-bit sum of version 1 over the keys
+static void runChecksums(const BenchOptions &options) {
+	uint8_t keys[DEVICE_KEYS_HELPER_SIZE];
+	randomKeys(keys);
+
+	for(int version = 2; version >= 1; version--) {
+		std::vector<uint64_t> nanos;
+		volatile uint32_t sink = 0;
+
+		for(uint32_t ii = 0; ii < options.iterations; ii++) {
+			std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+			for(int rep = 0; rep < 100; rep++) {
+				sink = sink + ((version == 2) ? DeviceKeyHelperRecord::calculateCrc(keys, sizeof(keys)) : DeviceKeyHelperRecord::calculateChecksumV1(keys, sizeof(keys)));
+			}
+			std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
+			nanos.push_back((uint64_t) std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count() / 100);
+		}
+		std::sort(nanos.begin(), nanos.end());
+
+		uint64_t p50 = percentile(nanos, 50);
+		printf("{\"checksum\":\"%s\",\"bytes\":%u,\"nanos\":{\"p50\":%llu,\"p90\":%llu},\"mbPerSecond\":%.1f}\n",
+			(version == 2) ? "crc32" : "sum16", (unsigned) sizeof(keys),
+			(unsigned long long) p50, (unsigned long long) percentile(nanos, 90), p50 ? sizeof(keys) * 1000.0 / p50 : 0.0);
+	}
+}
+
+static void usage() {
+	fprintf(stderr,
+		"usage: benchmark [options]\n"
+		"  --iterations N    Checks per case (default: 1000)\n"
+		"  --dual-slot       Use withDualSlot()\n"
+		"  --trimmed         Use withTrimmedKeys()\n"
+		"  --static-buffer   Use withStaticBuffer()\n");
+}
+
+int main(int argc, char *argv[]) {
+	BenchOptions options;
+
+	for(int ii = 1; ii < argc; ii++) {
+		std::string arg = argv[ii];
+		if (arg == "--iterations" && ii + 1 < argc) {
+			options.iterations = (uint32_t) strtoul(argv[++ii], NULL, 0);
+		}
+		else
+		if (arg == "--dual-slot") {
+			options.dualSlot = true;
+		}
+		else
+		if (arg == "--trimmed") {
+			options.trimmed = true;
+		}
+		else
+		if (arg == "--static-buffer") {
+			options.staticBuffer = true;
+		}
+		else {
+			usage();
+			return 2;
+		}
+	}
+	if (options.iterations == 0) {
+		usage();
+		return 2;
+	}
+
+	{
+		DeviceKeyHelperEEPROM helper(EEPROM_OFFSET);
+		runStorage("eeprom", helper, eeprom, EEPROM_OFFSET, options);
+	}
+
+	{
+		// Load and save functions always use the whole DeviceKeyHelperSavedData, in RAM at offset 0
+		static uint8_t functionStorage[STORAGE_SIZE];
+		DeviceKeyHelper helper([](DeviceKeyHelperSavedData *savedData) {
+			memcpy(savedData, functionStorage, sizeof(*savedData));
+			return true;
+		}, [](const DeviceKeyHelperSavedData *savedData) {
+			memcpy(functionStorage, savedData, sizeof(*savedData));
+			return true;
+		});
+		runStorage("functions", helper, functionStorage, 0, options);
+	}
+
+	runChecksums(options);
+
+	printf("{\"summary\":{\"udp\":%s,\"keysSize\":%u,\"savedDataSize\":%u,\"iterations\":%u,\"dualSlot\":%s,\"trimmed\":%s,\"staticBuffer\":%s}}\n",
+		HAL_PLATFORM_CLOUD_UDP ? "true" : "false", (unsigned) DEVICE_KEYS_HELPER_SIZE, (unsigned) sizeof(DeviceKeyHelperSavedData),
+		options.iterations, options.dualSlot ? "true" : "false", options.trimmed ? "true" : "false", options.staticBuffer ? "true" : "false");
+	return 0;
+}
+
+
+//
+// Heap use, counted while a check is running
+//
+
+void *operator new(size_t size) {
+	if (counting) {
+		allocations++;
+		allocatedBytes += size;
+	}
+	void *p = malloc(size ? size : 1);
+	if (!p) {
+		throw std::bad_alloc();
+	}
+	return p;
+}
+
+void *operator new[](size_t size) {
+	return operator new(size);
+}
+
+void operator delete(void *p) noexcept {
+	free(p);
+}
+
+void operator delete[](void *p) noexcept {
+	free(p);
+}
+
+void operator delete(void *p, size_t) noexcept {
+	free(p);
+}
+
+void operator delete[](void *p, size_t) noexcept {
+	free(p);
+}
+
+
+//
+// Device OS stand-ins declared in ../recoverysim/host/Particle.h and dct.h
+//
+
+Logger Log("app");
+SystemClass System;
+CloudClass Particle;
+
+// Logging would be most of the time of a check, so it's discarded
+void Logger::trace(const char *fmt, ...) const {}
+void Logger::info(const char *fmt, ...) const {}
+void Logger::warn(const char *fmt, ...) const {}
+void Logger::error(const char *fmt, ...) const {}
+
+void SystemClass::on(system_event_t events, void (*handler)(system_event_t event, int param)) {
+}
+
+void SystemClass::reset(uint32_t data) {
+	// CHECKMODE_AUTOMATIC returns after this instead of restarting
+	resets++;
+}
+
+int SystemClass::resetReason() {
+	return 0;
+}
+
+uint32_t SystemClass::resetReasonData() {
+	return 0;
+}
+
+bool CloudClass::connect() {
+	return true;
+}
+
+void CloudClass::disconnect() {
+}
+
+bool CloudClass::connected() {
+	return true;
+}
+
+system_tick_t millis() {
+	return (system_tick_t) std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - startTime).count();
+}
+
+uint32_t micros() {
+	return (uint32_t) std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - startTime).count();
+}
+
+void delay(uint32_t ms) {
+}
+
+int system_format_diag_data(const uint16_t *id, size_t count, unsigned flags, appender_fn append, void *append_data, void *reserved) {
+	// Only used by the connection monitor, which isn't benchmarked
+	return -1;
+}
+
+int os_queue_create(os_queue_t *queue, size_t item_size, size_t item_count, void *reserved) {
+	return -1;
+}
+
+int os_queue_put(os_queue_t queue, const void *item, system_tick_t delay, void *reserved) {
+	return -1;
+}
+
+int os_queue_take(os_queue_t queue, void *item, system_tick_t delay, void *reserved) {
+	return -1;
+}
+
+Thread::Thread(const char *name, wiring_thread_fn_t fn, void *param, os_thread_prio_t priority, size_t stackSize) {
+	fprintf(stderr, "withThreadExecution() is not supported by the benchmark\n");
+	abort();
+}
+
+void HAL_EEPROM_Get(uint32_t index, void *data, size_t length) {
+	memcpy(data, &eeprom[index], length);
+}
+
+void HAL_EEPROM_Put(uint32_t index, const void *data, size_t length) {
+	memcpy(&eeprom[index], data, length);
+}
+
+int dct_read_app_data_copy(uint32_t offset, void* ptr, size_t size) {
+	if (offset + size > DCT_SIZE) {
+		return 1;
+	}
+	memcpy(ptr, &dct[offset], size);
+	return 0;
+}
+
+int dct_write_app_data(const void* data, uint32_t offset, uint32_t size) {
+	if (offset + size > DCT_SIZE) {
+		return 1;
+	}
+	memcpy(&dct[offset], data, size);
+	return 0;
+}
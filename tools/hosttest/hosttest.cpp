@@ -0,0 +1,317 @@
+/**
+ * Host tool that tests behavior of DeviceKeyHelper that needs specific keys or storage faults
+ *
+ * Runs the library on a computer against a DCT and storage in RAM, like ../benchmark, and checks the
+ * results of each test instead of timing them. recoverysim covers the connection monitor and benchmark
+ * the cost of each check; the tests here cover cases neither of them reaches, such as keys that compact
+ * mode can't rebuild. The Device OS functions the library calls are declared by the stand-ins in
+ * ../recoverysim/host and implemented at the end of this file.
+ *
+ * See README.md in this directory for building and usage.
+ *
+ * Location: https://github.com/rickkas7/DeviceKeyHelperRK
+ * License: MIT
+ */
+
+#include "DeviceKeyHelperRK.h"
+
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <chrono>
+#include <random>
+#include <string>
+
+static const size_t DCT_SIZE = 4096;			// Covers all of the key offsets in dct.h
+static const size_t STORAGE_SIZE = 8192;		// Enough for dual slot Wi-Fi keys
+static const size_t EEPROM_OFFSET = 100;		// Where DeviceKeyHelperEEPROM saves, like the examples
+
+static uint8_t dct[DCT_SIZE];
+static uint8_t eeprom[STORAGE_SIZE];
+static bool dctReadFails = false;
+static bool verbose = false;
+
+static const std::chrono::steady_clock::time_point startTime = std::chrono::steady_clock::now();
+
+// Failed checks in the current test
+static unsigned failures = 0;
+
+#define TEST_CHECK(x) do { if (!(x)) { fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #x); failures++; } } while(0)
+
+static uint8_t *dctKeys() {
+	return &dct[DEVICE_KEYS_HELPER_OFFSET];
+}
+
+static const DeviceKeyHelperSavedDataHeader *savedHeader(size_t offset) {
+	return (const DeviceKeyHelperSavedDataHeader *)&eeprom[EEPROM_OFFSET + offset];
+}
+
+/**
+ * @brief Fills the DCT keys with the start of an RSA-2048 private key and random bytes
+ *
+ * The 257-byte modulus doesn't fit in DeviceKeyHelperRecord::KEY_PARSE_SIZE, so the public key can't be
+ * rebuilt from it. The system firmware creates 1024-bit keys on Wi-Fi devices and ECC keys on cellular
+ * devices, but keys can be replaced by other tools.
+ */
+static void largeRsaKeys(uint32_t seed) {
+	static const uint8_t start[] = {
+		0x30, 0x82, 0x04, 0xa3,		// SEQUENCE, 1187 bytes
+		0x02, 0x01, 0x00,			// INTEGER version 0
+		0x02, 0x82, 0x01, 0x01, 0x00	// INTEGER modulus, 257 bytes with the leading 0
+	};
+	std::mt19937 rng(seed);
+	for(size_t ii = 0; ii < DEVICE_KEYS_HELPER_SIZE; ii++) {
+		dctKeys()[ii] = (uint8_t) rng();
+	}
+	memcpy(dctKeys(), start, sizeof(start));
+}
+
+/**
+ * @brief Compact mode with keys whose public key can't be rebuilt saves the whole keys instead
+ */
+static void testCompactFallback(bool dualSlot) {
+	memset(eeprom, 0xff, sizeof(eeprom));
+	largeRsaKeys(1);
+
+	uint8_t good[DEVICE_KEYS_HELPER_SIZE];
+	memcpy(good, dctKeys(), sizeof(good));
+
+	DeviceKeyHelperEEPROM helper(EEPROM_OFFSET);
+	helper.withCompactKeys().withDualSlot(dualSlot);
+
+	TEST_CHECK(helper.check(DeviceKeyHelper::CHECKMODE_SAVE_CURRENT));
+	TEST_CHECK(helper.getStats().saves == 1);
+	TEST_CHECK(helper.getStats().saveFailures == 0);
+	TEST_CHECK(savedHeader(0)->magic == DeviceKeyHelperRecord::MAGIC_V2);
+	TEST_CHECK((savedHeader(0)->flags & DeviceKeyHelperRecord::FLAG_COMPACT) == 0);
+
+	size_t slotSize = sizeof(DeviceKeyHelperSavedData);
+	if (dualSlot) {
+		// The second save goes to the second slot, at the offset for the whole keys
+		dctKeys()[DEVICE_KEYS_HELPER_SIZE - 1] ^= 0x01;
+		memcpy(good, dctKeys(), sizeof(good));
+		TEST_CHECK(helper.check(DeviceKeyHelper::CHECKMODE_SAVE_CURRENT));
+		TEST_CHECK(savedHeader(slotSize)->magic == DeviceKeyHelperRecord::MAGIC_V2);
+		TEST_CHECK(savedHeader(slotSize)->generation == 2);
+	}
+
+	// Damage the keys in the DCT and check with a new object, as after a reset. The newest saved keys
+	// are found and restored.
+	dctKeys()[10] ^= 0x01;
+	dctKeys()[DEVICE_KEYS_HELPER_PRIVATE_KEY_SIZE + 10] ^= 0x01;
+
+	DeviceKeyHelperEEPROM restarted(EEPROM_OFFSET);
+	restarted.withCompactKeys().withDualSlot(dualSlot);
+	TEST_CHECK(!restarted.check(DeviceKeyHelper::CHECKMODE_AUTOMATIC_NO_RESTART));
+	TEST_CHECK(memcmp(dctKeys(), good, sizeof(good)) == 0);
+
+	// Once restored, the keys are unchanged and nothing more is saved
+	restarted.invalidateCache();
+	TEST_CHECK(restarted.check(DeviceKeyHelper::CHECKMODE_SAVE_CURRENT));
+	TEST_CHECK(restarted.getStats().saves == 0);
+	TEST_CHECK(restarted.getStats().saveFailures == 0);
+}
+
+/**
+ * @brief scrub() doesn't count a chunk as compared when the DCT can't be read
+ */
+static void testScrubDctError(bool) {
+	memset(eeprom, 0xff, sizeof(eeprom));
+	largeRsaKeys(2);
+
+	DeviceKeyHelperEEPROM helper(EEPROM_OFFSET);
+	helper.withScrubBudget(0);
+	TEST_CHECK(helper.check(DeviceKeyHelper::CHECKMODE_SAVE_CURRENT));
+
+	// With a budget of 0, each call does one step: the header, the layout, then one chunk
+	dctReadFails = true;
+	for(int ii = 0; ii < 100; ii++) {
+		TEST_CHECK(!helper.scrub());
+	}
+	dctReadFails = false;
+	TEST_CHECK(helper.getScrubStats().passes == 0);
+	TEST_CHECK(helper.getScrubStats().dctErrors >= 90);
+
+	// The pass continues from the chunk that failed and completes without a problem
+	int calls = 0;
+	while(!helper.scrub() && ++calls < 1000) {
+	}
+	TEST_CHECK(helper.getScrubStats().passes == 1);
+	TEST_CHECK(!helper.getScrubStats().lastDamaged);
+	TEST_CHECK(!helper.getScrubStats().lastMismatch);
+}
+
+static void usage() {
+	fprintf(stderr,
+		"usage: hosttest [options]\n"
+		"  --verbose         Log the library to stderr\n");
+}
+
+int main(int argc, char *argv[]) {
+	for(int ii = 1; ii < argc; ii++) {
+		std::string arg = argv[ii];
+		if (arg == "--verbose") {
+			verbose = true;
+		}
+		else {
+			usage();
+			return 2;
+		}
+	}
+
+	struct {
+		const char *name;
+		void (*fn)(bool);
+		bool param;
+	} tests[] = {
+		{ "compact-fallback", testCompactFallback, false },
+		{ "compact-fallback-dual-slot", testCompactFallback, true },
+		{ "scrub-dct-error", testScrubDctError, false },
+	};
+
+	unsigned failed = 0;
+	for(const auto &test : tests) {
+		failures = 0;
+		test.fn(test.param);
+		printf("{\"test\":\"%s\",\"passed\":%s}\n", test.name, failures ? "false" : "true");
+		if (failures) {
+			failed++;
+		}
+	}
+
+	printf("{\"summary\":{\"udp\":%s,\"tests\":%u,\"failed\":%u}}\n",
+		HAL_PLATFORM_CLOUD_UDP ? "true" : "false", (unsigned) (sizeof(tests) / sizeof(tests[0])), failed);
+	return failed ? 1 : 0;
+}
+
+
+//
+// Device OS stand-ins declared in ../recoverysim/host/Particle.h and dct.h
+//
+
+Logger Log("app");
+SystemClass System;
+CloudClass Particle;
+
+static void logMessage(const char *level, const char *fmt, va_list ap) {
+	if (verbose) {
+		fprintf(stderr, "[%s] ", level);
+		vfprintf(stderr, fmt, ap);
+		fprintf(stderr, "\n");
+	}
+}
+
+void Logger::trace(const char *fmt, ...) const {
+	va_list ap;
+	va_start(ap, fmt);
+	logMessage("trace", fmt, ap);
+	va_end(ap);
+}
+
+void Logger::info(const char *fmt, ...) const {
+	va_list ap;
+	va_start(ap, fmt);
+	logMessage("info", fmt, ap);
+	va_end(ap);
+}
+
+void Logger::warn(const char *fmt, ...) const {
+	va_list ap;
+	va_start(ap, fmt);
+	logMessage("warn", fmt, ap);
+	va_end(ap);
+}
+
+void Logger::error(const char *fmt, ...) const {
+	va_list ap;
+	va_start(ap, fmt);
+	logMessage("error", fmt, ap);
+	va_end(ap);
+}
+
+void SystemClass::on(system_event_t events, void (*handler)(system_event_t event, int param)) {
+}
+
+void SystemClass::reset(uint32_t data) {
+	// The tests use CHECKMODE_AUTOMATIC_NO_RESTART, so this is a failure
+	fprintf(stderr, "unexpected System.reset()\n");
+	failures++;
+}
+
+int SystemClass::resetReason() {
+	return 0;
+}
+
+uint32_t SystemClass::resetReasonData() {
+	return 0;
+}
+
+bool CloudClass::connect() {
+	return true;
+}
+
+void CloudClass::disconnect() {
+}
+
+bool CloudClass::connected() {
+	return true;
+}
+
+system_tick_t millis() {
+	return (system_tick_t) std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - startTime).count();
+}
+
+uint32_t micros() {
+	return (uint32_t) std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - startTime).count();
+}
+
+void delay(uint32_t ms) {
+}
+
+int system_format_diag_data(const uint16_t *id, size_t count, unsigned flags, appender_fn append, void *append_data, void *reserved) {
+	// Only used by the connection monitor, which isn't tested here
+	return -1;
+}
+
+int os_queue_create(os_queue_t *queue, size_t item_size, size_t item_count, void *reserved) {
+	return -1;
+}
+
+int os_queue_put(os_queue_t queue, const void *item, system_tick_t delay, void *reserved) {
+	return -1;
+}
+
+int os_queue_take(os_queue_t queue, void *item, system_tick_t delay, void *reserved) {
+	return -1;
+}
+
+Thread::Thread(const char *name, wiring_thread_fn_t fn, void *param, os_thread_prio_t priority, size_t stackSize) {
+	fprintf(stderr, "withThreadExecution() is not supported by hosttest\n");
+	abort();
+}
+
+void HAL_EEPROM_Get(uint32_t index, void *data, size_t length) {
+	memcpy(data, &eeprom[index], length);
+}
+
+void HAL_EEPROM_Put(uint32_t index, const void *data, size_t length) {
+	memcpy(&eeprom[index], data, length);
+}
+
+int dct_read_app_data_copy(uint32_t offset, void* ptr, size_t size) {
+	if (offset + size > DCT_SIZE || dctReadFails) {
+		return 1;
+	}
+	memcpy(ptr, &dct[offset], size);
+	return 0;
+}
+
+int dct_write_app_data(const void* data, uint32_t offset, uint32_t size) {
+	if (offset + size > DCT_SIZE) {
+		return 1;
+	}
+	memcpy(&dct[offset], data, size);
+	return 0;
+}
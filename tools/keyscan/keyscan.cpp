@@ -0,0 +1,633 @@
+/**
+ * Host tool for finding, validating, and extracting DeviceKeyHelperRK saved data
+ *
+ * Scans files and raw storage images (EEPROM, FRAM, and SD card dumps, key backup files) for saved
+ * data records using a pool of worker threads, validates them with the same code the library uses
+ * on the device, and writes a JSON report. It can also extract the keys, write normalized records
+ * for writing back to a device, and generate synthetic images for testing and benchmarking.
+ *
+ * See README.md in this directory for building and usage.
+ *
+ * Location: https://github.com/rickkas7/DeviceKeyHelperRK
+ * License: MIT
+ */
+
+#include "DeviceKeyHelperRecord.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <filesystem>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace fs = std::filesystem;
+
+/**
+ * @brief Options for the scan command
+ */
+struct ScanOptions {
+	size_t threads = 0;				//< Number of worker threads, 0 for one per CPU
+	bool all = false;				//< Also report candidates with a bad header, which are usually random data
+	std::string extractDir;			//< If not empty, write the keys of each valid record here
+	std::string recordsDir;			//< If not empty, write a normalized record for each valid record here
+	size_t benchIterations = 0;		//< If not 0, scan this many times and only report throughput
+	bool quiet = false;				//< Only output the summary
+};
+
+/**
+ * @brief Totals for a scan, updated by all of the worker threads
+ */
+struct ScanTotals {
+	std::atomic<uint64_t> files{0};
+	std::atomic<uint64_t> bytes{0};
+	std::atomic<uint64_t> valid{0};
+	std::atomic<uint64_t> invalid{0};
+	std::atomic<uint64_t> errors{0};
+};
+
+/**
+ * @brief Scans a list of files using a pool of worker threads
+ */
+class Scanner {
+public:
+	Scanner(const ScanOptions &options, const std::vector<std::string> &files) : options(options), files(files) {}
+
+	/**
+	 * @brief Scan all of the files, returns when done
+	 */
+	void run(size_t threads);
+
+	ScanTotals totals;
+
+protected:
+	void worker();
+
+	void scanFile(const std::string &path);
+
+	void scanData(const std::string &path, const uint8_t *data, size_t size, std::string &report);
+
+	void writeOutputs(const std::string &path, size_t offset, const uint8_t *data, const DeviceKeyHelperRecordInfo &info, std::string &line);
+
+	void output(const std::string &text);
+
+	const ScanOptions &options;
+	const std::vector<std::string> &files;
+	std::atomic<size_t> nextFile{0};
+	std::mutex outputMutex;
+};
+
+static std::string jsonString(const std::string &s) {
+	std::string result = "\"";
+	for(unsigned char c : s) {
+		if (c == '"' || c == '\\') {
+			result += '\\';
+			result += (char)c;
+		}
+		else
+		if (c < 0x20) {
+			char buf[8];
+			snprintf(buf, sizeof(buf), "\\u%04x", c);
+			result += buf;
+		}
+		else {
+			result += (char)c;
+		}
+	}
+	result += '"';
+	return result;
+}
+
+// Output file name for a record: the path with separators replaced, and the offset in the file
+static std::string outputName(const std::string &path, size_t offset) {
+	std::string name = path;
+	std::replace(name.begin(), name.end(), '/', '_');
+	return name + "@" + std::to_string(offset);
+}
+
+static bool writeFile(const std::string &path, const void *data, size_t size) {
+	FILE *fp = fopen(path.c_str(), "wb");
+	if (!fp) {
+		return false;
+	}
+	bool result = fwrite(data, 1, size, fp) == size;
+	return (fclose(fp) == 0) && result;
+}
+
+// Default DCT region for device keys of keysSize bytes, used for version 1 records which have no table of contents
+static bool defaultRegion(size_t keysSize, DeviceKeyHelperRegion &region) {
+	if (keysSize == DeviceKeyHelperRecord::TCP_KEYS_SIZE) {
+		region = { (uint16_t) DeviceKeyHelperRecord::TCP_KEYS_OFFSET, (uint16_t) keysSize };
+		return true;
+	}
+	if (keysSize == DeviceKeyHelperRecord::UDP_KEYS_SIZE) {
+		region = { (uint16_t) DeviceKeyHelperRecord::UDP_KEYS_OFFSET, (uint16_t) keysSize };
+		return true;
+	}
+	return false;
+}
+
+void Scanner::run(size_t threads) {
+	nextFile = 0;
+
+	std::vector<std::thread> pool;
+	for(size_t ii = 0; ii < threads; ii++) {
+		pool.emplace_back(&Scanner::worker, this);
+	}
+	for(std::thread &thread : pool) {
+		thread.join();
+	}
+}
+
+void Scanner::worker() {
+	while(true) {
+		size_t index = nextFile++;
+		if (index >= files.size()) {
+			break;
+		}
+		scanFile(files[index]);
+	}
+}
+
+void Scanner::scanFile(const std::string &path) {
+	std::string report;
+
+	int fd = open(path.c_str(), O_RDONLY);
+	struct stat sb;
+	if (fd < 0 || fstat(fd, &sb) != 0) {
+		report = "{\"file\":" + jsonString(path) + ",\"error\":" + jsonString(strerror(errno)) + "}\n";
+		totals.errors++;
+	}
+	else
+	if (sb.st_size > 0) {
+		// Images are mapped, not read, so large dumps are only paged in as they're scanned
+		size_t size = (size_t) sb.st_size;
+		void *data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (data == MAP_FAILED) {
+			report = "{\"file\":" + jsonString(path) + ",\"error\":" + jsonString(strerror(errno)) + "}\n";
+			totals.errors++;
+		}
+		else {
+			madvise(data, size, MADV_SEQUENTIAL);
+			scanData(path, (const uint8_t *)data, size, report);
+			munmap(data, size);
+			totals.bytes += size;
+		}
+	}
+	if (fd >= 0) {
+		close(fd);
+	}
+	totals.files++;
+
+	if (!report.empty() && !options.quiet) {
+		output(report);
+	}
+}
+
+void Scanner::scanData(const std::string &path, const uint8_t *data, size_t size, std::string &report) {
+	// Both magic numbers are 0x75a65c6x, little endian, so look for the last three bytes
+	static const uint8_t magicTail[3] = { 0x5c, 0xa6, 0x75 };
+
+	size_t pos = 1;
+	while(pos + sizeof(magicTail) <= size) {
+		const uint8_t *hit = (const uint8_t *) memmem(&data[pos], size - pos, magicTail, sizeof(magicTail));
+		if (!hit) {
+			break;
+		}
+		size_t offset = (hit - data) - 1;
+		pos = offset + 2;
+
+		if (data[offset] != 0x63 && data[offset] != 0x64) {
+			continue;
+		}
+
+		DeviceKeyHelperRecordInfo info;
+		DeviceKeyHelperRecord::Result result = DeviceKeyHelperRecord::validate(&data[offset], size - offset, info);
+		if (result == DeviceKeyHelperRecord::RESULT_BAD_HEADER && !options.all) {
+			// The magic bytes can occur in random data, including keys
+			continue;
+		}
+
+		char buf[256];
+		snprintf(buf, sizeof(buf), ",\"offset\":%zu,\"result\":\"%s\"", offset, DeviceKeyHelperRecord::getResultName(result));
+		std::string line = "{\"file\":" + jsonString(path) + buf;
+
+		if (result == DeviceKeyHelperRecord::RESULT_VALID || result == DeviceKeyHelperRecord::RESULT_BAD_CHECKSUM) {
+			snprintf(buf, sizeof(buf), ",\"version\":%u,\"flags\":%u,\"generation\":%lu,\"keysSize\":%zu,\"recordSize\":%zu,\"check\":\"0x%08lx\",\"regions\":[",
+				info.version, info.flags, (unsigned long) info.generation, info.layout.keysSize, info.recordSize, (unsigned long) info.check);
+			line += buf;
+			for(size_t ii = 0; ii < info.regionCount; ii++) {
+				snprintf(buf, sizeof(buf), "%s{\"offset\":%u,\"size\":%u}", (ii > 0) ? "," : "", info.regions[ii].offset, info.regions[ii].size);
+				line += buf;
+			}
+			line += "]";
+		}
+
+		if (result == DeviceKeyHelperRecord::RESULT_VALID) {
+			totals.valid++;
+			writeOutputs(path, offset, &data[offset], info, line);
+
+			// Dual slot saved data has two records one after the other
+			pos = offset + info.recordSize;
+		}
+		else {
+			totals.invalid++;
+		}
+
+		line += "}\n";
+		report += line;
+	}
+}
+
+void Scanner::writeOutputs(const std::string &path, size_t offset, const uint8_t *data, const DeviceKeyHelperRecordInfo &info, std::string &line) {
+	if (options.extractDir.empty() && options.recordsDir.empty()) {
+		return;
+	}
+
+	std::vector<uint8_t> keys(info.layout.keysSize);
+	DeviceKeyHelperRecord::readKeys(data, info, 0, keys.data(), keys.size());
+	std::string name = outputName(path, offset);
+
+	if (!options.extractDir.empty()) {
+		// All of the regions, as they would be restored to the DCT
+		std::string keysPath = options.extractDir + "/" + name + ".keys";
+		bool ok = writeFile(keysPath, keys.data(), keys.size());
+
+		// The device private key in DER format, which is what particle keys expects
+		if (ok && DeviceKeyHelperRecord::privateKeySize(keys.size()) != 0 && info.regionCount <= 1) {
+			size_t derLen = DeviceKeyHelperRecord::derSequenceSize(keys.data(), DeviceKeyHelperRecord::privateKeySize(keys.size()));
+			if (derLen > 0 && derLen <= DeviceKeyHelperRecord::privateKeySize(keys.size())) {
+				ok = writeFile(options.extractDir + "/" + name + ".der", keys.data(), derLen);
+			}
+		}
+		line += ",\"extracted\":" + (ok ? jsonString(keysPath) : std::string("false"));
+	}
+
+	if (!options.recordsDir.empty()) {
+		// Normalized record: current version, all of the keys, no flags, same generation
+		DeviceKeyHelperRegion toc[DEVICE_KEYS_HELPER_MAX_REGIONS];
+		size_t regionCount = info.regionCount;
+		memcpy(toc, info.regions, regionCount * sizeof(DeviceKeyHelperRegion));
+		if (regionCount == 0 && defaultRegion(keys.size(), toc[0])) {
+			regionCount = 1;
+		}
+
+		bool ok = false;
+		std::string recordPath = options.recordsDir + "/" + name + ".rec";
+		if (regionCount > 0) {
+			DeviceKeyHelperSavedDataHeader header;
+			DeviceKeyHelperRecord::initHeader(&header, DeviceKeyHelperRecord::calculateCrc(keys.data(), keys.size()), keys.size());
+			header.generation = info.generation;
+
+			std::vector<uint8_t> record(sizeof(header) + regionCount * sizeof(DeviceKeyHelperRegion));
+			memcpy(record.data(), &header, sizeof(header));
+			memcpy(&record[sizeof(header)], toc, regionCount * sizeof(DeviceKeyHelperRegion));
+			record.insert(record.end(), keys.begin(), keys.end());
+			ok = writeFile(recordPath, record.data(), record.size());
+		}
+		line += ",\"record\":" + (ok ? jsonString(recordPath) : std::string("false"));
+	}
+}
+
+void Scanner::output(const std::string &text) {
+	// One file's lines at a time so the output from different threads is not interleaved
+	std::lock_guard<std::mutex> lock(outputMutex);
+	fwrite(text.data(), 1, text.size(), stdout);
+}
+
+static bool collectFiles(const std::vector<std::string> &paths, std::vector<std::string> &files) {
+	for(const std::string &path : paths) {
+		std::error_code ec;
+		if (fs::is_directory(path, ec)) {
+			for(fs::recursive_directory_iterator it(path, ec), end; !ec && it != end; it.increment(ec)) {
+				if (it->is_regular_file(ec)) {
+					files.push_back(it->path().string());
+				}
+			}
+		}
+		else {
+			files.push_back(path);
+		}
+		if (ec) {
+			fprintf(stderr, "%s: %s\n", path.c_str(), ec.message().c_str());
+			return false;
+		}
+	}
+	// Biggest first, so one large image at the end doesn't leave the other threads idle
+	std::vector<std::pair<uintmax_t, std::string>> sized;
+	for(const std::string &file : files) {
+		std::error_code ec;
+		uintmax_t size = fs::file_size(file, ec);
+		sized.emplace_back(ec ? 0 : size, file);
+	}
+	std::stable_sort(sized.begin(), sized.end(), [](const std::pair<uintmax_t, std::string> &a, const std::pair<uintmax_t, std::string> &b) {
+		return a.first > b.first;
+	});
+	for(size_t ii = 0; ii < files.size(); ii++) {
+		files[ii] = sized[ii].second;
+	}
+	return true;
+}
+
+static int scanCommand(const ScanOptions &options, const std::vector<std::string> &paths) {
+	std::vector<std::string> files;
+	if (!collectFiles(paths, files)) {
+		return 2;
+	}
+
+	size_t threads = options.threads;
+	if (threads == 0) {
+		threads = std::max(1u, std::thread::hardware_concurrency());
+	}
+
+	for(const std::string &dir : { options.extractDir, options.recordsDir }) {
+		std::error_code ec;
+		if (!dir.empty() && !fs::create_directories(dir, ec) && ec) {
+			fprintf(stderr, "%s: %s\n", dir.c_str(), ec.message().c_str());
+			return 2;
+		}
+	}
+
+	if (options.benchIterations > 0) {
+		// The first pass also loads the files into the page cache, so the best pass is the scan throughput
+		ScanOptions benchOptions = options;
+		benchOptions.quiet = true;
+		benchOptions.extractDir.clear();
+		benchOptions.recordsDir.clear();
+
+		double best = 0, total = 0;
+		uint64_t bytes = 0, records = 0;
+		for(size_t ii = 0; ii < options.benchIterations; ii++) {
+			Scanner scanner(benchOptions, files);
+			auto start = std::chrono::steady_clock::now();
+			scanner.run(threads);
+			double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+			if (ii == 0 || seconds < best) {
+				best = seconds;
+			}
+			total += seconds;
+			bytes = scanner.totals.bytes;
+			records = scanner.totals.valid + scanner.totals.invalid;
+			fprintf(stderr, "pass %zu: %.3f sec, %.1f MB/sec\n", ii + 1, seconds, (seconds > 0) ? bytes / seconds / 1e6 : 0);
+		}
+		printf("{\"bench\":{\"files\":%zu,\"bytes\":%llu,\"records\":%llu,\"threads\":%zu,\"iterations\":%zu,\"bestSeconds\":%.6f,\"meanSeconds\":%.6f,\"mbPerSecond\":%.1f,\"filesPerSecond\":%.1f,\"recordsPerSecond\":%.1f}}\n",
+			files.size(), (unsigned long long) bytes, (unsigned long long) records, threads, options.benchIterations, best, total / options.benchIterations,
+			(best > 0) ? bytes / best / 1e6 : 0, (best > 0) ? files.size() / best : 0, (best > 0) ? records / best : 0);
+		return 0;
+	}
+
+	Scanner scanner(options, files);
+	auto start = std::chrono::steady_clock::now();
+	scanner.run(threads);
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+	const ScanTotals &totals = scanner.totals;
+	printf("{\"summary\":{\"files\":%llu,\"bytes\":%llu,\"valid\":%llu,\"invalid\":%llu,\"errors\":%llu,\"threads\":%zu,\"seconds\":%.6f,\"mbPerSecond\":%.1f}}\n",
+		(unsigned long long) totals.files, (unsigned long long) totals.bytes, (unsigned long long) totals.valid,
+		(unsigned long long) totals.invalid, (unsigned long long) totals.errors, threads, seconds,
+		(seconds > 0) ? totals.bytes / seconds / 1e6 : 0);
+
+	return (totals.invalid > 0 || totals.errors > 0) ? 1 : 0;
+}
+
+/**
+ * @brief Options for the generate command
+ */
+struct GenerateOptions {
+	size_t count = 1000;			//< Number of images
+	size_t imageSize = 4096;		//< Size of each image, filled with 0xff
+	bool udp = false;				//< Cellular device key sizes instead of Wi-Fi
+	bool trimmed = false;			//< Trimmed records, see DeviceKeyHelper::withTrimmedKeys()
+	bool dualSlot = false;			//< Two records, see DeviceKeyHelper::withDualSlot()
+	unsigned corruptPercent = 0;	//< Percentage of images with a corrupted record
+	unsigned seed = 1;
+};
+
+// Random DER-like key: a SEQUENCE header, random contents, and 0xff padding like the DCT
+static void randomKey(std::mt19937 &rng, uint8_t *slot, size_t slotSize, size_t keyLen) {
+	memset(slot, 0xff, slotSize);
+	slot[0] = 0x30;
+	slot[1] = 0x82;
+	slot[2] = (uint8_t)((keyLen - 4) >> 8);
+	slot[3] = (uint8_t)(keyLen - 4);
+	for(size_t ii = 4; ii < keyLen; ii++) {
+		slot[ii] = (uint8_t) rng();
+	}
+}
+
+// Builds a record for keys the same way DeviceKeyHelper saves them
+static std::vector<uint8_t> buildRecord(const std::vector<uint8_t> &keys, const DeviceKeyHelperRegion &region, uint32_t generation, bool trimmed) {
+	DeviceKeyHelperSavedDataHeader header;
+	DeviceKeyHelperRecord::initHeader(&header, DeviceKeyHelperRecord::calculateCrc(keys.data(), keys.size()), keys.size());
+	header.generation = generation;
+
+	std::vector<uint8_t> record(sizeof(header) + sizeof(region));
+	size_t privateKeySize = DeviceKeyHelperRecord::privateKeySize(keys.size());
+	if (trimmed) {
+		DeviceKeyHelperTrim trim[2];
+		size_t slotStart[2] = { 0, privateKeySize };
+		size_t slotSize[2] = { privateKeySize, keys.size() - privateKeySize };
+		for(size_t slot = 0; slot < 2; slot++) {
+			size_t used = slotSize[slot];
+			while(used > 0 && keys[slotStart[slot] + used - 1] == 0xff) {
+				used--;
+			}
+			trim[slot] = { (uint16_t) used, 0xff, 0 };
+		}
+		header.flags = DeviceKeyHelperRecord::FLAG_TRIMMED;
+		record.resize(record.size() + sizeof(trim));
+		memcpy(&record[record.size() - sizeof(trim)], trim, sizeof(trim));
+		record.insert(record.end(), keys.begin(), keys.begin() + trim[0].length);
+		record.insert(record.end(), keys.begin() + privateKeySize, keys.begin() + privateKeySize + trim[1].length);
+	}
+	else {
+		record.insert(record.end(), keys.begin(), keys.end());
+	}
+	memcpy(record.data(), &header, sizeof(header));
+	memcpy(&record[sizeof(header)], &region, sizeof(region));
+	return record;
+}
+
+static int generateCommand(const GenerateOptions &options, const std::string &dir) {
+	std::error_code ec;
+	if (!fs::create_directories(dir, ec) && ec) {
+		fprintf(stderr, "%s: %s\n", dir.c_str(), ec.message().c_str());
+		return 2;
+	}
+
+	size_t keysSize = options.udp ? DeviceKeyHelperRecord::UDP_KEYS_SIZE : DeviceKeyHelperRecord::TCP_KEYS_SIZE;
+	size_t privateKeySize = DeviceKeyHelperRecord::privateKeySize(keysSize);
+	DeviceKeyHelperRegion region;
+	defaultRegion(keysSize, region);
+
+	// Typical key lengths: RSA-1024 on Wi-Fi devices, EC P-256 on cellular devices
+	size_t privateLen = options.udp ? 121 : 608;
+	size_t publicLen = options.udp ? 91 : 162;
+
+	std::mt19937 rng(options.seed);
+	for(size_t ii = 0; ii < options.count; ii++) {
+		std::vector<uint8_t> keys(keysSize);
+		randomKey(rng, keys.data(), privateKeySize, privateLen);
+		randomKey(rng, &keys[privateKeySize], keysSize - privateKeySize, publicLen);
+
+		std::vector<uint8_t> image(options.imageSize, 0xff);
+		size_t offset = 0;
+		for(size_t slot = 0; slot < (options.dualSlot ? 2 : 1); slot++) {
+			std::vector<uint8_t> record = buildRecord(keys, region, (uint32_t)(slot + 1), options.trimmed);
+			if (offset + record.size() > image.size()) {
+				fprintf(stderr, "image size %zu is too small for the records\n", options.imageSize);
+				return 2;
+			}
+			memcpy(&image[offset], record.data(), record.size());
+
+			// The slots are always the size of the untrimmed record
+			offset += sizeof(DeviceKeyHelperSavedDataHeader) + sizeof(region) + keysSize;
+		}
+
+		if ((rng() % 100) < options.corruptPercent) {
+			// Flip a bit in the saved keys of the first record
+			image[sizeof(DeviceKeyHelperSavedDataHeader) + sizeof(region) + 64] ^= 0x01;
+		}
+
+		char name[32];
+		snprintf(name, sizeof(name), "/image%06zu.bin", ii);
+		if (!writeFile(dir + name, image.data(), image.size())) {
+			fprintf(stderr, "%s%s: %s\n", dir.c_str(), name, strerror(errno));
+			return 2;
+		}
+	}
+	return 0;
+}
+
+static void usage() {
+	fprintf(stderr,
+		"usage: keyscan scan [options] PATH...\n"
+		"  Scan files and directories (recursively) for saved data and output a JSON line for each record\n"
+		"  -j N             worker threads (default: one per CPU)\n"
+		"  --extract DIR    write the keys (.keys) and device private key (.der) of each valid record\n"
+		"  --records DIR    write a normalized record (.rec) for each valid record\n"
+		"  --all            also report candidates with a bad header, which are usually random data\n"
+		"  --bench N        scan N times and only output throughput\n"
+		"\n"
+		"usage: keyscan generate [options] DIR\n"
+		"  Write synthetic storage images containing saved data with random keys\n"
+		"  --count N        number of images (default: 1000)\n"
+		"  --size BYTES     size of each image (default: 4096)\n"
+		"  --udp            cellular device keys (default: Wi-Fi)\n"
+		"  --trimmed        trimmed records\n"
+		"  --dual           two records per image, like dual slot mode\n"
+		"  --corrupt PCT    percentage of images with a corrupted record (default: 0)\n"
+		"  --seed N         random number seed (default: 1)\n");
+}
+
+int main(int argc, char *argv[]) {
+	if (argc < 2) {
+		usage();
+		return 2;
+	}
+	std::string command = argv[1];
+	std::vector<std::string> args;
+
+	if (command == "scan") {
+		ScanOptions options;
+		for(int ii = 2; ii < argc; ii++) {
+			std::string arg = argv[ii];
+			bool hasValue = (ii + 1 < argc);
+			if (arg == "-j" && hasValue) {
+				options.threads = strtoul(argv[++ii], NULL, 0);
+			}
+			else
+			if (arg == "--extract" && hasValue) {
+				options.extractDir = argv[++ii];
+			}
+			else
+			if (arg == "--records" && hasValue) {
+				options.recordsDir = argv[++ii];
+			}
+			else
+			if (arg == "--all") {
+				options.all = true;
+			}
+			else
+			if (arg == "--bench" && hasValue) {
+				options.benchIterations = strtoul(argv[++ii], NULL, 0);
+			}
+			else
+			if (arg[0] == '-') {
+				usage();
+				return 2;
+			}
+			else {
+				args.push_back(arg);
+			}
+		}
+		if (args.empty()) {
+			usage();
+			return 2;
+		}
+		return scanCommand(options, args);
+	}
+
+	if (command == "generate") {
+		GenerateOptions options;
+		for(int ii = 2; ii < argc; ii++) {
+			std::string arg = argv[ii];
+			bool hasValue = (ii + 1 < argc);
+			if (arg == "--count" && hasValue) {
+				options.count = strtoul(argv[++ii], NULL, 0);
+			}
+			else
+			if (arg == "--size" && hasValue) {
+				options.imageSize = strtoul(argv[++ii], NULL, 0);
+			}
+			else
+			if (arg == "--udp") {
+				options.udp = true;
+			}
+			else
+			if (arg == "--trimmed") {
+				options.trimmed = true;
+			}
+			else
+			if (arg == "--dual") {
+				options.dualSlot = true;
+			}
+			else
+			if (arg == "--corrupt" && hasValue) {
+				options.corruptPercent = (unsigned) strtoul(argv[++ii], NULL, 0);
+			}
+			else
+			if (arg == "--seed" && hasValue) {
+				options.seed = (unsigned) strtoul(argv[++ii], NULL, 0);
+			}
+			else
+			if (arg[0] == '-') {
+				usage();
+				return 2;
+			}
+			else {
+				args.push_back(arg);
+			}
+		}
+		if (args.size() != 1) {
+			usage();
+			return 2;
+		}
+		return generateCommand(options, args[0]);
+	}
+
+	usage();
+	return 2;
+}
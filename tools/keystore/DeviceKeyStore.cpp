@@ -0,0 +1,686 @@
+/**
+ * Fleet key backup store for DeviceKeyHelperRK saved data
+ *
+ * Location: https://github.com/rickkas7/DeviceKeyHelperRK
+ * License: MIT
+ */
+
+#include "DeviceKeyStore.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <random>
+#include <thread>
+#include <vector>
+
+static_assert(sizeof(DeviceKeyStoreHeader) == 32, "DeviceKeyStoreHeader size");
+static_assert(sizeof(DeviceKeyStoreEntry) == 32, "DeviceKeyStoreEntry size");
+static_assert(sizeof(DeviceKeyStoreIndexHeader) == 48, "DeviceKeyStoreIndexHeader size");
+static_assert(sizeof(DeviceKeyStoreSlot) == 8, "DeviceKeyStoreSlot size");
+
+// The store file grows by doubling up to this much at a time. The space is allocated, not left
+// sparse, because writing to sparse pages of a shared mapping allocates blocks one page fault at a
+// time, which makes add() several times slower. The unused part is truncated on close.
+static const size_t MAX_GROW_SIZE = 1024 * 1024 * 1024;
+static const size_t MIN_GROW_ENTRIES = 1024;
+
+// msync() needs a page aligned address
+static int syncRange(void *addr, size_t size) {
+	static const uintptr_t pageSize = (uintptr_t) sysconf(_SC_PAGESIZE);
+	uintptr_t start = (uintptr_t) addr & ~(pageSize - 1);
+	return msync((void *) start, (uintptr_t) addr + size - start, MS_SYNC);
+}
+
+// Extend a file to size bytes with allocated blocks
+static bool allocate(int fd, size_t size) {
+	int err = posix_fallocate(fd, 0, size);
+	if (err != 0) {
+		errno = err;
+		return false;
+	}
+	return true;
+}
+
+static uint64_t nextPowerOf2(uint64_t value) {
+	uint64_t result = 1;
+	while(result < value) {
+		result <<= 1;
+	}
+	return result;
+}
+
+DeviceKeyStore::DeviceKeyStore() {
+}
+
+DeviceKeyStore::~DeviceKeyStore() {
+	close();
+}
+
+bool DeviceKeyStore::create(const char *path, size_t stride) {
+	close();
+
+	stride = (stride + 63) & ~(size_t)63;
+	if (stride <= sizeof(DeviceKeyStoreEntry) + sizeof(DeviceKeyHelperSavedDataHeader) || stride > 65536) {
+		return setError("stride is not valid");
+	}
+
+	this->path = path;
+	readOnly = false;
+	storeFd = ::open(path, O_RDWR | O_CREAT | O_EXCL, 0644);
+	if (storeFd < 0) {
+		return setError(path, errno);
+	}
+	if (flock(storeFd, LOCK_EX | LOCK_NB) != 0) {
+		setError(path, errno);
+		close();
+		return false;
+	}
+
+	size_t size = HEADER_SIZE + MIN_GROW_ENTRIES * stride;
+	if (!allocate(storeFd, size) || !mapStore(size)) {
+		setError(path, errno);
+		close();
+		return false;
+	}
+
+	std::random_device rd;
+	storeHeader->magic = STORE_MAGIC;
+	storeHeader->version = VERSION;
+	storeHeader->headerSize = HEADER_SIZE;
+	storeHeader->stride = (uint32_t) stride;
+	storeHeader->storeId = ((uint64_t) rd() << 32) | rd();
+	storeHeader->count = 0;
+	syncRange(storeHeader, sizeof(DeviceKeyStoreHeader));
+
+	if (!buildIndex(MIN_INDEX_CAPACITY)) {
+		close();
+		return false;
+	}
+	indexRebuilt = false;
+	return true;
+}
+
+bool DeviceKeyStore::open(const char *path, bool readOnly) {
+	close();
+
+	this->path = path;
+	this->readOnly = readOnly;
+	storeFd = ::open(path, readOnly ? O_RDONLY : O_RDWR);
+	if (storeFd < 0) {
+		return setError(path, errno);
+	}
+	if (flock(storeFd, (readOnly ? LOCK_SH : LOCK_EX) | LOCK_NB) != 0) {
+		if (errno == EWOULDBLOCK) {
+			setError("store is in use by another process");
+		}
+		else {
+			setError(path, errno);
+		}
+		close();
+		return false;
+	}
+
+	struct stat sb;
+	if (fstat(storeFd, &sb) != 0 || (size_t) sb.st_size < HEADER_SIZE || !mapStore((size_t) sb.st_size)) {
+		setError("not a store file");
+		close();
+		return false;
+	}
+
+	const DeviceKeyStoreHeader *h = storeHeader;
+	if (h->magic != STORE_MAGIC || h->version != VERSION || h->headerSize != HEADER_SIZE ||
+		h->stride <= sizeof(DeviceKeyStoreEntry) || (h->stride % 64) != 0 || h->count >= 0xffffffff) {
+		setError("not a store file or unsupported version");
+		close();
+		return false;
+	}
+	if (HEADER_SIZE + h->count * h->stride > storeMapSize) {
+		setError("store file is truncated");
+		close();
+		return false;
+	}
+
+	indexRebuilt = false;
+	if (!openIndex()) {
+		if (!buildIndex(std::max<uint64_t>(MIN_INDEX_CAPACITY, nextPowerOf2(h->count * 2)))) {
+			close();
+			return false;
+		}
+		indexRebuilt = true;
+	}
+	else
+	if (!readOnly) {
+		// Cleared until close() so an index that was not closed normally is rebuilt
+		indexHeader->clean = 0;
+		syncRange(indexHeader, sizeof(DeviceKeyStoreIndexHeader));
+	}
+	return true;
+}
+
+void DeviceKeyStore::close() {
+	if (storeHeader && !readOnly) {
+		size_t size = HEADER_SIZE + storeHeader->count * storeHeader->stride;
+		msync(storeMap, storeMapSize, MS_SYNC);
+
+		// The index is only marked clean once the entries it refers to are on disk
+		if (indexHeader && indexFd >= 0) {
+			indexHeader->clean = 1;
+			msync(indexMap, indexMapSize, MS_SYNC);
+		}
+
+		munmap(storeMap, storeMapSize);
+		storeMap = NULL;
+
+		// Remove the unused space preallocated by add()
+		if (ftruncate(storeFd, size) == 0) {
+			fsync(storeFd);
+		}
+	}
+	if (storeMap) {
+		munmap(storeMap, storeMapSize);
+	}
+	storeMap = NULL;
+	storeMapSize = 0;
+	storeHeader = NULL;
+
+	unmapIndex();
+
+	if (storeFd >= 0) {
+		::close(storeFd);
+		storeFd = -1;
+	}
+}
+
+bool DeviceKeyStore::sync() {
+	if (!storeHeader) {
+		return setError("store is not open");
+	}
+	if (msync(storeMap, storeMapSize, MS_SYNC) != 0 || (indexFd >= 0 && msync(indexMap, indexMapSize, MS_SYNC) != 0)) {
+		return setError("sync", errno);
+	}
+	return true;
+}
+
+bool DeviceKeyStore::add(const uint8_t *deviceId, const void *record, size_t size, uint64_t time, bool *added) {
+	if (added) {
+		*added = false;
+	}
+	if (!storeHeader || readOnly) {
+		return setError("store is not open for writing");
+	}
+
+	// The same validation as the library on the device does, so a bad backup is never stored
+	DeviceKeyHelperRecordInfo info;
+	DeviceKeyHelperRecord::Result result = DeviceKeyHelperRecord::validate(record, size, info);
+	if (result != DeviceKeyHelperRecord::RESULT_VALID) {
+		return setError((std::string("saved data is not valid: ") + DeviceKeyHelperRecord::getResultName(result)).c_str());
+	}
+	size_t recordSize = info.recordSize;
+	size_t stride = storeHeader->stride;
+	if (recordSize > stride - sizeof(DeviceKeyStoreEntry)) {
+		return setError("saved data is larger than the stride of the store");
+	}
+
+	const DeviceKeyStoreEntry *newest = find(deviceId);
+	if (newest && newest->recordSize == recordSize && memcmp(getRecord(newest), record, recordSize) == 0) {
+		// Unchanged since the last backup
+		return true;
+	}
+
+	uint64_t index = storeHeader->count;
+	if (index >= 0xfffffffe) {
+		return setError("store is full");
+	}
+
+	if (HEADER_SIZE + (index + 1) * stride > storeMapSize) {
+		size_t grow = std::min(std::max(storeMapSize - HEADER_SIZE, MIN_GROW_ENTRIES * stride), MAX_GROW_SIZE);
+		size_t newSize = storeMapSize + grow - (grow % stride);
+
+		// newest points into the old mapping
+		uint64_t newestIndex = newest ? getEntryIndex(newest) : 0;
+		munmap(storeMap, storeMapSize);
+		storeMap = NULL;
+		storeHeader = NULL;
+		if (!allocate(storeFd, newSize) || !mapStore(newSize)) {
+			setError(path.c_str(), errno);
+			close();
+			return false;
+		}
+		if (newest) {
+			newest = getEntry(newestIndex);
+		}
+	}
+
+	DeviceKeyStoreEntry *entry = (DeviceKeyStoreEntry *) &storeMap[HEADER_SIZE + index * stride];
+
+	// Anything left from an entry that was never committed is cleared
+	memset(entry, 0, stride);
+	memcpy(entry->deviceId, deviceId, DEVICE_KEY_STORE_ID_SIZE);
+	entry->previous = newest ? (uint32_t)(getEntryIndex(newest) + 1) : 0;
+	entry->time = time ? time : (uint64_t) ::time(NULL);
+	entry->recordSize = (uint16_t) recordSize;
+	memcpy(entry + 1, record, recordSize);
+	entry->crc = calculateEntryCrc(entry);
+
+	if (syncOnAdd && syncRange(entry, sizeof(DeviceKeyStoreEntry) + recordSize) != 0) {
+		return setError(path.c_str(), errno);
+	}
+
+	// Committing the entry
+	storeHeader->count = index + 1;
+	if (syncOnAdd) {
+		syncRange(storeHeader, sizeof(DeviceKeyStoreHeader));
+	}
+
+	if (!newest && (indexHeader->used + 1) * 2 > indexHeader->capacity) {
+		if (!buildIndex(indexHeader->capacity * 2)) {
+			// The entry is added, the index will be rebuilt the next time the store is opened
+			close();
+			return false;
+		}
+	}
+	else {
+		indexEntry(index);
+		indexHeader->count = index + 1;
+	}
+
+	if (added) {
+		*added = true;
+	}
+	return true;
+}
+
+const DeviceKeyStoreEntry *DeviceKeyStore::find(const uint8_t *deviceId) const {
+	if (!slots) {
+		return NULL;
+	}
+	const DeviceKeyStoreSlot *slot = findSlot(deviceId, (uint32_t) hashDeviceId(deviceId));
+	if (!slot || slot->entry == 0) {
+		return NULL;
+	}
+	return getEntry(slot->entry - 1);
+}
+
+const DeviceKeyStoreEntry *DeviceKeyStore::getEntry(uint64_t index) const {
+	if (!storeHeader || index >= storeHeader->count) {
+		return NULL;
+	}
+	return (const DeviceKeyStoreEntry *) &storeMap[HEADER_SIZE + index * storeHeader->stride];
+}
+
+const DeviceKeyStoreEntry *DeviceKeyStore::getPrevious(const DeviceKeyStoreEntry *entry) const {
+	if (!entry || entry->previous == 0 || entry->previous - 1 >= getEntryIndex(entry)) {
+		return NULL;
+	}
+	return getEntry(entry->previous - 1);
+}
+
+uint64_t DeviceKeyStore::getEntryIndex(const DeviceKeyStoreEntry *entry) const {
+	return ((const uint8_t *) entry - &storeMap[HEADER_SIZE]) / storeHeader->stride;
+}
+
+DeviceKeyStoreVerifyResult DeviceKeyStore::verify(size_t threads, std::function<void(uint64_t index, Problem problem, DeviceKeyHelperRecord::Result result)> onProblem) const {
+	DeviceKeyStoreVerifyResult verifyResult = {};
+	if (!storeHeader) {
+		return verifyResult;
+	}
+
+	const uint64_t count = storeHeader->count;
+	const uint64_t chunkSize = 4096;
+	std::atomic<uint64_t> nextChunk{0};
+	std::atomic<uint64_t> bytes{0}, problems{0}, newest{0};
+	std::mutex problemMutex;
+
+	auto report = [&](uint64_t index, Problem problem, DeviceKeyHelperRecord::Result result) {
+		problems++;
+		if (onProblem) {
+			std::lock_guard<std::mutex> lock(problemMutex);
+			onProblem(index, problem, result);
+		}
+	};
+
+	auto worker = [&]() {
+		uint64_t localBytes = 0, localNewest = 0;
+		while(true) {
+			uint64_t start = (nextChunk++) * chunkSize;
+			if (start >= count) {
+				break;
+			}
+			uint64_t end = std::min(start + chunkSize, count);
+			for(uint64_t index = start; index < end; index++) {
+				const DeviceKeyStoreEntry *entry = getEntry(index);
+				localBytes += entry->recordSize;
+
+				const DeviceKeyStoreEntry *found = find(entry->deviceId);
+				if (!found || getEntryIndex(found) < index) {
+					report(index, PROBLEM_INDEX, DeviceKeyHelperRecord::RESULT_VALID);
+				}
+				else
+				if (found == entry) {
+					localNewest++;
+				}
+
+				if (entry->recordSize > storeHeader->stride - sizeof(DeviceKeyStoreEntry) || calculateEntryCrc(entry) != entry->crc) {
+					report(index, PROBLEM_ENTRY_CRC, DeviceKeyHelperRecord::RESULT_VALID);
+					continue;
+				}
+
+				DeviceKeyHelperRecordInfo info;
+				DeviceKeyHelperRecord::Result result = DeviceKeyHelperRecord::validate(getRecord(entry), entry->recordSize, info);
+				if (result != DeviceKeyHelperRecord::RESULT_VALID || info.recordSize != entry->recordSize) {
+					report(index, PROBLEM_RECORD, result);
+				}
+
+				if (entry->previous != 0) {
+					const DeviceKeyStoreEntry *previous = getPrevious(entry);
+					if (!previous || memcmp(previous->deviceId, entry->deviceId, DEVICE_KEY_STORE_ID_SIZE) != 0) {
+						report(index, PROBLEM_HISTORY, DeviceKeyHelperRecord::RESULT_VALID);
+					}
+				}
+			}
+		}
+		bytes += localBytes;
+		newest += localNewest;
+	};
+
+	if (threads == 0) {
+		threads = std::max(1u, std::thread::hardware_concurrency());
+	}
+	std::vector<std::thread> pool;
+	for(size_t ii = 1; ii < threads; ii++) {
+		pool.emplace_back(worker);
+	}
+	worker();
+	for(std::thread &thread : pool) {
+		thread.join();
+	}
+
+	if (newest != getDeviceCount()) {
+		// Slots that don't point to the newest entry of a device, reported as the entry after the last
+		report(count, PROBLEM_INDEX, DeviceKeyHelperRecord::RESULT_VALID);
+	}
+
+	verifyResult.entries = count;
+	verifyResult.devices = getDeviceCount();
+	verifyResult.bytes = bytes;
+	verifyResult.problems = problems;
+	return verifyResult;
+}
+
+// [static]
+bool DeviceKeyStore::parseDeviceId(const char *hex, uint8_t *deviceId) {
+	if (strlen(hex) < DEVICE_KEY_STORE_ID_SIZE * 2) {
+		return false;
+	}
+	for(size_t ii = 0; ii < DEVICE_KEY_STORE_ID_SIZE * 2; ii++) {
+		char c = hex[ii];
+		int value;
+		if (c >= '0' && c <= '9') {
+			value = c - '0';
+		}
+		else
+		if (c >= 'a' && c <= 'f') {
+			value = c - 'a' + 10;
+		}
+		else
+		if (c >= 'A' && c <= 'F') {
+			value = c - 'A' + 10;
+		}
+		else {
+			return false;
+		}
+		if ((ii % 2) == 0) {
+			deviceId[ii / 2] = (uint8_t)(value << 4);
+		}
+		else {
+			deviceId[ii / 2] |= (uint8_t) value;
+		}
+	}
+	return true;
+}
+
+// [static]
+std::string DeviceKeyStore::formatDeviceId(const uint8_t *deviceId) {
+	char buf[DEVICE_KEY_STORE_ID_SIZE * 2 + 1];
+	for(size_t ii = 0; ii < DEVICE_KEY_STORE_ID_SIZE; ii++) {
+		snprintf(&buf[ii * 2], 3, "%02x", deviceId[ii]);
+	}
+	return buf;
+}
+
+// [static]
+uint32_t DeviceKeyStore::calculateEntryCrc(const DeviceKeyStoreEntry *entry) {
+	DeviceKeyStoreEntry header = *entry;
+	header.crc = 0;
+	uint32_t crc = DeviceKeyHelperRecord::calculateCrc(&header, sizeof(header));
+	return DeviceKeyHelperRecord::calculateCrc(getRecord(entry), entry->recordSize, crc);
+}
+
+bool DeviceKeyStore::mapStore(size_t size) {
+	void *map = mmap(NULL, size, PROT_READ | (readOnly ? 0 : PROT_WRITE), MAP_SHARED, storeFd, 0);
+	if (map == MAP_FAILED) {
+		return false;
+	}
+	storeMap = (uint8_t *) map;
+	storeMapSize = size;
+	storeHeader = (DeviceKeyStoreHeader *) storeMap;
+	return true;
+}
+
+bool DeviceKeyStore::openIndex() {
+	std::string indexPath = path + ".idx";
+	int fd = ::open(indexPath.c_str(), readOnly ? O_RDONLY : O_RDWR);
+	if (fd < 0) {
+		return false;
+	}
+	struct stat sb;
+	if (fstat(fd, &sb) != 0 || (size_t) sb.st_size < HEADER_SIZE || !mapIndex(fd, (size_t) sb.st_size)) {
+		::close(fd);
+		return false;
+	}
+
+	// Anything that doesn't match exactly means the index is rebuilt
+	const DeviceKeyStoreIndexHeader *h = indexHeader;
+	uint64_t capacity = h->capacity;
+	if (h->magic != INDEX_MAGIC || h->version != VERSION || h->headerSize != HEADER_SIZE || h->clean != 1 ||
+		h->storeId != storeHeader->storeId || h->count != storeHeader->count ||
+		capacity == 0 || (capacity & (capacity - 1)) != 0 || capacity > 0x80000000 ||
+		indexMapSize != HEADER_SIZE + capacity * sizeof(DeviceKeyStoreSlot) || h->used * 2 > capacity) {
+		unmapIndex();
+		return false;
+	}
+	return true;
+}
+
+bool DeviceKeyStore::buildIndex(uint64_t capacity) {
+	capacity = nextPowerOf2(capacity);
+	if (capacity > 0x80000000) {
+		return setError("index is too large");
+	}
+	size_t size = HEADER_SIZE + capacity * sizeof(DeviceKeyStoreSlot);
+
+	// When growing, the slots of the old index are moved without reading the store
+	uint8_t *oldMap = indexMap;
+	size_t oldMapSize = indexMapSize;
+	int oldFd = indexFd;
+	DeviceKeyStoreSlot *oldSlots = slots;
+	uint64_t oldCapacity = indexHeader ? indexHeader->capacity : 0;
+	indexMap = NULL;
+	indexFd = -1;
+
+	std::string indexPath = path + ".idx";
+	std::string tempPath = indexPath + ".tmp";
+	int fd = -1;
+	bool ok = true;
+	if (!readOnly) {
+		fd = ::open(tempPath.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+		ok = (fd >= 0 && ftruncate(fd, size) == 0);
+	}
+	if (!ok || !mapIndex(fd, size)) {
+		setError(tempPath.c_str(), errno);
+		if (fd >= 0) {
+			::close(fd);
+			unlink(tempPath.c_str());
+		}
+		indexMap = oldMap;
+		indexMapSize = oldMapSize;
+		indexFd = oldFd;
+		slots = oldSlots;
+		indexHeader = oldMap ? (DeviceKeyStoreIndexHeader *) oldMap : NULL;
+		return false;
+	}
+
+	indexHeader->magic = INDEX_MAGIC;
+	indexHeader->version = VERSION;
+	indexHeader->clean = 0;
+	indexHeader->headerSize = HEADER_SIZE;
+	indexHeader->storeId = storeHeader->storeId;
+	indexHeader->capacity = capacity;
+	indexHeader->used = 0;
+
+	if (oldSlots) {
+		const uint64_t mask = capacity - 1;
+		for(uint64_t ii = 0; ii < oldCapacity; ii++) {
+			if (oldSlots[ii].entry != 0) {
+				uint64_t pos = oldSlots[ii].hash & mask;
+				while(slots[pos].entry != 0) {
+					pos = (pos + 1) & mask;
+				}
+				slots[pos] = oldSlots[ii];
+				indexHeader->used++;
+			}
+		}
+		// Entries added since the old index was last updated
+		for(uint64_t index = ((DeviceKeyStoreIndexHeader *) oldMap)->count; index < storeHeader->count; index++) {
+			indexEntry(index);
+		}
+		munmap(oldMap, oldMapSize);
+		if (oldFd >= 0) {
+			::close(oldFd);
+		}
+	}
+	else {
+		for(uint64_t index = 0; index < storeHeader->count; index++) {
+			indexEntry(index);
+		}
+	}
+	indexHeader->count = storeHeader->count;
+
+	if (fd >= 0) {
+		// Replaces any old index atomically
+		if (msync(indexMap, indexMapSize, MS_SYNC) != 0 || rename(tempPath.c_str(), indexPath.c_str()) != 0) {
+			setError(indexPath.c_str(), errno);
+			unmapIndex();
+			unlink(tempPath.c_str());
+			return false;
+		}
+	}
+	return true;
+}
+
+bool DeviceKeyStore::mapIndex(int fd, size_t size) {
+	void *map;
+	if (fd >= 0) {
+		map = mmap(NULL, size, PROT_READ | (readOnly ? 0 : PROT_WRITE), MAP_SHARED, fd, 0);
+	}
+	else {
+		map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	}
+	if (map == MAP_FAILED) {
+		return false;
+	}
+	indexFd = fd;
+	indexMap = (uint8_t *) map;
+	indexMapSize = size;
+	indexHeader = (DeviceKeyStoreIndexHeader *) indexMap;
+	slots = (DeviceKeyStoreSlot *) &indexMap[HEADER_SIZE];
+	return true;
+}
+
+void DeviceKeyStore::unmapIndex() {
+	if (indexMap) {
+		munmap(indexMap, indexMapSize);
+	}
+	if (indexFd >= 0) {
+		::close(indexFd);
+	}
+	indexMap = NULL;
+	indexMapSize = 0;
+	indexFd = -1;
+	indexHeader = NULL;
+	slots = NULL;
+}
+
+void DeviceKeyStore::indexEntry(uint64_t index) {
+	const DeviceKeyStoreEntry *entry = getEntry(index);
+	uint32_t hash = (uint32_t) hashDeviceId(entry->deviceId);
+
+	DeviceKeyStoreSlot *slot = findSlot(entry->deviceId, hash);
+	if (!slot) {
+		// Can't happen, the index is grown before it's half full
+		return;
+	}
+	if (slot->entry == 0) {
+		slot->hash = hash;
+		indexHeader->used++;
+	}
+	slot->entry = (uint32_t)(index + 1);
+}
+
+DeviceKeyStoreSlot *DeviceKeyStore::findSlot(const uint8_t *deviceId, uint32_t hash) const {
+	// Linear probing. The index is at most half full, so this is usually one or two slots.
+	const uint64_t capacity = indexHeader->capacity;
+	const uint64_t mask = capacity - 1;
+	uint64_t pos = hash & mask;
+	for(uint64_t ii = 0; ii < capacity; ii++) {
+		DeviceKeyStoreSlot *slot = &slots[pos];
+		if (slot->entry == 0) {
+			return slot;
+		}
+		if (slot->hash == hash) {
+			const DeviceKeyStoreEntry *entry = getEntry(slot->entry - 1);
+			if (entry && memcmp(entry->deviceId, deviceId, DEVICE_KEY_STORE_ID_SIZE) == 0) {
+				return slot;
+			}
+		}
+		pos = (pos + 1) & mask;
+	}
+	return NULL;
+}
+
+bool DeviceKeyStore::setError(const char *what, int err) {
+	lastError = what;
+	if (err != 0) {
+		lastError += ": ";
+		lastError += strerror(err);
+	}
+	return false;
+}
+
+// [static]
+uint64_t DeviceKeyStore::hashDeviceId(const uint8_t *deviceId) {
+	// Device IDs of devices made together share most of their bytes, so all of them are mixed
+	uint64_t a;
+	uint32_t b;
+	memcpy(&a, deviceId, sizeof(a));
+	memcpy(&b, &deviceId[sizeof(a)], sizeof(b));
+
+	uint64_t h = a ^ ((uint64_t) b * 0x9e3779b97f4a7c15ULL);
+	h ^= h >> 30;
+	h *= 0xbf58476d1ce4e5b9ULL;
+	h ^= h >> 27;
+	h *= 0x94d049bb133111ebULL;
+	h ^= h >> 31;
+	return h;
+}
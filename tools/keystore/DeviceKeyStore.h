@@ -0,0 +1,338 @@
+/**
+ * Fleet key backup store for DeviceKeyHelperRK saved data
+ *
+ * A host library that keeps a central copy of the saved data of every device in one append-only,
+ * memory-mapped file of fixed-stride entries, with an open-addressing hash index by device ID in a
+ * second file. The records are stored exactly as the devices save them and are parsed and validated
+ * with DeviceKeyHelperRecord, the same code the library uses on the device.
+ *
+ * See README.md in this directory for the file format and usage.
+ *
+ * Location: https://github.com/rickkas7/DeviceKeyHelperRK
+ * License: MIT
+ */
+
+#ifndef __DEVICEKEYSTORE_H
+#define __DEVICEKEYSTORE_H
+
+#include "DeviceKeyHelperRecord.h"
+
+#include <functional>
+#include <string>
+
+/**
+ * @brief Length of a device ID in bytes. It's 24 characters in hex, like System.deviceID().
+ */
+const size_t DEVICE_KEY_STORE_ID_SIZE = 12;
+
+/**
+ * @brief The header at the beginning of the store file
+ *
+ * It's followed by padding to headerSize, then the entries, each stride bytes.
+ */
+typedef struct {
+	uint32_t	magic;			// DeviceKeyStore::STORE_MAGIC
+	uint16_t	version;		// DeviceKeyStore::VERSION
+	uint16_t	reserved1;
+	uint32_t	headerSize;		// Offset of the first entry, DeviceKeyStore::HEADER_SIZE
+	uint32_t	stride;			// Size of each entry including its saved data, a multiple of 64
+	uint64_t	storeId;		// Random number assigned on create, the index must have the same one
+	uint64_t	count;			// Number of entries that have been added. Entries are committed by updating this.
+} DeviceKeyStoreHeader;
+
+/**
+ * @brief An entry in the store, followed by recordSize bytes of saved data
+ *
+ * Entries are never modified or removed. Adding saved data for a device that is already in the store
+ * adds a new entry that links to the old one with previous, so the history of each device is kept.
+ */
+typedef struct {
+	uint8_t		deviceId[DEVICE_KEY_STORE_ID_SIZE];	// Device ID the saved data came from
+	uint32_t	previous;		// Entry number + 1 of the previous entry for this device, 0 if none
+	uint64_t	time;			// When the entry was added, seconds since the Unix epoch
+	uint16_t	recordSize;		// Number of bytes of saved data after this header
+	uint16_t	reserved;		// Currently always 0
+	uint32_t	crc;			// CRC-32 of this header (with crc 0) and the saved data
+} DeviceKeyStoreEntry;
+
+/**
+ * @brief The header at the beginning of the index file
+ *
+ * It's followed by padding to headerSize, then capacity DeviceKeyStoreSlot. The index can always be
+ * rebuilt from the store, and is rebuilt whenever it doesn't match the store.
+ */
+typedef struct {
+	uint32_t	magic;			// DeviceKeyStore::INDEX_MAGIC
+	uint16_t	version;		// DeviceKeyStore::VERSION
+	uint8_t		clean;			// 1 if the index was closed normally, 0 while it's open for writing
+	uint8_t		reserved1;
+	uint32_t	headerSize;		// Offset of the first slot, DeviceKeyStore::HEADER_SIZE
+	uint32_t	reserved2;
+	uint64_t	storeId;		// storeId of the store this is the index of
+	uint64_t	count;			// Number of store entries that are indexed
+	uint64_t	capacity;		// Number of slots, a power of 2
+	uint64_t	used;			// Number of slots in use, which is the number of devices
+} DeviceKeyStoreIndexHeader;
+
+/**
+ * @brief A slot in the hash index
+ */
+typedef struct {
+	uint32_t	entry;			// Entry number + 1 of the newest entry for the device, 0 for an empty slot
+	uint32_t	hash;			// Low 32 bits of the hash of the device ID
+} DeviceKeyStoreSlot;
+
+/**
+ * @brief Results of DeviceKeyStore::verify()
+ */
+typedef struct {
+	uint64_t	entries;		//< Number of entries checked
+	uint64_t	devices;		//< Number of devices in the index
+	uint64_t	bytes;			//< Number of bytes of saved data checked
+	uint64_t	problems;		//< Number of problems found
+} DeviceKeyStoreVerifyResult;
+
+/**
+ * @brief Append-only, memory-mapped store of saved data indexed by device ID
+ *
+ * Lookups return pointers into the mapped file, so nothing is copied. Only one process can have a
+ * store open for writing, and not while others have it open for reading.
+ *
+ * Pointers returned by find() and getEntry() are valid until the next add() or close(). Adding
+ * entries can grow and remap the file.
+ */
+class DeviceKeyStore {
+public:
+	/**
+	 * @brief Problems found by verify()
+	 */
+	enum Problem {
+		PROBLEM_ENTRY_CRC = 0,		//< The entry header or saved data does not match its CRC
+		PROBLEM_RECORD,				//< The saved data is not valid according to DeviceKeyHelperRecord::validate()
+		PROBLEM_HISTORY,			//< The previous link is not an earlier entry for the same device
+		PROBLEM_INDEX				//< The index does not point to the newest entry for the device
+	};
+
+	static constexpr uint32_t STORE_MAGIC = 0x53b7a65c;		//< Magic bytes for the store file
+	static constexpr uint32_t INDEX_MAGIC = 0x49b7a65c;		//< Magic bytes for the index file
+	static constexpr uint16_t VERSION = 1;					//< Current file format version
+	static constexpr size_t HEADER_SIZE = 4096;				//< Size of the store and index file headers, so the entries and slots are page aligned
+	static constexpr size_t DEFAULT_STRIDE = 2048;			//< Default entry size, enough for device keys on any device with a few extra regions
+	static constexpr size_t MIN_INDEX_CAPACITY = 65536;		//< Slots in a new index
+
+	DeviceKeyStore();
+	virtual ~DeviceKeyStore();
+
+	/**
+	 * @brief Create a new, empty store
+	 *
+	 * @param path Path to the store file. The index is path with ".idx" appended. Fails if the store
+	 * already exists.
+	 *
+	 * @param stride Size of each entry, which limits the size of saved data to stride - sizeof(DeviceKeyStoreEntry).
+	 * Rounded up to a multiple of 64. Cellular devices only need 512.
+	 *
+	 * The store is left open for writing.
+	 */
+	bool create(const char *path, size_t stride = DEFAULT_STRIDE);
+
+	/**
+	 * @brief Open an existing store
+	 *
+	 * @param path Path to the store file
+	 *
+	 * @param readOnly Open for reading only. Multiple processes can open a store for reading at the same time.
+	 *
+	 * If the index is missing, was not closed normally, or is for a different store, it's rebuilt from
+	 * the store. When opened read-only the rebuilt index is only kept in memory.
+	 */
+	bool open(const char *path, bool readOnly = false);
+
+	/**
+	 * @brief Close the store, flushing all changes to disk
+	 */
+	void close();
+
+	/**
+	 * @brief Flush the store and index to disk
+	 */
+	bool sync();
+
+	/**
+	 * @brief Flush each entry to disk before it's committed
+	 *
+	 * @param value true to flush each entry before updating the count in the header. This guarantees
+	 * a power loss can't leave the count including an entry that wasn't written, but makes add() much
+	 * slower. Without it, verify() will find such entries by their CRC.
+	 */
+	DeviceKeyStore &withSyncOnAdd(bool value = true) { syncOnAdd = value; return *this; };
+
+	/**
+	 * @brief Add saved data for a device
+	 *
+	 * @param deviceId The DEVICE_KEY_STORE_ID_SIZE byte device ID
+	 *
+	 * @param record The saved data, DeviceKeyHelperSavedData or any other format the library saves.
+	 * It's stored exactly as is, up to the end of the record.
+	 *
+	 * @param size The number of bytes at record. This can be more than the record.
+	 *
+	 * @param time When the saved data was backed up, seconds since the Unix epoch. 0 for the current time.
+	 *
+	 * @param added If not NULL, set to false if the newest entry for the device already has identical
+	 * saved data, in which case no entry is added.
+	 *
+	 * @return false if the saved data is not valid, doesn't fit in an entry, or the store could not be
+	 * written. See getLastError().
+	 */
+	bool add(const uint8_t *deviceId, const void *record, size_t size, uint64_t time = 0, bool *added = NULL);
+
+	/**
+	 * @brief Find the newest entry for a device
+	 *
+	 * @param deviceId The DEVICE_KEY_STORE_ID_SIZE byte device ID
+	 *
+	 * @return The entry in the mapped file or NULL if the device is not in the store. Use getRecord()
+	 * for the saved data and getPrevious() for older entries.
+	 */
+	const DeviceKeyStoreEntry *find(const uint8_t *deviceId) const;
+
+	/**
+	 * @brief Get an entry by its entry number, 0 through getCount() - 1
+	 */
+	const DeviceKeyStoreEntry *getEntry(uint64_t index) const;
+
+	/**
+	 * @brief Get the previous entry for the same device, or NULL if entry is the oldest
+	 */
+	const DeviceKeyStoreEntry *getPrevious(const DeviceKeyStoreEntry *entry) const;
+
+	/**
+	 * @brief Get the entry number of an entry
+	 */
+	uint64_t getEntryIndex(const DeviceKeyStoreEntry *entry) const;
+
+	/**
+	 * @brief Get the saved data that follows an entry header. Its size is entry->recordSize.
+	 */
+	static const uint8_t *getRecord(const DeviceKeyStoreEntry *entry) { return (const uint8_t *)(entry + 1); };
+
+	/**
+	 * @brief Check the CRC of every entry, validate the saved data, and check the history links and the index
+	 *
+	 * @param threads Number of threads to check entries with, 0 for one per CPU
+	 *
+	 * @param onProblem Called for each problem found with the entry number, the problem, and for
+	 * PROBLEM_RECORD the result from DeviceKeyHelperRecord::validate(). It's called from one thread at
+	 * a time, but not necessarily in order. Can be NULL. If the number of devices in the index is wrong,
+	 * PROBLEM_INDEX is reported with the entry number getCount().
+	 *
+	 * The entries are checked in place in the mapped file.
+	 */
+	DeviceKeyStoreVerifyResult verify(size_t threads = 0, std::function<void(uint64_t index, Problem problem, DeviceKeyHelperRecord::Result result)> onProblem = NULL) const;
+
+	/**
+	 * @brief Number of entries in the store
+	 */
+	uint64_t getCount() const { return storeHeader ? storeHeader->count : 0; };
+
+	/**
+	 * @brief Number of devices in the store
+	 */
+	uint64_t getDeviceCount() const { return indexHeader ? indexHeader->used : 0; };
+
+	/**
+	 * @brief Size of each entry
+	 */
+	size_t getStride() const { return storeHeader ? storeHeader->stride : 0; };
+
+	/**
+	 * @brief Number of slots in the index
+	 */
+	uint64_t getIndexCapacity() const { return indexHeader ? indexHeader->capacity : 0; };
+
+	/**
+	 * @brief true if the index was rebuilt from the store by open()
+	 */
+	bool getIndexRebuilt() const { return indexRebuilt; };
+
+	/**
+	 * @brief Description of the last error
+	 */
+	const std::string &getLastError() const { return lastError; };
+
+	/**
+	 * @brief Convert a 24 character hex device ID to DEVICE_KEY_STORE_ID_SIZE bytes
+	 */
+	static bool parseDeviceId(const char *hex, uint8_t *deviceId);
+
+	/**
+	 * @brief Convert DEVICE_KEY_STORE_ID_SIZE bytes to a 24 character lowercase hex device ID
+	 */
+	static std::string formatDeviceId(const uint8_t *deviceId);
+
+	/**
+	 * @brief Calculate the CRC of an entry and its saved data, as stored in entry->crc
+	 */
+	static uint32_t calculateEntryCrc(const DeviceKeyStoreEntry *entry);
+
+protected:
+	/**
+	 * @brief Map the store file, size is the file size
+	 */
+	bool mapStore(size_t size);
+
+	/**
+	 * @brief Open the index file and check that it's the index of the store
+	 */
+	bool openIndex();
+
+	/**
+	 * @brief Build the index from the store with at least the given number of slots
+	 *
+	 * The new index is written to a temporary file and renamed over the old one, or when the store is
+	 * read-only, built in memory.
+	 */
+	bool buildIndex(uint64_t capacity);
+
+	/**
+	 * @brief Map an index file or memory of size bytes
+	 */
+	bool mapIndex(int fd, size_t size);
+
+	void unmapIndex();
+
+	/**
+	 * @brief Point the index slot for a device to an entry, adding the device if necessary
+	 */
+	void indexEntry(uint64_t index);
+
+	/**
+	 * @brief Find the slot for a device, either the one in use by it or the empty slot it would go in
+	 */
+	DeviceKeyStoreSlot *findSlot(const uint8_t *deviceId, uint32_t hash) const;
+
+	bool setError(const char *what, int err = 0);
+
+	static uint64_t hashDeviceId(const uint8_t *deviceId);
+
+	std::string path;
+	int storeFd = -1;
+	int indexFd = -1;
+	bool readOnly = false;
+	bool syncOnAdd = false;
+	bool indexRebuilt = false;
+
+	uint8_t *storeMap = NULL;
+	size_t storeMapSize = 0;
+	DeviceKeyStoreHeader *storeHeader = NULL;
+
+	uint8_t *indexMap = NULL;
+	size_t indexMapSize = 0;
+	DeviceKeyStoreIndexHeader *indexHeader = NULL;
+	DeviceKeyStoreSlot *slots = NULL;
+
+	std::string lastError;
+};
+
+#endif /* __DEVICEKEYSTORE_H */
@@ -0,0 +1,463 @@
+/**
+ * Host tool for the fleet key backup store
+ *
+ * Creates DeviceKeyStore files, adds saved data backed up from devices, looks up the keys of a
+ * device, and verifies the integrity of the whole store.
+ *
+ * See README.md in this directory for building and usage.
+ *
+ * Location: https://github.com/rickkas7/DeviceKeyHelperRK
+ * License: MIT
+ */
+
+#include "DeviceKeyStore.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <filesystem>
+#include <random>
+#include <string>
+#include <vector>
+
+namespace fs = std::filesystem;
+
+static bool readFile(const std::string &path, std::vector<uint8_t> &data) {
+	FILE *fp = fopen(path.c_str(), "rb");
+	if (!fp) {
+		return false;
+	}
+	data.clear();
+	uint8_t buf[4096];
+	size_t count;
+	while((count = fread(buf, 1, sizeof(buf), fp)) > 0) {
+		data.insert(data.end(), buf, buf + count);
+	}
+	bool result = !ferror(fp);
+	fclose(fp);
+	return result;
+}
+
+static bool writeFile(const std::string &path, const void *data, size_t size) {
+	FILE *fp = fopen(path.c_str(), "wb");
+	if (!fp) {
+		return false;
+	}
+	bool result = fwrite(data, 1, size, fp) == size;
+	return (fclose(fp) == 0) && result;
+}
+
+static double secondsSince(std::chrono::steady_clock::time_point start) {
+	return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+static std::string entryJson(const DeviceKeyStore &store, const DeviceKeyStoreEntry *entry) {
+	DeviceKeyHelperRecordInfo info;
+	DeviceKeyHelperRecord::Result result = DeviceKeyHelperRecord::validate(DeviceKeyStore::getRecord(entry), entry->recordSize, info);
+
+	char buf[256];
+	snprintf(buf, sizeof(buf), "{\"deviceId\":\"%s\",\"entry\":%llu,\"time\":%llu,\"recordSize\":%u,\"result\":\"%s\"",
+		DeviceKeyStore::formatDeviceId(entry->deviceId).c_str(), (unsigned long long) store.getEntryIndex(entry),
+		(unsigned long long) entry->time, entry->recordSize, DeviceKeyHelperRecord::getResultName(result));
+	std::string line = buf;
+	if (result == DeviceKeyHelperRecord::RESULT_VALID) {
+		snprintf(buf, sizeof(buf), ",\"version\":%u,\"flags\":%u,\"generation\":%lu,\"keysSize\":%zu,\"check\":\"0x%08lx\"",
+			info.version, info.flags, (unsigned long) info.generation, info.layout.keysSize, (unsigned long) info.check);
+		line += buf;
+	}
+	return line;
+}
+
+static int createCommand(const std::string &storePath, size_t stride) {
+	DeviceKeyStore store;
+	if (!store.create(storePath.c_str(), stride)) {
+		fprintf(stderr, "%s\n", store.getLastError().c_str());
+		return 1;
+	}
+	printf("{\"created\":\"%s\",\"stride\":%zu}\n", storePath.c_str(), store.getStride());
+	return 0;
+}
+
+static int addCommand(const std::string &storePath, const std::string &deviceIdStr, const std::string &path, size_t offset) {
+	uint8_t deviceId[DEVICE_KEY_STORE_ID_SIZE];
+	if (deviceIdStr.size() != DEVICE_KEY_STORE_ID_SIZE * 2 || !DeviceKeyStore::parseDeviceId(deviceIdStr.c_str(), deviceId)) {
+		fprintf(stderr, "device ID must be 24 hex characters\n");
+		return 2;
+	}
+	std::vector<uint8_t> data;
+	if (!readFile(path, data) || offset >= data.size()) {
+		fprintf(stderr, "%s: could not read saved data\n", path.c_str());
+		return 1;
+	}
+
+	DeviceKeyStore store;
+	bool added;
+	if (!store.open(storePath.c_str()) || !store.add(deviceId, &data[offset], data.size() - offset, 0, &added)) {
+		fprintf(stderr, "%s\n", store.getLastError().c_str());
+		return 1;
+	}
+	printf("%s,\"added\":%s}\n", entryJson(store, store.find(deviceId)).c_str(), added ? "true" : "false");
+	return 0;
+}
+
+static int importCommand(const std::string &storePath, const std::vector<std::string> &paths) {
+	// Files named with the device ID, like the backup files the library writes to SD cards and file systems
+	std::vector<std::string> files;
+	for(const std::string &path : paths) {
+		std::error_code ec;
+		if (fs::is_directory(path, ec)) {
+			for(fs::recursive_directory_iterator it(path, ec), end; !ec && it != end; it.increment(ec)) {
+				if (it->is_regular_file(ec)) {
+					files.push_back(it->path().string());
+				}
+			}
+		}
+		else {
+			files.push_back(path);
+		}
+	}
+
+	DeviceKeyStore store;
+	if (!store.open(storePath.c_str())) {
+		fprintf(stderr, "%s\n", store.getLastError().c_str());
+		return 1;
+	}
+
+	uint64_t added = 0, unchanged = 0, skipped = 0, failed = 0;
+	auto start = std::chrono::steady_clock::now();
+	std::vector<uint8_t> data;
+	for(const std::string &file : files) {
+		uint8_t deviceId[DEVICE_KEY_STORE_ID_SIZE];
+		std::string name = fs::path(file).filename().string();
+		if (!DeviceKeyStore::parseDeviceId(name.c_str(), deviceId)) {
+			skipped++;
+			continue;
+		}
+		bool wasAdded;
+		if (!readFile(file, data)) {
+			printf("{\"file\":\"%s\",\"error\":\"%s\"}\n", file.c_str(), strerror(errno));
+			failed++;
+		}
+		else
+		if (!store.add(deviceId, data.data(), data.size(), 0, &wasAdded)) {
+			printf("{\"file\":\"%s\",\"error\":\"%s\"}\n", file.c_str(), store.getLastError().c_str());
+			failed++;
+		}
+		else
+		if (wasAdded) {
+			added++;
+		}
+		else {
+			unchanged++;
+		}
+	}
+	if (!store.sync()) {
+		fprintf(stderr, "%s\n", store.getLastError().c_str());
+		return 1;
+	}
+	printf("{\"import\":{\"added\":%llu,\"unchanged\":%llu,\"skipped\":%llu,\"failed\":%llu,\"entries\":%llu,\"devices\":%llu,\"seconds\":%.6f}}\n",
+		(unsigned long long) added, (unsigned long long) unchanged, (unsigned long long) skipped, (unsigned long long) failed,
+		(unsigned long long) store.getCount(), (unsigned long long) store.getDeviceCount(), secondsSince(start));
+	return (failed > 0) ? 1 : 0;
+}
+
+static int getCommand(const std::string &storePath, const std::string &deviceIdStr, bool history, const std::string &keysPath, const std::string &derPath, const std::string &recordPath) {
+	uint8_t deviceId[DEVICE_KEY_STORE_ID_SIZE];
+	if (deviceIdStr.size() != DEVICE_KEY_STORE_ID_SIZE * 2 || !DeviceKeyStore::parseDeviceId(deviceIdStr.c_str(), deviceId)) {
+		fprintf(stderr, "device ID must be 24 hex characters\n");
+		return 2;
+	}
+
+	DeviceKeyStore store;
+	if (!store.open(storePath.c_str(), true)) {
+		fprintf(stderr, "%s\n", store.getLastError().c_str());
+		return 1;
+	}
+	const DeviceKeyStoreEntry *entry = store.find(deviceId);
+	if (!entry) {
+		fprintf(stderr, "%s is not in the store\n", deviceIdStr.c_str());
+		return 1;
+	}
+
+	for(const DeviceKeyStoreEntry *e = entry; e; e = history ? store.getPrevious(e) : NULL) {
+		printf("%s}\n", entryJson(store, e).c_str());
+	}
+
+	const uint8_t *record = DeviceKeyStore::getRecord(entry);
+	if (!recordPath.empty() && !writeFile(recordPath, record, entry->recordSize)) {
+		fprintf(stderr, "%s: %s\n", recordPath.c_str(), strerror(errno));
+		return 1;
+	}
+	if (!keysPath.empty() || !derPath.empty()) {
+		DeviceKeyHelperRecordInfo info;
+		if (DeviceKeyHelperRecord::validate(record, entry->recordSize, info) != DeviceKeyHelperRecord::RESULT_VALID) {
+			fprintf(stderr, "saved data is not valid\n");
+			return 1;
+		}
+		std::vector<uint8_t> keys(info.layout.keysSize);
+		DeviceKeyHelperRecord::readKeys(record, info, 0, keys.data(), keys.size());
+		if (!keysPath.empty() && !writeFile(keysPath, keys.data(), keys.size())) {
+			fprintf(stderr, "%s: %s\n", keysPath.c_str(), strerror(errno));
+			return 1;
+		}
+		if (!derPath.empty()) {
+			size_t privateKeySize = DeviceKeyHelperRecord::privateKeySize(keys.size());
+			size_t derLen = DeviceKeyHelperRecord::derSequenceSize(keys.data(), privateKeySize);
+			if (privateKeySize == 0 || info.regionCount > 1 || derLen == 0 || derLen > privateKeySize) {
+				fprintf(stderr, "saved data does not contain a device private key\n");
+				return 1;
+			}
+			if (!writeFile(derPath, keys.data(), derLen)) {
+				fprintf(stderr, "%s: %s\n", derPath.c_str(), strerror(errno));
+				return 1;
+			}
+		}
+	}
+	return 0;
+}
+
+static int verifyCommand(const std::string &storePath, size_t threads) {
+	DeviceKeyStore store;
+	auto start = std::chrono::steady_clock::now();
+	if (!store.open(storePath.c_str(), true)) {
+		fprintf(stderr, "%s\n", store.getLastError().c_str());
+		return 1;
+	}
+	double openSeconds = secondsSince(start);
+
+	static const char *problemNames[] = { "entry_crc", "record", "history", "index" };
+	start = std::chrono::steady_clock::now();
+	DeviceKeyStoreVerifyResult result = store.verify(threads, [&](uint64_t index, DeviceKeyStore::Problem problem, DeviceKeyHelperRecord::Result recordResult) {
+		const DeviceKeyStoreEntry *entry = store.getEntry(index);
+		printf("{\"entry\":%llu,\"deviceId\":\"%s\",\"problem\":\"%s\",\"result\":\"%s\"}\n", (unsigned long long) index,
+			entry ? DeviceKeyStore::formatDeviceId(entry->deviceId).c_str() : "", problemNames[problem], DeviceKeyHelperRecord::getResultName(recordResult));
+	});
+	double seconds = secondsSince(start);
+
+	printf("{\"verify\":{\"entries\":%llu,\"devices\":%llu,\"bytes\":%llu,\"problems\":%llu,\"indexRebuilt\":%s,\"openSeconds\":%.6f,\"seconds\":%.6f,\"entriesPerSecond\":%.1f}}\n",
+		(unsigned long long) result.entries, (unsigned long long) result.devices, (unsigned long long) result.bytes, (unsigned long long) result.problems,
+		store.getIndexRebuilt() ? "true" : "false", openSeconds, seconds, (seconds > 0) ? result.entries / seconds : 0);
+	return (result.problems > 0) ? 1 : 0;
+}
+
+static int statsCommand(const std::string &storePath) {
+	DeviceKeyStore store;
+	if (!store.open(storePath.c_str(), true)) {
+		fprintf(stderr, "%s\n", store.getLastError().c_str());
+		return 1;
+	}
+	printf("{\"stats\":{\"entries\":%llu,\"devices\":%llu,\"stride\":%zu,\"indexCapacity\":%llu,\"indexRebuilt\":%s}}\n",
+		(unsigned long long) store.getCount(), (unsigned long long) store.getDeviceCount(), store.getStride(),
+		(unsigned long long) store.getIndexCapacity(), store.getIndexRebuilt() ? "true" : "false");
+	return 0;
+}
+
+// Builds a valid record with random keys, the same way DeviceKeyHelper saves device keys
+static std::vector<uint8_t> randomRecord(std::mt19937_64 &rng, bool udp, uint32_t generation) {
+	size_t keysSize = udp ? DeviceKeyHelperRecord::UDP_KEYS_SIZE : DeviceKeyHelperRecord::TCP_KEYS_SIZE;
+	DeviceKeyHelperRegion region = { (uint16_t)(udp ? DeviceKeyHelperRecord::UDP_KEYS_OFFSET : DeviceKeyHelperRecord::TCP_KEYS_OFFSET), (uint16_t) keysSize };
+
+	std::vector<uint8_t> keys(keysSize, 0xff);
+	for(size_t ii = 0; ii < keysSize / 2; ii++) {
+		keys[ii] = (uint8_t) rng();
+	}
+
+	DeviceKeyHelperSavedDataHeader header;
+	DeviceKeyHelperRecord::initHeader(&header, DeviceKeyHelperRecord::calculateCrc(keys.data(), keys.size()), keys.size());
+	header.generation = generation;
+
+	std::vector<uint8_t> record(sizeof(header) + sizeof(region) + keys.size());
+	memcpy(record.data(), &header, sizeof(header));
+	memcpy(&record[sizeof(header)], &region, sizeof(region));
+	memcpy(&record[sizeof(header) + sizeof(region)], keys.data(), keys.size());
+	return record;
+}
+
+// Device IDs of a production run share a prefix and differ in the last bytes
+static void benchDeviceId(uint64_t n, uint8_t *deviceId) {
+	static const uint8_t prefix[4] = { 0xe0, 0x0f, 0xce, 0x68 };
+	memcpy(deviceId, prefix, sizeof(prefix));
+	for(size_t ii = 0; ii < 8; ii++) {
+		deviceId[DEVICE_KEY_STORE_ID_SIZE - 1 - ii] = (uint8_t)(n >> (ii * 8));
+	}
+}
+
+static int benchCommand(const std::string &storePath, uint64_t count, uint64_t lookups, bool udp) {
+	std::mt19937_64 rng(1);
+
+	// A small pool of records, so the benchmark measures the store rather than generating keys
+	std::vector<std::vector<uint8_t>> records;
+	for(size_t ii = 0; ii < 64; ii++) {
+		records.push_back(randomRecord(rng, udp, (uint32_t)(ii + 1)));
+	}
+
+	DeviceKeyStore store;
+	if (!store.create(storePath.c_str(), udp ? 512 : DeviceKeyStore::DEFAULT_STRIDE)) {
+		fprintf(stderr, "%s\n", store.getLastError().c_str());
+		return 1;
+	}
+	auto start = std::chrono::steady_clock::now();
+	for(uint64_t n = 0; n < count; n++) {
+		uint8_t deviceId[DEVICE_KEY_STORE_ID_SIZE];
+		benchDeviceId(n, deviceId);
+		const std::vector<uint8_t> &record = records[n % records.size()];
+		if (!store.add(deviceId, record.data(), record.size())) {
+			fprintf(stderr, "%s\n", store.getLastError().c_str());
+			return 1;
+		}
+	}
+	double addSeconds = secondsSince(start);
+	store.close();
+
+	start = std::chrono::steady_clock::now();
+	if (!store.open(storePath.c_str(), true)) {
+		fprintf(stderr, "%s\n", store.getLastError().c_str());
+		return 1;
+	}
+	double openSeconds = secondsSince(start);
+
+	// Half hits in random order, half misses
+	std::vector<uint64_t> order(lookups);
+	for(uint64_t ii = 0; ii < lookups; ii++) {
+		order[ii] = (ii % 2) ? rng() % count : count + rng() % count;
+	}
+	uint64_t hits = 0;
+	volatile uint32_t sink = 0;
+	start = std::chrono::steady_clock::now();
+	for(uint64_t n : order) {
+		uint8_t deviceId[DEVICE_KEY_STORE_ID_SIZE];
+		benchDeviceId(n, deviceId);
+		const DeviceKeyStoreEntry *entry = store.find(deviceId);
+		if (entry) {
+			// Touch the saved data, as a caller would
+			sink = sink + DeviceKeyStore::getRecord(entry)[4];
+			hits++;
+		}
+	}
+	double lookupSeconds = secondsSince(start);
+
+	start = std::chrono::steady_clock::now();
+	DeviceKeyStoreVerifyResult result = store.verify();
+	double verifySeconds = secondsSince(start);
+
+	printf("{\"bench\":{\"entries\":%llu,\"devices\":%llu,\"stride\":%zu,\"addSeconds\":%.3f,\"addsPerSecond\":%.0f,\"openSeconds\":%.6f,"
+		"\"lookups\":%llu,\"hits\":%llu,\"lookupSeconds\":%.3f,\"lookupsPerSecond\":%.0f,\"verifySeconds\":%.3f,\"verifyEntriesPerSecond\":%.0f,\"problems\":%llu}}\n",
+		(unsigned long long) store.getCount(), (unsigned long long) store.getDeviceCount(), store.getStride(), addSeconds, (addSeconds > 0) ? count / addSeconds : 0, openSeconds,
+		(unsigned long long) lookups, (unsigned long long) hits, lookupSeconds, (lookupSeconds > 0) ? lookups / lookupSeconds : 0,
+		verifySeconds, (verifySeconds > 0) ? result.entries / verifySeconds : 0, (unsigned long long) result.problems);
+	return (hits != lookups / 2 || result.problems > 0) ? 1 : 0;
+}
+
+static void usage() {
+	fprintf(stderr,
+		"usage: keystore create STORE [--stride BYTES]\n"
+		"  Create an empty store (default stride: 2048, 512 is enough for cellular devices)\n"
+		"usage: keystore add STORE DEVICEID FILE [--offset N]\n"
+		"  Add the saved data at offset N of FILE (default: 0) for a device\n"
+		"usage: keystore import STORE PATH...\n"
+		"  Add the saved data in files whose names start with the device ID, directories are scanned recursively\n"
+		"usage: keystore get STORE DEVICEID [--history] [--keys FILE] [--der FILE] [--record FILE]\n"
+		"  Look up a device and optionally write its keys, device private key, or saved data\n"
+		"usage: keystore verify STORE [-j N]\n"
+		"  Check every entry and the index with N threads (default: one per CPU)\n"
+		"usage: keystore stats STORE\n"
+		"usage: keystore bench STORE [--count N] [--lookups N] [--udp]\n"
+		"  Create a new store with N synthetic devices (default: 1000000), then time lookups and verify\n");
+}
+
+int main(int argc, char *argv[]) {
+	if (argc < 3) {
+		usage();
+		return 2;
+	}
+	std::string command = argv[1];
+	std::string storePath = argv[2];
+
+	size_t stride = DeviceKeyStore::DEFAULT_STRIDE, offset = 0, threads = 0;
+	uint64_t count = 1000000, lookups = 1000000;
+	bool history = false, udp = false;
+	std::string keysPath, derPath, recordPath;
+	std::vector<std::string> args;
+	for(int ii = 3; ii < argc; ii++) {
+		std::string arg = argv[ii];
+		bool hasValue = (ii + 1 < argc);
+		if (arg == "--stride" && hasValue) {
+			stride = strtoul(argv[++ii], NULL, 0);
+		}
+		else
+		if (arg == "--offset" && hasValue) {
+			offset = strtoul(argv[++ii], NULL, 0);
+		}
+		else
+		if (arg == "-j" && hasValue) {
+			threads = strtoul(argv[++ii], NULL, 0);
+		}
+		else
+		if (arg == "--count" && hasValue) {
+			count = strtoull(argv[++ii], NULL, 0);
+		}
+		else
+		if (arg == "--lookups" && hasValue) {
+			lookups = strtoull(argv[++ii], NULL, 0);
+		}
+		else
+		if (arg == "--history") {
+			history = true;
+		}
+		else
+		if (arg == "--udp") {
+			udp = true;
+		}
+		else
+		if (arg == "--keys" && hasValue) {
+			keysPath = argv[++ii];
+		}
+		else
+		if (arg == "--der" && hasValue) {
+			derPath = argv[++ii];
+		}
+		else
+		if (arg == "--record" && hasValue) {
+			recordPath = argv[++ii];
+		}
+		else
+		if (arg[0] == '-') {
+			usage();
+			return 2;
+		}
+		else {
+			args.push_back(arg);
+		}
+	}
+
+	if (command == "create" && args.empty()) {
+		return createCommand(storePath, stride);
+	}
+	if (command == "add" && args.size() == 2) {
+		return addCommand(storePath, args[0], args[1], offset);
+	}
+	if (command == "import" && !args.empty()) {
+		return importCommand(storePath, args);
+	}
+	if (command == "get" && args.size() == 1) {
+		return getCommand(storePath, args[0], history, keysPath, derPath, recordPath);
+	}
+	if (command == "verify" && args.empty()) {
+		return verifyCommand(storePath, threads);
+	}
+	if (command == "stats" && args.empty()) {
+		return statsCommand(storePath);
+	}
+	if (command == "bench" && args.empty() && count > 0) {
+		return benchCommand(storePath, count, lookups, udp);
+	}
+	usage();
+	return 2;
+}
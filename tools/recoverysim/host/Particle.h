@@ -0,0 +1,194 @@
+/**
+ * Host stand-in for the parts of Particle.h used by DeviceKeyHelperRK, used by recoverysim and benchmark
+ *
+ * Only what the library needs to compile is declared here. The functions that the connection monitor
+ * calls (System, Particle, millis, the diagnostics, and the queue used by withLoopExecution()) are
+ * implemented by the simulator in recoverysim.cpp against its virtual clock, and by
+ * ../../benchmark/benchmark.cpp against the real clock. Classes that are only used by storage backends
+ * the tools don't use, such as TwoWire, are declared but not implemented.
+ *
+ * Location: https://github.com/rickkas7/DeviceKeyHelperRK
+ * License: MIT
+ */
+
+#ifndef __RECOVERYSIM_PARTICLE_H
+#define __RECOVERYSIM_PARTICLE_H
+
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <functional>
+#include <string>
+
+// Build with -DRECOVERYSIM_SYSTEM_VERSION=0x00070000 to simulate system firmware before 0.8.0, which
+// doesn't have the cloud connection error code
+#ifdef RECOVERYSIM_SYSTEM_VERSION
+#define SYSTEM_VERSION RECOVERYSIM_SYSTEM_VERSION
+#else
+#define SYSTEM_VERSION 0x01050000
+#endif
+
+// Build with -DRECOVERYSIM_UDP=1 to simulate a cellular device
+#ifdef RECOVERYSIM_UDP
+#define HAL_PLATFORM_CLOUD_UDP RECOVERYSIM_UDP
+#else
+#define HAL_PLATFORM_CLOUD_UDP 0
+#endif
+
+#define retained
+#define STARTUP(x)
+
+typedef uint32_t system_tick_t;
+typedef uint64_t system_event_t;
+
+const system_event_t cloud_status = 1 << 5;
+
+enum {
+	cloud_status_disconnected = 0,
+	cloud_status_connecting = 1,
+	cloud_status_connected = 8,
+	cloud_status_disconnecting = 9
+};
+
+// The IDs only need to be distinct, as the simulator is the only source of diagnostic data
+#define DIAG_ID_CLOUD_CONNECTION_STATUS 10
+#define DIAG_ID_CLOUD_DISCONNECTS 11
+#define DIAG_ID_CLOUD_CONNECTION_ERROR_CODE 13
+#define DIAG_ID_CLOUD_CONNECTION_ATTEMPTS 14
+
+#define RESET_REASON_USER 140
+
+#define OS_THREAD_PRIORITY_DEFAULT 2
+#define OS_THREAD_STACK_SIZE_DEFAULT 3072
+#define CLOCK_SPEED_100KHZ 100000
+#define CLOCK_SPEED_400KHZ 400000
+
+#define CONCURRENT_WAIT_FOREVER ((system_tick_t)-1)
+
+typedef uint8_t os_thread_prio_t;
+typedef void *os_queue_t;
+
+class Logger {
+public:
+	Logger(const char *name) : name(name) {}
+
+	void trace(const char *fmt, ...) const __attribute__((format(printf, 2, 3)));
+	void info(const char *fmt, ...) const __attribute__((format(printf, 2, 3)));
+	void warn(const char *fmt, ...) const __attribute__((format(printf, 2, 3)));
+	void error(const char *fmt, ...) const __attribute__((format(printf, 2, 3)));
+
+	const char *name;
+};
+
+extern Logger Log;
+
+class SystemClass {
+public:
+	void on(system_event_t events, void (*handler)(system_event_t event, int param));
+	void reset(uint32_t data = 0);
+	int resetReason();
+	uint32_t resetReasonData();
+};
+
+extern SystemClass System;
+
+class CloudClass {
+public:
+	bool connect();
+	void disconnect();
+	bool connected();
+};
+
+extern CloudClass Particle;
+
+system_tick_t millis();
+uint32_t micros();
+void delay(uint32_t ms);
+
+typedef bool (*appender_fn)(void *appender, const uint8_t *data, size_t size);
+int system_format_diag_data(const uint16_t *id, size_t count, unsigned flags, appender_fn append, void *append_data, void *reserved);
+
+int os_queue_create(os_queue_t *queue, size_t item_size, size_t item_count, void *reserved);
+int os_queue_put(os_queue_t queue, const void *item, system_tick_t delay, void *reserved);
+int os_queue_take(os_queue_t queue, void *item, system_tick_t delay, void *reserved);
+
+typedef void (*wiring_thread_fn_t)(void *param);
+
+/**
+ * @brief Not simulated, withThreadExecution() can't be used
+ */
+class Thread {
+public:
+	Thread(const char *name, wiring_thread_fn_t fn, void *param, os_thread_prio_t priority, size_t stackSize);
+};
+
+/**
+ * @brief The simulator is single threaded, so there's nothing to lock
+ */
+class Mutex {
+public:
+	void lock() {}
+	bool trylock() { return true; }
+	void unlock() {}
+};
+
+void HAL_EEPROM_Get(uint32_t index, void *data, size_t length);
+void HAL_EEPROM_Put(uint32_t index, const void *data, size_t length);
+
+class TwoWire {
+public:
+	void setSpeed(uint32_t speed);
+	void begin();
+	void end();
+	bool isEnabled();
+	void beginTransmission(int address);
+	uint8_t endTransmission(bool stop = true);
+	size_t write(uint8_t data);
+	uint8_t requestFrom(uint8_t address, uint8_t count, uint8_t stop = true);
+	int available();
+	int read();
+};
+
+/**
+ * @brief Enough of JSONBufferWriter for DeviceKeyHelper::getStatsJson()
+ */
+class JSONBufferWriter {
+public:
+	JSONBufferWriter(char *buf, size_t size) : buf(buf), size(size) {}
+
+	JSONBufferWriter &beginObject() { separator(); append("{"); first = true; return *this; }
+	JSONBufferWriter &endObject() { append("}"); first = false; return *this; }
+	JSONBufferWriter &name(const char *name) { separator(); append("\""); append(name); append("\":"); first = true; return *this; }
+	JSONBufferWriter &value(unsigned value) { separator(); append(std::to_string(value).c_str()); return *this; }
+	JSONBufferWriter &value(int value) { separator(); append(std::to_string(value).c_str()); return *this; }
+	JSONBufferWriter &value(bool value) { separator(); append(value ? "true" : "false"); return *this; }
+
+	size_t dataSize() const { return offset; }
+	size_t bufferSize() const { return size; }
+
+private:
+	void separator() {
+		if (!first) {
+			append(",");
+		}
+		first = false;
+	}
+
+	void append(const char *str) {
+		size_t len = strlen(str);
+		if (offset < size) {
+			memcpy(buf + offset, str, (size - offset < len) ? size - offset : len);
+		}
+		offset += len;
+	}
+
+	char *buf;
+	size_t size;
+	size_t offset = 0;
+	bool first = true;
+};
+
+#endif /* __RECOVERYSIM_PARTICLE_H */
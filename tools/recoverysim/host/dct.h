@@ -0,0 +1,33 @@
+/**
+ * Host stand-in for the Device OS dct.h, used by recoverysim and benchmark
+ *
+ * The device key offsets and sizes are the ones checked by DeviceKeyHelperRecord. The functions are
+ * implemented by each tool on its own DCT in RAM.
+ *
+ * Location: https://github.com/rickkas7/DeviceKeyHelperRK
+ * License: MIT
+ */
+
+#ifndef __RECOVERYSIM_DCT_H
+#define __RECOVERYSIM_DCT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define DCT_DEVICE_PRIVATE_KEY_OFFSET 34
+#define DCT_DEVICE_PRIVATE_KEY_SIZE 1216
+#define DCT_DEVICE_PUBLIC_KEY_OFFSET 1250
+#define DCT_DEVICE_PUBLIC_KEY_SIZE 384
+#define DCT_SERVER_PUBLIC_KEY_OFFSET 2082
+#define DCT_SERVER_PUBLIC_KEY_SIZE 768
+#define DCT_ALT_DEVICE_PRIVATE_KEY_OFFSET 3106
+#define DCT_ALT_DEVICE_PRIVATE_KEY_SIZE 128
+#define DCT_ALT_DEVICE_PUBLIC_KEY_OFFSET 3234
+#define DCT_ALT_DEVICE_PUBLIC_KEY_SIZE 192
+#define DCT_ALT_SERVER_PUBLIC_KEY_OFFSET 3490
+#define DCT_ALT_SERVER_PUBLIC_KEY_SIZE 192
+
+int dct_read_app_data_copy(uint32_t offset, void* ptr, size_t size);
+int dct_write_app_data(const void* data, uint32_t offset, uint32_t size);
+
+#endif /* __RECOVERYSIM_DCT_H */
@@ -0,0 +1,1306 @@
+/**
+ * Host tool that simulates the cloud connection recovery of DeviceKeyHelperRK
+ *
+ * Runs the connection monitor of the library (DeviceKeyHelper::eventHandler() and everything it calls)
+ * on a computer against a simulated device: a DCT, a cloud that accepts or rejects the device keys, a
+ * backup storage medium with latency and failures, and resets. Time is virtual and advances from event
+ * to event, so an hour of device time takes well under a millisecond, and the same options and seed
+ * always give the same results. Each scenario is a list of faults, given on the command line or
+ * generated randomly, and the output is the time to recover, the number of resets, and the number of
+ * unnecessary writes for each scenario.
+ *
+ * The Device OS functions the library calls are declared by the stand-ins in the host directory and
+ * implemented at the end of this file.
+ *
+ * See README.md in this directory for building and usage.
+ *
+ * Location: https://github.com/rickkas7/DeviceKeyHelperRK
+ * License: MIT
+ */
+
+#include "DeviceKeyHelperRK.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <chrono>
+#include <deque>
+#include <fstream>
+#include <memory>
+#include <queue>
+#include <random>
+#include <string>
+#include <vector>
+
+// DIAG_ID_CLOUD_CONNECTION_ERROR_CODE after a keys error, the values checked by eventHandler()
+#if HAL_PLATFORM_CLOUD_UDP
+static const int32_t KEYS_ERROR_CODE = 10;
+#else
+static const int32_t KEYS_ERROR_CODE = 26;
+#endif
+
+// DIAG_ID_CLOUD_CONNECTION_ERROR_CODE for any other connection failure
+static const int32_t NETWORK_ERROR_CODE = 1;
+
+static const size_t DCT_SIZE = 4096;			// Covers all of the key offsets in dct.h
+static const size_t STORAGE_SIZE = 8192;		// Backup storage, enough for dual slot Wi-Fi keys
+
+/**
+ * @brief Things that can go wrong during a scenario
+ */
+enum FaultType {
+	FAULT_KEYS_CORRUPT,			// Damage the keys in the DCT
+	FAULT_KEYS_ROTATED,			// New keys in the DCT and the cloud, then a reset, like particle keys doctor
+	FAULT_OUTAGE,				// Network down for the duration, connection attempts fail
+	FAULT_DROP,					// The cloud connection is lost, the device reconnects
+	FAULT_REBOOT,				// A reset not caused by the library, such as a power cycle
+	FAULT_KEYS_REJECTED,		// The cloud reports a keys error for the duration even though the keys are good
+	FAULT_BACKUP_FAIL,			// The backup storage reports errors for the duration
+	FAULT_BACKUP_CORRUPT,		// Damage one byte of the saved keys
+	FAULT_BACKUP_ERASE,			// Erase the backup storage
+	FAULT_COUNT
+};
+
+static const char * const faultNames[FAULT_COUNT] = {
+	"keys-corrupt", "keys-rotated", "outage", "drop", "reboot", "keys-rejected", "backup-fail", "backup-corrupt", "backup-erase"
+};
+
+static const bool faultHasDuration[FAULT_COUNT] = {
+	false, false, true, false, false, true, true, false, false
+};
+
+// Relative frequency of each fault in random scenarios
+static const unsigned faultWeights[FAULT_COUNT] = {
+	3, 1, 2, 2, 1, 1, 1, 1, 1
+};
+
+/**
+ * @brief One fault in a scenario
+ */
+struct Fault {
+	FaultType type;
+	uint64_t atMs;					//< Time from the start of the scenario
+	uint64_t durationMs = 0;		//< For outage, keys-rejected, and backup-fail
+};
+
+/**
+ * @brief A list of faults, in time order
+ */
+struct Scenario {
+	std::vector<Fault> faults;
+
+	/**
+	 * @brief Parse a scenario like "keys-corrupt@60,drop@90,outage@300+120", times in seconds
+	 *
+	 * @return false if the scenario is not valid, with a message in error
+	 */
+	bool parse(const std::string &spec, std::string &error);
+
+	/**
+	 * @brief Format the scenario the way parse() accepts it
+	 */
+	std::string toString() const;
+};
+
+/**
+ * @brief Options for the simulated device, cloud, and storage
+ */
+struct SimOptions {
+	uint32_t horizonSec = 3600;			//< Length of each scenario
+	uint32_t bootMs = 8000;				//< Time from a reset until the first connection attempt, including bringing up the network
+	uint32_t handshakeMinMs = 1000;		//< Time for a connection attempt to succeed or fail, chosen randomly in this range
+	uint32_t handshakeMaxMs = 5000;
+	uint32_t retryMinMs = 5000;			//< Time between failed connection attempts, chosen randomly in this range
+	uint32_t retryMaxMs = 30000;
+	uint32_t openMicros = 500;			//< Time to open the backup storage
+	uint32_t readNanos = 200;			//< Time to read one byte of backup storage, in nanoseconds
+	uint32_t writeNanos = 20000;		//< Time to write one byte of backup storage, in nanoseconds
+	uint32_t loopMs = 0;				//< If not 0, use withLoopExecution() with loop() called this often
+	bool reconnectRecovery = false;		//< Use withReconnectRecovery()
+	bool dualSlot = false;				//< Use withDualSlot()
+	bool noBackup = false;				//< Start with empty backup storage instead of saved keys
+	size_t randomCount = 0;				//< Number of random scenarios
+	size_t first = 0;					//< Number of the first scenario, which selects its random numbers
+	size_t maxFaults = 4;				//< Most faults in a random scenario, not counting the drop or reboot after keys-corrupt
+	uint64_t seed = 1;
+	bool quiet = false;					//< Only output the summary
+	bool verbose = false;				//< Log the library and the simulator to stderr
+};
+
+/**
+ * @brief Results for one scenario
+ */
+struct ScenarioResult {
+	uint32_t incidents = 0;				//< Keys errors, from the first failed attempt with bad keys until connected
+	uint32_t recovered = 0;				//< Incidents that ended with the device connected
+	uint64_t recoveryMs = 0;			//< Longest time to recover from an incident
+	uint64_t downtimeMs = 0;			//< Total time not connected to the cloud, including booting
+	uint32_t resets = 0;				//< Resets by the library
+	uint32_t unnecessaryResets = 0;		//< Resets by the library without writing to the DCT first
+	uint32_t connectAttempts = 0;
+	uint32_t saves = 0;					//< Saves of the keys to the backup storage
+	uint32_t restores = 0;				//< Writes of the keys to the DCT
+	uint32_t unnecessaryWrites = 0;		//< Saves of the keys that were already saved, and DCT writes that didn't change the DCT
+	uint32_t harmfulWrites = 0;			//< Saves of keys the cloud rejects, and DCT writes that replaced good keys
+	uint64_t storageBytesWritten = 0;
+	bool connectedAtEnd = false;
+	std::vector<uint64_t> recoveryTimes;	//< Time to recover from each incident that was recovered
+};
+
+/**
+ * @brief Discrete event simulation of a device running the library
+ *
+ * There is one instance while the scenarios run, which the Device OS stand-ins use through sim.
+ */
+class Simulator {
+public:
+	Simulator(const SimOptions &options) : options(options) {}
+
+	/**
+	 * @brief Run one scenario from power on until the horizon
+	 */
+	ScenarioResult run(const Scenario &scenario, uint64_t seed);
+
+	// Called from the Device OS stand-ins and the storage backend
+	void advanceMicros(uint64_t micros) { now += micros; }
+	void systemReset(uint32_t data);
+	void cloudConnect();
+	void cloudDisconnect();
+	void dctWrite(const void *data, uint32_t offset, uint32_t size);
+	void queuePut();
+	void storageCommitted();
+
+	enum CloudState {
+		CLOUD_OFF,				// Not connected and not trying to connect
+		CLOUD_WAITING,			// A connection attempt is scheduled
+		CLOUD_CONNECTING,		// The handshake is in progress
+		CLOUD_CONNECTED
+	};
+
+	const SimOptions &options;
+	uint64_t now = 0;						//< Virtual time in microseconds
+	uint64_t resetTime = 0;					//< Value of now at the last reset, millis() and micros() count from here
+	uint8_t dct[DCT_SIZE];
+	uint8_t storage[STORAGE_SIZE];
+	size_t storageUsed = 0;					//< Highest byte of storage written
+	int backupFailures = 0;					//< Number of backup-fail faults in progress
+	CloudState cloudState = CLOUD_OFF;
+	int32_t lastError = 0;					//< DIAG_ID_CLOUD_CONNECTION_ERROR_CODE
+	int32_t attempts = 0;					//< DIAG_ID_CLOUD_CONNECTION_ATTEMPTS
+	int32_t disconnects = 0;				//< DIAG_ID_CLOUD_DISCONNECTS
+	int resetReason = 0;					//< System.resetReason() for this boot
+	uint32_t resetReasonData = 0;
+	bool resetPending = false;				//< The library called System.reset(), nothing else runs until the next boot
+	void (*handler)(system_event_t event, int param) = NULL;
+	std::vector<std::unique_ptr<std::deque<std::vector<uint8_t>>>> queues;
+	std::vector<size_t> queueItemSize;
+	ScenarioResult result;
+
+protected:
+	enum EventType {
+		EVENT_BOOT,
+		EVENT_CONNECT_ATTEMPT,
+		EVENT_HANDSHAKE_DONE,
+		EVENT_LOOP,
+		EVENT_FAULT_START,
+		EVENT_FAULT_END
+	};
+
+	struct Event {
+		uint64_t at;
+		uint64_t seq;				//< Events at the same time run in the order they were scheduled
+		EventType type;
+		uint32_t epoch;				//< bootEpoch or cloudEpoch when scheduled, the event is dropped if it changed
+		size_t fault;
+
+		bool operator>(const Event &other) const {
+			return (at != other.at) ? (at > other.at) : (seq > other.seq);
+		}
+	};
+
+	void schedule(uint64_t at, EventType type, uint32_t epoch, size_t fault = 0);
+	void handleEvent(const Event &event);
+	void boot();
+	void reboot(int reason, uint32_t data);
+	void connectAttempt();
+	void handshakeDone();
+	void dropConnection();
+	void scheduleAttempt(uint32_t minMs, uint32_t maxMs);
+	void setConnected(bool connected);
+	void sendEvent(int param);
+	void faultStart(const Fault &fault);
+	void faultEnd(const Fault &fault);
+	bool keysGood() const;
+	void randomKeys(uint8_t *keys);
+	uint32_t randomRange(uint32_t min, uint32_t max);
+
+	std::priority_queue<Event, std::vector<Event>, std::greater<Event>> events;
+	uint64_t nextSeq = 0;
+	uint32_t bootEpoch = 0;					//< Changes on each reset, cancels boot and loop events
+	uint32_t cloudEpoch = 0;				//< Changes on each reset and disconnect, cancels connection events
+	bool cloudWanted = false;				//< Particle.connect() was called, or AUTOMATIC mode after boot
+	bool loopPending = false;
+	int outages = 0;						//< Number of outage faults in progress
+	int keysRejected = 0;					//< Number of keys-rejected faults in progress
+	uint8_t cloudKeys[DEVICE_KEYS_HELPER_SIZE];		//< The keys the cloud accepts
+	uint8_t savedKeys[DEVICE_KEYS_HELPER_SIZE];		//< The keys last saved to the backup storage
+	bool savedIntact = false;				//< savedKeys is valid and no backup fault happened since
+	uint32_t dctWritesThisBoot = 0;
+	bool incidentOpen = false;
+	uint64_t incidentStart = 0;
+	uint64_t disconnectedSince = 0;
+	bool connected = false;
+	const Scenario *scenario = NULL;
+	std::mt19937_64 rng;
+	std::unique_ptr<DeviceKeyHelper> helper;
+};
+
+static Simulator *sim;
+
+/**
+ * @brief Backup storage for DeviceKeyHelperT, in RAM with simulated latency and failures
+ *
+ * Like EEPROM, it can always be opened and reads 0xff where nothing was written.
+ */
+class SimStorage {
+public:
+	bool open(bool write) {
+		sim->advanceMicros(sim->options.openMicros);
+		writing = write;
+		lastError = (sim->backupFailures > 0) ? -1 : 0;
+		return (lastError == 0);
+	}
+
+	bool read(size_t pos, void *data, size_t size) {
+		sim->advanceMicros((uint64_t)size * sim->options.readNanos / 1000);
+		if (sim->backupFailures > 0) {
+			lastError = -1;
+			return false;
+		}
+		if (pos + size > STORAGE_SIZE) {
+			return false;
+		}
+		memcpy(data, &sim->storage[pos], size);
+		return true;
+	}
+
+	bool write(size_t pos, const void *data, size_t size) {
+		if (sim->resetPending) {
+			return false;
+		}
+		sim->advanceMicros((uint64_t)size * sim->options.writeNanos / 1000);
+		if (sim->backupFailures > 0) {
+			lastError = -1;
+			return false;
+		}
+		if (pos + size > STORAGE_SIZE) {
+			return false;
+		}
+		memcpy(&sim->storage[pos], data, size);
+		sim->storageUsed = std::max(sim->storageUsed, pos + size);
+		sim->result.storageBytesWritten += size;
+		return true;
+	}
+
+	bool commit() {
+		if (writing && !sim->resetPending) {
+			sim->storageCommitted();
+		}
+		return true;
+	}
+
+	int getLastError() const {
+		return lastError;
+	}
+
+	void close() {
+		writing = false;
+	}
+
+protected:
+	bool writing = false;
+	int lastError = 0;
+};
+
+typedef DeviceKeyHelperT<SimStorage> DeviceKeyHelperSim;
+
+
+bool Scenario::parse(const std::string &spec, std::string &error) {
+	faults.clear();
+
+	size_t start = 0;
+	while(start < spec.size()) {
+		size_t end = spec.find(',', start);
+		if (end == std::string::npos) {
+			end = spec.size();
+		}
+		std::string item = spec.substr(start, end - start);
+		start = end + 1;
+		if (item.empty()) {
+			continue;
+		}
+
+		size_t at = item.find('@');
+		if (at == std::string::npos) {
+			error = "missing @ in " + item;
+			return false;
+		}
+		std::string name = item.substr(0, at);
+
+		Fault fault;
+		int type = 0;
+		while(type < FAULT_COUNT && name != faultNames[type]) {
+			type++;
+		}
+		if (type == FAULT_COUNT) {
+			error = "unknown fault " + name;
+			return false;
+		}
+		fault.type = (FaultType) type;
+
+		char *endp;
+		const char *p = item.c_str() + at + 1;
+		double seconds = strtod(p, &endp);
+		if (endp == p || seconds < 0) {
+			error = "bad time in " + item;
+			return false;
+		}
+		fault.atMs = (uint64_t)(seconds * 1000);
+
+		if (*endp == '+') {
+			p = endp + 1;
+			seconds = strtod(p, &endp);
+			if (endp == p || seconds < 0) {
+				error = "bad duration in " + item;
+				return false;
+			}
+			fault.durationMs = (uint64_t)(seconds * 1000);
+		}
+		if (*endp != 0) {
+			error = "bad time in " + item;
+			return false;
+		}
+		if (faultHasDuration[fault.type] && fault.durationMs == 0) {
+			error = name + " needs a duration, such as " + name + "@60+30";
+			return false;
+		}
+		faults.push_back(fault);
+	}
+
+	std::stable_sort(faults.begin(), faults.end(), [](const Fault &a, const Fault &b) {
+		return a.atMs < b.atMs;
+	});
+	return true;
+}
+
+std::string Scenario::toString() const {
+	std::string str;
+	char buf[64];
+
+	for(const Fault &fault : faults) {
+		if (!str.empty()) {
+			str += ",";
+		}
+		if (faultHasDuration[fault.type]) {
+			snprintf(buf, sizeof(buf), "%s@%g+%g", faultNames[fault.type], fault.atMs / 1000.0, fault.durationMs / 1000.0);
+		}
+		else {
+			snprintf(buf, sizeof(buf), "%s@%g", faultNames[fault.type], fault.atMs / 1000.0);
+		}
+		str += buf;
+	}
+	return str;
+}
+
+
+ScenarioResult Simulator::run(const Scenario &scenario, uint64_t seed) {
+	this->scenario = &scenario;
+	rng.seed(seed);
+
+	now = resetTime = 0;
+	events = decltype(events)();
+	nextSeq = 0;
+	bootEpoch = cloudEpoch = 0;
+	cloudState = CLOUD_OFF;
+	cloudWanted = false;
+	loopPending = false;
+	lastError = attempts = disconnects = 0;
+	resetReason = 0;
+	resetReasonData = 0;
+	resetPending = false;
+	handler = NULL;
+	queues.clear();
+	queueItemSize.clear();
+	outages = keysRejected = backupFailures = 0;
+	incidentOpen = false;
+	connected = false;
+	disconnectedSince = 0;
+	dctWritesThisBoot = 0;
+
+	memset(dct, 0xff, sizeof(dct));
+	randomKeys(&dct[DEVICE_KEYS_HELPER_OFFSET]);
+	memcpy(cloudKeys, &dct[DEVICE_KEYS_HELPER_OFFSET], DEVICE_KEYS_HELPER_SIZE);
+
+	memset(storage, 0xff, sizeof(storage));
+	storageUsed = 0;
+	savedIntact = false;
+	if (!options.noBackup) {
+		// The keys were saved before the scenario started, this isn't counted in the results
+		DeviceKeyHelperSim primer;
+		primer.withDualSlot(options.dualSlot);
+		primer.check(DeviceKeyHelper::CHECKMODE_SAVE_CURRENT);
+	}
+	result = ScenarioResult();
+	now = 0;
+
+	for(size_t ii = 0; ii < scenario.faults.size(); ii++) {
+		const Fault &fault = scenario.faults[ii];
+		schedule(fault.atMs * 1000, EVENT_FAULT_START, 0, ii);
+		if (faultHasDuration[fault.type]) {
+			schedule((fault.atMs + fault.durationMs) * 1000, EVENT_FAULT_END, 0, ii);
+		}
+	}
+	schedule((uint64_t)options.bootMs * 1000, EVENT_BOOT, bootEpoch);
+
+	uint64_t horizon = (uint64_t)options.horizonSec * 1000000;
+	while(!events.empty() && events.top().at <= horizon) {
+		Event event = events.top();
+		events.pop();
+
+		// Work done by the library, such as reading storage, can move the clock past scheduled events
+		if (event.at > now) {
+			now = event.at;
+		}
+		handleEvent(event);
+	}
+	if (now < horizon) {
+		now = horizon;
+	}
+
+	if (!connected) {
+		result.downtimeMs += (now - disconnectedSince) / 1000;
+	}
+	result.connectedAtEnd = connected;
+
+	helper.reset();
+	this->scenario = NULL;
+	return result;
+}
+
+void Simulator::schedule(uint64_t at, EventType type, uint32_t epoch, size_t fault) {
+	Event event;
+	event.at = at;
+	event.seq = nextSeq++;
+	event.type = type;
+	event.epoch = epoch;
+	event.fault = fault;
+	events.push(event);
+}
+
+void Simulator::handleEvent(const Event &event) {
+	switch(event.type) {
+	case EVENT_BOOT:
+		if (event.epoch == bootEpoch) {
+			boot();
+		}
+		break;
+
+	case EVENT_CONNECT_ATTEMPT:
+		if (event.epoch == cloudEpoch) {
+			connectAttempt();
+		}
+		break;
+
+	case EVENT_HANDSHAKE_DONE:
+		if (event.epoch == cloudEpoch) {
+			handshakeDone();
+		}
+		break;
+
+	case EVENT_LOOP:
+		if (event.epoch == bootEpoch) {
+			loopPending = false;
+			helper->loop();
+		}
+		break;
+
+	case EVENT_FAULT_START:
+		faultStart(scenario->faults[event.fault]);
+		break;
+
+	case EVENT_FAULT_END:
+		faultEnd(scenario->faults[event.fault]);
+		break;
+	}
+}
+
+void Simulator::boot() {
+	Log.trace("boot resetReason=%d", resetReason);
+
+	// The retained variables of the old helper aren't simulated, so it starts with no verified keys
+	helper.reset();
+	resetPending = false;
+	dctWritesThisBoot = 0;
+	queues.clear();
+	queueItemSize.clear();
+
+	// setup()
+	DeviceKeyHelperSim *newHelper = new DeviceKeyHelperSim();
+	helper.reset(newHelper);
+	newHelper->withReconnectRecovery(options.reconnectRecovery).withDualSlot(options.dualSlot);
+	if (options.loopMs) {
+		newHelper->withLoopExecution();
+	}
+	newHelper->startMonitor();
+
+	// AUTOMATIC mode
+	cloudWanted = true;
+	scheduleAttempt(0, 0);
+}
+
+void Simulator::reboot(int reason, uint32_t data) {
+	resetPending = true;
+	resetTime = now;
+	resetReason = reason;
+	resetReasonData = data;
+	handler = NULL;
+	bootEpoch++;
+	cloudEpoch++;
+	cloudState = CLOUD_OFF;
+	cloudWanted = false;
+	loopPending = false;
+	setConnected(false);
+	schedule(now + (uint64_t)options.bootMs * 1000, EVENT_BOOT, bootEpoch);
+}
+
+void Simulator::systemReset(uint32_t data) {
+	if (resetPending) {
+		// System.reset() doesn't return on a device, so the library may call it again afterwards
+		return;
+	}
+	Log.trace("System.reset data=0x%08x", data);
+
+	result.resets++;
+	if (dctWritesThisBoot == 0) {
+		result.unnecessaryResets++;
+	}
+	reboot(RESET_REASON_USER, data);
+}
+
+void Simulator::cloudConnect() {
+	if (resetPending) {
+		return;
+	}
+	cloudWanted = true;
+	if (cloudState == CLOUD_OFF) {
+		scheduleAttempt(0, 0);
+	}
+}
+
+void Simulator::cloudDisconnect() {
+	if (resetPending) {
+		return;
+	}
+	cloudWanted = false;
+	cloudEpoch++;
+	if (cloudState == CLOUD_CONNECTED) {
+		disconnects++;
+		setConnected(false);
+	}
+	cloudState = CLOUD_OFF;
+}
+
+void Simulator::connectAttempt() {
+	cloudState = CLOUD_CONNECTING;
+	attempts++;
+	result.connectAttempts++;
+
+	uint32_t epoch = cloudEpoch;
+	sendEvent(cloud_status_connecting);
+	if (epoch == cloudEpoch) {
+		schedule(now + (uint64_t)randomRange(options.handshakeMinMs, options.handshakeMaxMs) * 1000, EVENT_HANDSHAKE_DONE, cloudEpoch);
+	}
+}
+
+void Simulator::handshakeDone() {
+	bool good = keysGood();
+
+	if (outages > 0) {
+		lastError = NETWORK_ERROR_CODE;
+	}
+	else
+	if (!good || keysRejected > 0) {
+		lastError = KEYS_ERROR_CODE;
+	}
+	else {
+		lastError = 0;
+		attempts = 0;
+		cloudState = CLOUD_CONNECTED;
+		setConnected(true);
+		sendEvent(cloud_status_connected);
+		return;
+	}
+
+	if (lastError == KEYS_ERROR_CODE && !good && !incidentOpen) {
+		incidentOpen = true;
+		incidentStart = now;
+		result.incidents++;
+	}
+	Log.trace("connection failed error=%ld", (long)lastError);
+
+	uint32_t epoch = cloudEpoch;
+	cloudState = CLOUD_WAITING;
+	sendEvent(cloud_status_disconnected);
+	if (epoch == cloudEpoch && cloudWanted) {
+		scheduleAttempt(options.retryMinMs, options.retryMaxMs);
+	}
+}
+
+void Simulator::dropConnection() {
+	if (cloudState != CLOUD_CONNECTED) {
+		return;
+	}
+	disconnects++;
+	lastError = NETWORK_ERROR_CODE;
+	setConnected(false);
+
+	uint32_t epoch = cloudEpoch;
+	cloudState = CLOUD_WAITING;
+	sendEvent(cloud_status_disconnecting);
+	sendEvent(cloud_status_disconnected);
+	if (epoch == cloudEpoch && cloudWanted) {
+		scheduleAttempt(0, options.retryMinMs);
+	}
+}
+
+void Simulator::scheduleAttempt(uint32_t minMs, uint32_t maxMs) {
+	cloudState = CLOUD_WAITING;
+	schedule(now + (uint64_t)randomRange(minMs, maxMs) * 1000, EVENT_CONNECT_ATTEMPT, cloudEpoch);
+}
+
+void Simulator::setConnected(bool connected) {
+	if (connected == this->connected) {
+		return;
+	}
+	this->connected = connected;
+
+	if (connected) {
+		result.downtimeMs += (now - disconnectedSince) / 1000;
+		if (incidentOpen) {
+			uint64_t recoveryMs = (now - incidentStart) / 1000;
+			result.recovered++;
+			result.recoveryMs = std::max(result.recoveryMs, recoveryMs);
+			result.recoveryTimes.push_back(recoveryMs);
+			incidentOpen = false;
+		}
+	}
+	else {
+		disconnectedSince = now;
+	}
+}
+
+void Simulator::sendEvent(int param) {
+	if (handler) {
+		handler(cloud_status, param);
+	}
+}
+
+void Simulator::faultStart(const Fault &fault) {
+	Log.trace("fault %s", faultNames[fault.type]);
+
+	switch(fault.type) {
+	case FAULT_KEYS_CORRUPT: {
+		// Overwrite a few bytes, making sure at least one changes
+		uint8_t *keys = &dct[DEVICE_KEYS_HELPER_OFFSET];
+		size_t size = randomRange(1, 32);
+		size_t offset = randomRange(0, DEVICE_KEYS_HELPER_SIZE - size);
+		for(size_t ii = 0; ii < size; ii++) {
+			keys[offset + ii] = (uint8_t) rng();
+		}
+		keys[offset] = ~cloudKeys[offset];
+		break;
+	}
+
+	case FAULT_KEYS_ROTATED:
+		randomKeys(cloudKeys);
+		memcpy(&dct[DEVICE_KEYS_HELPER_OFFSET], cloudKeys, DEVICE_KEYS_HELPER_SIZE);
+		reboot(0, 0);
+		break;
+
+	case FAULT_OUTAGE:
+		outages++;
+		dropConnection();
+		break;
+
+	case FAULT_DROP:
+		dropConnection();
+		break;
+
+	case FAULT_REBOOT:
+		reboot(0, 0);
+		break;
+
+	case FAULT_KEYS_REJECTED:
+		keysRejected++;
+		break;
+
+	case FAULT_BACKUP_FAIL:
+		backupFailures++;
+		break;
+
+	case FAULT_BACKUP_CORRUPT:
+		if (storageUsed > 0) {
+			storage[randomRange(0, storageUsed - 1)] ^= (uint8_t)(1 << randomRange(0, 7));
+		}
+		savedIntact = false;
+		break;
+
+	case FAULT_BACKUP_ERASE:
+		memset(storage, 0xff, sizeof(storage));
+		storageUsed = 0;
+		savedIntact = false;
+		break;
+
+	default:
+		break;
+	}
+}
+
+void Simulator::faultEnd(const Fault &fault) {
+	Log.trace("fault %s ended", faultNames[fault.type]);
+
+	switch(fault.type) {
+	case FAULT_OUTAGE:
+		outages--;
+		break;
+
+	case FAULT_KEYS_REJECTED:
+		keysRejected--;
+		break;
+
+	case FAULT_BACKUP_FAIL:
+		backupFailures--;
+		break;
+
+	default:
+		break;
+	}
+}
+
+void Simulator::dctWrite(const void *data, uint32_t offset, uint32_t size) {
+	if (resetPending || offset + size > DCT_SIZE) {
+		return;
+	}
+	bool wasGood = keysGood();
+	bool same = (memcmp(&dct[offset], data, size) == 0);
+
+	memcpy(&dct[offset], data, size);
+	dctWritesThisBoot++;
+	result.restores++;
+
+	if (same) {
+		result.unnecessaryWrites++;
+	}
+	else
+	if (wasGood && !keysGood()) {
+		result.harmfulWrites++;
+	}
+}
+
+void Simulator::storageCommitted() {
+	const uint8_t *keys = &dct[DEVICE_KEYS_HELPER_OFFSET];
+
+	result.saves++;
+	if (savedIntact && memcmp(savedKeys, keys, DEVICE_KEYS_HELPER_SIZE) == 0) {
+		result.unnecessaryWrites++;
+	}
+	if (!keysGood()) {
+		result.harmfulWrites++;
+	}
+	memcpy(savedKeys, keys, DEVICE_KEYS_HELPER_SIZE);
+	savedIntact = true;
+}
+
+void Simulator::queuePut() {
+	if (options.loopMs && !loopPending) {
+		// loop() is called often, but only does something when there is a queued check
+		uint64_t period = (uint64_t)options.loopMs * 1000;
+		loopPending = true;
+		schedule((now / period + 1) * period, EVENT_LOOP, bootEpoch);
+	}
+}
+
+bool Simulator::keysGood() const {
+	return memcmp(&dct[DEVICE_KEYS_HELPER_OFFSET], cloudKeys, DEVICE_KEYS_HELPER_SIZE) == 0;
+}
+
+// Random bytes with 0xff padding at the end, like keys in the DCT. Only the CRC is checked, not the DER.
+void Simulator::randomKeys(uint8_t *keys) {
+	size_t privateKeySize = DeviceKeyHelperRecord::privateKeySize(DEVICE_KEYS_HELPER_SIZE);
+	size_t used[2] = { privateKeySize * 3 / 4, (DEVICE_KEYS_HELPER_SIZE - privateKeySize) * 3 / 4 };
+
+	memset(keys, 0xff, DEVICE_KEYS_HELPER_SIZE);
+	for(size_t ii = 0; ii < used[0]; ii++) {
+		keys[ii] = (uint8_t) rng();
+	}
+	for(size_t ii = 0; ii < used[1]; ii++) {
+		keys[privateKeySize + ii] = (uint8_t) rng();
+	}
+}
+
+uint32_t Simulator::randomRange(uint32_t min, uint32_t max) {
+	if (max <= min) {
+		return min;
+	}
+	return min + (uint32_t)(rng() % (max - min + 1));
+}
+
+
+/**
+ * @brief Generates a random scenario
+ *
+ * keys-corrupt is followed by a drop or reboot, otherwise the damage wouldn't be noticed until a later
+ * fault happened to make the device connect again.
+ */
+static Scenario randomScenario(const SimOptions &options, std::mt19937_64 &rng) {
+	Scenario scenario;
+	unsigned totalWeight = 0;
+	for(size_t ii = 0; ii < FAULT_COUNT; ii++) {
+		totalWeight += faultWeights[ii];
+	}
+	uint64_t horizonMs = (uint64_t)options.horizonSec * 1000;
+
+	size_t count = 1 + rng() % std::max<size_t>(options.maxFaults, 1);
+	for(size_t ii = 0; ii < count; ii++) {
+		unsigned pick = rng() % totalWeight;
+		int type = 0;
+		while(pick >= faultWeights[type]) {
+			pick -= faultWeights[type];
+			type++;
+		}
+
+		Fault fault;
+		fault.type = (FaultType) type;
+		fault.atMs = (rng() % (horizonMs * 3 / 4 / 1000 + 1)) * 1000;
+		if (faultHasDuration[type]) {
+			fault.durationMs = (10 + rng() % 591) * 1000;
+		}
+		scenario.faults.push_back(fault);
+
+		if (type == FAULT_KEYS_CORRUPT) {
+			Fault notice;
+			notice.type = (rng() % 2) ? FAULT_DROP : FAULT_REBOOT;
+			notice.atMs = fault.atMs + (rng() % 121) * 1000;
+			scenario.faults.push_back(notice);
+		}
+	}
+
+	std::stable_sort(scenario.faults.begin(), scenario.faults.end(), [](const Fault &a, const Fault &b) {
+		return a.atMs < b.atMs;
+	});
+	return scenario;
+}
+
+static uint64_t percentile(const std::vector<uint64_t> &sorted, unsigned pct) {
+	if (sorted.empty()) {
+		return 0;
+	}
+	return sorted[(sorted.size() - 1) * pct / 100];
+}
+
+static int runCommand(const SimOptions &options, const std::vector<Scenario> &scripted) {
+	Simulator simulator(options);
+	sim = &simulator;
+
+	size_t count = scripted.empty() ? options.randomCount : scripted.size();
+	ScenarioResult totals;
+	uint64_t unrecovered = 0;
+	uint64_t disconnectedAtEnd = 0;
+	std::vector<uint64_t> recoveryTimes;
+
+	auto startTime = std::chrono::steady_clock::now();
+
+	for(size_t ii = 0; ii < count; ii++) {
+		// Each scenario has its own seeds, so any scenario can be run again by itself with --first and the
+		// faults it was reported with, and get the same result
+		size_t index = options.first + ii;
+		uint64_t seed = options.seed * 1000003 + index;
+
+		Scenario random;
+		if (scripted.empty()) {
+			std::mt19937_64 scenarioRng(seed);
+			random = randomScenario(options, scenarioRng);
+		}
+		const Scenario &scenario = scripted.empty() ? random : scripted[ii];
+
+		ScenarioResult result = simulator.run(scenario, seed ^ 0x5deece66dULL);
+
+		totals.incidents += result.incidents;
+		totals.recovered += result.recovered;
+		totals.downtimeMs += result.downtimeMs;
+		totals.resets += result.resets;
+		totals.unnecessaryResets += result.unnecessaryResets;
+		totals.connectAttempts += result.connectAttempts;
+		totals.saves += result.saves;
+		totals.restores += result.restores;
+		totals.unnecessaryWrites += result.unnecessaryWrites;
+		totals.harmfulWrites += result.harmfulWrites;
+		totals.storageBytesWritten += result.storageBytesWritten;
+		recoveryTimes.insert(recoveryTimes.end(), result.recoveryTimes.begin(), result.recoveryTimes.end());
+
+		bool recovered = (result.recovered == result.incidents);
+		if (!recovered) {
+			unrecovered++;
+		}
+		if (!result.connectedAtEnd) {
+			disconnectedAtEnd++;
+		}
+
+		if (!options.quiet) {
+			printf("{\"scenario\":%zu,\"faults\":\"%s\",\"recovered\":%s,\"incidents\":%u,\"recoveryMs\":%llu,\"downtimeMs\":%llu,\"resets\":%u,\"unnecessaryResets\":%u,\"connectAttempts\":%u,\"saves\":%u,\"restores\":%u,\"unnecessaryWrites\":%u,\"harmfulWrites\":%u,\"storageBytesWritten\":%llu,\"connectedAtEnd\":%s}\n",
+				index, scenario.toString().c_str(), recovered ? "true" : "false", result.incidents, (unsigned long long)result.recoveryMs,
+				(unsigned long long)result.downtimeMs, result.resets, result.unnecessaryResets, result.connectAttempts, result.saves, result.restores,
+				result.unnecessaryWrites, result.harmfulWrites, (unsigned long long)result.storageBytesWritten, result.connectedAtEnd ? "true" : "false");
+		}
+	}
+
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count();
+	std::sort(recoveryTimes.begin(), recoveryTimes.end());
+
+	printf("{\"summary\":{\"scenarios\":%zu,\"systemVersion\":\"0x%08x\",\"udp\":%s,\"reconnectRecovery\":%s,\"loopMs\":%u,\"dualSlot\":%s,"
+		"\"incidents\":%u,\"recovered\":%u,\"unrecoveredScenarios\":%llu,\"disconnectedAtEnd\":%llu,"
+		"\"recoveryMs\":{\"p50\":%llu,\"p90\":%llu,\"p99\":%llu,\"max\":%llu},"
+		"\"resets\":%u,\"unnecessaryResets\":%u,\"connectAttempts\":%u,\"saves\":%u,\"restores\":%u,\"unnecessaryWrites\":%u,\"harmfulWrites\":%u,"
+		"\"seconds\":%.6f,\"scenariosPerSecond\":%.1f}}\n",
+		count, (unsigned) SYSTEM_VERSION, HAL_PLATFORM_CLOUD_UDP ? "true" : "false", options.reconnectRecovery ? "true" : "false", options.loopMs,
+		options.dualSlot ? "true" : "false", totals.incidents, totals.recovered, (unsigned long long)unrecovered, (unsigned long long)disconnectedAtEnd,
+		(unsigned long long)percentile(recoveryTimes, 50), (unsigned long long)percentile(recoveryTimes, 90),
+		(unsigned long long)percentile(recoveryTimes, 99), (unsigned long long)(recoveryTimes.empty() ? 0 : recoveryTimes.back()),
+		totals.resets, totals.unnecessaryResets, totals.connectAttempts, totals.saves, totals.restores, totals.unnecessaryWrites, totals.harmfulWrites,
+		seconds, (seconds > 0) ? count / seconds : 0.0);
+
+	sim = NULL;
+	return (unrecovered == 0) ? 0 : 1;
+}
+
+// Parses MIN,MAX
+static bool parseRange(const char *str, uint32_t &min, uint32_t &max) {
+	char *end;
+	min = (uint32_t) strtoul(str, &end, 0);
+	if (*end != ',') {
+		return false;
+	}
+	max = (uint32_t) strtoul(end + 1, &end, 0);
+	return (*end == 0 && min <= max);
+}
+
+static void usage() {
+	fprintf(stderr,
+		"usage: recoverysim [options] SCENARIO...\n"
+		"       recoverysim [options] --file FILE\n"
+		"       recoverysim [options] --random N\n"
+		"  SCENARIO is a list of faults like keys-corrupt@60,drop@90,outage@300+120 (seconds)\n"
+		"  faults: keys-corrupt keys-rotated outage+ drop reboot keys-rejected+ backup-fail+ backup-corrupt backup-erase (+ needs a duration)\n"
+		"  --seed N                   Random number seed (default: 1)\n"
+		"  --first N                  Number of the first scenario, to run one again by itself (default: 0)\n"
+		"  --max-faults N             Most faults in a random scenario (default: 4)\n"
+		"  --horizon SEC              Length of each scenario (default: 3600)\n"
+		"  --boot MS                  Time from reset to the first connection attempt (default: 8000)\n"
+		"  --handshake MIN,MAX        Time for a connection attempt in ms (default: 1000,5000)\n"
+		"  --retry MIN,MAX            Time between connection attempts in ms (default: 5000,30000)\n"
+		"  --storage OPEN,READ,WRITE  Storage open time in us, read and write time per byte in ns (default: 500,200,20000)\n"
+		"  --loop MS                  Use withLoopExecution(), with loop() called every MS\n"
+		"  --reconnect-recovery       Use withReconnectRecovery()\n"
+		"  --dual-slot                Use withDualSlot()\n"
+		"  --no-backup                Start without saved keys\n"
+		"  --quiet                    Only output the summary\n"
+		"  --verbose                  Log to stderr\n");
+}
+
+int main(int argc, char *argv[]) {
+	SimOptions options;
+	std::vector<std::string> specs;
+	std::string file;
+
+	for(int ii = 1; ii < argc; ii++) {
+		std::string arg = argv[ii];
+		bool hasValue = (ii + 1 < argc);
+		if (arg == "--random" && hasValue) {
+			options.randomCount = strtoul(argv[++ii], NULL, 0);
+		}
+		else
+		if (arg == "--seed" && hasValue) {
+			options.seed = strtoull(argv[++ii], NULL, 0);
+		}
+		else
+		if (arg == "--first" && hasValue) {
+			options.first = strtoul(argv[++ii], NULL, 0);
+		}
+		else
+		if (arg == "--max-faults" && hasValue) {
+			options.maxFaults = strtoul(argv[++ii], NULL, 0);
+		}
+		else
+		if (arg == "--file" && hasValue) {
+			file = argv[++ii];
+		}
+		else
+		if (arg == "--horizon" && hasValue) {
+			options.horizonSec = (uint32_t) strtoul(argv[++ii], NULL, 0);
+		}
+		else
+		if (arg == "--boot" && hasValue) {
+			options.bootMs = (uint32_t) strtoul(argv[++ii], NULL, 0);
+		}
+		else
+		if (arg == "--handshake" && hasValue) {
+			if (!parseRange(argv[++ii], options.handshakeMinMs, options.handshakeMaxMs)) {
+				usage();
+				return 2;
+			}
+		}
+		else
+		if (arg == "--retry" && hasValue) {
+			if (!parseRange(argv[++ii], options.retryMinMs, options.retryMaxMs)) {
+				usage();
+				return 2;
+			}
+		}
+		else
+		if (arg == "--storage" && hasValue) {
+			if (sscanf(argv[++ii], "%u,%u,%u", &options.openMicros, &options.readNanos, &options.writeNanos) != 3) {
+				usage();
+				return 2;
+			}
+		}
+		else
+		if (arg == "--loop" && hasValue) {
+			options.loopMs = (uint32_t) strtoul(argv[++ii], NULL, 0);
+		}
+		else
+		if (arg == "--reconnect-recovery") {
+			options.reconnectRecovery = true;
+		}
+		else
+		if (arg == "--dual-slot") {
+			options.dualSlot = true;
+		}
+		else
+		if (arg == "--no-backup") {
+			options.noBackup = true;
+		}
+		else
+		if (arg == "--quiet") {
+			options.quiet = true;
+		}
+		else
+		if (arg == "--verbose") {
+			options.verbose = true;
+		}
+		else
+		if (arg[0] == '-') {
+			usage();
+			return 2;
+		}
+		else {
+			specs.push_back(arg);
+		}
+	}
+
+	if (!file.empty()) {
+		std::ifstream in(file);
+		if (!in) {
+			fprintf(stderr, "unable to open %s\n", file.c_str());
+			return 2;
+		}
+		std::string line;
+		while(std::getline(in, line)) {
+			line.erase(0, line.find_first_not_of(" \t"));
+			line.erase(line.find_last_not_of(" \t\r") + 1);
+			if (!line.empty() && line[0] != '#') {
+				specs.push_back(line);
+			}
+		}
+	}
+
+	std::vector<Scenario> scripted;
+	for(const std::string &spec : specs) {
+		Scenario scenario;
+		std::string error;
+		if (!scenario.parse(spec, error)) {
+			fprintf(stderr, "%s\n", error.c_str());
+			return 2;
+		}
+		scripted.push_back(scenario);
+	}
+
+	if (scripted.empty() == (options.randomCount == 0)) {
+		// Exactly one of scenarios or --random is required
+		usage();
+		return 2;
+	}
+	return runCommand(options, scripted);
+}
+
+
+//
+// Device OS stand-ins declared in host/Particle.h and host/dct.h
+//
+
+Logger Log("app");
+SystemClass System;
+CloudClass Particle;
+
+static void logMessage(const char *level, const char *name, const char *fmt, va_list ap) {
+	fprintf(stderr, "%10.3f %s [%s] ", sim ? sim->now / 1000000.0 : 0.0, level, name);
+	vfprintf(stderr, fmt, ap);
+	fputc('\n', stderr);
+}
+
+#define LOGGER_METHOD(method, level) \
+	void Logger::method(const char *fmt, ...) const { \
+		if (sim && sim->options.verbose) { \
+			va_list ap; \
+			va_start(ap, fmt); \
+			logMessage(level, name, fmt, ap); \
+			va_end(ap); \
+		} \
+	}
+
+LOGGER_METHOD(trace, "TRACE")
+LOGGER_METHOD(info, "INFO")
+LOGGER_METHOD(warn, "WARN")
+LOGGER_METHOD(error, "ERROR")
+
+void SystemClass::on(system_event_t events, void (*handler)(system_event_t event, int param)) {
+	if (events & cloud_status) {
+		sim->handler = handler;
+	}
+}
+
+void SystemClass::reset(uint32_t data) {
+	sim->systemReset(data);
+}
+
+int SystemClass::resetReason() {
+	return sim->resetReason;
+}
+
+uint32_t SystemClass::resetReasonData() {
+	return sim->resetReasonData;
+}
+
+bool CloudClass::connect() {
+	sim->cloudConnect();
+	return true;
+}
+
+void CloudClass::disconnect() {
+	sim->cloudDisconnect();
+}
+
+bool CloudClass::connected() {
+	return sim->cloudState == Simulator::CLOUD_CONNECTED;
+}
+
+system_tick_t millis() {
+	return (system_tick_t)((sim->now - sim->resetTime) / 1000);
+}
+
+uint32_t micros() {
+	return (uint32_t)(sim->now - sim->resetTime);
+}
+
+void delay(uint32_t ms) {
+	sim->advanceMicros((uint64_t)ms * 1000);
+}
+
+int system_format_diag_data(const uint16_t *id, size_t count, unsigned flags, appender_fn append, void *append_data, void *reserved) {
+	// Binary format: idSize and valueSize (uint16_t), then an ID and value for each ID, little endian
+	uint8_t buf[4 + 6 * 8];
+	size_t len = 0;
+
+	auto put = [&](uint32_t value, size_t size) {
+		for(size_t ii = 0; ii < size; ii++) {
+			buf[len++] = (uint8_t)(value >> (ii * 8));
+		}
+	};
+	put(2, 2);
+	put(4, 2);
+
+	for(size_t ii = 0; ii < count && ii < 8; ii++) {
+		int32_t value;
+		if (id[ii] == DIAG_ID_CLOUD_CONNECTION_ERROR_CODE) {
+			value = sim->lastError;
+		}
+		else
+		if (id[ii] == DIAG_ID_CLOUD_CONNECTION_ATTEMPTS) {
+			value = sim->attempts;
+		}
+		else
+		if (id[ii] == DIAG_ID_CLOUD_DISCONNECTS) {
+			value = sim->disconnects;
+		}
+		else
+		if (id[ii] == DIAG_ID_CLOUD_CONNECTION_STATUS) {
+			value = (sim->cloudState == Simulator::CLOUD_CONNECTED) ? 2 : 0;
+		}
+		else {
+			continue;
+		}
+		put(id[ii], 2);
+		put((uint32_t) value, 4);
+	}
+
+	// Split in two to exercise reassembly in the parser
+	size_t half = len / 2;
+	append(append_data, buf, half);
+	append(append_data, buf + half, len - half);
+	return 0;
+}
+
+int os_queue_create(os_queue_t *queue, size_t item_size, size_t item_count, void *reserved) {
+	sim->queues.emplace_back(new std::deque<std::vector<uint8_t>>());
+	sim->queueItemSize.push_back(item_size);
+	// The handle is the index plus 1, so it's never NULL
+	*queue = (os_queue_t)(uintptr_t) sim->queues.size();
+	return 0;
+}
+
+int os_queue_put(os_queue_t queue, const void *item, system_tick_t delay, void *reserved) {
+	size_t index = (size_t)(uintptr_t) queue - 1;
+	const uint8_t *p = (const uint8_t *) item;
+	sim->queues[index]->push_back(std::vector<uint8_t>(p, p + sim->queueItemSize[index]));
+	sim->queuePut();
+	return 0;
+}
+
+int os_queue_take(os_queue_t queue, void *item, system_tick_t delay, void *reserved) {
+	size_t index = (size_t)(uintptr_t) queue - 1;
+	if (index >= sim->queues.size() || sim->queues[index]->empty()) {
+		return 1;
+	}
+	memcpy(item, sim->queues[index]->front().data(), sim->queueItemSize[index]);
+	sim->queues[index]->pop_front();
+	return 0;
+}
+
+Thread::Thread(const char *name, wiring_thread_fn_t fn, void *param, os_thread_prio_t priority, size_t stackSize) {
+	fprintf(stderr, "withThreadExecution() is not simulated, use --loop instead\n");
+	abort();
+}
+
+int dct_read_app_data_copy(uint32_t offset, void* ptr, size_t size) {
+	if (offset + size > DCT_SIZE) {
+		return 1;
+	}
+	memcpy(ptr, &sim->dct[offset], size);
+	return 0;
+}
+
+int dct_write_app_data(const void* data, uint32_t offset, uint32_t size) {
+	sim->dctWrite(data, offset, size);
+	return 0;
+}